@@ -525,6 +525,12 @@ void CMapSolid::AddFace(CMapFace *pFace)
 	pNewFace->SetRenderColor(r, g, b);
 	pNewFace->SetCordonFace( m_bIsCordonBrush );
 	pNewFace->SetParent(this);
+
+	CMapWorld *pWorld = GetWorldObject(this);
+	if (pWorld != NULL)
+	{
+		pWorld->FaceID_AddFace(pNewFace);
+	}
 }
 
 
@@ -578,6 +584,15 @@ CMapClass *CMapSolid::CopyFrom(CMapClass *pobj, bool bUpdateDependencies)
 		Assert(pToFace->GetPointCount() != 0);
 	}
 
+	//
+	// If we are in the world, our faces may have new IDs now (when undoing, for instance).
+	//
+	CMapWorld *pWorld = GetWorldObject(this);
+	if (pWorld != NULL)
+	{
+		pWorld->FaceID_AddSolidFaces(this);
+	}
+
 	return(this);
 }
 
@@ -1270,6 +1285,7 @@ void CMapSolid::PostloadWorld(CMapWorld *pWorld)
 		if (pFace->GetFaceID() == 0)
 		{
 			pFace->SetFaceID(pWorld->FaceID_GetNext());
+			pWorld->FaceID_AddFace(pFace);
 		}
 	}
 }
@@ -1320,7 +1336,7 @@ void CMapSolid::OnRemoveFromWorld(CMapWorld *pWorld, bool bNotifyChildren)
 	for (int i = 0; i < nFaces; i++)
 	{
 		CMapFace *pFace = GetFace(i);
-		pFace->OnRemoveFromWorld();
+		pFace->OnRemoveFromWorld(pWorld);
 	}
 }
 
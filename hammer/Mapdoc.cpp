@@ -55,6 +55,8 @@
 #include "Shell.h"
 #include "StatusBarIDs.h"
 #include "StrDlg.h"
+#include "MapStudioModel.h"
+#include "StudioModel.h"
 #include "TextureSystem.h"
 #include "TextureConverter.h"
 #include "TransformDlg.h"
@@ -66,6 +68,7 @@
 #include "StockSolids.h"
 #include "ToolMorph.h"
 #include "ToolBlock.h"
+#include "tier0/icommandline.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include <tier0/memdbgon.h>
@@ -1366,6 +1369,50 @@ bool CMapDoc::HandleLoadError(CChunkFile *pFile, const char *szChunkName, CMapDo
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Waits for the models queued while the world's helpers were being
+//			created, fixing up each helper's bounds as its model finishes.
+//			Cancelling leaves the rest as placeholders.
+// Input  : bShowProgress - Whether to update the load progress dialog.
+//-----------------------------------------------------------------------------
+static void WaitForModelLoads(bool bShowProgress)
+{
+	int nTotal = CStudioModelCache::GetPendingLoadCount();
+	if (bShowProgress)
+	{
+		pProgDlg->ShowCancelButton();
+	}
+
+	while (CStudioModelCache::GetPendingLoadCount() > 0)
+	{
+		int nFinished = CStudioModelCache::FinishAsyncLoads(0.05f);
+		if (nFinished > 0)
+		{
+			CMapStudioModel::UpdateLoadedModels();
+		}
+
+		if (bShowProgress)
+		{
+			char szStatus[80];
+			sprintf(szStatus, "Loading models (%d of %d)...", nTotal - CStudioModelCache::GetPendingLoadCount(), nTotal);
+			pProgDlg->SetWindowText(szStatus);
+
+			if (pProgDlg->CheckCancelButton())
+			{
+				CStudioModelCache::CancelAsyncLoads();
+				break;
+			}
+		}
+
+		if (nFinished == 0)
+		{
+			// Wake up now and then to keep the dialog responsive.
+			CStudioModelCache::WaitForLoadedModel(50);
+		}
+	}
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Loads this document from a VMF file.
 // Input  : pszFileName - Full path of file to load.
@@ -1401,6 +1448,10 @@ bool CMapDoc::LoadVMF(const char *pszFileName, bool bIsInstance)
 
 	bool bLocked = VisGroups_LockUpdates( true );
 
+	// Started with -vmfloadbench, report how long reading and setting up the map took.
+	bool bLoadBench = !m_bLoadingInstance && CommandLine()->FindParm( "-vmfloadbench" );
+	double flLoadStart = Plat_FloatTime();
+
 	//
 	// Open the file.
 	//
@@ -1464,6 +1515,7 @@ bool CMapDoc::LoadVMF(const char *pszFileName, bool bIsInstance)
 		File.PopHandlers();
 	}
 
+	double flParseTime = Plat_FloatTime() - flLoadStart;
 
 	if (eResult == ChunkFile_Ok)
 	{
@@ -1471,6 +1523,11 @@ bool CMapDoc::LoadVMF(const char *pszFileName, bool bIsInstance)
 			pProgDlg->SetWindowText( "Postload Processing..." );
 		Postload();
 
+		if ( bLoadBench )
+		{
+			Msg( mwStatus, "Loaded %s: parse %.3f seconds, postload %.3f seconds.", pszFileName, flParseTime, Plat_FloatTime() - flLoadStart - flParseTime );
+		}
+
 		if ( !m_bLoadingInstance )
 			pProgDlg->StepIt();
 		m_bLoading = false;
@@ -1664,7 +1721,27 @@ void CMapDoc::Postload(void)
 	// may do so in PostLoadWorld.
 	//
 	CountGUIDs();
+
+	// Entities create their model helpers here. The models are read on another
+	// thread while PostloadWorld carries on, then waited for so that the cull
+	// tree and everything after it see their real bounds.
+	CStudioModelCache::BeginAsyncLoad();
+	double flPostloadStart = Plat_FloatTime();
 	m_pWorld->PostloadWorld();
+	double flPostloadTime = Plat_FloatTime() - flPostloadStart;
+	if (CStudioModelCache::GetPendingLoadCount() > 0)
+	{
+		WaitForModelLoads( !m_bLoadingInstance );
+	}
+	CStudioModelCache::EndAsyncLoad();
+	CMapStudioModel::UpdateLoadedModels();
+
+	if ( CommandLine()->FindParm( "-faceidbench" ) )
+	{
+		// Most of this is sidelists looking up their faces on overlay-heavy maps.
+		Msg( mwStatus, "PostloadWorld took %.3f seconds.", flPostloadTime );
+		m_pWorld->FaceID_BenchmarkLookups();
+	}
 	if ( !m_bLoadingInstance )
 	{
 		pProgDlg->StepIt();
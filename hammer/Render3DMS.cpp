@@ -39,6 +39,8 @@
 #include "mainfrm.h"
 #include "mathlib/halton.h"
 #include "materialsystem/materialsystemutil.h"
+#include "tier1/checksum_crc.h"
+#include "tier1/utlmap.h"
 
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -784,38 +786,114 @@ bool CompareLightPreview_Lights(CLightPreview_Light const &a, CLightPreview_Ligh
 #define MAX_PREVIEW_LIGHTS 75								// max # of lights to process.
 
 
+// what the lighting preview thread was last told about an object's shadowing triangles
+struct ShadowOwner_t
+{
+	int m_nOwnerID;
+	CRC32_t m_TriangleCRC;
+	int m_nLastSeen;
+};
+
+static CUtlMap<CMapClass *, ShadowOwner_t> s_ShadowOwners( DefLessFunc( CMapClass * ) );
+static CMapWorld *s_pShadowOwnerWorld = NULL;
+static int s_nNextShadowOwnerID = 0;
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Sends the shadowing triangles of any objects whose geometry changed
+//			since the last send to the lighting preview thread, so that it only
+//			has to rebuild the part of its acceleration structure which changed.
+//-----------------------------------------------------------------------------
 void CRender3D::SendShadowTriangles( void )
 {
 	static int LastSendTimeStamp=-1;
+	static int s_nSendCounter=0;
 	if ( GetUpdateCounter( EVTYPE_FACE_CHANGED ) != LastSendTimeStamp )
 	{
 		LastSendTimeStamp = GetUpdateCounter( EVTYPE_FACE_CHANGED );
-		CUtlVector<Vector> *tri_list=new CUtlVector<Vector>;
 		CMapDoc *pDoc = m_pView->GetMapDoc();
 		CMapWorld *pWorld = pDoc->GetMapWorld();
 
 		if ( !pWorld )
 			return;
 
-		if (g_pLPreviewOutputBitmap)
-			delete g_pLPreviewOutputBitmap;
-		g_pLPreviewOutputBitmap = NULL;
+		bool bReplaceAll = ( pWorld != s_pShadowOwnerWorld );
+		if ( bReplaceAll )
+		{
+			s_ShadowOwners.RemoveAll();
+			s_pShadowOwnerWorld = pWorld;
+		}
+		s_nSendCounter++;
+
+		CUtlVector<LightingPreviewShadowObject_t *> *pChangedList = new CUtlVector<LightingPreviewShadowObject_t *>;
+		CUtlVector<Vector> tri_list;
 		EnumChildrenPos_t pos;
 		CMapClass *pChild = pWorld->GetFirstDescendent( pos );
 		while ( pChild )
 		{
+			tri_list.RemoveAll();
 			if (pChild->IsVisible())
-				pChild->AddShadowingTriangles( *tri_list );
+				pChild->AddShadowingTriangles( tri_list );
+
+			if ( tri_list.Count() )
+			{
+				CRC32_t crc = CRC32_ProcessSingleBuffer( tri_list.Base(), tri_list.Count() * sizeof( Vector ) );
+
+				bool bChanged = true;
+				int nIndex = s_ShadowOwners.Find( pChild );
+				if ( nIndex == s_ShadowOwners.InvalidIndex() )
+				{
+					ShadowOwner_t owner;
+					owner.m_nOwnerID = s_nNextShadowOwnerID++;
+					owner.m_TriangleCRC = crc;
+					nIndex = s_ShadowOwners.Insert( pChild, owner );
+				}
+				else
+				{
+					bChanged = ( s_ShadowOwners[nIndex].m_TriangleCRC != crc );
+					s_ShadowOwners[nIndex].m_TriangleCRC = crc;
+				}
+				s_ShadowOwners[nIndex].m_nLastSeen = s_nSendCounter;
+
+				if ( bChanged )
+				{
+					LightingPreviewShadowObject_t *pObject = new LightingPreviewShadowObject_t;
+					pObject->m_nOwnerID = s_ShadowOwners[nIndex].m_nOwnerID;
+					pObject->m_Triangles.AddMultipleToTail( tri_list.Count(), tri_list.Base() );
+					pChangedList->AddToTail( pObject );
+				}
+			}
 			pChild = pWorld->GetNextDescendent( pos );
 		}
-		if ( tri_list->Count() )
+
+		// anything we didn't see this time was deleted, hidden, or lost all of its triangles
+		CUtlVector<CMapClass *> removed;
+		for ( int i = s_ShadowOwners.FirstInorder(); i != s_ShadowOwners.InvalidIndex(); i = s_ShadowOwners.NextInorder( i ) )
+		{
+			if ( s_ShadowOwners[i].m_nLastSeen != s_nSendCounter )
+			{
+				LightingPreviewShadowObject_t *pObject = new LightingPreviewShadowObject_t;
+				pObject->m_nOwnerID = s_ShadowOwners[i].m_nOwnerID;
+				pChangedList->AddToTail( pObject );
+				removed.AddToTail( s_ShadowOwners.Key( i ) );
+			}
+		}
+		for ( int i = 0; i < removed.Count(); i++ )
+			s_ShadowOwners.Remove( removed[i] );
+
+		if ( pChangedList->Count() || bReplaceAll )
 		{
+			if (g_pLPreviewOutputBitmap)
+				delete g_pLPreviewOutputBitmap;
+			g_pLPreviewOutputBitmap = NULL;
+
 			MessageToLPreview msg( LPREVIEW_MSG_GEOM_DATA );
-			msg.m_pShadowTriangleList = tri_list;
+			msg.m_pShadowObjectList = pChangedList;
+			msg.m_bReplaceAllShadowGeometry = bReplaceAll;
 			g_HammerToLPreviewMsgQueue.QueueMessage( msg );
 		}
 		else
-			delete tri_list;
+			delete pChangedList;
 	}
 
 }
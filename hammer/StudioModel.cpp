@@ -75,8 +75,78 @@ bool			g_bUpdateBones2D = true;
 // Model meshes themselves are cached to avoid redundancy. There should never be
 // more than one copy of a given studio model in memory at once.
 //-----------------------------------------------------------------------------
-ModelCache_t CStudioModelCache::m_Cache[1024];
-int CStudioModelCache::m_nItems = 0;
+CUtlLinkedList<ModelCache_t, int> CStudioModelCache::m_Cache;
+CUtlHashtable<const char *, int> CStudioModelCache::m_PathToEntry;
+CUtlHashtable<StudioModel *, int, PointerHashFunctor> CStudioModelCache::m_ModelToEntry;
+CUtlLinkedList<int, int> CStudioModelCache::m_Unreferenced;
+int64 CStudioModelCache::m_nMemory = 0;
+int64 CStudioModelCache::m_nUnreferencedMemory = 0;
+int CStudioModelCache::m_nLoads = 0;
+int CStudioModelCache::m_nCacheHits = 0;
+int CStudioModelCache::m_nEvictions = 0;
+double CStudioModelCache::m_flLoadTime = 0;
+
+//-----------------------------------------------------------------------------
+// Asynchronous loading. There is one loader thread, since that is how the
+// engine drives the MDL cache from its own loading thread, and it only reads
+// MDL and VVD data. Building the meshes needs the material system, so that is
+// left to the main thread.
+//-----------------------------------------------------------------------------
+CUtlLinkedList<StudioModelLoadJob_t, int> CStudioModelCache::m_LoadQueue;
+CUtlLinkedList<StudioModelLoadJob_t, int> CStudioModelCache::m_LoadedQueue;
+CThreadFastMutex CStudioModelCache::m_LoadMutex;
+CThreadEvent CStudioModelCache::m_LoadEvent;
+CThreadEvent CStudioModelCache::m_LoadedEvent;
+ThreadHandle_t CStudioModelCache::m_hLoaderThread = NULL;
+bool CStudioModelCache::m_bLoaderBusy = false;
+bool CStudioModelCache::m_bLoaderExiting = false;
+int CStudioModelCache::m_nAsyncLoadDepth = 0;
+int CStudioModelCache::m_nPendingLoads = 0;
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Turns a model path into the key used by the cache: lower case, with
+//			forward slashes and no doubled slashes.
+//-----------------------------------------------------------------------------
+void CStudioModelCache::NormalizePath(const char *pszModelPath, char *pszNormalized, int nMaxLen)
+{
+	V_strncpy( pszNormalized, pszModelPath, nMaxLen );
+	V_FixSlashes( pszNormalized, '/' );
+	V_FixDoubleSlashes( pszNormalized );
+	V_strlower( pszNormalized );
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the cache index of a model, or m_Cache.InvalidIndex() if
+//			it isn't cached. Doesn't touch the reference count.
+//-----------------------------------------------------------------------------
+int CStudioModelCache::FindEntry(const char *pszNormalizedPath)
+{
+	UtlHashHandle_t hEntry = m_PathToEntry.Find( pszNormalizedPath );
+	if ( hEntry == m_PathToEntry.InvalidHandle() )
+		return m_Cache.InvalidIndex();
+
+	return m_PathToEntry[hEntry];
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Increments the reference count of a cache entry, taking it off the
+//			unreferenced list if nothing was using it.
+//-----------------------------------------------------------------------------
+void CStudioModelCache::AddRefEntry(int nIndex)
+{
+	ModelCache_t &entry = m_Cache[nIndex];
+	if (entry.iUnreferenced != m_Unreferenced.InvalidIndex())
+	{
+		m_Unreferenced.Remove(entry.iUnreferenced);
+		entry.iUnreferenced = m_Unreferenced.InvalidIndex();
+		m_nUnreferencedMemory -= entry.nMemory;
+	}
+
+	entry.nRefCount++;
+}
 
 
 //-----------------------------------------------------------------------------
@@ -85,27 +155,20 @@ int CStudioModelCache::m_nItems = 0;
 StudioModel *CStudioModelCache::FindModel(const char *pszModelPath)
 {
 	char testPath[MAX_PATH];
-	V_strncpy( testPath, pszModelPath, sizeof( testPath ) );
-	V_FixSlashes( testPath );
+	NormalizePath( pszModelPath, testPath, sizeof( testPath ) );
 
 	//
-	// First look for the model in the cache. If it's there, increment the
-	// reference count and return a pointer to the cached model.
+	// If the model is in the cache, increment the reference count and return
+	// a pointer to the cached model.
 	//
-	for (int i = 0; i < m_nItems; i++)
+	int nIndex = FindEntry( testPath );
+	if (nIndex == m_Cache.InvalidIndex())
 	{
-		char testPath2[MAX_PATH];
-		V_strncpy( testPath2, m_Cache[i].pszPath, sizeof( testPath2 ) );
-		V_FixSlashes( testPath2 );
-
-		if (!stricmp(testPath, testPath2))
-		{
-			m_Cache[i].nRefCount++;
-			return(m_Cache[i].pModel);
-		}
+		return NULL;
 	}
 
-	return NULL;
+	AddRefEntry(nIndex);
+	return(m_Cache[nIndex].pModel);
 }
 
 
@@ -117,13 +180,64 @@ StudioModel *CStudioModelCache::FindModel(const char *pszModelPath)
 //-----------------------------------------------------------------------------
 StudioModel *CStudioModelCache::CreateModel(const char *pszModelPath)
 {
-	StudioModel *pTest = FindModel( pszModelPath );
-	if ( pTest )
-		return pTest;
+	char testPath[MAX_PATH];
+	NormalizePath( pszModelPath, testPath, sizeof( testPath ) );
+
+	int nIndex = FindEntry( testPath );
+	if (nIndex != m_Cache.InvalidIndex())
+	{
+		StudioModel *pModel = m_Cache[nIndex].pModel;
+		switch (pModel->GetLoadState())
+		{
+			case STUDIOMODEL_LOAD_FAILED:
+			{
+				// Same as loading it again and failing.
+				return(NULL);
+			}
+
+			case STUDIOMODEL_LOAD_CANCELLED:
+			{
+				if (IsAsyncLoading())
+				{
+					QueueLoad(nIndex, pszModelPath);
+				}
+				else
+				{
+					LoadModelNow(nIndex, pszModelPath);
+					if (!pModel->IsLoaded())
+					{
+						return(NULL);
+					}
+				}
+				break;
+			}
+
+			default:
+			{
+				m_nCacheHits++;
+				break;
+			}
+		}
+
+		AddRefEntry(nIndex);
+		return(pModel);
+	}
+
+	//
+	// While a map is loading, hand back a placeholder and let the loader thread
+	// read it.
+	//
+	if (IsAsyncLoading())
+	{
+		StudioModel *pModel = new StudioModel;
+		QueueLoad(AddModel(pModel, testPath), pszModelPath);
+		return(pModel);
+	}
 
 	//
 	// If it isn't there, try to create one.
 	//
+	double flStart = Plat_FloatTime();
 	StudioModel *pModel = new StudioModel;
 
 	if (pModel != NULL)
@@ -147,7 +261,8 @@ StudioModel *CStudioModelCache::CreateModel(const char *pszModelPath)
 	//
 	if (pModel != NULL)
 	{
-		CStudioModelCache::AddModel(pModel, pszModelPath);
+		int nNewIndex = CStudioModelCache::AddModel(pModel, testPath);
+		SetLoadResult(nNewIndex, true, Plat_FloatTime() - flStart);
 	}
 
 	return(pModel);
@@ -157,48 +272,213 @@ StudioModel *CStudioModelCache::CreateModel(const char *pszModelPath)
 //-----------------------------------------------------------------------------
 // Purpose: Adds the model to the cache, setting the reference count to one.
 // Input  : pModel - Model to add to the cache.
-//			pszModelPath - The full path of the .MDL file, which is used as a
-//				key in the model cache.
-// Output : Returns TRUE if the model was successfully added, FALSE if we ran
-//			out of memory trying to add the model to the cache.
+//			pszNormalizedPath - The normalized path of the .MDL file, which is
+//				used as a key in the model cache.
+// Output : Returns the cache index of the model.
+//-----------------------------------------------------------------------------
+int CStudioModelCache::AddModel(StudioModel *pModel, const char *pszNormalizedPath)
+{
+	int nIndex = m_Cache.AddToTail();
+	ModelCache_t &entry = m_Cache[nIndex];
+
+	entry.pModel = pModel;
+	entry.pszPath = new char [strlen(pszNormalizedPath) + 1];
+	strcpy(entry.pszPath, pszNormalizedPath);
+	entry.nRefCount = 1;
+	entry.nMemory = 0;
+	entry.flLoadTime = 0;
+	entry.iUnreferenced = m_Unreferenced.InvalidIndex();
+
+	// The path table points at the entry's own copy of the path
+	m_PathToEntry.Insert(entry.pszPath, nIndex);
+	m_ModelToEntry.Insert(pModel, nIndex);
+
+	return(nIndex);
+}
+
+
 //-----------------------------------------------------------------------------
-BOOL CStudioModelCache::AddModel(StudioModel *pModel, const char *pszModelPath)
+// Purpose: Records how loading a cached model went, and counts its memory.
+// Input  : nIndex - Cache index of the model.
+//			bLoaded - Whether the model loaded.
+//			flLoadTime - How long the model took to load, for the statistics.
+//-----------------------------------------------------------------------------
+void CStudioModelCache::SetLoadResult(int nIndex, bool bLoaded, float flLoadTime)
 {
+	ModelCache_t &entry = m_Cache[nIndex];
+
+	entry.pModel->m_LoadState = bLoaded ? STUDIOMODEL_LOADED : STUDIOMODEL_LOAD_FAILED;
+	entry.flLoadTime = flLoadTime;
+
+	m_nMemory -= entry.nMemory;
+	entry.nMemory = entry.pModel->GetMemoryUsage();
+	m_nMemory += entry.nMemory;
+
+	m_nLoads++;
+	m_flLoadTime += flLoadTime;
+
 	//
-	// Copy the model pointer.
+	// Models released while the loader thread had them couldn't go on the
+	// unreferenced list then.
 	//
-	m_Cache[m_nItems].pModel = pModel;
+	if ((entry.nRefCount == 0) && (entry.iUnreferenced == m_Unreferenced.InvalidIndex()))
+	{
+		MarkUnreferenced(nIndex);
+	}
+	else
+	{
+		EvictUnreferenced((int64)Options.general.iModelCacheSize * 1024 * 1024);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Loads a cached model that isn't loaded yet on this thread.
+//-----------------------------------------------------------------------------
+void CStudioModelCache::LoadModelNow(int nIndex, const char *pszModelPath)
+{
+	StudioModel *pModel = m_Cache[nIndex].pModel;
+
+	double flStart = Plat_FloatTime();
+	bool bLoaded = pModel->LoadModel(pszModelPath);
+	if (bLoaded)
+	{
+		bLoaded = pModel->PostLoadModel(pszModelPath);
+	}
+
+	SetLoadResult(nIndex, bLoaded, Plat_FloatTime() - flStart);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Puts a model nothing references on the unreferenced list, where it
+//			can be evicted.
+//-----------------------------------------------------------------------------
+void CStudioModelCache::MarkUnreferenced(int nIndex)
+{
+	ModelCache_t &entry = m_Cache[nIndex];
+
+	entry.iUnreferenced = m_Unreferenced.AddToTail(nIndex);
+	m_nUnreferencedMemory += entry.nMemory;
+
+	EvictUnreferenced((int64)Options.general.iModelCacheSize * 1024 * 1024);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Frees a model and removes it from the cache.
+// Input  : nIndex - Cache index of the model.
+//-----------------------------------------------------------------------------
+void CStudioModelCache::RemoveModel(int nIndex)
+{
+	ModelCache_t &entry = m_Cache[nIndex];
+
+	if (entry.iUnreferenced != m_Unreferenced.InvalidIndex())
+	{
+		m_Unreferenced.Remove(entry.iUnreferenced);
+		m_nUnreferencedMemory -= entry.nMemory;
+	}
+
+	m_nMemory -= entry.nMemory;
+
+	m_PathToEntry.Remove(entry.pszPath);
+	m_ModelToEntry.Remove(entry.pModel);
 
 	//
-	// Allocate space for and copy the model path.
+	// Free the path, which was allocated by AddModel.
 	//
-	m_Cache[m_nItems].pszPath = new char [strlen(pszModelPath) + 1];
-	if (m_Cache[m_nItems].pszPath != NULL)
+	delete [] entry.pszPath;
+	delete entry.pModel;
+
+	m_Cache.Remove(nIndex);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Frees the least recently released models until the cache uses no
+//			more than the given amount of memory, or nothing unreferenced is left.
+//-----------------------------------------------------------------------------
+void CStudioModelCache::EvictUnreferenced(int64 nMaxMemory)
+{
+	while ((m_nMemory > nMaxMemory) && (m_Unreferenced.Count() > 0))
 	{
-		strcpy(m_Cache[m_nItems].pszPath, pszModelPath);
+		RemoveModel(m_Unreferenced[m_Unreferenced.Head()]);
+		m_nEvictions++;
 	}
-	else
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Frees every model that nothing references.
+//-----------------------------------------------------------------------------
+void CStudioModelCache::PurgeUnreferenced(void)
+{
+	while (m_Unreferenced.Count() > 0)
+	{
+		RemoveModel(m_Unreferenced[m_Unreferenced.Head()]);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Reloads a cached model after its files changed on disk. Models that
+//			nothing references are just dropped, they'll be loaded again if
+//			they're used.
+// Input  : pszModelPath - Path of the .MDL file.
+//-----------------------------------------------------------------------------
+void CStudioModelCache::ReloadModel(const char *pszModelPath)
+{
+	char testPath[MAX_PATH];
+	NormalizePath( pszModelPath, testPath, sizeof( testPath ) );
+
+	int nIndex = FindEntry( testPath );
+	if (nIndex == m_Cache.InvalidIndex())
+	{
+		return;
+	}
+
+	ModelCache_t &entry = m_Cache[nIndex];
+	if (entry.pModel->GetLoadState() == STUDIOMODEL_LOAD_PENDING)
 	{
-		return(FALSE);
+		// The loader thread will read the new files.
+		return;
+	}
+
+	if (entry.nRefCount == 0)
+	{
+		RemoveModel(nIndex);
+		return;
 	}
 
-	m_Cache[m_nItems].nRefCount = 1;
+	entry.pModel->FreeModel();
 
-	m_nItems++;
+	if (!entry.pModel->IsLoaded())
+	{
+		// Maybe the change fixed it.
+		LoadModelNow(nIndex, pszModelPath);
+		return;
+	}
 
-	return(TRUE);
+	entry.pModel->LoadModel( pszModelPath );
+
+	m_nMemory -= entry.nMemory;
+	entry.nMemory = entry.pModel->GetMemoryUsage();
+	m_nMemory += entry.nMemory;
 }
 
 
 //-----------------------------------------------------------------------------
-// Purpose: Advances the animation of all models in the cache for the given interval.
+// Purpose: Advances the animation of all models in use for the given interval.
 // Input  : flInterval - delta time in seconds.
 //-----------------------------------------------------------------------------
 void CStudioModelCache::AdvanceAnimation(float flInterval)
 {
-	for (int i = 0; i < m_nItems; i++)
+	for (int i = m_Cache.Head(); i != m_Cache.InvalidIndex(); i = m_Cache.Next(i))
 	{
-		m_Cache[i].pModel->AdvanceFrame(flInterval);
+		if ((m_Cache[i].nRefCount > 0) && m_Cache[i].pModel->IsLoaded())
+		{
+			m_Cache[i].pModel->AdvanceFrame(flInterval);
+		}
 	}
 }
 
@@ -211,60 +491,334 @@ void CStudioModelCache::AdvanceAnimation(float flInterval)
 //-----------------------------------------------------------------------------
 void CStudioModelCache::AddRef(StudioModel *pModel)
 {
-	for (int i = 0; i < m_nItems; i++)
+	UtlHashHandle_t hEntry = m_ModelToEntry.Find(pModel);
+	if (hEntry != m_ModelToEntry.InvalidHandle())
 	{
-		if (m_Cache[i].pModel == pModel)
-		{
-			m_Cache[i].nRefCount++;
-			return;
-		}
+		AddRefEntry(m_ModelToEntry[hEntry]);
 	}
 }
 
 
 //-----------------------------------------------------------------------------
 // Purpose: Called by client code to release an instance of a model. If the
-//			model's reference count is zero, the model is freed.
+//			model's reference count is zero, the model goes on the unreferenced
+//			list, and is freed once the cache needs the memory.
 // Input  : pModel - Pointer to the model to release.
 //-----------------------------------------------------------------------------
 void CStudioModelCache::Release(StudioModel *pModel)
 {
-	for (int i = 0; i < m_nItems; i++)
+	UtlHashHandle_t hEntry = m_ModelToEntry.Find(pModel);
+	if (hEntry == m_ModelToEntry.InvalidHandle())
+	{
+		return;
+	}
+
+	int nIndex = m_ModelToEntry[hEntry];
+	ModelCache_t &entry = m_Cache[nIndex];
+
+	entry.nRefCount--;
+	Assert(entry.nRefCount >= 0);
+
+	if (entry.nRefCount <= 0)
+	{
+		entry.nRefCount = 0;
+
+		//
+		// The loader thread may still be reading a pending model, so it goes on
+		// the list once it's finished.
+		//
+		if (pModel->GetLoadState() != STUDIOMODEL_LOAD_PENDING)
+		{
+			MarkUnreferenced(nIndex);
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the cache's memory use and load statistics.
+//-----------------------------------------------------------------------------
+void CStudioModelCache::GetStats(StudioModelCacheStats_t &stats)
+{
+	stats.nModels = m_Cache.Count();
+	stats.nUnreferencedModels = m_Unreferenced.Count();
+	stats.nMemory = m_nMemory;
+	stats.nUnreferencedMemory = m_nUnreferencedMemory;
+	stats.nLoads = m_nLoads;
+	stats.nCacheHits = m_nCacheHits;
+	stats.nEvictions = m_nEvictions;
+	stats.flLoadTime = m_flLoadTime;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Starts handing back placeholders from CreateModel and loading them
+//			on the loader thread. Calls nest.
+//-----------------------------------------------------------------------------
+void CStudioModelCache::BeginAsyncLoad(void)
+{
+	if (m_nAsyncLoadDepth++ > 0)
+	{
+		return;
+	}
+
+	m_bLoaderExiting = false;
+	m_hLoaderThread = CreateSimpleThread(LoaderThreadFN, NULL);
+	if (m_hLoaderThread == NULL)
+	{
+		Warning("Couldn't start the model loader thread. Models will load synchronously.\n");
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Finishes any models still loading and stops the loader thread once
+//			the outermost BeginAsyncLoad is matched.
+//-----------------------------------------------------------------------------
+void CStudioModelCache::EndAsyncLoad(void)
+{
+	Assert(m_nAsyncLoadDepth > 0);
+	if (--m_nAsyncLoadDepth > 0)
+	{
+		return;
+	}
+
+	while (GetPendingLoadCount() > 0)
+	{
+		if (FinishAsyncLoads(FLT_MAX) == 0)
+		{
+			m_LoadedEvent.Wait();
+		}
+	}
+
+	if (m_hLoaderThread != NULL)
 	{
-		if (m_Cache[i].pModel == pModel)
 		{
-			m_Cache[i].nRefCount--;
-			Assert(m_Cache[i].nRefCount >= 0);
-
-			//
-			// If this model is no longer referenced, free it and remove it
-			// from the cache.
-			//
-			if (m_Cache[i].nRefCount <= 0)
+			AUTO_LOCK(m_LoadMutex);
+			m_bLoaderExiting = true;
+		}
+		m_LoadEvent.Set();
+		ThreadJoin(m_hLoaderThread);
+		ReleaseThreadHandle(m_hLoaderThread);
+		m_hLoaderThread = NULL;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the number of models the loader thread hasn't read or the
+//			main thread hasn't finished yet.
+//-----------------------------------------------------------------------------
+int CStudioModelCache::GetPendingLoadCount(void)
+{
+	return(m_nPendingLoads);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Blocks until the loader thread finishes reading a model, or until
+//			the time runs out.
+//-----------------------------------------------------------------------------
+void CStudioModelCache::WaitForLoadedModel(unsigned nMaxMilliseconds)
+{
+	if (m_hLoaderThread != NULL)
+	{
+		m_LoadedEvent.Wait(nMaxMilliseconds);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Sets up the render data of models the loader thread has read. Must
+//			be called from the main thread.
+// Input  : flMaxSeconds - Stop after the first model that goes over this time.
+// Output : Returns the number of models finished.
+//-----------------------------------------------------------------------------
+int CStudioModelCache::FinishAsyncLoads(float flMaxSeconds)
+{
+	double flStart = Plat_FloatTime();
+	int nFinished = 0;
+
+	for (;;)
+	{
+		StudioModelLoadJob_t job;
+		{
+			AUTO_LOCK(m_LoadMutex);
+			if (m_LoadedQueue.Count() == 0)
 			{
-				//
-				// Free the path, which was allocated by AddModel.
-				//
-				delete [] m_Cache[i].pszPath;
-				delete m_Cache[i].pModel;
-
-				//
-				// Decrement the item count and copy the last element in the cache over
-				// this element.
-				//
-				m_nItems--;
-
-				m_Cache[i].pModel = m_Cache[m_nItems].pModel;
-				m_Cache[i].pszPath = m_Cache[m_nItems].pszPath;
-				m_Cache[i].nRefCount = m_Cache[m_nItems].nRefCount;
+				break;
 			}
 
+			int nHead = m_LoadedQueue.Head();
+			job = m_LoadedQueue[nHead];
+			m_LoadedQueue.Remove(nHead);
+		}
+
+		FinishLoad(job);
+		nFinished++;
+
+		if (Plat_FloatTime() - flStart >= flMaxSeconds)
+		{
 			break;
 		}
 	}
+
+	return(nFinished);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Drops the models the loader thread hasn't started on. They stay as
+//			placeholders, and are loaded again the next time they're created.
+//-----------------------------------------------------------------------------
+void CStudioModelCache::CancelAsyncLoads(void)
+{
+	CUtlVector<StudioModel *> Cancelled;
+	{
+		AUTO_LOCK(m_LoadMutex);
+		for (int i = m_LoadQueue.Head(); i != m_LoadQueue.InvalidIndex(); i = m_LoadQueue.Next(i))
+		{
+			Cancelled.AddToTail(m_LoadQueue[i].pModel);
+		}
+		m_LoadQueue.RemoveAll();
+	}
+
+	for (int i = 0; i < Cancelled.Count(); i++)
+	{
+		int nIndex = m_ModelToEntry[m_ModelToEntry.Find(Cancelled[i])];
+		ModelCache_t &entry = m_Cache[nIndex];
+
+		entry.pModel->m_LoadState = STUDIOMODEL_LOAD_CANCELLED;
+		m_nPendingLoads--;
+
+		if (entry.nRefCount == 0)
+		{
+			MarkUnreferenced(nIndex);
+		}
+	}
+
+	// Let the model the loader thread is on finish, then set it up.
+	WaitForLoaderThread();
+	FinishAsyncLoads(FLT_MAX);
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Queues a cached model for the loader thread.
+//-----------------------------------------------------------------------------
+void CStudioModelCache::QueueLoad(int nIndex, const char *pszModelPath)
+{
+	StudioModelLoadJob_t job;
+	job.pModel = m_Cache[nIndex].pModel;
+	V_strncpy(job.szPath, pszModelPath, sizeof(job.szPath));
+	job.bLoaded = false;
+	job.flLoadTime = 0;
+
+	job.pModel->m_LoadState = STUDIOMODEL_LOAD_PENDING;
+	m_nPendingLoads++;
+
+	{
+		AUTO_LOCK(m_LoadMutex);
+		m_LoadQueue.AddToTail(job);
+	}
+
+	m_LoadEvent.Set();
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Builds the render data for a model the loader thread has read.
+//-----------------------------------------------------------------------------
+void CStudioModelCache::FinishLoad(const StudioModelLoadJob_t &job)
+{
+	UtlHashHandle_t hEntry = m_ModelToEntry.Find(job.pModel);
+	Assert(hEntry != m_ModelToEntry.InvalidHandle());
+	int nIndex = m_ModelToEntry[hEntry];
+
+	double flStart = Plat_FloatTime();
+	bool bLoaded = job.bLoaded;
+	if (bLoaded)
+	{
+		// The loader thread may be reading the next model.
+		MDLCACHE_CRITICAL_SECTION_(g_pMDLCache);
+		bLoaded = job.pModel->LoadRenderData() && job.pModel->PostLoadModel(job.szPath);
+	}
+
+	m_nPendingLoads--;
+	SetLoadResult(nIndex, bLoaded, job.flLoadTime + (Plat_FloatTime() - flStart));
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Waits until the loader thread isn't reading a model.
+//-----------------------------------------------------------------------------
+void CStudioModelCache::WaitForLoaderThread(void)
+{
+	for (;;)
+	{
+		{
+			AUTO_LOCK(m_LoadMutex);
+			if (!m_bLoaderBusy)
+			{
+				return;
+			}
+		}
+
+		m_LoadedEvent.Wait();
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Loader thread. Reads the queued models one at a time.
+//-----------------------------------------------------------------------------
+unsigned CStudioModelCache::LoaderThreadFN(void *pParam)
+{
+	for (;;)
+	{
+		StudioModelLoadJob_t job;
+		bool bHaveJob = false;
+		bool bExiting;
+		{
+			AUTO_LOCK(m_LoadMutex);
+			if (m_LoadQueue.Count() > 0)
+			{
+				int nHead = m_LoadQueue.Head();
+				job = m_LoadQueue[nHead];
+				m_LoadQueue.Remove(nHead);
+
+				m_bLoaderBusy = true;
+				bHaveJob = true;
+			}
+			bExiting = m_bLoaderExiting;
+		}
+
+		if (!bHaveJob)
+		{
+			if (bExiting)
+			{
+				break;
+			}
+
+			m_LoadEvent.Wait();
+			continue;
+		}
+
+		double flStart = Plat_FloatTime();
+		job.bLoaded = job.pModel->LoadModelData(job.szPath);
+		job.flLoadTime = Plat_FloatTime() - flStart;
+
+		{
+			AUTO_LOCK(m_LoadMutex);
+			m_LoadedQueue.AddToTail(job);
+			m_bLoaderBusy = false;
+		}
+		m_LoadedEvent.Set();
+	}
+
+	return 0;
+}
+
 
 //-----------------------------------------------------------------------------
 // Purpose: Watch for changes to studio models and reload them if necessary.
@@ -350,12 +904,7 @@ void CStudioFileChangeWatcher::Update()
 			g_pMDLCache->ResetErrorModelStatus( hModel );
 
 			// If we have it in the StudioModel cache, flush its data.
-			StudioModel *pTest = CStudioModelCache::FindModel( pName );
-			if ( pTest )
-			{
-				pTest->FreeModel();
-				pTest->LoadModel( pName );
-			}
+			CStudioModelCache::ReloadModel( pName );
 		}
 
 		m_ChangedModels.Purge();
@@ -414,6 +963,7 @@ StudioModel::StudioModel(void) : m_pModelName(0)
 	m_MDLHandle = MDLHANDLE_INVALID;
 	m_pModel = NULL;
 	m_pStudioHdr = NULL;
+	m_LoadState = STUDIOMODEL_LOADED;
 	m_pPosePos = NULL;
 	m_pPoseAng = NULL;
 }
@@ -582,6 +1132,9 @@ void StudioModel::SetupModel ( int bodypart )
 //-----------------------------------------------------------------------------
 void StudioModel::DrawModel3D( CRender3D *pRender, float flAlpha, bool bWireframe )
 {
+	// Views can repaint while the loader thread is reading other models.
+	MDLCACHE_CRITICAL_SECTION_( g_pMDLCache );
+
 	studiohdr_t *pStudioHdr = GetStudioRenderHdr();
 	if (!pStudioHdr)
 		return;
@@ -647,6 +1200,8 @@ void StudioModel::DrawModel3D( CRender3D *pRender, float flAlpha, bool bWirefram
 
 void StudioModel::DrawModel2D( CRender2D *pRender, float flAlpha, bool bWireFrame  )
 {
+	MDLCACHE_CRITICAL_SECTION_( g_pMDLCache );
+
 	studiohdr_t *pStudioHdr = GetStudioRenderHdr();
 	if (!pStudioHdr)
 		return;
@@ -737,6 +1292,7 @@ bool StudioModel::IsTranslucent()
 //-----------------------------------------------------------------------------
 void StudioModel::FreeModel(void)
 {
+	MDLCACHE_CRITICAL_SECTION_( g_pMDLCache );
 	/*int nRef = */g_pMDLCache->Release( m_MDLHandle );
 //	Assert( nRef == 0 );
 	m_MDLHandle = MDLHANDLE_INVALID;
@@ -750,6 +1306,8 @@ CStudioHdr *StudioModel::GetStudioHdr() const
 	if (m_pStudioHdr->IsValid())
 		return m_pStudioHdr;
 
+	// Helpers can ask for this while the loader thread is reading other models.
+	MDLCACHE_CRITICAL_SECTION_( g_pMDLCache );
 	studiohdr_t *hdr = g_pMDLCache->GetStudioHdr( m_MDLHandle );
 
 	m_pStudioHdr->Init( hdr );
@@ -773,11 +1331,53 @@ studiohdr_t *StudioModel::GetStudioRenderHdr() const
 
 studiohwdata_t* StudioModel::GetHardwareData()
 {
+	MDLCACHE_CRITICAL_SECTION_( g_pMDLCache );
 	return g_pMDLCache->GetHardwareData( m_MDLHandle );
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Returns roughly how many bytes the model takes up: the studio header
+//			and the vertexes of its root LOD.
+//-----------------------------------------------------------------------------
+int StudioModel::GetMemoryUsage()
+{
+	int nMemory = sizeof(StudioModel);
+
+	if (m_MDLHandle == MDLHANDLE_INVALID)
+		return nMemory;
+
+	MDLCACHE_CRITICAL_SECTION_( g_pMDLCache );
+	studiohdr_t *pStudioHdr = g_pMDLCache->GetStudioHdr( m_MDLHandle );
+	if (!pStudioHdr)
+		return nMemory;
+
+	nMemory += pStudioHdr->length;
+
+	for (int i = 0; i < pStudioHdr->numbodyparts; i++)
+	{
+		mstudiobodyparts_t *pBodyPart = pStudioHdr->pBodypart( i );
+		for (int j = 0; j < pBodyPart->nummodels; j++)
+		{
+			nMemory += pBodyPart->pModel( j )->numvertices * ( sizeof( mstudiovertex_t ) + sizeof( Vector4D ) );
+		}
+	}
+
+	return nMemory;
+}
+
+
 bool StudioModel::LoadModel( const char *modelname )
+{
+	return LoadModelData( modelname ) && LoadRenderData();
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Reads the MDL and VVD data. Doesn't touch the material system, so
+//			the model loader thread can call it.
+//-----------------------------------------------------------------------------
+bool StudioModel::LoadModelData( const char *modelname )
 {
 	// Load the MDL file data
 	Assert( m_MDLHandle == MDLHANDLE_INVALID );
@@ -801,12 +1401,29 @@ bool StudioModel::LoadModel( const char *modelname )
 		strcpy( m_pModelName, modelname );
 	}
 
+	// This runs on the loader thread while the main thread draws other models.
+	MDLCACHE_CRITICAL_SECTION_( g_pMDLCache );
+
 	m_MDLHandle = g_pMDLCache->FindMDL( modelname );
 	if (m_MDLHandle == MDLHANDLE_INVALID)
 		return false;
 
 	// Cache a bunch of stuff into memory
 	g_pMDLCache->GetStudioHdr( m_MDLHandle );
+	g_pMDLCache->GetVertexData( m_MDLHandle );
+
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Builds the meshes once the data is read. Main thread only.
+//-----------------------------------------------------------------------------
+bool StudioModel::LoadRenderData( void )
+{
+	if ( m_MDLHandle == MDLHANDLE_INVALID )
+		return false;
+
 	g_pMDLCache->GetHardwareData( m_MDLHandle );
 
 	if (m_pStudioHdr)
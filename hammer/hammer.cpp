@@ -1208,6 +1208,9 @@ void CHammer::Shutdown()
 		}
 	}
 
+	// Free the models no document is using any more
+	CStudioModelCache::PurgeUnreferenced();
+
 	g_Textures.ShutDown();
 
 	// Shutdown the sound system
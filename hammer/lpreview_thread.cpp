@@ -7,10 +7,15 @@
 #include "stdafx.h"
 #include "lpreview_thread.h"
 #include "mathlib/simdvectormatrix.h"
+#include "tier1/utlmap.h"
 #include "raytrace.h"
 #include "hammer.h"
 #include "mainfrm.h"
 #include "lprvwindow.h"
+#include "globalfunctions.h"
+#include "tier0/icommandline.h"
+#include "tier1/utlbuffer.h"
+#include "filesystem.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include <tier0/memdbgon.h>
@@ -86,6 +91,42 @@ public:
 
 #define N_INCREMENTAL_STEPS 32
 
+// when the triangles of objects changed since the last full build of the shadow acceleration
+// structure exceed this fraction of the scene (or the minimum below), everything is rebuilt
+// from scratch instead of just the changed objects
+#define SHADOW_DELTA_MAX_FRACTION 0.125
+#define SHADOW_DELTA_MIN_TRIANGLES 8192
+
+// kd-trees of the most recently opened maps are kept in the user's temp directory, one file
+// per scene hash. older ones are deleted.
+#define KDTREE_CACHE_MAX_FILES 8
+
+// shadowing triangles of one hammer object, and where they live in the preview's ray tracing
+// environments
+struct ShadowGeometryOwner_t
+{
+	CUtlVector<Vector> m_Triangles;
+	int m_nFirstBaseTriangle;								// index in m_pRtEnv, or -1 if the triangles
+															// are in m_pDeltaRtEnv
+};
+
+// max # of threads used to shade a single light. must be a power of 2, since lines are
+// split between workers using a line mask
+#define MAX_LPREVIEW_WORKERS 16
+
+class CLightingPreviewThread;
+
+struct LightingPreviewWorker_t
+{
+	CLightingPreviewThread *m_pOwner;
+	int m_nIndex;											// also the line match for this worker
+	ThreadHandle_t m_hThread;
+	CThreadEvent m_StartEvent;
+	CThreadEvent m_DoneEvent;
+	Vector m_Contribution[4];								// partial light sum of each simd lane for
+															// the current task
+};
+
 class CLightingPreviewThread
 {
 public:
@@ -96,10 +137,23 @@ public:
 	CSIMDVectorMatrix m_Albedos;
 	CSIMDVectorMatrix m_ResultImage;
 
+	// shadow geometry is split into the "base" environment, holding everything as of the last
+	// full rebuild, and the "delta" environment holding objects changed since then. changed
+	// objects are disabled in the base environment rather than rebuilding it.
+	CUtlMap<int, ShadowGeometryOwner_t *> m_ShadowGeometry;
 	RayTracingEnvironment *m_pRtEnv;
+	RayTracingEnvironment *m_pDeltaRtEnv;
+	int m_nDeltaTriangles;
+
 	CIncrementalLightInfo *m_pIncrementalLightInfoList;
 
 	bool m_bAccStructureBuilt;
+	bool m_bDeltaAccStructureBuilt;
+
+	// set when all of the shadow geometry was replaced (a map was opened), so that the next
+	// base kd-tree is loaded from, or written to, the kd-tree cache
+	bool m_bUseKDTreeCache;
+	char m_szKDTreeCacheDir[MAX_PATH];
 	Vector m_LastEyePosition;
 
 	bool m_bResultChangedSinceLastSend;
@@ -114,25 +168,54 @@ public:
 	Vector m_MinViewCoords;
 	Vector m_MaxViewCoords;
 
+	// worker pool for CalculateForLight. worker 0 is this thread.
+	int m_nWorkers;
+	LightingPreviewWorker_t m_Workers[MAX_LPREVIEW_WORKERS];
+	CLightingPreviewLightDescription *m_pTaskLight;
+	int m_nTaskCalcMask;
+	bool m_bWorkersExiting;
+
+	// time at which the current results were thrown away, for reporting time to full result
+	double m_flConvergeStartTime;
+
 	CLightingPreviewThread(void)
 	{
 		m_nBitmapGenerationCounter = -1;
 		m_pLightList = NULL;
 		m_pRtEnv = NULL;
+		m_pDeltaRtEnv = NULL;
+		m_nDeltaTriangles = 0;
 		m_bAccStructureBuilt = false;
+		m_bDeltaAccStructureBuilt = false;
+		m_bUseKDTreeCache = false;
+		char szTempDir[MAX_PATH];
+		if ( ! GetTempPath( sizeof( szTempDir ), szTempDir ) )
+			szTempDir[0] = 0;
+		Q_snprintf( m_szKDTreeCacheDir, sizeof( m_szKDTreeCacheDir ), "%shammer_lpreview\\", szTempDir );
+		m_ShadowGeometry.SetLessFunc( DefLessFunc( int ) );
 		m_pIncrementalLightInfoList = NULL;
 		m_fLastSendTime = -1.0e6;
 		m_bResultChangedSinceLastSend = false;
 		m_nContributionCounter = 1000000;
+		m_flConvergeStartTime = -1.0;
 		InitIncrementalInformation();
+		StartWorkers();
 	}
 
 	void InitIncrementalInformation( void );
 
+	void StartWorkers( void );
+	void StopWorkers( void );
+
+	// loop run by each worker thread other than worker 0
+	void WorkerLoop( LightingPreviewWorker_t *pWorker );
+
 	~CLightingPreviewThread( void )
 	{
+		StopWorkers();
 		if ( m_pLightList )
 			delete m_pLightList;
+		RemoveAllShadowGeometry();
 		while ( m_pIncrementalLightInfoList )
 		{
 			CIncrementalLightInfo *n=m_pIncrementalLightInfoList->m_pNext;
@@ -153,20 +236,38 @@ public:
 	// handle new g-buffers from master
 	void HandleGBuffersMessage( MessageToLPreview &msg_in );
 
-	// accept triangle list from master
+	// accept changed shadow triangles from master
 	void HandleGeomMessage( MessageToLPreview &msg_in );
 
+	void RemoveAllShadowGeometry( void );
+
+	// rebuild the base environment from all objects, emptying the delta environment
+	void RebuildShadowEnvironment( void );
+
+	// rebuild just the delta environment from the objects not in the base environment
+	void RebuildDeltaShadowEnvironment( void );
+
+	// build the base environment's kd-tree, using the kd-tree cache if m_bUseKDTreeCache
+	void SetupBaseAccelerationStructure( void );
+
+	// delete all but the newest KDTREE_CACHE_MAX_FILES files in the kd-tree cache
+	void PruneKDTreeCache( void );
+
+	// trace shadow rays against the base and delta environments, returning the closest hits
+	void TraceShadowRays( FourRays const &rays, RayTracingResult *pResult );
+
 	// send one of our output images back
 	void SendVectorMatrixAsRendering( CSIMDVectorMatrix const &src );
 
 	// calculate m_MinViewCoords, m_MaxViewCoords - the bounding box of the rendered pixels+the eye
 	void CalculateSceneBounds( void );
 
-	// inner lighting loop. meant to be multithreaded on dual-core (or more)
+	// inner lighting loop. run by each worker on the lines where
+	// (line & nLineMask) == nLineMatch
 	void CalculateForLightTask( int nLineMask, int nLineMatch,
 								CLightingPreviewLightDescription &l,
 								int calc_mask,
-								float *fContributionOut );
+								Vector *pContributionOut );
 
 	void CalculateForLight( CLightingPreviewLightDescription &l );
 
@@ -198,6 +299,7 @@ public:
 			}
 		m_bResultChangedSinceLastSend = true;
 		m_fLastSendTime = Plat_FloatTime()-9;				// force send
+		m_flConvergeStartTime = Plat_FloatTime();
 	}
 
 	// handle a message. returns true if the thread shuold exit
@@ -378,35 +480,312 @@ void CLightingPreviewThread::InitIncrementalInformation( void )
 	}
 }
 
+static unsigned LightingPreviewWorkerFN( void *thread_start_arg )
+{
+	LightingPreviewWorker_t *pWorker = (LightingPreviewWorker_t *) thread_start_arg;
+	ThreadSetPriority( -2 );								// low, same as the preview thread
+	pWorker->m_pOwner->WorkerLoop( pWorker );
+	return 0;
+}
+
+void CLightingPreviewThread::StartWorkers( void )
+{
+	m_pTaskLight = NULL;
+	m_nTaskCalcMask = 0;
+	m_bWorkersExiting = false;
+
+	int nThreads = GetCPUInformation()->m_nLogicalProcessors;
+	nThreads = CommandLine()->ParmValue( "-lpreviewthreads", nThreads );
+	nThreads = clamp( nThreads, 1, MAX_LPREVIEW_WORKERS );
+
+	// round down to a power of 2 so that the workers can split lines by mask
+	m_nWorkers = 1;
+	while ( m_nWorkers * 2 <= nThreads )
+		m_nWorkers *= 2;
+
+	for( int i = 0; i < MAX_LPREVIEW_WORKERS; i++ )
+	{
+		m_Workers[i].m_pOwner = this;
+		m_Workers[i].m_nIndex = i;
+		m_Workers[i].m_hThread = NULL;
+		for( int c = 0; c < 4; c++ )
+			m_Workers[i].m_Contribution[c].Init();
+	}
+	for( int i = 1; i < m_nWorkers; i++ )
+		m_Workers[i].m_hThread = CreateSimpleThread( LightingPreviewWorkerFN, &m_Workers[i] );
+}
+
+void CLightingPreviewThread::StopWorkers( void )
+{
+	m_bWorkersExiting = true;
+	for( int i = 1; i < m_nWorkers; i++ )
+		m_Workers[i].m_StartEvent.Set();
+	for( int i = 1; i < m_nWorkers; i++ )
+	{
+		ThreadJoin( m_Workers[i].m_hThread );
+		ReleaseThreadHandle( m_Workers[i].m_hThread );
+		m_Workers[i].m_hThread = NULL;
+	}
+	m_nWorkers = 1;
+}
+
+void CLightingPreviewThread::WorkerLoop( LightingPreviewWorker_t *pWorker )
+{
+	for(;;)
+	{
+		pWorker->m_StartEvent.Wait();
+		if ( m_bWorkersExiting )
+			break;
+		CalculateForLightTask( m_nWorkers - 1, pWorker->m_nIndex, *m_pTaskLight, m_nTaskCalcMask,
+							   pWorker->m_Contribution );
+		pWorker->m_DoneEvent.Set();
+	}
+}
+
 float cg[3]={ 1,0,0};
 float cr[3]={ 0,1,0 };
 float cb[3]={ 0,0,1 };
 
-void CLightingPreviewThread::HandleGeomMessage( MessageToLPreview &msg_in )
+// make a triangle in an environment which has been set up for tracing impossible to hit. A zero
+// normal makes every ray parallel to its plane.
+static void DisableIntersectionTriangle( RayTracingEnvironment *pEnv, int nTriangle )
 {
-	if (m_pRtEnv)
+	TriIntersectData_t &tri = pEnv->OptimizedTriangleList[nTriangle].m_Data.m_IntersectData;
+	tri.m_flNx = 0;
+	tri.m_flNy = 0;
+	tri.m_flNz = 0;
+	tri.m_flD = 0;
+}
+
+void CLightingPreviewThread::RemoveAllShadowGeometry( void )
+{
+	for( int i = m_ShadowGeometry.FirstInorder(); i != m_ShadowGeometry.InvalidIndex();
+		 i = m_ShadowGeometry.NextInorder( i ) )
+		delete m_ShadowGeometry[i];
+	m_ShadowGeometry.RemoveAll();
+	if ( m_pRtEnv )
 	{
 		delete m_pRtEnv;
 		m_pRtEnv = NULL;
 	}
-	CUtlVector<Vector> &tris=*( msg_in.m_pShadowTriangleList);
-	if (tris.Count())
+	if ( m_pDeltaRtEnv )
 	{
-//		FILE *fp = fopen( "c:\\gl.out", "w" );
-		m_pRtEnv = new RayTracingEnvironment;
-		for(int i=0;i<tris.Count();i+=3)
+		delete m_pDeltaRtEnv;
+		m_pDeltaRtEnv = NULL;
+	}
+	m_nDeltaTriangles = 0;
+}
+
+void CLightingPreviewThread::RebuildShadowEnvironment( void )
+{
+	if ( m_pRtEnv )
+	{
+		delete m_pRtEnv;
+		m_pRtEnv = NULL;
+	}
+	if ( m_pDeltaRtEnv )
+	{
+		delete m_pDeltaRtEnv;
+		m_pDeltaRtEnv = NULL;
+	}
+	m_nDeltaTriangles = 0;
+
+	int nTriangles = 0;
+	for( int i = m_ShadowGeometry.FirstInorder(); i != m_ShadowGeometry.InvalidIndex();
+		 i = m_ShadowGeometry.NextInorder( i ) )
+	{
+		ShadowGeometryOwner_t *pOwner = m_ShadowGeometry[i];
+		CUtlVector<Vector> &tris = pOwner->m_Triangles;
+		pOwner->m_nFirstBaseTriangle = nTriangles;
+		if ( tris.Count() && ( ! m_pRtEnv ) )
+			m_pRtEnv = new RayTracingEnvironment;
+		for( int t = 0; t < tris.Count(); t += 3 )
 		{
-//			fprintf(fp,"3\n");
-// 			for(int j=0;j<3;j++)
-// 				fprintf( fp,"%f %f %f %f %f %f\n", tris[j+i].x,tris[j+i].y,tris[j+i].z, cr[j],cg[j],cb[j] );
-			m_pRtEnv->AddTriangle( i, tris[i],tris[1+i],tris[2+i], Vector( .5,.5,.5) );
+			m_pRtEnv->AddTriangle( nTriangles, tris[t], tris[1+t], tris[2+t], Vector( .5,.5,.5) );
+			nTriangles++;
 		}
-//		fclose( fp );
 	}
-	delete msg_in.m_pShadowTriangleList;
 	m_bAccStructureBuilt = false;
+	m_bDeltaAccStructureBuilt = false;
+}
+
+void CLightingPreviewThread::RebuildDeltaShadowEnvironment( void )
+{
+	if ( m_pDeltaRtEnv )
+	{
+		delete m_pDeltaRtEnv;
+		m_pDeltaRtEnv = NULL;
+	}
+
+	int nTriangles = 0;
+	for( int i = m_ShadowGeometry.FirstInorder(); i != m_ShadowGeometry.InvalidIndex();
+		 i = m_ShadowGeometry.NextInorder( i ) )
+	{
+		ShadowGeometryOwner_t *pOwner = m_ShadowGeometry[i];
+		if ( pOwner->m_nFirstBaseTriangle != -1 )
+			continue;
+		CUtlVector<Vector> &tris = pOwner->m_Triangles;
+		if ( tris.Count() && ( ! m_pDeltaRtEnv ) )
+			m_pDeltaRtEnv = new RayTracingEnvironment;
+		for( int t = 0; t < tris.Count(); t += 3 )
+		{
+			m_pDeltaRtEnv->AddTriangle( nTriangles, tris[t], tris[1+t], tris[2+t], Vector( .5,.5,.5) );
+			nTriangles++;
+		}
+	}
+	m_nDeltaTriangles = nTriangles;
+	m_bDeltaAccStructureBuilt = false;
+}
+
+void CLightingPreviewThread::SetupBaseAccelerationStructure( void )
+{
+	bool bUseCache = m_bUseKDTreeCache;
+	m_bUseKDTreeCache = false;
+	if ( ! bUseCache )
+	{
+		m_pRtEnv->SetupAccelerationStructure();
+		return;
+	}
+
+	// reopening the same map gives the same triangles, and so the same hash, which names the
+	// cache file. each map gets its own file.
+	MD5Value_t sceneHash;
+	m_pRtEnv->CalculateSceneHash( sceneHash );
+	char szHash[2 * MD5_DIGEST_LENGTH + 1];
+	Q_binarytohex( sceneHash.bits, MD5_DIGEST_LENGTH, szHash, sizeof( szHash ) );
+	char szCacheFile[MAX_PATH];
+	Q_snprintf( szCacheFile, sizeof( szCacheFile ), "%s%s.kdtree", m_szKDTreeCacheDir, szHash );
+
+	CUtlBuffer buf;
+	if ( g_pFullFileSystem->ReadFile( szCacheFile, NULL, buf ) &&
+		 m_pRtEnv->LoadAccelerationStructure( buf, sceneHash ) )
+		return;
+
+	m_pRtEnv->SetupAccelerationStructure();
+	buf.Purge();
+	m_pRtEnv->WriteAccelerationStructure( buf, sceneHash );
+	CreateDirectory( m_szKDTreeCacheDir, NULL );
+	if ( g_pFullFileSystem->WriteFile( szCacheFile, NULL, buf ) )
+		PruneKDTreeCache();
+}
+
+void CLightingPreviewThread::PruneKDTreeCache( void )
+{
+	char szSearch[MAX_PATH];
+	Q_snprintf( szSearch, sizeof( szSearch ), "%s*.kdtree", m_szKDTreeCacheDir );
+
+	for(;;)
+	{
+		WIN32_FIND_DATA fileData;
+		HANDLE hFind = FindFirstFile( szSearch, &fileData );
+		if ( hFind == INVALID_HANDLE_VALUE )
+			return;
+
+		int nFiles = 0;
+		WIN32_FIND_DATA oldest = fileData;
+		do
+		{
+			nFiles++;
+			if ( CompareFileTime( &fileData.ftLastWriteTime, &oldest.ftLastWriteTime ) < 0 )
+				oldest = fileData;
+		} while ( FindNextFile( hFind, &fileData ) );
+		FindClose( hFind );
+
+		if ( nFiles <= KDTREE_CACHE_MAX_FILES )
+			return;
+
+		char szOldest[MAX_PATH];
+		Q_snprintf( szOldest, sizeof( szOldest ), "%s%s", m_szKDTreeCacheDir, oldest.cFileName );
+		if ( ! DeleteFile( szOldest ) )
+			return;
+	}
+}
+
+void CLightingPreviewThread::HandleGeomMessage( MessageToLPreview &msg_in )
+{
+	if ( msg_in.m_bReplaceAllShadowGeometry )
+	{
+		RemoveAllShadowGeometry();
+		m_bUseKDTreeCache = true;
+	}
+
+	// the base environment can only have triangles disabled once it is in intersection
+	// format. before that, rebuilding it is cheap anyway.
+	bool bFullRebuild = ( ! m_bAccStructureBuilt ) || ( ! m_pRtEnv );
+
+	CUtlVector<LightingPreviewShadowObject_t *> &objects = *( msg_in.m_pShadowObjectList );
+	for( int i = 0; i < objects.Count(); i++ )
+	{
+		LightingPreviewShadowObject_t *pObject = objects[i];
+		int nIndex = m_ShadowGeometry.Find( pObject->m_nOwnerID );
+		if ( nIndex != m_ShadowGeometry.InvalidIndex() )
+		{
+			ShadowGeometryOwner_t *pOwner = m_ShadowGeometry[nIndex];
+			if ( ( pOwner->m_nFirstBaseTriangle != -1 ) && ( ! bFullRebuild ) )
+			{
+				int nTris = pOwner->m_Triangles.Count() / 3;
+				for( int t = 0; t < nTris; t++ )
+					DisableIntersectionTriangle( m_pRtEnv, pOwner->m_nFirstBaseTriangle + t );
+			}
+			if ( ! pObject->m_Triangles.Count() )
+			{
+				delete pOwner;
+				m_ShadowGeometry.RemoveAt( nIndex );
+			}
+			else
+			{
+				pOwner->m_Triangles.Swap( pObject->m_Triangles );
+				pOwner->m_nFirstBaseTriangle = -1;
+			}
+		}
+		else if ( pObject->m_Triangles.Count() )
+		{
+			ShadowGeometryOwner_t *pOwner = new ShadowGeometryOwner_t;
+			pOwner->m_Triangles.Swap( pObject->m_Triangles );
+			pOwner->m_nFirstBaseTriangle = -1;
+			m_ShadowGeometry.Insert( pObject->m_nOwnerID, pOwner );
+		}
+		delete pObject;
+	}
+	delete msg_in.m_pShadowObjectList;
+
+	if ( ! bFullRebuild )
+	{
+		RebuildDeltaShadowEnvironment();
+		int nMaxDelta = max( SHADOW_DELTA_MIN_TRIANGLES,
+							 (int) ( SHADOW_DELTA_MAX_FRACTION * m_pRtEnv->OptimizedTriangleList.Count() ) );
+		bFullRebuild = ( m_nDeltaTriangles > nMaxDelta );
+	}
+	if ( bFullRebuild )
+		RebuildShadowEnvironment();
+
 	DiscardResults();
+}
 
+void CLightingPreviewThread::TraceShadowRays( FourRays const &rays, RayTracingResult *pResult )
+{
+	if ( m_pRtEnv )
+		m_pRtEnv->Trace4Rays( rays, Four_Zeros, ReplicateX4( 1.0e9 ), pResult );
+	else
+	{
+		memset( pResult->HitIds, 0xff, sizeof( pResult->HitIds ) );
+		pResult->HitDistance = ReplicateX4( 1.0e23 );
+	}
+	if ( m_pDeltaRtEnv )
+	{
+		RayTracingResult delta_rslt;
+		m_pDeltaRtEnv->Trace4Rays( rays, Four_Zeros, ReplicateX4( 1.0e9 ), &delta_rslt );
+		for( int c = 0; c < 4; c++ )
+		{
+			if ( ( delta_rslt.HitIds[c] != -1 ) &&
+				 ( ( pResult->HitIds[c] == -1 ) ||
+				   ( delta_rslt.HitDistance.m128_f32[c] < pResult->HitDistance.m128_f32[c] ) ) )
+			{
+				pResult->HitIds[c] = delta_rslt.HitIds[c];
+				pResult->HitDistance.m128_f32[c] = delta_rslt.HitDistance.m128_f32[c];
+			}
+		}
+	}
 }
 
 
@@ -570,6 +949,12 @@ void CLightingPreviewThread::DoWork( void )
 			{
 				m_bResultChangedSinceLastSend = true;
 			}
+			if ( ( m_flConvergeStartTime >= 0.0 ) && ( ! AnyUsefulWorkToDo() ) )
+			{
+				DBG( "lighting preview: %d lights fully calculated in %.3f seconds using %d threads\n",
+					 m_pLightList->Count(), Plat_FloatTime() - m_flConvergeStartTime, m_nWorkers );
+				m_flConvergeStartTime = -1.0;
+			}
 			return;
 		}
 	}
@@ -638,7 +1023,7 @@ void CLightingPreviewThread::SendResult( void )
 void CLightingPreviewThread::CalculateForLightTask( int nLineMask, int nLineMatch,
 													CLightingPreviewLightDescription &l,
 													int calc_mask,
-													float *fContributionOut )
+													Vector *pContributionOut )
 {
 	FourVectors zero_vector;
 	zero_vector.x=Four_Zeros;
@@ -661,7 +1046,7 @@ void CLightingPreviewThread::CalculateForLightTask( int nLineMask, int nLineMatc
 			ThisLinesTotalLight=LastLinesTotalLight;
 		else
 		{
-			if ( (work_line_number & nLineMatch) == nLineMatch)
+			if ( (work_line_number & nLineMask) == nLineMatch)
 			{
 				for(int x=0;x<rslt.m_nPaddedWidth;x++)
 				{
@@ -689,7 +1074,7 @@ void CLightingPreviewThread::CalculateForLightTask( int nLineMask, int nLineMatc
 						myray.origin += pos;
 
 						RayTracingResult r_rslt;
-						m_pRtEnv->Trace4Rays( myray, Four_Zeros, ReplicateX4( 1.0e9 ), &r_rslt );
+						TraceShadowRays( myray, &r_rslt );
 
 						for(int c=0;c<4;c++)					// !!speed!! use sse logic ops here
 						{
@@ -718,8 +1103,8 @@ void CLightingPreviewThread::CalculateForLightTask( int nLineMask, int nLineMatc
 			work_line_number++;
 		}
 	}
-	fltx4 lmag=total_light.length();
-	*(fContributionOut)=lmag.m128_f32[0]+lmag.m128_f32[1]+lmag.m128_f32[2]+lmag.m128_f32[3];
+	for(int c=0;c<4;c++)
+		pContributionOut[c]=total_light.Vec( c );
 }
 
 void CLightingPreviewThread::CalculateForLight( CLightingPreviewLightDescription &l )
@@ -727,7 +1112,12 @@ void CLightingPreviewThread::CalculateForLight( CLightingPreviewLightDescription
 	if ( m_pRtEnv && (! m_bAccStructureBuilt ) )
 	{
 		m_bAccStructureBuilt = true;
-		m_pRtEnv->SetupAccelerationStructure();
+		SetupBaseAccelerationStructure();
+	}
+	if ( m_pDeltaRtEnv && (! m_bDeltaAccStructureBuilt ) )
+	{
+		m_bDeltaAccStructureBuilt = true;
+		m_pDeltaRtEnv->SetupAccelerationStructure();
 	}
 	CIncrementalLightInfo *l_info=l.m_pIncrementalInfo;
 	Assert( l_info );
@@ -743,9 +1133,26 @@ void CLightingPreviewThread::CalculateForLight( CLightingPreviewLightDescription
 	}
 	int calc_mask=m_LineMask[new_incr_level] &~ prev_msk;
 
-	// multihread here
-	float total_light;
-	CalculateForLightTask( 0, 0, l, calc_mask, &total_light );
+	// fan the lines out across the workers. this thread does worker 0's share.
+	m_pTaskLight = &l;
+	m_nTaskCalcMask = calc_mask;
+	for( int i = 1; i < m_nWorkers; i++ )
+		m_Workers[i].m_StartEvent.Set();
+	CalculateForLightTask( m_nWorkers - 1, 0, l, calc_mask, m_Workers[0].m_Contribution );
+	for( int i = 1; i < m_nWorkers; i++ )
+		m_Workers[i].m_DoneEvent.Wait();
+	m_pTaskLight = NULL;
+
+	// sum the partial vectors in worker order so the result doesn't depend on thread timing,
+	// then take the magnitude once, so it doesn't depend on the number of workers either
+	float total_light = 0.0;
+	for( int c = 0; c < 4; c++ )
+	{
+		Vector lane_total( 0, 0, 0 );
+		for( int i = 0; i < m_nWorkers; i++ )
+			lane_total += m_Workers[i].m_Contribution[c];
+		total_light += lane_total.Length();
+	}
 	l_info->m_fTotalContribution = total_light;
 
 	// throw away light array if no contribution
@@ -32,12 +32,21 @@ public:
 	}
 };
 
+// the shadowing triangles of one map object. LPREVIEW_MSG_GEOM_DATA only carries the objects
+// which changed since the last message.
+struct LightingPreviewShadowObject_t
+{
+	int m_nOwnerID;											// stable id assigned by hammer
+	CUtlVector<Vector> m_Triangles;							// 3 positions per triangle. empty
+															// means the object is gone
+};
+
 enum HammerToLightingPreviewMessageType
 {
 	// messages from hammer to preview task
 	LPREVIEW_MSG_STOP,									// no lighting previews open - stop working
 	LPREVIEW_MSG_EXIT,										// we're exiting program - shut down
-	LPREVIEW_MSG_GEOM_DATA,									  // we have new shadow geometry data
+	LPREVIEW_MSG_GEOM_DATA,									  // we have changed shadow geometry data
 	LPREVIEW_MSG_G_BUFFERS,							 // we have new g buffer data from the renderer
 	LPREVIEW_MSG_LIGHT_DATA,								// new light data in m_pLightList
 };
@@ -66,7 +75,8 @@ struct MessageToLPreview
 	FloatBitMap_t *m_pDefferedRenderingBMs[4];				// if LPREVIEW_MSG_G_BUFFERS
 	CUtlVector<CLightingPreviewLightDescription> *m_pLightList;	// if LPREVIEW_MSG_LIGHT_DATA
 	Vector m_EyePosition;									// for LPREVIEW_MSG_LIGHT_DATA & G_BUFFERS
-	CUtlVector<Vector> *m_pShadowTriangleList;				// for LPREVIEW_MSG_GEOM_DATA
+	CUtlVector<LightingPreviewShadowObject_t *> *m_pShadowObjectList;	// for LPREVIEW_MSG_GEOM_DATA
+	bool m_bReplaceAllShadowGeometry;						// for LPREVIEW_MSG_GEOM_DATA
 	int m_nBitmapGenerationCounter;							// for LPREVIEW_MSG_G_BUFFERS
 
 };
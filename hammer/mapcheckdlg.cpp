@@ -1539,6 +1539,7 @@ static void FixDuplicateFaceIDs(MapError *pError)
 	CMapFace *pFace = (CMapFace *)pError->dwExtra;
 
 	pFace->SetFaceID(pWorld->FaceID_GetNext());
+	pWorld->FaceID_AddFace(pFace);
 }
 
 //-----------------------------------------------------------------------------
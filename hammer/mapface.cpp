@@ -2669,6 +2669,7 @@ ChunkFileResult_t CMapFace::LoadVMF(CChunkFile *pFile)
 void CMapFace::OnAddToWorld(CMapWorld *pWorld)
 {
 	SignalUpdate( EVTYPE_FACE_CHANGED );
+	pWorld->FaceID_AddFace(this);
 	if (HasDisp())
 	{
 		//
@@ -2687,11 +2688,11 @@ void CMapFace::OnAddToWorld(CMapWorld *pWorld)
 // Purpose: Called just after this object has been removed from the world so
 //			that it can unlink itself from other objects in the world.
 // Input  : pWorld - The world that we were just removed from.
-//			bNotifyChildren - Whether we should forward notification to our children.
 //-----------------------------------------------------------------------------
-void CMapFace::OnRemoveFromWorld(void)
+void CMapFace::OnRemoveFromWorld(CMapWorld *pWorld)
 {
 	SignalUpdate( EVTYPE_FACE_CHANGED );
+	pWorld->FaceID_RemoveFace(this);
 	if (HasDisp())
 	{
 		//
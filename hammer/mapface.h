@@ -300,7 +300,7 @@ public:
 	void RenderVertices(CRender *pRender);
 
 	void OnAddToWorld(CMapWorld *pWorld);
-	void OnRemoveFromWorld(void);
+	void OnRemoveFromWorld(CMapWorld *pWorld);
 
 	static void SetShowSelection(bool bShowSelection);
 
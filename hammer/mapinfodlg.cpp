@@ -12,6 +12,7 @@
 #include "MapSolid.h"
 #include "MapWorld.h"
 #include "MapInfoDlg.h"
+#include "StudioModel.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include <tier0/memdbgon.h>
@@ -181,6 +182,9 @@ void CMapInfoDlg::DoDataExchange(CDataExchange *pDX)
 	DDX_Control(pDX, IDC_POINTENTITIES, m_PointEntities);
 	DDX_Control(pDX, IDC_UNIQUETEXTURES, m_UniqueTextures);
 	DDX_Control(pDX, IDC_TEXTUREMEMORY, m_TextureMemory);
+	DDX_Control(pDX, IDC_CACHEDMODELS, m_CachedModels);
+	DDX_Control(pDX, IDC_MODELMEMORY, m_ModelMemory);
+	DDX_Control(pDX, IDC_MODELLOADTIME, m_ModelLoadTime);
 	DDX_Control(pDX, IDC_WADSUSED, m_WadsUsed);
 	//}}AFX_DATA_MAP
 }
@@ -223,6 +227,21 @@ BOOL CMapInfoDlg::OnInitDialog(void)
 	ultoa(m_uTextureMemory, szBuf, 10);
 	sprintf(szBuf, "%u bytes (%.2f MB)", m_uTextureMemory, (float)m_uTextureMemory / 1024000.0);
 	m_TextureMemory.SetWindowText(szBuf);
+
+	//
+	// The model cache is shared by all open maps.
+	//
+	StudioModelCacheStats_t ModelStats;
+	CStudioModelCache::GetStats(ModelStats);
+
+	sprintf(szBuf, "%d (%d unused, %d evicted)", ModelStats.nModels, ModelStats.nUnreferencedModels, ModelStats.nEvictions);
+	m_CachedModels.SetWindowText(szBuf);
+
+	sprintf(szBuf, "%.2f MB (%.2f MB unused)", (float)ModelStats.nMemory / 1024000.0, (float)ModelStats.nUnreferencedMemory / 1024000.0);
+	m_ModelMemory.SetWindowText(szBuf);
+
+	sprintf(szBuf, "%d in %.2f s, %d cache hits", ModelStats.nLoads, ModelStats.flLoadTime, ModelStats.nCacheHits);
+	m_ModelLoadTime.SetWindowText(szBuf);
 	
 	return TRUE;
 }
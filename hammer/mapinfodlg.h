@@ -36,6 +36,9 @@ class CMapInfoDlg : public CDialog
 		CStatic	m_PointEntities;
 		CStatic	m_TextureMemory;
 		CStatic	m_UniqueTextures;
+		CStatic	m_CachedModels;
+		CStatic	m_ModelMemory;
+		CStatic	m_ModelLoadTime;
 		CListBox m_WadsUsed;
 		//}}AFX_DATA
 
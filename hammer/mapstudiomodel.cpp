@@ -18,6 +18,7 @@
 #include "TextureSystem.h"
 #include "Material.h"
 #include "Options.h"
+#include "mapworld.h"
 #include "camera.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -32,6 +33,7 @@ IMPLEMENT_MAPCLASS(CMapStudioModel)
 
 float CMapStudioModel::m_fRenderDistance = STUDIO_RENDER_DISTANCE;
 BOOL CMapStudioModel::m_bAnimateModels = TRUE;
+CUtlVector<CMapStudioModel *> CMapStudioModel::m_LoadingModels;
 
 
 //-----------------------------------------------------------------------------
@@ -61,7 +63,20 @@ CMapClass *CMapStudioModel::CreateMapStudioModel(CHelperInfo *pHelperInfo, CMapE
 	{
 		bool bLightProp = !stricmp(pHelperInfo->GetName(), "lightprop");
 		bool bOrientedBounds = (bLightProp | !stricmp(pHelperInfo->GetName(), "studioprop"));
-		return CreateMapStudioModel(pszModel, bOrientedBounds, bLightProp);
+		CMapStudioModel *pModel = CreateMapStudioModel(pszModel, bOrientedBounds, bLightProp);
+
+		//
+		// Until the model loads, show the size the FGD gives the entity.
+		//
+		GDclass *pClass = pParent->GetClass();
+		if ((pModel != NULL) && (pClass != NULL) && pClass->HasBoundBox())
+		{
+			pClass->GetBoundBox(pModel->m_PlaceholderMins, pModel->m_PlaceholderMaxs);
+			pModel->m_bHasPlaceholderBox = true;
+			pModel->CalcBounds();
+		}
+
+		return(pModel);
 	}
 
 	return(NULL);
@@ -86,6 +101,11 @@ CMapStudioModel *CMapStudioModel::CreateMapStudioModel(const char *pszModelPath,
 		pModel->ReversePitch(bReversePitch);
 
 		pModel->CalcBounds();
+
+		if (pModel->m_pStudioModel->GetLoadState() == STUDIOMODEL_LOAD_PENDING)
+		{
+			m_LoadingModels.AddToTail(pModel);
+		}
 	}
 	else
 	{
@@ -111,6 +131,8 @@ CMapStudioModel::CMapStudioModel(void)
 //-----------------------------------------------------------------------------
 CMapStudioModel::~CMapStudioModel(void)
 {
+	m_LoadingModels.FindAndFastRemove(this);
+
 	if (m_pStudioModel != NULL)
 	{
 		CStudioModelCache::Release(m_pStudioModel);
@@ -118,6 +140,41 @@ CMapStudioModel::~CMapStudioModel(void)
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Recalculates the bounds of the helpers whose models have finished
+//			loading on the loader thread since the last call, and relinks them
+//			in the culling tree. Must be called after CStudioModelCache's
+//			FinishAsyncLoads.
+//-----------------------------------------------------------------------------
+void CMapStudioModel::UpdateLoadedModels(void)
+{
+	for (int i = m_LoadingModels.Count() - 1; i >= 0; i--)
+	{
+		CMapStudioModel *pModel = m_LoadingModels[i];
+		if (pModel->m_pStudioModel->GetLoadState() == STUDIOMODEL_LOAD_PENDING)
+		{
+			continue;
+		}
+
+		m_LoadingModels.FastRemove(i);
+
+		// Cancelled and failed models keep the placeholder box.
+		if (pModel->IsModelLoaded())
+		{
+			CMapWorld *pWorld = GetWorldObject(pModel);
+			if (pWorld != NULL)
+			{
+				pWorld->UpdateChildBounds(pModel);
+			}
+			else
+			{
+				pModel->CalcBounds();
+			}
+		}
+	}
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Called by the renderer before every frame to animate the models.
 //-----------------------------------------------------------------------------
@@ -141,7 +198,7 @@ void CMapStudioModel::CalcBounds(BOOL bFullUpdate)
 	Vector Mins(0, 0, 0);
 	Vector Maxs(0, 0, 0);
 
-	if (m_pStudioModel != NULL)
+	if (IsModelLoaded())
 	{
 		//
 		// The 3D bounds are the bounds of the oriented model's first sequence, so that
@@ -177,6 +234,11 @@ void CMapStudioModel::CalcBounds(BOOL bFullUpdate)
 		m_CullBox.bmins += m_Origin;
 		m_CullBox.bmaxs += m_Origin;
 	}
+	else if (m_bHasPlaceholderBox)
+	{
+		Mins = m_CullBox.bmins = m_Origin + m_PlaceholderMins;
+		Maxs = m_CullBox.bmaxs = m_Origin + m_PlaceholderMaxs;
+	}
 
 	//
 	// If we do not yet have a valid bounding box, use a default box.
@@ -224,8 +286,17 @@ CMapClass *CMapStudioModel::CopyFrom(CMapClass *pObject, bool bUpdateDependencie
 	if (m_pStudioModel != NULL)
 	{
 		CStudioModelCache::AddRef(m_pStudioModel);
+
+		if ((m_pStudioModel->GetLoadState() == STUDIOMODEL_LOAD_PENDING) && !m_LoadingModels.HasElement(this))
+		{
+			m_LoadingModels.AddToTail(this);
+		}
 	}
 
+	m_PlaceholderMins = pFrom->m_PlaceholderMins;
+	m_PlaceholderMaxs = pFrom->m_PlaceholderMaxs;
+	m_bHasPlaceholderBox = pFrom->m_bHasPlaceholderBox;
+
 	m_Angles = pFrom->m_Angles;
 	m_Skin = pFrom->m_Skin;
 	m_bOrientedBounds = pFrom->m_bOrientedBounds;
@@ -290,6 +361,9 @@ void CMapStudioModel::Initialize(void)
 	m_flPitch = 0;
 	m_bReversePitch = false;
 	m_pStudioModel = NULL;
+	m_PlaceholderMins.Init();
+	m_PlaceholderMaxs.Init();
+	m_bHasPlaceholderBox = false;
 	m_Skin = 0;
 
 	m_bScreenSpaceFade = false;
@@ -407,7 +481,7 @@ static void DrawBasisVectors( CRender3D* pRender, const Vector &origin, const QA
 //-----------------------------------------------------------------------------
 bool CMapStudioModel::ShouldRenderLast()
 {
-	return m_pStudioModel->IsTranslucent() || Options.view3d.bPreviewModelFade;
+	return (IsModelLoaded() && m_pStudioModel->IsTranslucent()) || Options.view3d.bPreviewModelFade;
 }
 
 
@@ -454,8 +528,9 @@ void CMapStudioModel::Render2D(CRender2D *pRender)
 	QAngle vecAngles;
 	GetRenderAngles(vecAngles);
 
-	bool bDrawAsModel = (Options.view2d.bDrawModels && ((sizeX+sizeY) > 50)) ||	
-						IsSelected() ||	pRender->IsInLocalTransformMode();
+	bool bDrawAsModel = IsModelLoaded() &&
+						((Options.view2d.bDrawModels && ((sizeX+sizeY) > 50)) ||
+						IsSelected() ||	pRender->IsInLocalTransformMode());
 						
 	if ( !bDrawAsModel || IsSelected() )
 	{
@@ -583,7 +658,7 @@ void CMapStudioModel::Render3D(CRender3D *pRender)
 	//
 	// If we have a model, render it if it is close enough to the camera.
 	//
-	if (m_pStudioModel != NULL)
+	if (IsModelLoaded())
 	{
 		Vector ViewPoint;
 		pRender->GetCamera()->GetViewPoint(ViewPoint);
@@ -638,7 +713,7 @@ void CMapStudioModel::Render3D(CRender3D *pRender)
 		}
 	}
 	//
-	// Else no model, render as a bounding box.
+	// Else no model, or it's still loading, render as a bounding box.
 	//
 	else
 	{
@@ -801,7 +876,7 @@ void CMapStudioModel::SetFrame(int nFrame)
 //-----------------------------------------------------------------------------
 int CMapStudioModel::GetSequence(void)
 {
-	if (!m_pStudioModel)
+	if (!IsModelLoaded())
 	{
 		return 0;
 	}
@@ -815,7 +890,7 @@ int CMapStudioModel::GetSequence(void)
 //-----------------------------------------------------------------------------
 int CMapStudioModel::GetSequenceCount(void)
 {
-	if (!m_pStudioModel)
+	if (!IsModelLoaded())
 	{
 		return 0;
 	}
@@ -830,7 +905,7 @@ int CMapStudioModel::GetSequenceCount(void)
 //-----------------------------------------------------------------------------
 void CMapStudioModel::GetSequenceName(int nIndex, char *szName)
 {
-	if (m_pStudioModel)
+	if (IsModelLoaded())
 	{
 		m_pStudioModel->GetSequenceName(nIndex, szName);
 	}
@@ -843,7 +918,7 @@ void CMapStudioModel::GetSequenceName(int nIndex, char *szName)
 //-----------------------------------------------------------------------------
 void CMapStudioModel::SetSequence(int nIndex)
 {
-	if (m_pStudioModel)
+	if (IsModelLoaded())
 	{
 		m_pStudioModel->SetSequence(nIndex);
 	}
@@ -852,7 +927,7 @@ void CMapStudioModel::SetSequence(int nIndex)
 
 int CMapStudioModel::GetSequenceIndex( const char *pSequenceName ) const
 {
-	if ( m_pStudioModel )
+	if ( IsModelLoaded() )
 	{
 		int cnt = m_pStudioModel->GetSequenceCount();
 		for ( int i=0; i < cnt; i++ )
@@ -30,6 +30,7 @@ class CMapStudioModel : public CMapHelper
 		static CMapStudioModel *CreateMapStudioModel(const char *pszModelPath, bool bOrientedBBox, bool bReversePitch);
 
 		static void AdvanceAnimation(float flInterval);
+		static void UpdateLoadedModels(void);
 
 		//
 		// Construction/destruction:
@@ -95,8 +96,12 @@ class CMapStudioModel : public CMapHelper
 		
 		inline void ReversePitch(bool bReversePitch);
 		inline void SetOrientedBounds(bool bOrientedBounds);
+		inline bool IsModelLoaded(void) const;
 
 		StudioModel *m_pStudioModel;		// Pointer to a studio model in the model cache.
+		Vector m_PlaceholderMins;			// Box used until the model has loaded, relative to the origin.
+		Vector m_PlaceholderMaxs;
+		bool m_bHasPlaceholderBox;
 		QAngle m_Angles;					// Euler angles of this studio model.
 		float m_flPitch;					// Pitch (stored separately for lights -- yuck!)
 		bool m_bPitchSet;
@@ -120,6 +125,7 @@ class CMapStudioModel : public CMapHelper
 		//
 		static float m_fRenderDistance;		// Distance beyond which studio models render as bounding boxes.
 		static BOOL m_bAnimateModels;		// Whether to animate studio models.
+		static CUtlVector<CMapStudioModel *> m_LoadingModels;	// Sized from a placeholder until their models load.
 };
 
 
@@ -134,6 +140,16 @@ void CMapStudioModel::SetOrientedBounds(bool bOrientedBounds)
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Returns whether the model can be drawn. While a map loads, models
+//			are placeholders until the loader thread has read them.
+//-----------------------------------------------------------------------------
+bool CMapStudioModel::IsModelLoaded(void) const
+{
+	return (m_pStudioModel != NULL) && m_pStudioModel->IsLoaded();
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Sets whether this object negates pitch.
 //-----------------------------------------------------------------------------
@@ -542,6 +542,36 @@ void CMapWorld::UpdateChild(CMapClass *pChild)
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Recalculates the bounds of the branch of the world an object is in
+//			and relinks the branch in the culling tree, without notifying the
+//			document. Used when a model finishes loading after PostloadWorld
+//			has sized its helper from a placeholder box.
+// Input  : pObject - Object in this world whose bounds changed.
+//-----------------------------------------------------------------------------
+void CMapWorld::UpdateChildBounds(CMapClass *pObject)
+{
+	CMapClass *pChild = pObject;
+	while ((pChild->GetParent() != NULL) && (pChild->GetParent() != this))
+	{
+		pChild = pChild->GetParent();
+	}
+
+	if (pChild->GetParent() != this)
+	{
+		return;
+	}
+
+	pChild->CalcBounds(TRUE);
+	CalcBounds(FALSE);
+
+	if (m_pCullTree != NULL)
+	{
+		m_pCullTree->UpdateCullTreeObjectRecurse(pChild);
+	}
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: 
 // Input  : *pList - 
@@ -826,6 +856,12 @@ void CMapWorld::PostloadWorld(void)
 		RemoveKey(nIndex);
 	}
 
+	//
+	// Objects aren't added to the world one by one during loading, so the face
+	// ID table has to be built before any sidelists look up their faces.
+	//
+	FaceID_RebuildTable();
+
 	//
 	// Call PostLoadWorld on all our children and add any entities to the
 	// entity list.
@@ -1142,13 +1178,171 @@ static bool EnsureTrailingChar(char *psz, char ch, int nSize)
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Finds the face with the corresponding face ID by walking every solid
+//			in the world. Used for IDs more than one solid has, and to check
+//			the lookup table against.
+//-----------------------------------------------------------------------------
+static CMapFace *FaceID_FindFaceByWalk(CMapWorld *pWorld, int nFaceID)
+{
+	EnumChildrenPos_t pos;
+	CMapClass *pChild = pWorld->GetFirstDescendent(pos);
+	while (pChild != NULL)
+	{
+		CMapSolid *pSolid = dynamic_cast <CMapSolid *>(pChild);
+		if (pSolid != NULL)
+		{
+			CMapFace *pFace = pSolid->FindFaceID(nFaceID);
+			if (pFace != NULL)
+			{
+				return(pFace);
+			}
+		}
+
+		pChild = pWorld->GetNextDescendent(pos);
+	}
+
+	return(NULL);
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Finds the face with the corresponding face ID.
-//			FIXME: AAARGH, slow!! Need to build a table or something.
 // Input  : nFaceID - 
 //-----------------------------------------------------------------------------
 CMapFace *CMapWorld::FaceID_FaceForID(int nFaceID)
 {
+	if (m_FaceIDDuplicates.HasElement(nFaceID))
+	{
+		// More than one solid uses this ID, so find the same one the walk always has.
+		return(FaceID_FindFaceByWalk(this, nFaceID));
+	}
+
+	UtlHashHandle_t hEntry = m_FaceIDToSolid.Find(nFaceID);
+	if (hEntry == m_FaceIDToSolid.InvalidHandle())
+	{
+		return(NULL);
+	}
+
+	CMapSolid *pSolid = m_FaceIDToSolid[hEntry];
+	if (!m_FaceIDSolids.HasElement(pSolid))
+	{
+		// The solid has left the world.
+		m_FaceIDToSolid.RemoveAndAdvance(hEntry);
+		return(NULL);
+	}
+
+	// NULL if the solid's faces were renumbered since the entry was added.
+	return(pSolid->FindFaceID(nFaceID));
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Adds a face to the face ID lookup table. Called when the face is
+//			added to the world or given a new ID while in the world.
+// Input  : pFace - The face, which must belong to a solid.
+//-----------------------------------------------------------------------------
+void CMapWorld::FaceID_AddFace(CMapFace *pFace)
+{
+	CMapSolid *pSolid = dynamic_cast <CMapSolid *>(pFace->GetParent());
+	if ((pSolid == NULL) || (pFace->GetFaceID() == 0))
+	{
+		return;
+	}
+
+	m_FaceIDSolids.Insert(pSolid);
+
+	int nFaceID = pFace->GetFaceID();
+	UtlHashHandle_t hEntry = m_FaceIDToSolid.Find(nFaceID);
+	if (hEntry == m_FaceIDToSolid.InvalidHandle())
+	{
+		m_FaceIDToSolid.Insert(nFaceID, pSolid);
+		return;
+	}
+
+	CMapSolid *pOldSolid = m_FaceIDToSolid[hEntry];
+	if ((pOldSolid != pSolid) && m_FaceIDSolids.HasElement(pOldSolid) && (pOldSolid->FindFaceID(nFaceID) != NULL))
+	{
+		// Maps with duplicate face IDs resolve them to the first face in the world.
+		m_FaceIDDuplicates.Insert(nFaceID);
+		return;
+	}
+
+	m_FaceIDToSolid[hEntry] = pSolid;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Removes a face from the face ID lookup table. Called when the face's
+//			solid is removed from the world.
+//-----------------------------------------------------------------------------
+void CMapWorld::FaceID_RemoveFace(CMapFace *pFace)
+{
+	CMapSolid *pSolid = dynamic_cast <CMapSolid *>(pFace->GetParent());
+	if (pSolid == NULL)
+	{
+		return;
+	}
+
+	// Entries for IDs this solid's faces used to have are dropped when they are next looked up.
+	m_FaceIDSolids.Remove(pSolid);
+
+	UtlHashHandle_t hEntry = m_FaceIDToSolid.Find(pFace->GetFaceID());
+	if ((hEntry != m_FaceIDToSolid.InvalidHandle()) && (m_FaceIDToSolid[hEntry] == pSolid))
+	{
+		m_FaceIDToSolid.RemoveAndAdvance(hEntry);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Adds all the faces of a solid in the world to the face ID lookup
+//			table. Used when the solid's faces are replaced in place.
+//-----------------------------------------------------------------------------
+void CMapWorld::FaceID_AddSolidFaces(CMapSolid *pSolid)
+{
+	int nFaceCount = pSolid->GetFaceCount();
+	for (int nFace = 0; nFace < nFaceCount; nFace++)
+	{
+		FaceID_AddFace(pSolid->GetFace(nFace));
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Builds the face ID lookup table from scratch. Called after loading,
+//			since objects aren't added to the world one at a time then.
+//-----------------------------------------------------------------------------
+void CMapWorld::FaceID_RebuildTable(void)
+{
+	m_FaceIDToSolid.RemoveAll();
+	m_FaceIDSolids.RemoveAll();
+	m_FaceIDDuplicates.RemoveAll();
+
+	EnumChildrenPos_t pos;
+	CMapClass *pChild = GetFirstDescendent(pos);
+	while (pChild != NULL)
+	{
+		CMapSolid *pSolid = dynamic_cast <CMapSolid *>(pChild);
+		if (pSolid != NULL)
+		{
+			FaceID_AddSolidFaces(pSolid);
+		}
+
+		pChild = GetNextDescendent(pos);
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Times looking up every face in the world through the table against
+//			walking the world for each one, and checks that they agree. Run
+//			after loading a map when hammer is started with -faceidbench.
+//-----------------------------------------------------------------------------
+void CMapWorld::FaceID_BenchmarkLookups(void)
+{
+	CUtlVector<int> FaceIDs;
+
 	EnumChildrenPos_t pos;
 	CMapClass *pChild = GetFirstDescendent(pos);
 	while (pChild != NULL)
@@ -1159,18 +1353,45 @@ CMapFace *CMapWorld::FaceID_FaceForID(int nFaceID)
 			int nFaceCount = pSolid->GetFaceCount();
 			for (int nFace = 0; nFace < nFaceCount; nFace++)
 			{
-				CMapFace *pFace = pSolid->GetFace(nFace);
-				if (pFace->GetFaceID() == nFaceID)
-				{
-					return(pFace);
-				}
+				FaceIDs.AddToTail(pSolid->GetFace(nFace)->GetFaceID());
 			}
 		}
 
 		pChild = GetNextDescendent(pos);
 	}
 
-	return(NULL);
+	if (FaceIDs.Count() == 0)
+	{
+		return;
+	}
+
+	double flStart = Plat_FloatTime();
+	int nFound = 0;
+	for (int i = 0; i < FaceIDs.Count(); i++)
+	{
+		if (FaceID_FaceForID(FaceIDs[i]) != NULL)
+		{
+			nFound++;
+		}
+	}
+	double flTableTime = Plat_FloatTime() - flStart;
+
+	// A walk costs as much as the whole world, so only time a spread out sample.
+	int nWalkLookups = min(FaceIDs.Count(), 500);
+	int nMismatches = 0;
+	flStart = Plat_FloatTime();
+	for (int i = 0; i < nWalkLookups; i++)
+	{
+		int nFaceID = FaceIDs[(int)((int64)i * FaceIDs.Count() / nWalkLookups)];
+		if (FaceID_FindFaceByWalk(this, nFaceID) != FaceID_FaceForID(nFaceID))
+		{
+			nMismatches++;
+		}
+	}
+	double flWalkTime = Plat_FloatTime() - flStart;
+
+	Msg(mwStatus, "Face ID lookups: %d faces, %d found. table %.3f us/lookup, walk %.1f us/lookup (%d sampled), %d mismatches.",
+		FaceIDs.Count(), nFound, flTableTime * 1e6 / FaceIDs.Count(), flWalkTime * 1e6 / nWalkLookups, nWalkLookups, nMismatches);
 }
 
 
@@ -1490,7 +1711,6 @@ void CMapWorld::FaceID_StringToFaceLists(CMapFaceList *pFullFaceList, CMapFaceLi
 			//
 			// Get the corresponding face and add it to the list.
 			//
-			// FACEID TODO: fix so we only interate the world objects once
 			CMapFace *pFace = FaceID_FaceForID(FullFaceIDList.Element(i));
 			if (pFace != NULL)
 			{
@@ -1508,7 +1728,6 @@ void CMapWorld::FaceID_StringToFaceLists(CMapFaceList *pFullFaceList, CMapFaceLi
 			//
 			// Get the corresponding face and add it to the list.
 			//
-			// FACEID TODO: fix so we only interate the world objects once
 			CMapFace *pFace = FaceID_FaceForID(PartialFaceIDList.Element(i));
 			if (pFace != NULL)
 			{
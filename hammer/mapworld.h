@@ -14,6 +14,7 @@
 #include "EditGameClass.h"
 #include "MapClass.h"
 #include "MapPath.h"
+#include "tier1/utlhashtable.h"
 
 // Flags for SaveVMF.
 #define SAVEFLAGS_LIGHTSONLY	(1<<0)
@@ -31,6 +32,7 @@ class CVisGroup;
 class CCullTreeNode;
 class IEditorTexture;
 class CMapGroup;
+class CMapSolid;
 
 struct SaveLists_t;
 
@@ -106,6 +108,7 @@ class CMapWorld : public CMapClass, public CEditGameClass
 		virtual int SerializeMAP(std::fstream &file, BOOL fIsStoring, BoundBox *pIntersecting = NULL);
 
 		virtual void UpdateChild(CMapClass *pChild);
+		void UpdateChildBounds(CMapClass *pObject);
 
 		void UpdateAllDependencies( CMapClass *pObject );
 
@@ -115,6 +118,11 @@ class CMapWorld : public CMapClass, public CEditGameClass
 		inline int FaceID_GetNext(void);
 		inline void FaceID_SetNext(int nNextFaceID);
 		CMapFace *FaceID_FaceForID(int nFaceID);
+		void FaceID_AddFace(CMapFace *pFace);
+		void FaceID_RemoveFace(CMapFace *pFace);
+		void FaceID_AddSolidFaces(CMapSolid *pSolid);
+		void FaceID_RebuildTable(void);
+		void FaceID_BenchmarkLookups(void);
 		void FaceID_StringToFaceIDLists(CMapFaceIDList *pFullFaceList, CMapFaceIDList *pPartialFaceList, const char *pszValue);
 		void FaceID_StringToFaceLists(CMapFaceList *pFullFaceList, CMapFaceList *pPartialFaceList, const char *pszValue);
 		static bool FaceID_FaceIDListsToString(char *pszList, int nSize, CMapFaceIDList *pFullFaceIDList, CMapFaceIDList *pPartialFaceIDList);
@@ -183,6 +191,17 @@ class CMapWorld : public CMapClass, public CEditGameClass
 
 		int m_nNextFaceID;						// Used for assigning unique IDs to every solid face in this world.
 
+		//
+		// Face ID lookup table. Face pointers move when solids add or delete faces, so the table
+		// holds the solid that owns each face ID and FaceID_FaceForID finds the face in it. Entries
+		// can go stale when a solid's faces are renumbered, so solids are only trusted while they
+		// are in m_FaceIDSolids, which they leave when they are removed from the world. IDs that
+		// more than one solid has used are in m_FaceIDDuplicates and are looked up by walking.
+		//
+		CUtlHashtable<int, CMapSolid *> m_FaceIDToSolid;
+		CUtlHashtable<CMapSolid *, empty_t, PointerHashFunctor> m_FaceIDSolids;
+		CUtlHashtable<int, empty_t> m_FaceIDDuplicates;
+
 		IWorldEditDispMgr	*m_pWorldDispMgr;	// world editable displacement manager
 };
 
@@ -655,6 +655,7 @@ bool COptions::Read(void)
 	general.bClosedCorrectly = APP()->GetProfileInt(pszGeneral, "Closed Correctly", TRUE);
 	general.bUseVGUIModelBrowser = APP()->GetProfileInt(pszGeneral, "VGUI Model Browser", TRUE);	
 	general.bShowHiddenTargetsAsBroken = APP()->GetProfileInt(pszGeneral, "Show Hidden Targets As Broken", TRUE);	
+	general.iModelCacheSize = APP()->GetProfileInt(pszGeneral, "Model Cache Size", 512);
 	
 	char szDefaultAutosavePath[MAX_PATH];
 	strcpy( szDefaultAutosavePath, APP()->GetProfileString(pszGeneral, "Directory", "C:"));
@@ -884,6 +885,7 @@ void COptions::Write( BOOL fOverwrite, BOOL fSaveConfigs )
 	APP()->SetDirectory( DIR_AUTOSAVE, general.szAutosaveDir );
 	APP()->WriteProfileInt(pszGeneral, "VGUI Model Browser", general.bUseVGUIModelBrowser );
 	APP()->WriteProfileInt(pszGeneral, "Show Hidden Targets As Broken", general.bShowHiddenTargetsAsBroken);
+	APP()->WriteProfileInt(pszGeneral, "Model Cache Size", general.iModelCacheSize);
 
 	
 	// write view2d
@@ -983,6 +985,7 @@ void COptions::SetDefaults(void)
 	general.bShowCollisionModels = FALSE;
 	general.bShowDetailObjects = TRUE;
 	general.bShowNoDrawBrushes = TRUE;
+	general.iModelCacheSize = 512;
 	
 	// view2d
 	view2d.bCrosshairs = FALSE;
@@ -46,6 +46,7 @@ public:
 	BOOL bShowNoDrawBrushes;
 	BOOL bEnableAutosave;
 	BOOL bShowHiddenTargetsAsBroken;
+	int iModelCacheSize;			// MB of models to keep cached, counting ones no map uses any more
 }; 
 
 
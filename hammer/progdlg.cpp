@@ -168,6 +168,27 @@ BOOL CProgressDlg::CheckCancelButton()
     return bResult;
 }
 
+void CProgressDlg::ShowCancelButton()
+{
+    // The button starts out hidden on top of the progress bar. Move it
+    // under the bar and make the dialog taller to fit it.
+    CWnd *pButton = GetDlgItem(IDCANCEL);
+    if ((pButton == NULL) || pButton->IsWindowVisible())
+      return;
+
+    CRect rcButton(59, 25, 109, 39);
+    MapDialogRect(&rcButton);
+    pButton->MoveWindow(&rcButton);
+    pButton->ShowWindow(SW_SHOW);
+
+    CRect rcExtra(0, 0, 0, 18);
+    MapDialogRect(&rcExtra);
+
+    CRect rcWindow;
+    GetWindowRect(&rcWindow);
+    SetWindowPos(NULL, 0, 0, rcWindow.Width(), rcWindow.Height() + rcExtra.Height(), SWP_NOMOVE | SWP_NOZORDER);
+}
+
 void CProgressDlg::UpdatePercent(int nNewPos)
 {
     CWnd *pWndPercent = GetDlgItem(CG_IDC_PROGDLG_PERCENT);
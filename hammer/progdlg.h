@@ -25,6 +25,7 @@ public:
 
     // Checking for Cancel button
     BOOL CheckCancelButton();
+    void ShowCancelButton();
     // Progress Dialog manipulation
     void SetRange(int nLower,int nUpper);
     int  SetStep(int nStep);
@@ -599,6 +599,12 @@ void CSSolid::ToMapSolid(CMapSolid *p)
 		delete[] pts;
 	}
 
+	CMapWorld *pWorld = CMapClass::GetWorldObject(pSolid);
+	if (pWorld != NULL)
+	{
+		pWorld->FaceID_AddSolidFaces(pSolid);
+	}
+
 	pSolid->PostUpdate(Notify_Changed);
 }
 
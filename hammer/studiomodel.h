@@ -18,6 +18,9 @@ typedef unsigned char byte;
 #include "hammer_mathlib.h"
 #include "studio.h"
 #include "UtlVector.h"
+#include "utllinkedlist.h"
+#include "tier1/utlhashtable.h"
+#include "tier0/threadtools.h"
 #include "datacache/imdlcache.h"
 #include "FileChangeWatcher.h"
 
@@ -28,16 +31,59 @@ class CRender3D;
 class CRender2D;
 
 
+enum StudioModelLoadState_t
+{
+	STUDIOMODEL_LOADED = 0,
+	STUDIOMODEL_LOAD_PENDING,		// queued for, or being read by, the loader thread
+	STUDIOMODEL_LOAD_FAILED,
+	STUDIOMODEL_LOAD_CANCELLED,
+};
+
+
 struct ModelCache_t
 {
 	StudioModel *pModel;
-	char *pszPath;
+	char *pszPath;				// normalized, see CStudioModelCache::NormalizePath
 	int nRefCount;
+	int nMemory;				// approximate bytes, from StudioModel::GetMemoryUsage
+	float flLoadTime;			// seconds spent in LoadModel and PostLoadModel
+	int iUnreferenced;			// index in the unreferenced list while nRefCount is zero
+};
+
+
+struct StudioModelLoadJob_t
+{
+	StudioModel *pModel;
+	char szPath[MAX_PATH];		// as it was given to CreateModel, for the MDL cache
+	bool bLoaded;				// set by the loader thread
+	float flLoadTime;			// seconds the loader thread spent on it
+};
+
+
+struct StudioModelCacheStats_t
+{
+	int nModels;				// models in the cache, including unreferenced ones
+	int nUnreferencedModels;
+	int64 nMemory;				// approximate bytes for all the cached models
+	int64 nUnreferencedMemory;
+	int nLoads;					// models loaded from disk since startup
+	int nCacheHits;				// CreateModel calls that found the model in the cache
+	int nEvictions;				// unreferenced models freed to stay under the budget
+	double flLoadTime;			// seconds spent loading models since startup
 };
 
 
 //-----------------------------------------------------------------------------
-// Purpose: Defines an interface to a cache of studio models.
+// Purpose: Defines an interface to a cache of studio models. Models are hashed
+//			by their normalized path. Models nobody references any more stay
+//			cached, so closing and reopening a map doesn't reload them, until
+//			the cache goes over Options.general.iModelCacheSize. The least
+//			recently released ones are freed first.
+//
+//			Models created between BeginAsyncLoad and EndAsyncLoad come back
+//			right away in the STUDIOMODEL_LOAD_PENDING state. A loader thread
+//			reads their MDL and VVD data, and FinishAsyncLoads builds the render
+//			data on the main thread.
 //-----------------------------------------------------------------------------
 class CStudioModelCache
 {
@@ -49,13 +95,57 @@ class CStudioModelCache
 		static void Release(StudioModel *pModel);
 		static void AdvanceAnimation(float flInterval);
 
-	protected:
+		static void ReloadModel(const char *pszModelPath);
+		static void PurgeUnreferenced(void);
+		static void GetStats(StudioModelCacheStats_t &stats);
 
-		static BOOL AddModel(StudioModel *pModel, const char *pszModelPath);
-		static void RemoveModel(StudioModel *pModel);
+		static void BeginAsyncLoad(void);
+		static void EndAsyncLoad(void);
+		static int FinishAsyncLoads(float flMaxSeconds);
+		static int GetPendingLoadCount(void);
+		static void WaitForLoadedModel(unsigned nMaxMilliseconds);
+		static void CancelAsyncLoads(void);
 
-		static ModelCache_t m_Cache[1024];
-		static int m_nItems;
+	protected:
+
+		static void NormalizePath(const char *pszModelPath, char *pszNormalized, int nMaxLen);
+		static int FindEntry(const char *pszNormalizedPath);
+		static void AddRefEntry(int nIndex);
+		static int AddModel(StudioModel *pModel, const char *pszNormalizedPath);
+		static void SetLoadResult(int nIndex, bool bLoaded, float flLoadTime);
+		static void MarkUnreferenced(int nIndex);
+		static void RemoveModel(int nIndex);
+		static void EvictUnreferenced(int64 nMaxMemory);
+
+		static void LoadModelNow(int nIndex, const char *pszModelPath);
+		static void QueueLoad(int nIndex, const char *pszModelPath);
+		static void FinishLoad(const StudioModelLoadJob_t &job);
+		static void WaitForLoaderThread(void);
+		static bool IsAsyncLoading(void) { return (m_nAsyncLoadDepth > 0) && (m_hLoaderThread != NULL); }
+		static unsigned LoaderThreadFN(void *pParam);
+
+		static CUtlLinkedList<ModelCache_t, int> m_Cache;
+		static CUtlHashtable<const char *, int> m_PathToEntry;
+		static CUtlHashtable<StudioModel *, int, PointerHashFunctor> m_ModelToEntry;
+		static CUtlLinkedList<int, int> m_Unreferenced;		// cache indices, least recently released first
+
+		static int64 m_nMemory;
+		static int64 m_nUnreferencedMemory;
+		static int m_nLoads;
+		static int m_nCacheHits;
+		static int m_nEvictions;
+		static double m_flLoadTime;
+
+		static CUtlLinkedList<StudioModelLoadJob_t, int> m_LoadQueue;	// guarded by m_LoadMutex
+		static CUtlLinkedList<StudioModelLoadJob_t, int> m_LoadedQueue;	// guarded by m_LoadMutex
+		static CThreadFastMutex m_LoadMutex;
+		static CThreadEvent m_LoadEvent;
+		static CThreadEvent m_LoadedEvent;	// set when the loader thread finishes a model
+		static ThreadHandle_t m_hLoaderThread;
+		static bool m_bLoaderBusy;		// guarded by m_LoadMutex
+		static bool m_bLoaderExiting;	// guarded by m_LoadMutex
+		static int m_nAsyncLoadDepth;
+		static int m_nPendingLoads;
 };
 
 
@@ -77,6 +167,8 @@ public:
 
 	void					FreeModel ();
 	bool					LoadModel( const char *modelname );
+	bool					LoadModelData( const char *modelname );	// safe on the loader thread
+	bool					LoadRenderData( void );
 	bool					PostLoadModel ( const char *modelname );
 	void					DrawModel3D( CRender3D *pRender, float flAlpha, bool bWireframe);
 	void					DrawModel2D( CRender2D *pRender, float flAlpha, bool bWireFrame);
@@ -101,8 +193,16 @@ public:
 	void					GetOrigin( Vector &v );
 	void					SetAngles( QAngle& pfAngles );
 	bool					IsTranslucent();
+	int						GetMemoryUsage();
+
+	StudioModelLoadState_t	GetLoadState() const { return m_LoadState; }
+	bool					IsLoaded() const { return m_LoadState == STUDIOMODEL_LOADED; }
 
 private:
+	friend class CStudioModelCache;
+
+	StudioModelLoadState_t	m_LoadState;
+
 	CStudioHdr				*m_pStudioHdr;
 	CStudioHdr				*GetStudioHdr() const;
 	studiohdr_t*			GetStudioRenderHdr() const;
@@ -36,6 +36,8 @@
 #ifdef _WIN32
 #include <io.h>
 #endif
+#include <ctype.h>
+#include <errno.h>
 #include <math.h>
 #include <sys/stat.h>
 #include <stdlib.h>
@@ -90,6 +92,12 @@ void CChunkHandlerMap::AddHandler(const char *pszChunkName, ChunkHandler_t pfnHa
 	pNew->Handler.pData = pData;
 	pNew->pNext = NULL;
 
+	// The first handler added for a name is the one that gets used.
+	if (!m_HandlersByName.HasElement(pNew->Handler.szChunkName))
+	{
+		m_HandlersByName.Insert(pNew->Handler.szChunkName, &pNew->Handler);
+	}
+
 	if (m_pHandlers == NULL)
 	{
 		m_pHandlers = pNew;
@@ -139,19 +147,15 @@ ChunkErrorHandler_t CChunkHandlerMap::GetErrorHandler(void **ppData)
 //-----------------------------------------------------------------------------
 ChunkHandler_t CChunkHandlerMap::GetHandler(const char *pszChunkName, void **ppData)
 {
-	ChunkHandlerInfoNode_t *pNode = m_pHandlers;
-	while (pNode != NULL)
+	UtlHashHandle_t hHandler = m_HandlersByName.Find(pszChunkName);
+	if (hHandler != m_HandlersByName.InvalidHandle())
 	{
-		if (!stricmp(pNode->Handler.szChunkName, pszChunkName))
-		{
-			*ppData = pNode->Handler.pData;
-			return(pNode->Handler.pfnHandler);
-		}
-
-		pNode = pNode->pNext;
+		ChunkHandlerInfo_t *pHandler = m_HandlersByName[hHandler];
+		*ppData = pHandler->pData;
+		return(pHandler->pfnHandler);
 	}
 
-	return(false);
+	return(NULL);
 }
 
 
@@ -160,6 +164,14 @@ ChunkHandler_t CChunkHandlerMap::GetHandler(const char *pszChunkName, void **ppD
 //-----------------------------------------------------------------------------
 CChunkFile::CChunkFile(void)
 {
+	m_pReadBuffer = NULL;
+	m_pReadPos = NULL;
+	m_pReadEnd = NULL;
+	m_nReadLine = 1;
+	m_nErrorCount = 0;
+	m_szReadFileName[0] = '\0';
+	m_nTokenScratch = 0;
+
 	m_hFile = NULL;
 	m_nCurrentDepth = 0;
 	m_szIndent[0] = '\0';
@@ -173,10 +185,7 @@ CChunkFile::CChunkFile(void)
 //-----------------------------------------------------------------------------
 CChunkFile::~CChunkFile(void)
 {
-	if (m_hFile != NULL)
-	{
-		fclose(m_hFile);
-	}
+	Close();
 }
 
 
@@ -236,6 +245,11 @@ ChunkFileResult_t CChunkFile::Close(void)
 		m_hFile = NULL;
 	}
 
+	delete [] m_pReadBuffer;
+	m_pReadBuffer = NULL;
+	m_pReadPos = NULL;
+	m_pReadEnd = NULL;
+
 	return(ChunkFile_Ok);
 }
 
@@ -297,7 +311,10 @@ const char *CChunkFile::GetErrorText(ChunkFileResult_t eResult)
 		}
 	}
 
-	return(m_TokenReader.Error(szError));
+	static char szErrorBuf[256];
+	Q_snprintf(szErrorBuf, sizeof( szErrorBuf ), "File %s, line %d: %s", m_szReadFileName, m_nReadLine, szError);
+	m_nErrorCount++;
+	return(szErrorBuf);
 }
 
 
@@ -362,10 +379,10 @@ ChunkFileResult_t CChunkFile::HandleChunk(const char *szChunkName)
 			do
 			{
 				ChunkType_t eChunkType;
-				char szKey[MAX_KEYVALUE_LEN];
-				char szValue[MAX_KEYVALUE_LEN];
+				const char *pszKey;
+				const char *pszValue;
 
-				while ((eResult = ReadNext(szKey, szValue, sizeof(szValue), eChunkType)) == ChunkFile_Ok)
+				while ((eResult = ReadNext(&pszKey, &pszValue, eChunkType)) == ChunkFile_Ok)
 				{
 					if (eChunkType == ChunkType_Chunk)
 					{
@@ -402,16 +419,45 @@ ChunkFileResult_t CChunkFile::Open(const char *pszFileName, ChunkFileOpenMode_t
 {
 	if (eMode == ChunkFile_Read)
 	{
-		// UNDONE: TokenReader encapsulates file - unify reading and writing to use the same file I/O.
-		// UNDONE: Support in-memory parsing.
-		if (m_TokenReader.Open(pszFileName))
+		Close();
+
+		FILE *hFile = fopen(pszFileName, "rb");
+		if (hFile == NULL)
 		{
-			m_nCurrentDepth = 0;
+			return(ChunkFile_OpenFail);
 		}
-		else
+
+		fseek(hFile, 0, SEEK_END);
+		long nSize = ftell(hFile);
+		fseek(hFile, 0, SEEK_SET);
+		if (nSize < 0)
+		{
+			fclose(hFile);
+			return(ChunkFile_OpenFail);
+		}
+
+		m_pReadBuffer = new char[nSize + 1];
+		if (m_pReadBuffer == NULL)
+		{
+			fclose(hFile);
+			return(ChunkFile_OutOfMemory);
+		}
+
+		long nRead = (long)fread(m_pReadBuffer, 1, nSize, hFile);
+		fclose(hFile);
+		if (nRead != nSize)
 		{
+			Close();
 			return(ChunkFile_OpenFail);
-		}	
+		}
+
+		m_pReadBuffer[nSize] = '\0';
+		m_pReadPos = m_pReadBuffer;
+		m_pReadEnd = m_pReadBuffer + nSize;
+		m_nReadLine = 1;
+		m_nErrorCount = 0;
+		Q_strncpy(m_szReadFileName, pszFileName, sizeof( m_szReadFileName ));
+		m_nCurrentDepth = 0;
 	}
 	else if (eMode == ChunkFile_Write)
 	{
@@ -461,19 +507,347 @@ void CChunkFile::PushHandlers(CChunkHandlerMap *pHandlerMap)
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Skips whitespace and comments in the read buffer.
+// Output : Returns true if the whitespace contained the combine strings
+//			character '+', which is used to merge consecutive quoted strings.
+//-----------------------------------------------------------------------------
+bool CChunkFile::SkipWhiteSpace(void)
+{
+	bool bCombineStrings = false;
+
+	while (m_pReadPos < m_pReadEnd)
+	{
+		char ch = *m_pReadPos;
+
+		if ((ch == ' ') || (ch == '\t') || (ch == '\r') || (ch == 0))
+		{
+			m_pReadPos++;
+		}
+		else if (ch == '+')
+		{
+			bCombineStrings = true;
+			m_pReadPos++;
+		}
+		else if (ch == '\n')
+		{
+			m_nReadLine++;
+			m_pReadPos++;
+		}
+		else if (ch == '/')
+		{
+			//
+			// A comment runs to the end of the line, or for at most 1024 characters
+			// as it did in TokenReader. A lone slash is ignored.
+			//
+			m_pReadPos++;
+			if ((m_pReadPos < m_pReadEnd) && (*m_pReadPos == '/'))
+			{
+				char *pszCommentEnd = MIN(m_pReadPos + 1024, m_pReadEnd);
+				while ((m_pReadPos < pszCommentEnd) && (*m_pReadPos++ != '\n'))
+				{
+				}
+				m_nReadLine++;
+			}
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	return(bCombineStrings);
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Reads a quoted string, the open quote having been read already. The
+//			string is unescaped and terminated in place in the read buffer.
+//
+//			This follows TokenReader::GetString, which read the file a batch of up
+//			to 1023 characters at a time, so errors come out the same. The only
+//			differences are where TokenReader read past the end of its batch: a
+//			backslash followed by anything but 'n' keeps that character, and a
+//			backslash at the end of a batch (as in \") is dropped.
+//
+// Input  : ppszToken - Receives a pointer to the string.
+// Output : Returns STRING, TOKENSTRINGTOOLONG or TOKENEOF.
+//-----------------------------------------------------------------------------
+trtoken_t CChunkFile::ReadString(const char **ppszToken)
+{
+	const int nBatchSize = 1023;
+
+	char *pszStart = m_pReadPos;
+	char *pszDest = pszStart;
+
+	//
+	// Until we reach the end of this string or run out of room in the
+	// callers' buffers...
+	//
+	while (true)
+	{
+		//
+		// Find the next batch of text, up to the next quote.
+		//
+		char *pszSrc = m_pReadPos;
+		char *pszBatchEnd = pszSrc;
+		while ((pszBatchEnd < m_pReadEnd) && (*pszBatchEnd != '\"') && (pszBatchEnd - pszSrc < nBatchSize))
+		{
+			pszBatchEnd++;
+		}
+
+		if (pszBatchEnd >= m_pReadEnd)
+		{
+			m_pReadPos = m_pReadEnd;
+			return(TOKENEOF);
+		}
+
+		m_pReadPos = pszBatchEnd;
+
+		//
+		// Unescape the text down to the destination. It never gets ahead of
+		// the text being read.
+		//
+		while ((pszSrc < pszBatchEnd) && (*pszSrc != '\0') && (pszDest - pszStart < MAX_KEYVALUE_LEN - 1))
+		{
+			if (*pszSrc == '\r')
+			{
+				//
+				// Newline encountered before closing quote -- unterminated string.
+				//
+				*pszDest = '\0';
+				*ppszToken = pszStart;
+				return(TOKENSTRINGTOOLONG);
+			}
+			else if (*pszSrc != '\\')
+			{
+				*pszDest = *pszSrc;
+				pszSrc++;
+			}
+			else
+			{
+				//
+				// Backslash sequence - replace with the appropriate character.
+				//
+				pszSrc++;
+				if (pszSrc >= pszBatchEnd)
+				{
+					break;
+				}
+
+				*pszDest = (*pszSrc == 'n') ? '\n' : *pszSrc;
+				pszSrc++;
+			}
+
+			pszDest++;
+		}
+
+		if ((pszSrc < pszBatchEnd) && (*pszSrc != '\0'))
+		{
+			//
+			// Ran out of room in the callers' buffers. Skip to the close-quote,
+			// terminate the string, and exit.
+			//
+			char *pszIgnoreEnd = MIN(m_pReadPos + 1024, m_pReadEnd);
+			while ((m_pReadPos < pszIgnoreEnd) && (*m_pReadPos++ != '\"'))
+			{
+			}
+
+			*pszDest = '\0';
+			*ppszToken = pszStart;
+			return(TOKENSTRINGTOOLONG);
+		}
+
+		//
+		// Check for closing quote.
+		//
+		if (*m_pReadPos == '\"')
+		{
+			//
+			// Eat the close quote and any whitespace.
+			//
+			m_pReadPos++;
+
+			bool bCombineStrings = SkipWhiteSpace();
+
+			//
+			// Combine consecutive quoted strings if the combine strings character was
+			// encountered between the two strings.
+			//
+			if (bCombineStrings && (m_pReadPos < m_pReadEnd) && (*m_pReadPos == '\"'))
+			{
+				//
+				// Eat the open quote and keep parsing this string.
+				//
+				m_pReadPos++;
+			}
+			else
+			{
+				//
+				// Done with this string, terminate the string and exit.
+				//
+				*pszDest = '\0';
+				*ppszToken = pszStart;
+				return(STRING);
+			}
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the next token from the read buffer.
+// Input  : ppszToken - Receives a pointer to the token text.
+// Output : Returns the type of token that was read, or TOKENERROR.
+//-----------------------------------------------------------------------------
+trtoken_t CChunkFile::NextToken(const char **ppszToken)
+{
+	char *pszStore = m_szTokenScratch[m_nTokenScratch];
+	char *pszStoreEnd = pszStore + MAX_KEYVALUE_LEN - 1;
+	m_nTokenScratch ^= 1;
+
+	*ppszToken = pszStore;
+	pszStore[0] = '\0';
+
+	if (m_pReadBuffer == NULL)
+	{
+		return(TOKENEOF);
+	}
+
+	SkipWhiteSpace();
+
+	if (m_pReadPos >= m_pReadEnd)
+	{
+		return(TOKENEOF);
+	}
+
+	unsigned char ch = *m_pReadPos++;
+
+	//
+	// Look for all the valid operators.
+	//
+	switch (ch)
+	{
+		case '@':
+		case ',':
+		case '!':
+		case '+':
+		case '&':
+		case '*':
+		case '$':
+		case '.':
+		case '=':
+		case ':':
+		case '[':
+		case ']':
+		case '(':
+		case ')':
+		case '{':
+		case '}':
+		case '\\':
+		{
+			pszStore[0] = ch;
+			pszStore[1] = '\0';
+			return(OPERATOR);
+		}
+	}
+
+	//
+	// Look for the start of a quoted string.
+	//
+	if (ch == '\"')
+	{
+		return(ReadString(ppszToken));
+	}
+
+	//
+	// Integers consist of numbers with an optional leading minus sign.
+	//
+	if (isdigit(ch) || (ch == '-'))
+	{
+		*pszStore++ = ch;
+
+		while (m_pReadPos < m_pReadEnd)
+		{
+			ch = *m_pReadPos;
+			if (ch == '-')
+			{
+				m_pReadPos++;
+				return(TOKENERROR);
+			}
+
+			if (!isdigit(ch))
+			{
+				//
+				// No identifier characters are allowed contiguous with numbers.
+				//
+				if (isalpha(ch) || (ch == '_'))
+				{
+					m_pReadPos++;
+					return(TOKENERROR);
+				}
+				break;
+			}
+
+			if (pszStore < pszStoreEnd)
+			{
+				*pszStore++ = ch;
+			}
+			m_pReadPos++;
+		}
+
+		*pszStore = '\0';
+		return(INTEGER);
+	}
+
+	//
+	// Identifiers consist of a consecutive string of alphanumeric
+	// characters and underscores.
+	//
+	if (!isalnum(ch) && (ch != '_'))
+	{
+		pszStore[0] = ch;
+		pszStore[1] = '\0';
+		return(TOKENERROR);
+	}
+
+	*pszStore++ = ch;
+	while (m_pReadPos < m_pReadEnd)
+	{
+		ch = *m_pReadPos;
+		if (!isalnum(ch) && (ch != '_'))
+		{
+			break;
+		}
+
+		if (pszStore < pszStoreEnd)
+		{
+			*pszStore++ = ch;
+		}
+		m_pReadPos++;
+	}
+
+	*pszStore = '\0';
+	return(IDENT);
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Reads the next term from the chunk file. The type of term read is
 //			returned in the eChunkType parameter.
-// Input  : szName - Name of key or chunk.
-//			szValue - If eChunkType is ChunkType_Key, contains the value of the key.
-//			nValueSize - Size of the buffer pointed to by szValue.
+// Input  : ppszName - Receives the name of the key or chunk.
+//			ppszValue - If eChunkType is ChunkType_Key, receives the value of the key.
 //			eChunkType - ChunkType_Key or ChunkType_Chunk.
 // Output : Returns ChunkFile_Ok on success, an error code if a parsing error occurs.
+//
+//			Quoted names and values point into the file buffer and stay valid until
+//			the file is closed. Unquoted ones are only valid until the next read.
 //-----------------------------------------------------------------------------
-ChunkFileResult_t CChunkFile::ReadNext(char *szName, char *szValue, int nValueSize, ChunkType_t &eChunkType)
+ChunkFileResult_t CChunkFile::ReadNext(const char **ppszName, const char **ppszValue, ChunkType_t &eChunkType)
 {
-	// HACK: pass in buffer sizes?
-	trtoken_t eTokenType = m_TokenReader.NextToken(szName, MAX_KEYVALUE_LEN);
+	const char *pszName;
+	trtoken_t eTokenType = NextToken(&pszName);
+	*ppszName = pszName;
 
 	if (eTokenType != TOKENEOF)
 	{
@@ -482,30 +856,30 @@ ChunkFileResult_t CChunkFile::ReadNext(char *szName, char *szValue, int nValueSi
 			case IDENT:
 			case STRING:
 			{
-				char szNext[MAX_KEYVALUE_LEN];
+				const char *pszNext;
 				trtoken_t eNextTokenType;
 
 				//
 				// Read the next token to determine what we have.
 				//
-				eNextTokenType = m_TokenReader.NextToken(szNext, sizeof(szNext));
+				eNextTokenType = NextToken(&pszNext);
 
 				switch (eNextTokenType)
 				{
 					case OPERATOR:
 					{
-						if (!stricmp(szNext, "{"))
+						if (!stricmp(pszNext, "{"))
 						{
 							// Beginning of new chunk.
 							m_nCurrentDepth++;
 							eChunkType = ChunkType_Chunk;
-							szValue[0] = '\0';
+							*ppszValue = "";
 							return(ChunkFile_Ok);
 						}
 						else
 						{
 							// Unexpected symbol.
-							Q_strncpy(m_szErrorToken, szNext, sizeof( m_szErrorToken ) );
+							Q_strncpy(m_szErrorToken, pszNext, sizeof( m_szErrorToken ) );
 							return(ChunkFile_UnexpectedSymbol);
 						}
 					}
@@ -514,7 +888,7 @@ ChunkFileResult_t CChunkFile::ReadNext(char *szName, char *szValue, int nValueSi
 					case IDENT:
 					{
 						// Key value pair.
-						Q_strncpy(szValue, szNext, nValueSize );
+						*ppszValue = pszNext;
 						eChunkType = ChunkType_Key;
 						return(ChunkFile_Ok);
 					}
@@ -535,7 +909,7 @@ ChunkFileResult_t CChunkFile::ReadNext(char *szName, char *szValue, int nValueSi
 
 			case OPERATOR:
 			{
-				if (!stricmp(szName, "}"))
+				if (!stricmp(pszName, "}"))
 				{
 					// End of current chunk.
 					m_nCurrentDepth--;
@@ -544,7 +918,7 @@ ChunkFileResult_t CChunkFile::ReadNext(char *szName, char *szValue, int nValueSi
 				else
 				{
 					// Unexpected symbol.
-					Q_strncpy(m_szErrorToken, szName, sizeof( m_szErrorToken ) );
+					Q_strncpy(m_szErrorToken, pszName, sizeof( m_szErrorToken ) );
 					return(ChunkFile_UnexpectedSymbol);
 				}
 			}
@@ -566,6 +940,31 @@ ChunkFileResult_t CChunkFile::ReadNext(char *szName, char *szValue, int nValueSi
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Reads the next term from the chunk file into the given buffers.
+// Input  : szName - Name of key or chunk.
+//			szValue - If eChunkType is ChunkType_Key, contains the value of the key.
+//			nValueSize - Size of the buffer pointed to by szValue.
+//			eChunkType - ChunkType_Key or ChunkType_Chunk.
+// Output : Returns ChunkFile_Ok on success, an error code if a parsing error occurs.
+//-----------------------------------------------------------------------------
+ChunkFileResult_t CChunkFile::ReadNext(char *szName, char *szValue, int nValueSize, ChunkType_t &eChunkType)
+{
+	const char *pszName;
+	const char *pszValue = "";
+	ChunkFileResult_t eResult = ReadNext(&pszName, &pszValue, eChunkType);
+
+	// HACK: pass in buffer sizes?
+	Q_strncpy(szName, pszName, MAX_KEYVALUE_LEN);
+	if (eResult == ChunkFile_Ok)
+	{
+		Q_strncpy(szValue, pszValue, nValueSize);
+	}
+
+	return(eResult);
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Reads the current chunk and dispatches keys and sub-chunks to the
 //			appropriate handler callbacks.
@@ -582,27 +981,30 @@ ChunkFileResult_t CChunkFile::ReadChunk(KeyHandler_t pfnKeyHandler, void *pData)
 	ChunkFileResult_t eResult;
 	do
 	{
-		char szName[MAX_KEYVALUE_LEN];
-		char szValue[MAX_KEYVALUE_LEN];
+		const char *pszName;
+		const char *pszValue;
 		ChunkType_t eChunkType;
 
-		eResult = ReadNext(szName, szValue, sizeof(szValue), eChunkType);
+		eResult = ReadNext(&pszName, &pszValue, eChunkType);
 
 		if (eResult == ChunkFile_Ok)
 		{
 			if (eChunkType == ChunkType_Chunk)
 			{
 				//
-				// Dispatch sub-chunks to the appropriate handler.
+				// Dispatch sub-chunks to the appropriate handler. The name is copied
+				// since the handler reads on through the file.
 				//
-				eResult = HandleChunk(szName);
+				char szChunkName[MAX_KEYVALUE_LEN];
+				Q_strncpy(szChunkName, pszName, sizeof( szChunkName ));
+				eResult = HandleChunk(szChunkName);
 			}
 			else if ((eChunkType == ChunkType_Key) && (pfnKeyHandler != NULL))
 			{
 				//
 				// Dispatch keys to the key value handler.
 				//
-				eResult = pfnKeyHandler(szName, szValue, pData);
+				eResult = pfnKeyHandler(pszName, pszValue, pData);
 			}
 		}
 	} while (eResult == ChunkFile_Ok);
@@ -14,6 +14,8 @@
 
 #include <stdio.h>
 #include "tokenreader.h"
+#include "tier1/strtools.h"
+#include "tier1/utlhashtable.h"
 
 
 #define MAX_INDENT_DEPTH		80
@@ -112,6 +114,9 @@ class CChunkHandlerMap
 		ChunkHandlerInfoNode_t *m_pHandlers;
 		ChunkErrorHandler_t m_pfnErrorHandler;
 		void *m_pErrorData;
+
+		// Handlers by name, for GetHandler. The keys point at the names in the handler list.
+		CUtlHashtable<const char *, ChunkHandlerInfo_t *, CaselessStringHashFunctor, CaselessStringEqualFunctor> m_HandlersByName;
 };
 
 
@@ -125,6 +130,7 @@ class CChunkFile
 		ChunkFileResult_t Open(const char *pszFileName, ChunkFileOpenMode_t eMode);
 		ChunkFileResult_t Close(void);
 		const char *GetErrorText(ChunkFileResult_t eResult);
+		inline int GetErrorCount(void) { return(m_nErrorCount); }
 
 		//
 		// Functions for writing chunk files.
@@ -149,6 +155,7 @@ class CChunkFile
 		//
 		ChunkFileResult_t ReadChunk(KeyHandler_t pfnKeyHandler = NULL, void *pData = NULL);
 		ChunkFileResult_t ReadNext(char *szKey, char *szValue, int nValueSize, ChunkType_t &eChunkType);
+		ChunkFileResult_t ReadNext(const char **ppszKey, const char **ppszValue, ChunkType_t &eChunkType);
 		ChunkFileResult_t HandleChunk(const char *szChunkName);
 		void HandleError(const char *szChunkName, ChunkFileResult_t eError);
 
@@ -178,7 +185,25 @@ class CChunkFile
 
 		void BuildIndentString(char *pszDest, int nDepth);
 
-		TokenReader m_TokenReader;
+		//
+		// Tokenizer for reading. The whole file is read into memory and quoted strings are
+		// unescaped and terminated in place, so they are handed out as pointers into the file
+		// buffer that stay valid until the file is closed. Identifiers, integers and operators
+		// are copied into the two scratch buffers in turn, so they are only valid until the
+		// token after next is read, which is the next call to ReadNext.
+		//
+		trtoken_t NextToken(const char **ppszToken);
+		trtoken_t ReadString(const char **ppszToken);
+		bool SkipWhiteSpace(void);
+
+		char *m_pReadBuffer;
+		char *m_pReadPos;
+		char *m_pReadEnd;
+		int m_nReadLine;
+		int m_nErrorCount;
+		char m_szReadFileName[128];
+		char m_szTokenScratch[2][MAX_KEYVALUE_LEN];
+		int m_nTokenScratch;
 
 		FILE *m_hFile;
 		char m_szErrorToken[80];
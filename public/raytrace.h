@@ -10,6 +10,7 @@
 #include <mathlib/lightdesc.h>
 #include <assert.h>
 #include <tier1/utlvector.h>
+#include <tier1/checksum_md5.h>
 #include <mathlib/mathlib.h>
 #include <bspfile.h>
 
@@ -220,6 +221,9 @@ public:
 #define RTE_FLAGS_FAST_TREE_GENERATION 1
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_COLORS 2				// saves memory if not needed
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS 4
+#define RTE_FLAGS_EXACT_TREE_GENERATION 8					// use the original single-threaded
+															// kd-tree builder which evaluates split
+															// costs at triangle vertices
 
 enum RayTraceLightingMode_t {
 	DIRECT_LIGHTING,										// just dot product lighting
@@ -253,10 +257,16 @@ public:
 	virtual bool VisitTriangle_ShouldContinue( const TriIntersectData_t &triangle, const FourRays &rays, fltx4 *hitMask, fltx4 *b0, fltx4 *b1, fltx4 *b2, int32 hitID ) = 0;
 };
 
+struct KDBuildTask_t;
+class CUtlBuffer;
+
 class RayTracingEnvironment
 {
 public:
 	uint32 Flags;											// RTE_FLAGS_xxx above
+	int m_nBuildThreads;									// max threads used by
+															// SetupAccelerationStructure. 0 = one per
+															// logical processor
 	Vector m_MinBound;
 	Vector m_MaxBound;
 
@@ -273,6 +283,7 @@ public:
 	{
 		BackgroundColor.DuplicateVector(Vector(1,0,0));		// red
 		Flags=0;
+		m_nBuildThreads=0;
 	}
 
 
@@ -298,6 +309,18 @@ public:
 	void SetupAccelerationStructure(void);
 
 
+	// kd-tree cache. CalculateSceneHash hashes the triangles added so far and the flags that
+	// change how the tree is built; it must be called before SetupAccelerationStructure.
+	// WriteAccelerationStructure saves the built triangles and kd-tree in a flat native format
+	// (a header followed by 16 byte aligned arrays). LoadAccelerationStructure can be called
+	// instead of SetupAccelerationStructure. It checks the data against the hash and the
+	// current triangles and returns false, leaving the environment untouched and setting
+	// *ppFailReason, if it can't be used.
+	void CalculateSceneHash( MD5Value_t &hash ) const;
+	void WriteAccelerationStructure( CUtlBuffer &buf, const MD5Value_t &sceneHash ) const;
+	bool LoadAccelerationStructure( CUtlBuffer &buf, const MD5Value_t &sceneHash,
+									const char **ppFailReason = NULL );
+
 	// lowest level intersection routine - fire 4 rays through the scene. all 4 rays must pass the
 	// Check() function, and t extents must be initialized. skipid can be set to exclude a
 	// particular id (such as the origin surface). This function finds the closest intersection.
@@ -310,6 +333,15 @@ public:
 					RayTracingResult *rslt_out,
 					int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
 
+	// trace nQuads groups of 4 rays. Groups whose rays all have the same direction signs are
+	// traced 8 or 16 at a time when the cpu supports it (see RayTrace_SetPacketSize), everything
+	// else goes through Trace4Rays. Hit distances are identical to tracing each group with
+	// Trace4Rays; only a tie between two triangles at exactly the same distance can report a
+	// different (equally close) triangle.
+	void TraceRayPackets(const FourRays *pRays, const fltx4 *pTMin, const fltx4 *pTMax, int nQuads,
+						 RayTracingResult *pResults,
+						 int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
+
 	// compute virtual light sources to model inter-reflection
 	void ComputeVirtualLightSources(void);
 
@@ -352,6 +384,22 @@ public:
 		
 	void RefineNode(int node_number,int32 const *tri_list,int ntris,
 						 Vector MinBound,Vector MaxBound, int depth);
+
+	// binned SAH split search used by the default (non-exact) builder. returns the cost of the
+	// best split found.
+	float FindBinnedSplit(int32 const *tri_list,int ntris,Vector MinBound,Vector MaxBound,
+						  int &split_plane, float &split_value);
+
+	// default kd-tree builder. Writes into the passed node and index lists so that subtrees can
+	// be built on separate threads and spliced together afterwards. If pDeferredTasks is not
+	// NULL, subtrees of at most nMaxTaskTriangles are queued there instead of being built.
+	void RefineNodeBinned(CUtlVector<CacheOptimizedKDNode> &nodes, CUtlVector<int32> &tri_indices,
+						  int node_number,int32 const *tri_list,int ntris,
+						  Vector MinBound,Vector MaxBound, int depth,
+						  CUtlVector<KDBuildTask_t *> *pDeferredTasks, int nMaxTaskTriangles);
+
+	// build the queued subtrees on worker threads and splice them into OptimizedKDTree
+	void BuildDeferredSubtrees(CUtlVector<KDBuildTask_t *> &tasks, int nThreads);
 	
 	void CalculateTriangleListBounds(int32 const *tris,int ntris,
 									 Vector &minout, Vector &maxout);
@@ -387,4 +435,10 @@ public:
 
 
 
+// packet width used by RayTracingEnvironment::TraceRayPackets. By default this is the widest
+// the cpu supports (4, 8 with AVX2, 16 with AVX-512). Setting it is clamped to what the cpu
+// supports, 0 selects the default. Returns the size now in use.
+int RayTrace_SetPacketSize( int nRays );
+int RayTrace_GetPacketSize( void );
+
 #endif
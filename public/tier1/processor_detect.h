@@ -9,4 +9,5 @@ bool CheckMMXTechnology(void);
 bool CheckSSETechnology(void);
 bool CheckSSE2Technology(void);
 bool Check3DNowTechnology(void);
-
+bool CheckAVX2Technology(void);		// also checks that the OS saves ymm state
+bool CheckAVX512Technology(void);	// AVX-512F, and that the OS saves zmm state
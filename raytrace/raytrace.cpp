@@ -5,6 +5,7 @@
 #include <filesystem_tools.h>
 #include <cmdlib.h>
 #include <stdio.h>
+#include <tier0/threadtools.h>
 
 static bool SameSign(float a, float b)
 {
@@ -869,16 +870,363 @@ void RayTracingEnvironment::RefineNode(int node_number,int32 const *tri_list,int
 }
 
 
+// The default builder evaluates the same SAH cost function as RefineNode, but only at
+// KD_SAH_BINS evenly spaced planes per axis (plus the planes which cut off empty space), so
+// finding a split is O(n) instead of O(n) per candidate plane. It doesn't write to the
+// triangles, so once the top of the tree has been built, the remaining subtrees are built on
+// separate threads.
+
+#define KD_SAH_BINS 32
+#define MIN_TRIANGLES_PER_BUILD_TASK 1024
+#define MAX_KD_BUILD_THREADS 32
+
+struct KDBuildTask_t
+{
+	int m_nNodeNumber;										// node in OptimizedKDTree to fill in
+	int32 *m_pTriangleList;
+	int m_nTriangles;
+	Vector m_MinBound;
+	Vector m_MaxBound;
+	int m_nDepth;
+
+	// output, with node and triangle indices local to this task. node 0 is m_nNodeNumber
+	CUtlVector<CacheOptimizedKDNode> m_Nodes;
+	CUtlVector<int32> m_TriangleIndexList;
+};
+
+static float SplitCost(int split_plane, float split_value, Vector const &MinBound,
+					   Vector const &MaxBound, float ISA, int nleft, int nright, int nboth)
+{
+	Vector LeftMaxes=MaxBound;
+	Vector RightMins=MinBound;
+	LeftMaxes[split_plane]=split_value;
+	RightMins[split_plane]=split_value;
+	float SA_L=BoxSurfaceArea(MinBound,LeftMaxes);
+	float SA_R=BoxSurfaceArea(RightMins,MaxBound);
+	return COST_OF_TRAVERSAL+COST_OF_INTERSECTION*(nboth+
+		(SA_L*ISA*(nleft))+(SA_R*ISA*(nright)));
+}
+
+float RayTracingEnvironment::FindBinnedSplit(int32 const *tri_list,int ntris,
+											 Vector MinBound,Vector MaxBound,
+											 int &split_plane, float &split_value)
+{
+	float best_cost=1.0e23;
+	split_plane=0;
+	split_value=0.5*(MinBound[0]+MaxBound[0]);
+	float ISA=1.0/BoxSurfaceArea(MinBound,MaxBound);
+
+	for(int axis=0;axis<3;axis++)
+	{
+		float lo=MinBound[axis];
+		float hi=MaxBound[axis];
+		if (hi<=lo)
+			continue;
+		float scale=KD_SAH_BINS/(hi-lo);
+
+		// count how many triangles start and end in each bin
+		int nStart[KD_SAH_BINS];
+		int nEnd[KD_SAH_BINS];
+		memset(nStart,0,sizeof(nStart));
+		memset(nEnd,0,sizeof(nEnd));
+		float min_coord=1.0e23,max_coord=-1.0e23;
+		for(int t=0;t<ntris;t++)
+		{
+			CacheOptimizedTriangle const &tri=OptimizedTriangleList[tri_list[t]];
+			float minc=tri.Vertex(0)[axis];
+			float maxc=minc;
+			for(int v=1;v<3;v++)
+			{
+				minc=min(minc,tri.Vertex(v)[axis]);
+				maxc=max(maxc,tri.Vertex(v)[axis]);
+			}
+			min_coord=min(min_coord,minc);
+			max_coord=max(max_coord,maxc);
+			nStart[clamp((int) ((minc-lo)*scale),0,KD_SAH_BINS-1)]++;
+			nEnd[clamp((int) ((maxc-lo)*scale),0,KD_SAH_BINS-1)]++;
+		}
+
+		// sweep the bin boundaries. triangles which ended in an earlier bin are on the left,
+		// ones which start in this bin or later are on the right.
+		int nEndedBefore=0;
+		int nStartedBefore=0;
+		for(int b=1;b<KD_SAH_BINS;b++)
+		{
+			nEndedBefore+=nEnd[b-1];
+			nStartedBefore+=nStart[b-1];
+			int nleft=nEndedBefore;
+			int nright=ntris-nStartedBefore;
+			int nboth=ntris-nleft-nright;
+			float trial_splitvalue=lo+b*(hi-lo)*(1.0/KD_SAH_BINS);
+			float trial_cost=SplitCost(axis,trial_splitvalue,MinBound,MaxBound,ISA,
+									   nleft,nright,nboth);
+			if (trial_cost<best_cost)
+			{
+				best_cost=trial_cost;
+				split_plane=axis;
+				split_value=trial_splitvalue;
+			}
+		}
+
+		// "grow" empty space on either side, like RefineNode does
+		if ((min_coord>lo) && (min_coord<hi))
+		{
+			float trial_cost=SplitCost(axis,min_coord,MinBound,MaxBound,ISA,0,ntris,0);
+			if (trial_cost<best_cost)
+			{
+				best_cost=trial_cost;
+				split_plane=axis;
+				split_value=min_coord;
+			}
+		}
+		if ((max_coord<hi) && (max_coord>lo))
+		{
+			float trial_cost=SplitCost(axis,max_coord,MinBound,MaxBound,ISA,ntris,0,0);
+			if (trial_cost<best_cost)
+			{
+				best_cost=trial_cost;
+				split_plane=axis;
+				split_value=max_coord;
+			}
+		}
+	}
+	return best_cost;
+}
+
+static void MakeBinnedLeaf(CUtlVector<CacheOptimizedKDNode> &nodes, CUtlVector<int32> &tri_indices,
+						   int node_number,int32 const *tri_list,int ntris,
+						   Vector const &MinBound,Vector const &MaxBound)
+{
+	nodes[node_number].Children=KDNODE_STATE_LEAF+(tri_indices.Count()<<2);
+	nodes[node_number].SetNumberOfTrianglesInLeafNode(ntris);
+#ifdef DEBUG_RAYTRACE
+	nodes[node_number].vecMins = MinBound;
+	nodes[node_number].vecMaxs = MaxBound;
+#endif
+	tri_indices.AddMultipleToTail(ntris,tri_list);
+}
+
+void RayTracingEnvironment::RefineNodeBinned(CUtlVector<CacheOptimizedKDNode> &nodes,
+											 CUtlVector<int32> &tri_indices,
+											 int node_number,int32 const *tri_list,int ntris,
+											 Vector MinBound,Vector MaxBound, int depth,
+											 CUtlVector<KDBuildTask_t *> *pDeferredTasks,
+											 int nMaxTaskTriangles)
+{
+	if (ntris<3)											// never split empty lists
+	{
+		MakeBinnedLeaf(nodes,tri_indices,node_number,tri_list,ntris,MinBound,MaxBound);
+		return;
+	}
+
+	if (pDeferredTasks && (ntris<=nMaxTaskTriangles))
+	{
+		// small enough to hand off to a worker thread
+		KDBuildTask_t *pTask=new KDBuildTask_t;
+		pTask->m_nNodeNumber=node_number;
+		pTask->m_pTriangleList=new int32[ntris];
+		memcpy(pTask->m_pTriangleList,tri_list,ntris*sizeof(int32));
+		pTask->m_nTriangles=ntris;
+		pTask->m_MinBound=MinBound;
+		pTask->m_MaxBound=MaxBound;
+		pTask->m_nDepth=depth;
+		pDeferredTasks->AddToTail(pTask);
+		return;
+	}
+
+	int split_plane;
+	float best_splitvalue;
+	float best_cost=FindBinnedSplit(tri_list,ntris,MinBound,MaxBound,split_plane,best_splitvalue);
+	float cost_of_no_split=COST_OF_INTERSECTION*ntris;
+	if ( (cost_of_no_split<=best_cost) || NEVER_SPLIT || (depth>MAX_TREE_DEPTH))
+	{
+		MakeBinnedLeaf(nodes,tri_indices,node_number,tri_list,ntris,MinBound,MaxBound);
+		return;
+	}
+
+	// classify against the chosen plane. the counts from the bins are only estimates.
+	int8 *classification=new int8[ntris];
+	int best_nleft=0,best_nright=0,best_nboth=0;
+	for(int t=0;t<ntris;t++)
+	{
+		CacheOptimizedTriangle &tri=OptimizedTriangleList[tri_list[t]];
+		classification[t]=tri.ClassifyAgainstAxisSplit(split_plane,best_splitvalue);
+		switch(classification[t])
+		{
+			case PLANECHECK_NEGATIVE:
+				best_nleft++;
+				break;
+			case PLANECHECK_POSITIVE:
+				best_nright++;
+				break;
+			case PLANECHECK_STRADDLING:
+				best_nboth++;
+				break;
+		}
+	}
+
+	// same layout as RefineNode - left, then straddling, then right
+	int32 *new_triangle_list=new int32[ntris];
+	int n_left_output=0;
+	int n_both_output=0;
+	int n_right_output=0;
+	for(int t=0;t<ntris;t++)
+	{
+		switch(classification[t])
+		{
+			case PLANECHECK_NEGATIVE:
+				new_triangle_list[n_left_output++]=tri_list[t];
+				break;
+			case PLANECHECK_POSITIVE:
+				n_right_output++;
+				new_triangle_list[ntris-n_right_output]=tri_list[t];
+				break;
+			case PLANECHECK_STRADDLING:
+				new_triangle_list[best_nleft+n_both_output]=tri_list[t];
+				n_both_output++;
+				break;
+		}
+	}
+	delete[] classification;
+
+	Vector LeftMaxes=MaxBound;
+	Vector RightMins=MinBound;
+	LeftMaxes[split_plane]=best_splitvalue;
+	RightMins[split_plane]=best_splitvalue;
+
+	int left_child=nodes.Count();
+	nodes[node_number].Children=split_plane+(left_child<<2);
+	nodes[node_number].SplittingPlaneValue=best_splitvalue;
+#ifdef DEBUG_RAYTRACE
+	nodes[node_number].vecMins = MinBound;
+	nodes[node_number].vecMaxs = MaxBound;
+#endif
+	CacheOptimizedKDNode newnode;
+	nodes.AddToTail(newnode);
+	nodes.AddToTail(newnode);
+	if ( (ntris<20) && ((best_nleft==0) || (best_nright==0)) )
+		depth+=100;
+	RefineNodeBinned(nodes,tri_indices,left_child,new_triangle_list,best_nleft+best_nboth,
+					 MinBound,LeftMaxes,depth+1,pDeferredTasks,nMaxTaskTriangles);
+	RefineNodeBinned(nodes,tri_indices,left_child+1,new_triangle_list+best_nleft,
+					 best_nright+best_nboth,RightMins,MaxBound,depth+1,pDeferredTasks,
+					 nMaxTaskTriangles);
+	delete[] new_triangle_list;
+}
+
+struct KDBuildThreadContext_t
+{
+	RayTracingEnvironment *m_pEnv;
+	CUtlVector<KDBuildTask_t *> m_Schedule;					// biggest tasks first
+	CInterlockedInt m_nNextTask;
+};
+
+static void BuildKDTask(RayTracingEnvironment *pEnv, KDBuildTask_t *pTask)
+{
+	CacheOptimizedKDNode root;
+	pTask->m_Nodes.AddToTail(root);
+	pEnv->RefineNodeBinned(pTask->m_Nodes,pTask->m_TriangleIndexList,0,pTask->m_pTriangleList,
+						   pTask->m_nTriangles,pTask->m_MinBound,pTask->m_MaxBound,
+						   pTask->m_nDepth,NULL,0);
+	delete[] pTask->m_pTriangleList;
+	pTask->m_pTriangleList=NULL;
+}
+
+static unsigned KDBuildThreadFN(void *pArg)
+{
+	KDBuildThreadContext_t *pContext=(KDBuildThreadContext_t *) pArg;
+	for(;;)
+	{
+		int nTask=pContext->m_nNextTask++;
+		if (nTask>=pContext->m_Schedule.Count())
+			break;
+		BuildKDTask(pContext->m_pEnv,pContext->m_Schedule[nTask]);
+	}
+	return 0;
+}
+
+static int __cdecl KDTaskSizeSortFn(KDBuildTask_t * const *a, KDBuildTask_t * const *b)
+{
+	return (*b)->m_nTriangles - (*a)->m_nTriangles;
+}
+
+void RayTracingEnvironment::BuildDeferredSubtrees(CUtlVector<KDBuildTask_t *> &tasks, int nThreads)
+{
+	KDBuildThreadContext_t context;
+	context.m_pEnv=this;
+	context.m_Schedule.AddMultipleToTail(tasks.Count(),tasks.Base());
+	context.m_Schedule.Sort(KDTaskSizeSortFn);
+	context.m_nNextTask=0;
+
+	nThreads=min(nThreads,tasks.Count());
+	ThreadHandle_t threads[MAX_KD_BUILD_THREADS];
+	for(int i=1;i<nThreads;i++)
+		threads[i]=CreateSimpleThread(KDBuildThreadFN,&context);
+	KDBuildThreadFN(&context);
+	for(int i=1;i<nThreads;i++)
+	{
+		ThreadJoin(threads[i]);
+		ReleaseThreadHandle(threads[i]);
+	}
+
+	// splice the subtrees in in the order they were queued, so the tree doesn't depend on the
+	// thread count. local node 0 replaces the placeholder, the rest are appended.
+	for(int t=0;t<tasks.Count();t++)
+	{
+		KDBuildTask_t *pTask=tasks[t];
+		int nodeBase=OptimizedKDTree.Count()-1;
+		int triBase=TriangleIndexList.Count();
+		for(int n=0;n<pTask->m_Nodes.Count();n++)
+		{
+			CacheOptimizedKDNode node=pTask->m_Nodes[n];
+			if (node.NodeType()==KDNODE_STATE_LEAF)
+				node.Children=KDNODE_STATE_LEAF+((triBase+node.TriangleIndexStart())<<2);
+			else
+				node.Children=node.NodeType()+((nodeBase+node.LeftChild())<<2);
+			if (n==0)
+				OptimizedKDTree[pTask->m_nNodeNumber]=node;
+			else
+				OptimizedKDTree.AddToTail(node);
+		}
+		TriangleIndexList.AddMultipleToTail(pTask->m_TriangleIndexList.Count(),
+											pTask->m_TriangleIndexList.Base());
+		delete pTask;
+	}
+	tasks.RemoveAll();
+}
+
+
 void RayTracingEnvironment::SetupAccelerationStructure(void)
 {
 	CacheOptimizedKDNode root;
 	OptimizedKDTree.AddToTail(root);
-	int32 *root_triangle_list=new int32[OptimizedTriangleList.Count()];
-	for(int t=0;t<OptimizedTriangleList.Count();t++)
+	int ntris=OptimizedTriangleList.Count();
+	int32 *root_triangle_list=new int32[ntris];
+	for(int t=0;t<ntris;t++)
 		root_triangle_list[t]=t;
-	CalculateTriangleListBounds(root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,
-								m_MaxBound);
-	RefineNode(0,root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,m_MaxBound,0);
+	CalculateTriangleListBounds(root_triangle_list,ntris,m_MinBound,m_MaxBound);
+	if (Flags & RTE_FLAGS_EXACT_TREE_GENERATION)
+		RefineNode(0,root_triangle_list,ntris,m_MinBound,m_MaxBound,0);
+	else
+	{
+		int nThreads=m_nBuildThreads;
+		if (nThreads<=0)
+			nThreads=GetCPUInformation()->m_nLogicalProcessors;
+		nThreads=clamp(nThreads,1,MAX_KD_BUILD_THREADS);
+		if (nThreads==1)
+			RefineNodeBinned(OptimizedKDTree,TriangleIndexList,0,root_triangle_list,ntris,
+							 m_MinBound,m_MaxBound,0,NULL,0);
+		else
+		{
+			// build the top of the tree here, leaving enough subtrees for the threads to
+			// balance the load between them
+			CUtlVector<KDBuildTask_t *> tasks;
+			int nMaxTaskTriangles=max(MIN_TRIANGLES_PER_BUILD_TASK,ntris/(8*nThreads));
+			RefineNodeBinned(OptimizedKDTree,TriangleIndexList,0,root_triangle_list,ntris,
+							 m_MinBound,m_MaxBound,0,&tasks,nMaxTaskTriangles);
+			BuildDeferredSubtrees(tasks,nThreads);
+		}
+	}
 	delete[] root_triangle_list;
 
 	// now, convert all triangles to "intersection format"
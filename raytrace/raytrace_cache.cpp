@@ -0,0 +1,197 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+// $Id$
+//
+// Saving and loading of the built acceleration structure, so that a scene which hasn't
+// changed doesn't have to rebuild its kd-tree.
+//
+// The file is the header below followed by the intersection format triangles, the kd nodes
+// and the triangle index list, each starting on a 16 byte boundary. Everything is stored in
+// native byte order and layout so that the arrays can be used straight from a mapped file;
+// the struct sizes in the header reject files from a build with a different layout.
+
+#include "raytrace.h"
+#include <tier1/utlbuffer.h>
+
+#define RTKD_CACHE_ID MAKEID('R','T','K','D')
+#define RTKD_CACHE_VERSION 1								// bump when the tree builder changes
+
+// flags which change the tree that gets built
+#define RTE_FLAGS_AFFECTING_TREE ( RTE_FLAGS_FAST_TREE_GENERATION | RTE_FLAGS_EXACT_TREE_GENERATION )
+
+struct RTKDCacheHeader_t
+{
+	int32 m_nId;
+	int32 m_nVersion;
+	int32 m_nHeaderSize;
+	int32 m_nTriangleSize;									// sizeof(CacheOptimizedTriangle)
+	int32 m_nNodeSize;										// sizeof(CacheOptimizedKDNode)
+	uint32 m_nTreeFlags;									// RTE_FLAGS_AFFECTING_TREE bits
+	MD5Value_t m_SceneHash;
+	int32 m_nTriangles;
+	int32 m_nNodes;
+	int32 m_nTriangleIndices;
+	float m_MinBound[3];
+	float m_MaxBound[3];
+	int32 m_nPad[2];
+};
+
+static int AlignCacheOffset( int nOffset )
+{
+	return ( nOffset + 15 ) & ~15;
+}
+
+static void PutCachePadding( CUtlBuffer &buf, int nStart )
+{
+	static const uint8 zeros[16] = { 0 };
+	int nOffset = buf.TellPut() - nStart;
+	buf.Put( zeros, AlignCacheOffset( nOffset ) - nOffset );
+}
+
+void RayTracingEnvironment::CalculateSceneHash( MD5Value_t &hash ) const
+{
+	MD5Context_t ctx;
+	MD5Init( &ctx );
+
+	uint32 nTreeFlags = Flags & RTE_FLAGS_AFFECTING_TREE;
+	MD5Update( &ctx, (unsigned char const *) &nTreeFlags, sizeof( nTreeFlags ) );
+	int32 nTriangles = OptimizedTriangleList.Count();
+	MD5Update( &ctx, (unsigned char const *) &nTriangles, sizeof( nTriangles ) );
+	for( int i = 0; i < nTriangles; i++ )
+	{
+		// the build scratch fields aren't part of the scene
+		TriGeometryData_t const &tri = OptimizedTriangleList[i].m_Data.m_GeometryData;
+		MD5Update( &ctx, (unsigned char const *) &tri.m_nTriangleID, sizeof( tri.m_nTriangleID ) );
+		MD5Update( &ctx, (unsigned char const *) tri.m_VertexCoordData, sizeof( tri.m_VertexCoordData ) );
+		MD5Update( &ctx, (unsigned char const *) &tri.m_nFlags, sizeof( tri.m_nFlags ) );
+	}
+	MD5Final( hash.bits, &ctx );
+}
+
+void RayTracingEnvironment::WriteAccelerationStructure( CUtlBuffer &buf, const MD5Value_t &sceneHash ) const
+{
+	RTKDCacheHeader_t header;
+	memset( &header, 0, sizeof( header ) );
+	header.m_nId = RTKD_CACHE_ID;
+	header.m_nVersion = RTKD_CACHE_VERSION;
+	header.m_nHeaderSize = sizeof( RTKDCacheHeader_t );
+	header.m_nTriangleSize = sizeof( CacheOptimizedTriangle );
+	header.m_nNodeSize = sizeof( CacheOptimizedKDNode );
+	header.m_nTreeFlags = Flags & RTE_FLAGS_AFFECTING_TREE;
+	header.m_SceneHash = sceneHash;
+	header.m_nTriangles = OptimizedTriangleList.Count();
+	header.m_nNodes = OptimizedKDTree.Count();
+	header.m_nTriangleIndices = TriangleIndexList.Count();
+	for( int c = 0; c < 3; c++ )
+	{
+		header.m_MinBound[c] = m_MinBound[c];
+		header.m_MaxBound[c] = m_MaxBound[c];
+	}
+
+	int nStart = buf.TellPut();
+	buf.Put( &header, sizeof( header ) );
+	PutCachePadding( buf, nStart );
+	for( int i = 0; i < OptimizedTriangleList.Count(); i++ )
+		buf.Put( &OptimizedTriangleList[i], sizeof( CacheOptimizedTriangle ) );
+	PutCachePadding( buf, nStart );
+	if ( OptimizedKDTree.Count() )
+		buf.Put( OptimizedKDTree.Base(), OptimizedKDTree.Count() * sizeof( CacheOptimizedKDNode ) );
+	PutCachePadding( buf, nStart );
+	if ( TriangleIndexList.Count() )
+		buf.Put( TriangleIndexList.Base(), TriangleIndexList.Count() * sizeof( int32 ) );
+}
+
+#define CACHE_FAIL( reason )			\
+	{									\
+		if ( ppFailReason )				\
+			*ppFailReason = reason;		\
+		return false;					\
+	}
+
+bool RayTracingEnvironment::LoadAccelerationStructure( CUtlBuffer &buf, const MD5Value_t &sceneHash,
+													   const char **ppFailReason )
+{
+	if ( OptimizedKDTree.Count() )
+		CACHE_FAIL( "acceleration structure already built" );
+
+	int nSize = buf.GetBytesRemaining();
+	if ( nSize < (int) sizeof( RTKDCacheHeader_t ) )
+		CACHE_FAIL( "file too short" );
+	RTKDCacheHeader_t header;
+	memcpy( &header, buf.PeekGet(), sizeof( header ) );
+
+	if ( header.m_nId != RTKD_CACHE_ID )
+		CACHE_FAIL( "not a kd-tree cache" );
+	if ( header.m_nVersion != RTKD_CACHE_VERSION ||
+		 header.m_nHeaderSize != sizeof( RTKDCacheHeader_t ) ||
+		 header.m_nTriangleSize != sizeof( CacheOptimizedTriangle ) ||
+		 header.m_nNodeSize != sizeof( CacheOptimizedKDNode ) )
+		CACHE_FAIL( "written by a different version" );
+	if ( header.m_nTreeFlags != ( Flags & RTE_FLAGS_AFFECTING_TREE ) )
+		CACHE_FAIL( "built with different options" );
+	if ( header.m_SceneHash != sceneHash || header.m_nTriangles != OptimizedTriangleList.Count() )
+		CACHE_FAIL( "scene has changed" );
+
+	// everything below is checking that the file is intact
+	if ( header.m_nNodes <= 0 || header.m_nTriangleIndices < 0 )
+		CACHE_FAIL( "corrupt header" );
+	if ( header.m_nNodes > nSize / (int) sizeof( CacheOptimizedKDNode ) ||
+		 header.m_nTriangleIndices > nSize / (int) sizeof( int32 ) )
+		CACHE_FAIL( "file is truncated" );
+	int nTriangleOffset = AlignCacheOffset( sizeof( RTKDCacheHeader_t ) );
+	int nNodeOffset = AlignCacheOffset( nTriangleOffset + header.m_nTriangles * sizeof( CacheOptimizedTriangle ) );
+	int nIndexOffset = AlignCacheOffset( nNodeOffset + header.m_nNodes * sizeof( CacheOptimizedKDNode ) );
+	int nEnd = nIndexOffset + header.m_nTriangleIndices * sizeof( int32 );
+	if ( nEnd > nSize )
+		CACHE_FAIL( "file is truncated" );
+
+	uint8 const *pData = (uint8 const *) buf.PeekGet();
+	CacheOptimizedTriangle const *pTriangles = (CacheOptimizedTriangle const *) ( pData + nTriangleOffset );
+	CacheOptimizedKDNode const *pNodes = (CacheOptimizedKDNode const *) ( pData + nNodeOffset );
+	int32 const *pIndices = (int32 const *) ( pData + nIndexOffset );
+
+	for( int i = 0; i < header.m_nTriangles; i++ )
+	{
+		TriIntersectData_t const &cached = pTriangles[i].m_Data.m_IntersectData;
+		TriGeometryData_t const &tri = OptimizedTriangleList[i].m_Data.m_GeometryData;
+		if ( cached.m_nTriangleID != tri.m_nTriangleID || cached.m_nFlags != tri.m_nFlags ||
+			 cached.m_nCoordSelect0 > 2 || cached.m_nCoordSelect1 > 2 )
+			CACHE_FAIL( "triangles don't match" );
+	}
+	for( int i = 0; i < header.m_nNodes; i++ )
+	{
+		CacheOptimizedKDNode const &node = pNodes[i];
+		if ( node.NodeType() == KDNODE_STATE_LEAF )
+		{
+			int nStart = node.TriangleIndexStart();
+			int nCount = node.NumberOfTrianglesInLeaf();
+			if ( nStart < 0 || nCount < 0 || nCount > header.m_nTriangleIndices - nStart )
+				CACHE_FAIL( "corrupt kd-tree" );
+		}
+		else
+		{
+			// children are always stored after their parent
+			if ( node.LeftChild() <= i || node.RightChild() >= header.m_nNodes )
+				CACHE_FAIL( "corrupt kd-tree" );
+		}
+	}
+	for( int i = 0; i < header.m_nTriangleIndices; i++ )
+	{
+		if ( pIndices[i] < 0 || pIndices[i] >= header.m_nTriangles )
+			CACHE_FAIL( "corrupt kd-tree" );
+	}
+
+	// it's good. the triangles replace the geometry format ones that
+	// SetupAccelerationStructure would have converted.
+	for( int i = 0; i < header.m_nTriangles; i++ )
+		memcpy( &OptimizedTriangleList[i], pTriangles + i, sizeof( CacheOptimizedTriangle ) );
+	OptimizedKDTree.SetCount( header.m_nNodes );
+	memcpy( OptimizedKDTree.Base(), pNodes, header.m_nNodes * sizeof( CacheOptimizedKDNode ) );
+	TriangleIndexList.SetCount( header.m_nTriangleIndices );
+	if ( header.m_nTriangleIndices )
+		memcpy( TriangleIndexList.Base(), pIndices, header.m_nTriangleIndices * sizeof( int32 ) );
+	m_MinBound.Init( header.m_MinBound[0], header.m_MinBound[1], header.m_MinBound[2] );
+	m_MaxBound.Init( header.m_MaxBound[0], header.m_MaxBound[1], header.m_MaxBound[2] );
+
+	buf.SeekGet( CUtlBuffer::SEEK_CURRENT, nEnd );
+	return true;
+}
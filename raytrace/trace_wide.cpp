@@ -0,0 +1,230 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+// $Id$
+//
+// 8 and 16 ray packet tracing for cpus with AVX2 or AVX-512.
+//
+// The wide kernels are compiled from trace_wide_kernel.h. With gcc they are built inside
+// target pragma regions instead of building this file with -mavx2 so that none of the inline
+// functions from the common headers get emitted with AVX instructions and picked by the linker
+// for the rest of the program. Floating point contraction is disabled in those regions since
+// fused multiply-adds would change the results. MSVC needs no flags to use the intrinsics.
+
+#include "raytrace.h"
+#include <tier1/processor_detect.h>
+
+#if defined( _MSC_VER ) || ( defined( __GNUC__ ) && !defined( __clang__ ) && ( __GNUC__ > 4 || ( __GNUC__ == 4 && __GNUC_MINOR__ >= 9 ) ) )
+#define RAYTRACE_AVX2
+#if !defined( _MSC_VER ) || ( _MSC_VER >= 1910 )
+#define RAYTRACE_AVX512
+#endif
+#endif
+
+#ifdef RAYTRACE_AVX2
+#include <immintrin.h>
+#endif
+
+#define WIDE_MAILBOX_HASH_SIZE 256
+#define WIDE_MAX_NODE_STACK_LEN (40*21)						// same as Trace4Rays
+
+#ifdef RAYTRACE_AVX2
+
+#ifdef __GNUC__
+#pragma GCC push_options
+#pragma GCC target ( "avx2" )
+#pragma GCC optimize ( "fp-contract=off" )
+#endif
+
+namespace RayTraceAVX2
+{
+	struct WideSIMD
+	{
+		typedef __m256 vec_t;
+		enum { WIDTH = 8 };
+
+		static FORCEINLINE vec_t Load( float const *p ) { return _mm256_loadu_ps( p ); }
+		static FORCEINLINE void Store( float *p, vec_t const &a ) { _mm256_storeu_ps( p, a ); }
+		static FORCEINLINE vec_t Replicate( float f ) { return _mm256_set1_ps( f ); }
+		static FORCEINLINE vec_t ReplicateI( int32 i ) { return _mm256_castsi256_ps( _mm256_set1_epi32( i ) ); }
+
+		static FORCEINLINE vec_t Add( vec_t const &a, vec_t const &b ) { return _mm256_add_ps( a, b ); }
+		static FORCEINLINE vec_t Sub( vec_t const &a, vec_t const &b ) { return _mm256_sub_ps( a, b ); }
+		static FORCEINLINE vec_t Mul( vec_t const &a, vec_t const &b ) { return _mm256_mul_ps( a, b ); }
+		static FORCEINLINE vec_t Div( vec_t const &a, vec_t const &b ) { return _mm256_div_ps( a, b ); }
+		static FORCEINLINE vec_t Min( vec_t const &a, vec_t const &b ) { return _mm256_min_ps( a, b ); }
+		static FORCEINLINE vec_t Max( vec_t const &a, vec_t const &b ) { return _mm256_max_ps( a, b ); }
+
+		static FORCEINLINE vec_t And( vec_t const &a, vec_t const &b ) { return _mm256_and_ps( a, b ); }
+		static FORCEINLINE vec_t Or( vec_t const &a, vec_t const &b ) { return _mm256_or_ps( a, b ); }
+		static FORCEINLINE vec_t AndNot( vec_t const &a, vec_t const &b ) { return _mm256_andnot_ps( a, b ); }	// ~a & b
+
+		// ordered, signaling - the same predicates as _mm_cmpgt_ps etc.
+		static FORCEINLINE vec_t CmpGt( vec_t const &a, vec_t const &b ) { return _mm256_cmp_ps( a, b, _CMP_GT_OS ); }
+		static FORCEINLINE vec_t CmpGe( vec_t const &a, vec_t const &b ) { return _mm256_cmp_ps( a, b, _CMP_GE_OS ); }
+		static FORCEINLINE vec_t CmpLt( vec_t const &a, vec_t const &b ) { return _mm256_cmp_ps( a, b, _CMP_LT_OS ); }
+		static FORCEINLINE vec_t CmpLe( vec_t const &a, vec_t const &b ) { return _mm256_cmp_ps( a, b, _CMP_LE_OS ); }
+
+		static FORCEINLINE bool AnyNegative( vec_t const &a ) { return _mm256_movemask_ps( a ) != 0; }
+	};
+
+#include "trace_wide_kernel.h"
+}
+
+#ifdef __GNUC__
+#pragma GCC pop_options
+#endif
+
+#endif // RAYTRACE_AVX2
+
+#ifdef RAYTRACE_AVX512
+
+#ifdef __GNUC__
+#pragma GCC push_options
+#pragma GCC target ( "avx512f" )
+#pragma GCC optimize ( "fp-contract=off" )
+#endif
+
+namespace RayTraceAVX512
+{
+	// AVX-512 compares produce mask registers. they are expanded back into all ones / all
+	// zeros lanes so that the kernel can treat them like the SSE masks. only AVX-512F
+	// instructions are used.
+	struct WideSIMD
+	{
+		typedef __m512 vec_t;
+		enum { WIDTH = 16 };
+
+		static FORCEINLINE vec_t Load( float const *p ) { return _mm512_loadu_ps( p ); }
+		static FORCEINLINE void Store( float *p, vec_t const &a ) { _mm512_storeu_ps( p, a ); }
+		static FORCEINLINE vec_t Replicate( float f ) { return _mm512_set1_ps( f ); }
+		static FORCEINLINE vec_t ReplicateI( int32 i ) { return _mm512_castsi512_ps( _mm512_set1_epi32( i ) ); }
+
+		static FORCEINLINE vec_t Add( vec_t const &a, vec_t const &b ) { return _mm512_add_ps( a, b ); }
+		static FORCEINLINE vec_t Sub( vec_t const &a, vec_t const &b ) { return _mm512_sub_ps( a, b ); }
+		static FORCEINLINE vec_t Mul( vec_t const &a, vec_t const &b ) { return _mm512_mul_ps( a, b ); }
+		static FORCEINLINE vec_t Div( vec_t const &a, vec_t const &b ) { return _mm512_div_ps( a, b ); }
+		static FORCEINLINE vec_t Min( vec_t const &a, vec_t const &b ) { return _mm512_min_ps( a, b ); }
+		static FORCEINLINE vec_t Max( vec_t const &a, vec_t const &b ) { return _mm512_max_ps( a, b ); }
+
+		static FORCEINLINE vec_t And( vec_t const &a, vec_t const &b )
+		{
+			return _mm512_castsi512_ps( _mm512_and_epi32( _mm512_castps_si512( a ), _mm512_castps_si512( b ) ) );
+		}
+		static FORCEINLINE vec_t Or( vec_t const &a, vec_t const &b )
+		{
+			return _mm512_castsi512_ps( _mm512_or_epi32( _mm512_castps_si512( a ), _mm512_castps_si512( b ) ) );
+		}
+		static FORCEINLINE vec_t AndNot( vec_t const &a, vec_t const &b )		// ~a & b
+		{
+			return _mm512_castsi512_ps( _mm512_andnot_epi32( _mm512_castps_si512( a ), _mm512_castps_si512( b ) ) );
+		}
+
+		static FORCEINLINE vec_t MaskToVec( __mmask16 m )
+		{
+			return _mm512_castsi512_ps( _mm512_maskz_mov_epi32( m, _mm512_set1_epi32( -1 ) ) );
+		}
+		static FORCEINLINE vec_t CmpGt( vec_t const &a, vec_t const &b ) { return MaskToVec( _mm512_cmp_ps_mask( a, b, _CMP_GT_OS ) ); }
+		static FORCEINLINE vec_t CmpGe( vec_t const &a, vec_t const &b ) { return MaskToVec( _mm512_cmp_ps_mask( a, b, _CMP_GE_OS ) ); }
+		static FORCEINLINE vec_t CmpLt( vec_t const &a, vec_t const &b ) { return MaskToVec( _mm512_cmp_ps_mask( a, b, _CMP_LT_OS ) ); }
+		static FORCEINLINE vec_t CmpLe( vec_t const &a, vec_t const &b ) { return MaskToVec( _mm512_cmp_ps_mask( a, b, _CMP_LE_OS ) ); }
+
+		static FORCEINLINE bool AnyNegative( vec_t const &a )
+		{
+			return _mm512_cmplt_epi32_mask( _mm512_castps_si512( a ), _mm512_setzero_si512() ) != 0;
+		}
+	};
+
+#include "trace_wide_kernel.h"
+}
+
+#ifdef __GNUC__
+#pragma GCC pop_options
+#endif
+
+#endif // RAYTRACE_AVX512
+
+
+static int s_nPacketRays = 0;								// 0 = not chosen yet
+
+static int MaxSupportedPacketRays( void )
+{
+#ifdef RAYTRACE_AVX512
+	if ( CheckAVX512Technology() )
+		return 16;
+#endif
+#ifdef RAYTRACE_AVX2
+	if ( CheckAVX2Technology() )
+		return 8;
+#endif
+	return 4;
+}
+
+int RayTrace_SetPacketSize( int nRays )
+{
+	int nMax = MaxSupportedPacketRays();
+	if ( nRays <= 0 || nRays > nMax )
+		nRays = nMax;
+	s_nPacketRays = ( nRays >= 16 ) ? 16 : ( nRays >= 8 ) ? 8 : 4;
+	return s_nPacketRays;
+}
+
+int RayTrace_GetPacketSize( void )
+{
+	if ( ! s_nPacketRays )
+		RayTrace_SetPacketSize( 0 );
+	return s_nPacketRays;
+}
+
+void RayTracingEnvironment::TraceRayPackets( const FourRays *pRays, const fltx4 *pTMin, const fltx4 *pTMax,
+											 int nQuads, RayTracingResult *pResults,
+											 int32 skip_id, ITransparentTriangleCallback *pCallback )
+{
+	// the callback interface only knows about 4 rays at a time
+	int nMaxPacketQuads = pCallback ? 1 : RayTrace_GetPacketSize() / 4;
+
+	int q = 0;
+	while ( q < nQuads )
+	{
+		int msk = pRays[q].CalculateDirectionSignMask();
+
+		// use the widest packet whose groups all have the same direction signs
+		int nPacketQuads = 1;
+		if ( msk != -1 )
+		{
+			for( int nTry = nMaxPacketQuads; nTry > 1; nTry >>= 1 )
+			{
+				if ( q + nTry > nQuads )
+					continue;
+				int i = 1;
+				while ( ( i < nTry ) && ( pRays[q + i].CalculateDirectionSignMask() == msk ) )
+					i++;
+				if ( i == nTry )
+				{
+					nPacketQuads = nTry;
+					break;
+				}
+			}
+		}
+
+		switch( nPacketQuads )
+		{
+#ifdef RAYTRACE_AVX512
+			case 4:
+				RayTraceAVX512::TraceWidePacket( *this, pRays + q, pTMin + q, pTMax + q, msk, pResults + q, skip_id );
+				break;
+#endif
+#ifdef RAYTRACE_AVX2
+			case 2:
+				RayTraceAVX2::TraceWidePacket( *this, pRays + q, pTMin + q, pTMax + q, msk, pResults + q, skip_id );
+				break;
+#endif
+			default:
+				if ( msk != -1 )
+					Trace4Rays( pRays[q], pTMin[q], pTMax[q], msk, pResults + q, skip_id, pCallback );
+				else
+					Trace4Rays( pRays[q], pTMin[q], pTMax[q], pResults + q, skip_id, pCallback );
+				nPacketQuads = 1;
+				break;
+		}
+		q += nPacketQuads;
+	}
+}
@@ -0,0 +1,268 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+// $Id$
+//
+// Wide packet traversal. This file is included by trace_wide.cpp once per instruction set,
+// inside a namespace which defines WideSIMD as the traits class for that width, so it
+// deliberately has no include guard.
+//
+// The traversal and intersection code mirrors RayTracingEnvironment::Trace4Rays operation for
+// operation (same operand order, same comparisons, same reciprocals) so that every ray gets
+// exactly the same hit distance as it does when traced 4 at a time.
+
+typedef WideSIMD::vec_t vec_t;
+
+struct WideRays_t
+{
+	vec_t origin[3];
+	vec_t direction[3];
+	vec_t OneOverRayDir[3];
+};
+
+struct WideHits_t
+{
+	vec_t HitIds;
+	vec_t HitDistance;
+	vec_t surface_normal[3];
+};
+
+struct WideNodeToVisit_t
+{
+	CacheOptimizedKDNode const *node;
+	vec_t TMin;
+	vec_t TMax;
+};
+
+static inline vec_t Dot( vec_t const *a, vec_t const &bx, vec_t const &by, vec_t const &bz )
+{
+	// same as FourVectors::operator*
+	vec_t dot = WideSIMD::Mul( a[0], bx );
+	dot = WideSIMD::Add( WideSIMD::Mul( a[1], by ), dot );
+	dot = WideSIMD::Add( WideSIMD::Mul( a[2], bz ), dot );
+	return dot;
+}
+
+static inline vec_t Select( vec_t const &mask, vec_t const &a, vec_t const &b )
+{
+	return WideSIMD::Or( WideSIMD::And( a, mask ), WideSIMD::AndNot( mask, b ) );
+}
+
+static void TraverseWidePacket( RayTracingEnvironment const &env, WideRays_t const &rays,
+								vec_t TMin, vec_t TMax, int DirectionSignMask,
+								WideHits_t &rslt, int32 skip_id )
+{
+	const vec_t Epsilons = WideSIMD::Replicate( 1.0e-10 );
+	const vec_t NegativeEpsilons = WideSIMD::Replicate( -1.0e-10 );
+	const vec_t Zeros = WideSIMD::Replicate( 1.0e-10 );			// same as FourZeros in raytrace.cpp
+	const vec_t Ones = WideSIMD::Replicate( 1.0 );
+
+	// clip rays against bounding box
+	for( int c = 0; c < 3; c++ )
+	{
+		vec_t isect_min_t =
+			WideSIMD::Mul( WideSIMD::Sub( WideSIMD::Replicate( env.m_MinBound[c] ), rays.origin[c] ),
+						   rays.OneOverRayDir[c] );
+		vec_t isect_max_t =
+			WideSIMD::Mul( WideSIMD::Sub( WideSIMD::Replicate( env.m_MaxBound[c] ), rays.origin[c] ),
+						   rays.OneOverRayDir[c] );
+		TMin = WideSIMD::Max( TMin, WideSIMD::Min( isect_min_t, isect_max_t ) );
+		TMax = WideSIMD::Min( TMax, WideSIMD::Max( isect_min_t, isect_max_t ) );
+	}
+	if ( ! WideSIMD::AnyNegative( WideSIMD::CmpLe( TMin, TMax ) ) )
+		return;												// missed bounding box
+
+	int32 mailboxids[WIDE_MAILBOX_HASH_SIZE];				// used to avoid redundant triangle tests
+	memset( mailboxids, 0xff, sizeof( mailboxids ) );
+
+	int front_idx[3], back_idx[3];
+	for( int c = 0; c < 3; c++ )
+	{
+		back_idx[c] = ( DirectionSignMask & ( 1 << c ) ) ? 0 : 1;
+		front_idx[c] = 1 - back_idx[c];
+	}
+
+	WideNodeToVisit_t NodeQueue[WIDE_MAX_NODE_STACK_LEN];
+	CacheOptimizedKDNode const *CurNode = &( env.OptimizedKDTree[0] );
+	WideNodeToVisit_t *stack_ptr = &NodeQueue[WIDE_MAX_NODE_STACK_LEN];
+	while( 1 )
+	{
+		while ( CurNode->NodeType() != KDNODE_STATE_LEAF )		// traverse until next leaf
+		{
+			int split_plane_number = CurNode->NodeType();
+			CacheOptimizedKDNode const *FrontChild = &( env.OptimizedKDTree[CurNode->LeftChild()] );
+
+			vec_t dist_to_sep_plane =						// dist=(split-org)/dir
+				WideSIMD::Mul(
+					WideSIMD::Sub( WideSIMD::Replicate( CurNode->SplittingPlaneValue ),
+								   rays.origin[split_plane_number] ),
+					rays.OneOverRayDir[split_plane_number] );
+			vec_t active = WideSIMD::CmpLe( TMin, TMax );		// mask of which rays are active
+
+			vec_t hits_front = WideSIMD::And( active, WideSIMD::CmpGe( dist_to_sep_plane, TMin ) );
+			if ( ! WideSIMD::AnyNegative( hits_front ) )
+			{
+				// missed the front. only traverse back
+				CurNode = FrontChild + back_idx[split_plane_number];
+				TMin = WideSIMD::Max( TMin, dist_to_sep_plane );
+			}
+			else
+			{
+				vec_t hits_back = WideSIMD::And( active, WideSIMD::CmpLe( dist_to_sep_plane, TMax ) );
+				if ( ! WideSIMD::AnyNegative( hits_back ) )
+				{
+					// missed the back - only need to traverse front node
+					CurNode = FrontChild + front_idx[split_plane_number];
+					TMax = WideSIMD::Min( TMax, dist_to_sep_plane );
+				}
+				else
+				{
+					// at least some rays hit both nodes. must push far, traverse near
+					assert( stack_ptr > NodeQueue );
+					--stack_ptr;
+					stack_ptr->node = FrontChild + back_idx[split_plane_number];
+					stack_ptr->TMin = WideSIMD::Max( TMin, dist_to_sep_plane );
+					stack_ptr->TMax = TMax;
+					CurNode = FrontChild + front_idx[split_plane_number];
+					TMax = WideSIMD::Min( TMax, dist_to_sep_plane );
+				}
+			}
+		}
+		// hit a leaf! must do intersection check
+		int ntris = CurNode->NumberOfTrianglesInLeaf();
+		if ( ntris )
+		{
+			int32 const *tlist = &( env.TriangleIndexList[CurNode->TriangleIndexStart()] );
+			do
+			{
+				int tnum = *( tlist++ );
+				int mbox_slot = tnum & ( WIDE_MAILBOX_HASH_SIZE - 1 );
+				TriIntersectData_t const *tri = &( env.OptimizedTriangleList[tnum].m_Data.m_IntersectData );
+				if ( ( mailboxids[mbox_slot] != tnum ) && ( tri->m_nTriangleID != skip_id ) )
+				{
+					mailboxids[mbox_slot] = tnum;
+
+					vec_t Nx = WideSIMD::Replicate( tri->m_flNx );
+					vec_t Ny = WideSIMD::Replicate( tri->m_flNy );
+					vec_t Nz = WideSIMD::Replicate( tri->m_flNz );
+
+					vec_t DDotN = Dot( rays.direction, Nx, Ny, Nz );
+					// mask off zero or near zero (ray parallel to surface)
+					vec_t did_hit = WideSIMD::Or( WideSIMD::CmpGt( DDotN, Epsilons ),
+												  WideSIMD::CmpLt( DDotN, NegativeEpsilons ) );
+
+					vec_t numerator = WideSIMD::Sub( WideSIMD::Replicate( tri->m_flD ),
+													 Dot( rays.origin, Nx, Ny, Nz ) );
+
+					vec_t isect_t = WideSIMD::Div( numerator, DDotN );
+					did_hit = WideSIMD::And( did_hit, WideSIMD::CmpGt( isect_t, Zeros ) );
+					did_hit = WideSIMD::And( did_hit, WideSIMD::CmpLt( isect_t, rslt.HitDistance ) );
+
+					if ( ! WideSIMD::AnyNegative( did_hit ) )
+						continue;
+
+					// now, check 3 edges
+					vec_t hitc1 = WideSIMD::Add( rays.origin[tri->m_nCoordSelect0],
+												 WideSIMD::Mul( isect_t, rays.direction[tri->m_nCoordSelect0] ) );
+					vec_t hitc2 = WideSIMD::Add( rays.origin[tri->m_nCoordSelect1],
+												 WideSIMD::Mul( isect_t, rays.direction[tri->m_nCoordSelect1] ) );
+
+					// do barycentric coordinate check
+					vec_t B0 = WideSIMD::Mul( WideSIMD::Replicate( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
+					B0 = WideSIMD::Add(
+						B0, WideSIMD::Mul( WideSIMD::Replicate( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
+					B0 = WideSIMD::Add( B0, WideSIMD::Replicate( tri->m_ProjectedEdgeEquations[2] ) );
+
+					did_hit = WideSIMD::And( did_hit, WideSIMD::CmpGe( B0, Zeros ) );
+
+					vec_t B1 = WideSIMD::Mul( WideSIMD::Replicate( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
+					B1 = WideSIMD::Add(
+						B1, WideSIMD::Mul( WideSIMD::Replicate( tri->m_ProjectedEdgeEquations[4] ), hitc2 ) );
+					B1 = WideSIMD::Add( B1, WideSIMD::Replicate( tri->m_ProjectedEdgeEquations[5] ) );
+
+					did_hit = WideSIMD::And( did_hit, WideSIMD::CmpGe( B1, Zeros ) );
+
+					vec_t B2 = WideSIMD::Add( B1, B0 );
+					did_hit = WideSIMD::And( did_hit, WideSIMD::CmpLe( B2, Ones ) );
+
+					if ( ! WideSIMD::AnyNegative( did_hit ) )
+						continue;
+
+					// transparent triangles are treated as opaque, the same as Trace4Rays does
+					// without a callback. packets with a callback never get here.
+					rslt.HitIds = Select( did_hit, WideSIMD::ReplicateI( tnum ), rslt.HitIds );
+					rslt.HitDistance = Select( did_hit, isect_t, rslt.HitDistance );
+					rslt.surface_normal[0] = Select( did_hit, Nx, rslt.surface_normal[0] );
+					rslt.surface_normal[1] = Select( did_hit, Ny, rslt.surface_normal[1] );
+					rslt.surface_normal[2] = Select( did_hit, Nz, rslt.surface_normal[2] );
+				}
+			} while ( --ntris );
+			// now, check if all rays have terminated
+			vec_t raydone = WideSIMD::CmpLe( TMax, rslt.HitDistance );
+			if ( ! WideSIMD::AnyNegative( raydone ) )
+				return;
+		}
+
+		if ( stack_ptr == &NodeQueue[WIDE_MAX_NODE_STACK_LEN] )
+			return;
+
+		// pop stack!
+		CurNode = stack_ptr->node;
+		TMin = stack_ptr->TMin;
+		TMax = stack_ptr->TMax;
+		stack_ptr++;
+	}
+}
+
+// trace WideSIMD::WIDTH rays, passed as WIDTH/4 groups of 4 which all have the same direction
+// sign mask.
+static void TraceWidePacket( RayTracingEnvironment const &env, FourRays const *pRays,
+							 fltx4 const *pTMin, fltx4 const *pTMax, int DirectionSignMask,
+							 RayTracingResult *pResults, int32 skip_id )
+{
+	const int nQuads = WideSIMD::WIDTH / 4;
+
+	// gather the groups into rows. the reciprocals are computed 4 at a time with the same code
+	// Trace4Rays uses so that they are bit for bit the same.
+	ALIGN16 float flRows[11][WideSIMD::WIDTH] ALIGN16_POST;
+	for( int q = 0; q < nQuads; q++ )
+	{
+		FourVectors OneOverRayDir = pRays[q].direction;
+		OneOverRayDir.MakeReciprocalSaturate();
+		for( int c = 0; c < 3; c++ )
+		{
+			StoreAlignedSIMD( &flRows[c][q * 4], pRays[q].origin[c] );
+			StoreAlignedSIMD( &flRows[3 + c][q * 4], pRays[q].direction[c] );
+			StoreAlignedSIMD( &flRows[6 + c][q * 4], OneOverRayDir[c] );
+		}
+		StoreAlignedSIMD( &flRows[9][q * 4], pTMin[q] );
+		StoreAlignedSIMD( &flRows[10][q * 4], pTMax[q] );
+	}
+
+	WideRays_t rays;
+	for( int c = 0; c < 3; c++ )
+	{
+		rays.origin[c] = WideSIMD::Load( flRows[c] );
+		rays.direction[c] = WideSIMD::Load( flRows[3 + c] );
+		rays.OneOverRayDir[c] = WideSIMD::Load( flRows[6 + c] );
+	}
+
+	WideHits_t rslt;
+	rslt.HitIds = WideSIMD::ReplicateI( -1 );
+	rslt.HitDistance = WideSIMD::Replicate( 1.0e23 );
+	rslt.surface_normal[0] = rslt.surface_normal[1] = rslt.surface_normal[2] = WideSIMD::Replicate( 0.0 );
+
+	TraverseWidePacket( env, rays, WideSIMD::Load( flRows[9] ), WideSIMD::Load( flRows[10] ),
+						DirectionSignMask, rslt, skip_id );
+
+	// scatter the results back out to the groups
+	WideSIMD::Store( flRows[0], rslt.HitIds );
+	WideSIMD::Store( flRows[1], rslt.HitDistance );
+	for( int c = 0; c < 3; c++ )
+		WideSIMD::Store( flRows[2 + c], rslt.surface_normal[c] );
+	for( int q = 0; q < nQuads; q++ )
+	{
+		memcpy( pResults[q].HitIds, &flRows[0][q * 4], sizeof( pResults[q].HitIds ) );
+		pResults[q].HitDistance = LoadAlignedSIMD( &flRows[1][q * 4] );
+		for( int c = 0; c < 3; c++ )
+			pResults[q].surface_normal[c] = LoadAlignedSIMD( &flRows[2 + c][q * 4] );
+	}
+}
@@ -12,6 +12,8 @@ bool CheckMMXTechnology(void) { return false; }
 bool CheckSSETechnology(void) { return false; }
 bool CheckSSE2Technology(void) { return false; }
 bool Check3DNowTechnology(void) { return false; }
+bool CheckAVX2Technology(void) { return false; }
+bool CheckAVX512Technology(void) { return false; }
 
 #elif defined( _WIN32 ) && !defined( _X360 )
 
@@ -269,6 +271,77 @@ bool Check3DNowTechnology(void)
     return retval;
 }
 
+// returns the structured extended feature flags (cpuid leaf 7 ebx) if the OS saves all of the
+// register state in XCR0Mask, or 0 if it doesn't
+static unsigned int GetExtendedFeatures( unsigned int XCR0Mask )
+{
+    unsigned int RegEAX = 0;
+    unsigned int RegEBX = 0;
+    unsigned int RegECX = 0;
+    unsigned int RegXCR0 = 0;
+
+    __try
+	{
+        _asm
+		{
+            mov eax, 0				// highest standard cpuid function
+            CPUID
+            mov RegEAX, eax
+		}
+    } 
+	__except(EXCEPTION_EXECUTE_HANDLER) 
+	{ 
+		return 0; 
+	}
+
+	if ( RegEAX < 7 )
+		return 0;
+
+	_asm
+	{
+		mov eax, 1
+		CPUID
+		mov RegECX, ecx
+	}
+
+	// bits 27 (OSXSAVE) and 28 (AVX). without OSXSAVE, xgetbv isn't available
+	if ( ( RegECX & 0x18000000 ) != 0x18000000 )
+		return 0;
+
+	_asm
+	{
+		xor ecx, ecx
+		_emit 0x0f					// xgetbv
+		_emit 0x01
+		_emit 0xd0
+		mov RegXCR0, eax
+	}
+
+	if ( ( RegXCR0 & XCR0Mask ) != XCR0Mask )
+		return 0;
+
+	_asm
+	{
+		mov eax, 7
+		xor ecx, ecx
+		CPUID
+		mov RegEBX, ebx
+	}
+	return RegEBX;
+}
+
+bool CheckAVX2Technology(void)
+{
+	// xmm and ymm state, bit 5 is AVX2
+	return ( GetExtendedFeatures( 0x6 ) & 0x20 ) != 0;
+}
+
+bool CheckAVX512Technology(void)
+{
+	// xmm, ymm, opmask and zmm state, bit 16 is AVX-512F
+	return ( GetExtendedFeatures( 0xe6 ) & 0x10000 ) != 0;
+}
+
 #pragma optimize( "", on )
 
 #endif // _WIN32
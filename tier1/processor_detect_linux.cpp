@@ -9,6 +9,10 @@
 #define cpuid(in,a,b,c,d)												\
 	asm("pushl %%ebx\n\t" "cpuid\n\t" "movl %%ebx,%%esi\n\t" "pop %%ebx": "=a" (a), "=S" (b), "=c" (c), "=d" (d) : "a" (in));
 
+// cpuid for leaves which take a subleaf in ecx
+#define cpuid_count(in,count,a,b,c,d)									\
+	asm("pushl %%ebx\n\t" "cpuid\n\t" "movl %%ebx,%%esi\n\t" "pop %%ebx": "=a" (a), "=S" (b), "=c" (c), "=d" (d) : "a" (in), "c" (count));
+
 bool CheckMMXTechnology(void)
 {
     unsigned long eax,ebx,edx,unused;
@@ -45,3 +49,37 @@ bool Check3DNowTechnology(void)
     }
     return false;
 }
+
+// returns the structured extended feature flags (cpuid leaf 7 ebx) if the OS saves all of the
+// register state in xcr0_mask, or 0 if it doesn't
+static unsigned long GetExtendedFeatures( unsigned long xcr0_mask )
+{
+    unsigned long eax,ebx,ecx,edx;
+    cpuid(0,eax,ebx,ecx,edx);
+    if ( eax < 7 )
+        return 0;
+
+    cpuid(1,eax,ebx,ecx,edx);
+    if ( ( ecx & 0x18000000 ) != 0x18000000 )		// bits 27 (OSXSAVE) and 28 (AVX)
+        return 0;
+
+    unsigned long xcr0,xcr0_hi;
+    asm("xgetbv" : "=a" (xcr0), "=d" (xcr0_hi) : "c" (0));
+    if ( ( xcr0 & xcr0_mask ) != xcr0_mask )
+        return 0;
+
+    cpuid_count(7,0,eax,ebx,ecx,edx);
+    return ebx;
+}
+
+bool CheckAVX2Technology(void)
+{
+    // xmm and ymm state
+    return GetExtendedFeatures( 0x6 ) & 0x20;
+}
+
+bool CheckAVX512Technology(void)
+{
+    // xmm, ymm, opmask and zmm state
+    return GetExtendedFeatures( 0xe6 ) & 0x10000;
+}
@@ -22,6 +22,7 @@
 #include "utlsymbol.h"
 #include "utlstring.h"
 #include "checksum_crc.h"
+#include "generichash.h"
 #include "physdll.h"
 #include "tier0/dbg.h"
 #include "lumpfiles.h"
@@ -1259,21 +1260,96 @@ const char *TexDataStringTable_GetString( int stringID )
 	return &g_TexDataStringData[g_TexDataStringTable[stringID]];
 }
 
-int	TexDataStringTable_AddOrFindString( const char *pString )
+// Case insensitive hash index over the string table. Each bucket holds a chain of string IDs
+// linked through s_TexDataStringHashNext. A string that is a duplicate of an earlier one isn't
+// chained, so that lookups find the first one like the old linear search did.
+#define TEXDATA_STRING_NOT_CHAINED	-2
+
+static CUtlVector<int>	s_TexDataStringHashHead;
+static CUtlVector<int>	s_TexDataStringHashNext;
+
+static int TexDataStringTable_FindIndexed( const char *pString, unsigned nHash )
 {
-	int i;
-	// garymcthack: Make this use an RBTree!
-	for( i = 0; i < g_TexDataStringTable.Count(); i++ )
+	int i = s_TexDataStringHashHead[ nHash & ( s_TexDataStringHashHead.Count() - 1 ) ];
+	while ( i >= 0 )
 	{
-		if( stricmp( pString, &g_TexDataStringData[g_TexDataStringTable[i]] ) == 0 )
-		{
+		if ( stricmp( pString, &g_TexDataStringData[g_TexDataStringTable[i]] ) == 0 )
 			return i;
-		}
+		i = s_TexDataStringHashNext[i];
+	}
+	return -1;
+}
+
+static void TexDataStringTable_IndexString( int stringID )
+{
+	Assert( stringID == s_TexDataStringHashNext.Count() );
+
+	const char *pString = &g_TexDataStringData[g_TexDataStringTable[stringID]];
+	unsigned nHash = HashStringCaseless( pString );
+	if ( TexDataStringTable_FindIndexed( pString, nHash ) >= 0 )
+	{
+		s_TexDataStringHashNext.AddToTail( TEXDATA_STRING_NOT_CHAINED );
+		return;
+	}
+
+	int &head = s_TexDataStringHashHead[ nHash & ( s_TexDataStringHashHead.Count() - 1 ) ];
+	s_TexDataStringHashNext.AddToTail( head );
+	head = stringID;
+}
+
+//-----------------------------------------------------------------------------
+// Rebuilds the lookup index for TexDataStringTable_AddOrFindString. Needs to be
+// called whenever g_TexDataStringData and g_TexDataStringTable are replaced.
+//-----------------------------------------------------------------------------
+void TexDataStringTable_RebuildIndex()
+{
+	int nBuckets = 256;
+	while ( nBuckets < 2 * g_TexDataStringTable.Count() )
+	{
+		nBuckets <<= 1;
+	}
+
+	s_TexDataStringHashHead.SetCount( nBuckets );
+	for ( int i = 0; i < nBuckets; i++ )
+	{
+		s_TexDataStringHashHead[i] = -1;
+	}
+
+	s_TexDataStringHashNext.RemoveAll();
+	s_TexDataStringHashNext.EnsureCapacity( g_TexDataStringTable.Count() );
+	for ( int i = 0; i < g_TexDataStringTable.Count(); i++ )
+	{
+		TexDataStringTable_IndexString( i );
+	}
+}
+
+int	TexDataStringTable_AddOrFindString( const char *pString )
+{
+	// the tables are written directly by some of the tools, so don't trust an index of the wrong size
+	if ( s_TexDataStringHashNext.Count() != g_TexDataStringTable.Count() || s_TexDataStringHashHead.Count() == 0 )
+	{
+		TexDataStringTable_RebuildIndex();
+	}
+
+	int i = TexDataStringTable_FindIndexed( pString, HashStringCaseless( pString ) );
+	if ( i >= 0 )
+	{
+		return i;
 	}
 
 	int len = strlen( pString );
 	int outOffset = g_TexDataStringData.AddMultipleToTail( len+1, pString );
 	int outIndex = g_TexDataStringTable.AddToTail( outOffset );
+
+	// keep the chains short
+	if ( s_TexDataStringHashHead.Count() < g_TexDataStringTable.Count() )
+	{
+		TexDataStringTable_RebuildIndex();
+	}
+	else
+	{
+		TexDataStringTable_IndexString( outIndex );
+	}
 	return outIndex;
 }
 
@@ -2268,6 +2344,7 @@ void LoadBSPFile( const char *filename )
 
 	CopyLump( FIELD_CHARACTER, LUMP_TEXDATA_STRING_DATA, g_TexDataStringData );
 	CopyLump( FIELD_INTEGER, LUMP_TEXDATA_STRING_TABLE, g_TexDataStringTable );
+	TexDataStringTable_RebuildIndex();
 
 	g_nOverlayCount = CopyLump( LUMP_OVERLAYS, g_Overlays );
 	g_nWaterOverlayCount = CopyLump( LUMP_WATEROVERLAYS, g_WaterOverlays );
@@ -2408,6 +2485,7 @@ void UnloadBSPFile()
 
 	g_TexDataStringData.Purge();
 	g_TexDataStringTable.Purge();
+	TexDataStringTable_RebuildIndex();
 
 	g_nOverlayCount = 0;
 	g_nWaterOverlayCount = 0;
@@ -283,6 +283,7 @@ void ExtractZipFileFromBSP( char *pBSPFileName, char *pZipFileName );
 //-----------------------------------------------------------------------------
 const char *		TexDataStringTable_GetString( int stringID );
 int					TexDataStringTable_AddOrFindString( const char *pString );
+void				TexDataStringTable_RebuildIndex();
 
 void	DecompressVis (byte *in, byte *decompressed);
 int		CompressVis (byte *vis, byte *dest);
@@ -351,6 +352,9 @@ void CalcTextureCoordsAtPoints(
 // Figure out lightmap extents on all (lit) faces.
 void UpdateAllFaceLightmapExtents();
 
+// Lightmap extents of a single face, in luxels.
+void CalcFaceExtents( dface_t *s, int lightmapTextureMinsInLuxels[2], int lightmapTextureSizeInLuxels[2] );
+
 
 //-----------------------------------------------------------------------------
 // Gets at an interface for the tree for enumeration of leaves in volumes.
@@ -17,13 +17,6 @@
 // doesn't seem to need to be here? -- in threads.h
 //extern int numthreads;
 
-// counters are only bumped when running single threaded,
-// because they are an awefull coherence problem
-int	c_active_windings;
-int	c_peak_windings;
-int	c_winding_allocs;
-int	c_winding_points;
-
 void pw(winding_t *w)
 {
 	int		i;
@@ -31,7 +24,57 @@ void pw(winding_t *w)
 		printf ("(%5.1f, %5.1f, %5.1f)\n",w->p[i][0], w->p[i][1],w->p[i][2]);
 }
 
-winding_t *winding_pool[MAX_POINTS_ON_WINDING+4];
+// Freed windings are kept on per-thread free lists, one per size, so that the threaded passes
+// don't all serialize on ThreadLock to allocate. A thread whose list runs dry takes a batch from
+// the shared list and a thread that collects too many gives a batch back, so that windings
+// which are allocated in one thread and freed in another still get reused.
+#define WINDING_POOL_SIZES		(MAX_POINTS_ON_WINDING+4)
+#define WINDING_POOL_BATCH		32
+
+struct WindingThreadPool_t
+{
+	winding_t	*m_pFree[WINDING_POOL_SIZES];
+	int			m_nFree[WINDING_POOL_SIZES];
+
+	// counted by the owning thread. active is allocs - frees made in this thread,
+	// so it goes negative in threads which free windings made elsewhere.
+	int			m_nActive;
+	int			m_nPeak;
+	int			m_nAllocs;
+	int			m_nPoints;
+};
+
+// the tool threads and THREADINDEX_MAIN each have their own pool. threads which
+// weren't started by RunThreadsOn share the last one under the mutex.
+#define WINDING_POOL_OTHER		(MAX_TOOL_THREADS+1)
+
+static WindingThreadPool_t g_WindingPools[MAX_TOOL_THREADS+2];
+static winding_t *g_pSharedFreeWindings[WINDING_POOL_SIZES];
+static CThreadFastMutex g_SharedWindingMutex;
+
+// moves up to nCount windings of one size from a free list to another. returns the number moved.
+static int MoveFreeWindings( winding_t **ppFrom, winding_t **ppTo, int nCount )
+{
+	int nMoved = 0;
+	while ( *ppFrom && nMoved < nCount )
+	{
+		winding_t *w = *ppFrom;
+		*ppFrom = w->next;
+		w->next = *ppTo;
+		*ppTo = w;
+		nMoved++;
+	}
+	return nMoved;
+}
+
+static void CountWindingAlloc( WindingThreadPool_t &pool, int points )
+{
+	pool.m_nAllocs++;
+	pool.m_nPoints += points;
+	pool.m_nActive++;
+	if ( pool.m_nActive > pool.m_nPeak )
+		pool.m_nPeak = pool.m_nActive;
+}
 
 /*
 =============
@@ -40,28 +83,43 @@ AllocWinding
 */
 winding_t *AllocWinding (int points)
 {
-	winding_t	*w;
+	winding_t	*w = NULL;
 
-	if (numthreads == 1)
+	int iThread = GetCurrentThreadIndex();
+	if ( iThread < 0 )
 	{
-		c_winding_allocs++;
-		c_winding_points += points;
-		c_active_windings++;
-		if (c_active_windings > c_peak_windings)
-			c_peak_windings = c_active_windings;
+		g_SharedWindingMutex.Lock();
+		CountWindingAlloc( g_WindingPools[WINDING_POOL_OTHER], points );
+		if ( g_pSharedFreeWindings[points] )
+		{
+			w = g_pSharedFreeWindings[points];
+			g_pSharedFreeWindings[points] = w->next;
+		}
+		g_SharedWindingMutex.Unlock();
 	}
-	ThreadLock();
-	if (winding_pool[points])
+	else
 	{
-		w = winding_pool[points];
-		winding_pool[points] = w->next;
+		WindingThreadPool_t &pool = g_WindingPools[iThread];
+		CountWindingAlloc( pool, points );
+		if ( !pool.m_pFree[points] && g_pSharedFreeWindings[points] )
+		{
+			g_SharedWindingMutex.Lock();
+			pool.m_nFree[points] += MoveFreeWindings( &g_pSharedFreeWindings[points], &pool.m_pFree[points], WINDING_POOL_BATCH );
+			g_SharedWindingMutex.Unlock();
+		}
+		if ( pool.m_pFree[points] )
+		{
+			w = pool.m_pFree[points];
+			pool.m_pFree[points] = w->next;
+			pool.m_nFree[points]--;
+		}
 	}
-	else
+
+	if ( !w )
 	{
 		w = (winding_t *)malloc(sizeof(*w));
 		w->p = (Vector *)calloc( points, sizeof(Vector) );
 	}
-	ThreadUnlock();
 	w->numpoints = 0; // None are occupied yet even though allocated.
 	w->maxpoints = points;
 	w->next = NULL;
@@ -72,12 +130,58 @@ void FreeWinding (winding_t *w)
 {
 	if ((unsigned int)w->numpoints == 0xdeaddead)
 		Error ("FreeWinding: freed a freed winding");
-
-	ThreadLock();
 	w->numpoints = 0xdeaddead; // flag as freed
-	w->next = winding_pool[w->maxpoints];
-	winding_pool[w->maxpoints] = w;
-	ThreadUnlock();
+
+	int points = w->maxpoints;
+	int iThread = GetCurrentThreadIndex();
+	if ( iThread < 0 )
+	{
+		g_SharedWindingMutex.Lock();
+		g_WindingPools[WINDING_POOL_OTHER].m_nActive--;
+		w->next = g_pSharedFreeWindings[points];
+		g_pSharedFreeWindings[points] = w;
+		g_SharedWindingMutex.Unlock();
+		return;
+	}
+
+	WindingThreadPool_t &pool = g_WindingPools[iThread];
+	pool.m_nActive--;
+	w->next = pool.m_pFree[points];
+	pool.m_pFree[points] = w;
+	if ( ++pool.m_nFree[points] > 2 * WINDING_POOL_BATCH )
+	{
+		g_SharedWindingMutex.Lock();
+		pool.m_nFree[points] -= MoveFreeWindings( &pool.m_pFree[points], &g_pSharedFreeWindings[points], WINDING_POOL_BATCH );
+		g_SharedWindingMutex.Unlock();
+	}
+}
+
+void ReportWindingPoolStats( void )
+{
+	Msg( "Winding pools:\n" );
+	Msg( "  thread     allocs      points     active       peak\n" );
+
+	int nAllocs = 0, nPoints = 0, nActive = 0;
+	for ( int i = 0; i < ARRAYSIZE( g_WindingPools ); i++ )
+	{
+		WindingThreadPool_t const &pool = g_WindingPools[i];
+		if ( !pool.m_nAllocs && !pool.m_nActive )
+			continue;
+
+		char szName[16];
+		if ( i == THREADINDEX_MAIN )
+			V_strncpy( szName, "main", sizeof( szName ) );
+		else if ( i == WINDING_POOL_OTHER )
+			V_strncpy( szName, "other", sizeof( szName ) );
+		else
+			V_snprintf( szName, sizeof( szName ), "%d", i );
+		Msg( "  %6s %10d %11d %10d %10d\n", szName, pool.m_nAllocs, pool.m_nPoints, pool.m_nActive, pool.m_nPeak );
+
+		nAllocs += pool.m_nAllocs;
+		nPoints += pool.m_nPoints;
+		nActive += pool.m_nActive;
+	}
+	Msg( "  %6s %10d %11d %10d\n", "total", nAllocs, nPoints, nActive );
 }
 
 /*
@@ -62,6 +62,8 @@ void	WindingPlane (winding_t *w, Vector &normal, vec_t *dist);
 void	RemoveColinearPoints (winding_t *w);
 int		WindingOnPlaneSide (winding_t *w, const Vector &normal, vec_t dist);
 void	FreeWinding (winding_t *w);
+// prints the per-thread winding allocation counters
+void	ReportWindingPoolStats( void );
 void	WindingBounds (winding_t *w, Vector &mins, Vector &maxs);
 
 void	ChopWindingInPlace (winding_t **w, const Vector &normal, vec_t dist, vec_t epsilon);
@@ -15,14 +15,21 @@
 
 #ifdef WIN32
 #include <windows.h>
+#else
+#include <sys/resource.h>
 #endif
 #include "cmdlib.h"
 #define NO_THREAD_NAMES
 #include "threads.h"
 #include "pacifier.h"
+#include "tier0/threadtools.h"
 
 #define	MAX_THREADS	MAX_TOOL_THREADS
 
+// number of chunks per thread when g_nThreadWorkChunk is 0
+#define AUTO_CHUNKS_PER_THREAD	32
+#define MAX_AUTO_CHUNK_SIZE		64
+
 
 class CRunThreadsData
 {
@@ -35,16 +42,107 @@ public:
 CRunThreadsData g_RunThreadsData[MAX_THREADS];
 
 
-int		dispatch;
+// Work items are handed out by atomically adding to a counter, a chunk at a time, instead of
+// taking ThreadLock() for each one. Without work stealing all threads take chunks from one
+// counter. With work stealing each thread starts with its own contiguous range, which keeps
+// neighbouring items on the same thread, and takes chunks from the other threads' ranges
+// when its own runs out.
+struct ThreadWorkRange_t
+{
+	volatile int m_nNext;				// next item to hand out. can run past m_nEnd.
+	int m_nEnd;
+
+	// only touched by the owning thread
+	int m_nChunkNext;					// rest of the chunk this thread is working through
+	int m_nChunkEnd;
+
+	// stats
+	int m_nItems;
+	int m_nStolenChunks;
+	double m_flStartTime;
+	double m_flDoneTime;				// when GetThreadWork first returned -1
+
+	char m_Pad[64];						// keep the counters on separate cache lines
+};
+
+static ThreadWorkRange_t g_ThreadWork[MAX_THREADS+1];
+static int g_nWorkRanges;				// ranges in use. 1 without work stealing
+static int g_nChunkSize;
+
 int		workcount;
 qboolean		pacifier;
 
 qboolean	threaded;
 bool g_bLowPriorityThreads = false;
 
-HANDLE g_ThreadHandles[MAX_THREADS];
+int g_nThreadWorkChunk = 0;
+bool g_bThreadWorkStealing = false;
+bool g_bThreadStats = false;
+
+static volatile int g_nItemsDispatched;
+static CThreadFastMutex g_PacifierMutex;
+
+ThreadHandle_t g_ThreadHandles[MAX_THREADS];
+
+
+static void SetupThreadWork( int workcnt )
+{
+	int nThreads = max( numthreads, 1 );
+
+	g_nChunkSize = g_nThreadWorkChunk;
+	if ( g_nChunkSize <= 0 )
+		g_nChunkSize = clamp( workcnt / ( nThreads * AUTO_CHUNKS_PER_THREAD ), 1, MAX_AUTO_CHUNK_SIZE );
+
+	g_nWorkRanges = g_bThreadWorkStealing ? nThreads : 1;
+	for ( int i = 0; i < MAX_THREADS+1; i++ )
+	{
+		ThreadWorkRange_t &range = g_ThreadWork[i];
+		if ( i < g_nWorkRanges )
+		{
+			range.m_nNext = (int)( ( (int64)workcnt * i ) / g_nWorkRanges );
+			range.m_nEnd = (int)( ( (int64)workcnt * ( i + 1 ) ) / g_nWorkRanges );
+		}
+		else
+		{
+			range.m_nNext = range.m_nEnd = 0;
+		}
+		range.m_nChunkNext = range.m_nChunkEnd = 0;
+		range.m_nItems = 0;
+		range.m_nStolenChunks = 0;
+		range.m_flStartTime = range.m_flDoneTime = 0;
+	}
+	g_nItemsDispatched = 0;
+}
+
+
+// take up to g_nChunkSize items from a range. returns false if it is empty.
+static bool TakeChunk( ThreadWorkRange_t &from, ThreadWorkRange_t &to )
+{
+	if ( from.m_nNext >= from.m_nEnd )
+		return false;
+	int nStart = ThreadInterlockedExchangeAdd( &from.m_nNext, g_nChunkSize );
+	if ( nStart >= from.m_nEnd )
+		return false;
+	to.m_nChunkNext = nStart;
+	to.m_nChunkEnd = min( nStart + g_nChunkSize, from.m_nEnd );
+	return true;
+}
 
 
+static void UpdateThreadWorkPacifier( int nItems )
+{
+	int nDispatched = ThreadInterlockedExchangeAdd( &g_nItemsDispatched, nItems ) + nItems;
+	if ( !pacifier || !workcount )
+		return;
+
+	// whoever gets the lock draws it, nobody waits for it
+	if ( g_PacifierMutex.TryLock() )
+	{
+		UpdatePacifier( (float)nDispatched / workcount );
+		g_PacifierMutex.Unlock();
+	}
+}
+
 
 /*
 =============
@@ -52,25 +150,64 @@ GetThreadWork
 
 =============
 */
-int	GetThreadWork (void)
+int	GetThreadWork( int iThread )
 {
-	int	r;
+	if ( iThread < 0 || iThread > MAX_THREADS )
+		iThread = THREADINDEX_MAIN;
+	ThreadWorkRange_t &range = g_ThreadWork[iThread];
 
-	ThreadLock ();
+	if ( range.m_nChunkNext < range.m_nChunkEnd )
+	{
+		range.m_nItems++;
+		return range.m_nChunkNext++;
+	}
 
-	if (dispatch == workcount)
+	// need a new chunk. without work stealing there is just the one shared range
+	bool bGotChunk = false;
+	if ( g_nWorkRanges == 1 )
 	{
-		ThreadUnlock ();
-		return -1;
+		bGotChunk = TakeChunk( g_ThreadWork[0], range );
+	}
+	else
+	{
+		int iOwn = ( iThread < g_nWorkRanges ) ? iThread : 0;
+		for ( int i = 0; i < g_nWorkRanges && !bGotChunk; i++ )
+		{
+			bGotChunk = TakeChunk( g_ThreadWork[( iOwn + i ) % g_nWorkRanges], range );
+			if ( bGotChunk && i )
+				range.m_nStolenChunks++;
+		}
 	}
 
-	UpdatePacifier( (float)dispatch / workcount );
+	if ( !bGotChunk )
+	{
+		if ( range.m_flDoneTime == 0 )
+			range.m_flDoneTime = Plat_FloatTime();
+		return -1;
+	}
 
-	r = dispatch;
-	dispatch++;
-	ThreadUnlock ();
+	UpdateThreadWorkPacifier( range.m_nChunkEnd - range.m_nChunkNext );
+	range.m_nItems++;
+	return range.m_nChunkNext++;
+}
 
-	return r;
+// one item at a time from the shared counter. callers that know their thread index should
+// use GetThreadWork( iThread ) instead, which hands out chunks.
+int	GetThreadWork (void)
+{
+	for ( int i = 0; i < g_nWorkRanges; i++ )
+	{
+		ThreadWorkRange_t &from = g_ThreadWork[i];
+		if ( from.m_nNext >= from.m_nEnd )
+			continue;
+		int nItem = ThreadInterlockedExchangeAdd( &from.m_nNext, 1 );
+		if ( nItem < from.m_nEnd )
+		{
+			UpdateThreadWorkPacifier( 1 );
+			return nItem;
+		}
+	}
+	return -1;
 }
 
 
@@ -82,7 +219,7 @@ void ThreadWorkerFunction( int iThread, void *pUserData )
 
 	while (1)
 	{
-		work = GetThreadWork ();
+		work = GetThreadWork( iThread );
 		if (work == -1)
 			break;
 		 
@@ -103,30 +240,26 @@ void RunThreadsOnIndividual (int workcnt, qboolean showpacifier, ThreadWorkerFn
 /*
 ===================================================================
 
-WIN32
+THREADS
 
 ===================================================================
 */
 
 int		numthreads = -1;
-CRITICAL_SECTION		crit;
+CThreadMutex	crit;
 static int enter;
 
-
-class CCritInit
-{
-public:
-	CCritInit()
-	{
-		InitializeCriticalSection (&crit);
-	}
-} g_CritInit;
-
+// 1 + the index of the RunThreadsOn thread, 0 in other threads
+static CTHREADLOCALINT g_iThreadIndexPlusOne;
 
 
 void SetLowPriority()
 {
+#ifdef WIN32
 	SetPriorityClass( GetCurrentProcess(), IDLE_PRIORITY_CLASS );
+#else
+	setpriority( PRIO_PROCESS, 0, 19 );
+#endif
 }
 
 
@@ -134,9 +267,7 @@ void ThreadSetDefault (void)
 {
 	if (numthreads == -1)	// not set manually
 	{
-		SYSTEM_INFO info;
-		GetSystemInfo (&info);
-		numthreads = clamp( int( info.dwNumberOfProcessors ), 1, MAX_THREADS );
+		numthreads = clamp( GetCPUInformation()->m_nLogicalProcessors, 1, MAX_THREADS );
 	}
 
 	Msg ("%i threads\n", numthreads);
@@ -147,7 +278,7 @@ void ThreadLock (void)
 {
 	if (!threaded)
 		return;
-	EnterCriticalSection (&crit);
+	crit.Lock();
 	if (enter)
 		Error ("Recursive ThreadLock\n");
 	enter = 1;
@@ -160,15 +291,28 @@ void ThreadUnlock (void)
 	if (!enter)
 		Error ("ThreadUnlock without lock\n");
 	enter = 0;
-	LeaveCriticalSection (&crit);
+	crit.Unlock();
+}
+
+
+int GetCurrentThreadIndex( void )
+{
+	int iThreadPlusOne = GETLOCAL( g_iThreadIndexPlusOne );
+	if ( iThreadPlusOne )
+		return iThreadPlusOne - 1;
+	return threaded ? -1 : THREADINDEX_MAIN;
 }
 
 
 // This runs in the thread and dispatches a RunThreadsFn call.
-DWORD WINAPI InternalRunThreadsFn( LPVOID pParameter )
+static unsigned InternalRunThreadsFn( void *pParameter )
 {
 	CRunThreadsData *pData = (CRunThreadsData*)pParameter;
+	g_iThreadIndexPlusOne = pData->m_iThread + 1;
+	g_ThreadWork[pData->m_iThread].m_flStartTime = Plat_FloatTime();
 	pData->m_Fn( pData->m_iThread, pData->m_pUserData );
+	if ( g_ThreadWork[pData->m_iThread].m_flDoneTime == 0 )
+		g_ThreadWork[pData->m_iThread].m_flDoneTime = Plat_FloatTime();
 	return 0;
 }
 
@@ -187,15 +331,9 @@ void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePr
 		g_RunThreadsData[i].m_pUserData = pUserData;
 		g_RunThreadsData[i].m_Fn = fn;
 
-		DWORD dwDummy;
-		g_ThreadHandles[i] = CreateThread(
-		   NULL,	// LPSECURITY_ATTRIBUTES lpsa,
-		   0,		// DWORD cbStack,
-		   InternalRunThreadsFn,	// LPTHREAD_START_ROUTINE lpStartAddr,
-		   &g_RunThreadsData[i],	// LPVOID lpvThreadParm,
-		   0,			// DWORD fdwCreate,
-		   &dwDummy );
+		g_ThreadHandles[i] = CreateSimpleThread( InternalRunThreadsFn, &g_RunThreadsData[i] );
 
+#ifdef WIN32
 		if ( ePriority == k_eRunThreadsPriority_UseGlobalState )
 		{
 			if( g_bLowPriorityThreads )
@@ -205,18 +343,43 @@ void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePr
 		{
 			SetThreadPriority( g_ThreadHandles[i], THREAD_PRIORITY_IDLE );
 		}
+#endif
 	}
 }
 
 
 void RunThreads_End()
 {
-	WaitForMultipleObjects( numthreads, g_ThreadHandles, TRUE, INFINITE );
 	for ( int i=0; i < numthreads; i++ )
-		CloseHandle( g_ThreadHandles[i] );
+	{
+		ThreadJoin( g_ThreadHandles[i] );
+		ReleaseThreadHandle( g_ThreadHandles[i] );
+	}
 
 	threaded = false;
 }
+
+
+// per thread busy time (start until it ran out of work) and idle time (waiting for the
+// other threads to finish)
+static void ReportThreadStats( double flEndTime )
+{
+	double flTotalBusy = 0, flTotalIdle = 0;
+	Msg( "  thread    items   busy(s)   idle(s)  stolen\n" );
+	for ( int i = 0; i < numthreads; i++ )
+	{
+		ThreadWorkRange_t &range = g_ThreadWork[i];
+		double flDone = range.m_flDoneTime ? range.m_flDoneTime : flEndTime;
+		double flBusy = max( flDone - range.m_flStartTime, 0.0 );
+		double flIdle = max( flEndTime - flDone, 0.0 );
+		flTotalBusy += flBusy;
+		flTotalIdle += flIdle;
+		Msg( "  %6d %8d %9.2f %9.2f %7d\n", i, range.m_nItems, flBusy, flIdle, range.m_nStolenChunks );
+	}
+	Msg( "  %d items, chunk size %d%s, %.1f%% idle\n", workcount, g_nChunkSize,
+		 ( g_nWorkRanges > 1 ) ? ", work stealing" : "",
+		 100.0 * flTotalIdle / max( flTotalBusy + flTotalIdle, 1.0e-6 ) );
+}
 	
 
 /*
@@ -229,8 +392,8 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 	int		start, end;
 
 	start = Plat_FloatTime();
-	dispatch = 0;
 	workcount = workcnt;
+	SetupThreadWork( workcnt );
 	StartPacifier("");
 	pacifier = showpacifier;
 
@@ -244,13 +407,13 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 	RunThreads_Start( fn, pUserData );
 	RunThreads_End();
 
-
-	end = Plat_FloatTime();
+	double flEndTime = Plat_FloatTime();
+	end = flEndTime;
 	if (pacifier)
 	{
 		EndPacifier(false);
 		printf (" (%i)\n", end-start);
 	}
+	if ( g_bThreadStats )
+		ReportThreadStats( flEndTime );
 }
-
-
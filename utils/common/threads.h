@@ -27,6 +27,15 @@ extern	int		numthreads;
 // If set to true, then all the threads that are created are low priority.
 extern bool	g_bLowPriorityThreads;
 
+// Work distribution for RunThreadsOn / RunThreadsOnIndividual.
+// g_nThreadWorkChunk is how many consecutive work items a thread takes at once (0 = pick one
+// from the work count). With g_bThreadWorkStealing each thread starts with its own range of
+// the work and takes chunks from the others when it runs out. g_bThreadStats prints per
+// thread busy/idle times after each run.
+extern int	g_nThreadWorkChunk;
+extern bool	g_bThreadWorkStealing;
+extern bool	g_bThreadStats;
+
 typedef void (*ThreadWorkerFn)( int iThread, int iWorkItem );
 typedef void (*RunThreadsFn)( int iThread, void *pUserData );
 
@@ -44,6 +53,7 @@ void SetLowPriority();
 
 void ThreadSetDefault (void);
 int	GetThreadWork (void);
+int	GetThreadWork( int iThread );	// hands out chunks, prefer this inside RunThreadsOn functions
 
 void RunThreadsOnIndividual ( int workcnt, qboolean showpacifier, ThreadWorkerFn fn );
 
@@ -56,6 +66,11 @@ void RunThreads_End();
 void ThreadLock (void);
 void ThreadUnlock (void);
 
+// Index of the calling thread: 0..numthreads-1 inside RunThreadsOn / RunThreads_Start
+// threads, THREADINDEX_MAIN from the main thread while no threads are running, and -1 from
+// any other thread.
+int GetCurrentThreadIndex( void );
+
 
 #ifndef NO_THREAD_NAMES
 #define RunThreadsOn(n,p,f) { if (p) printf("%-20s ", #f ":"); RunThreadsOn(n,p,f); }
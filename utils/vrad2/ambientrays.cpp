@@ -0,0 +1,288 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Kd-tree of the world's faces for the ambient gathers. See ambientrays.h.
+//
+//=============================================================================//
+
+#include "vrad.h"
+#include "ambientrays.h"
+#include "vradprofile.h"
+
+
+// Rays that hit the back of a face in a leaf go through it, like in the BSP walk.
+// Each pass starts this far past the last hit, so a ray runs out of length after
+// a finite number of faces and there's no need to cap the passes.
+#define AMBIENTRAY_PASSTHROUGH_EPSILON	0.1f
+
+
+bool g_bAmbientKDTree = true;
+
+struct AmbientTriangle_t
+{
+	int			m_nFace;
+	bool		m_bCullBack;				// faces in leaves are only hit from the front
+	bool		m_bHasLuxel;
+	bool		m_bDisp;					// interpolates m_LuxelCoords instead of projecting the hit
+	Vector		m_vecOrigin;
+	Vector		m_vecEdge1;
+	Vector		m_vecEdge2;
+	Vector2D	m_LuxelCoords[3];
+};
+
+static RayTracingEnvironment *s_pAmbientEnv = NULL;
+static CUtlVector<AmbientTriangle_t> s_AmbientTriangles;	// indexed by triangle id
+
+
+//-----------------------------------------------------------------------------
+// Adds the triangles of a face that isn't a displacement. CLightSurface skips
+// faces without lightmaps, except sky on a node, so those aren't added.
+//-----------------------------------------------------------------------------
+static void AddFaceTriangles( int iFace )
+{
+	dface_t *pFace = &g_pFaces[iFace];
+	texinfo_t *pTex = &texinfo[pFace->texinfo];
+	bool bNodeSky = ( pTex->flags & SURF_SKY ) && pFace->onNode;
+
+	if ( ( pTex->flags & SURF_NOLIGHT ) && !bNodeSky )
+		return;
+
+	Vector origin( 0.0f, 0.0f, 0.0f );
+	winding_t *pWinding = WindingFromFace( pFace, origin );
+	for ( int j = 2; j < pWinding->numpoints; ++j )
+	{
+		int nID = s_AmbientTriangles.AddToTail();
+		AmbientTriangle_t &tri = s_AmbientTriangles[nID];
+		tri.m_nFace = iFace;
+		tri.m_bCullBack = !pFace->onNode;
+		tri.m_bHasLuxel = !bNodeSky;
+		tri.m_bDisp = false;
+
+		s_pAmbientEnv->AddTriangle( nID, pWinding->p[0], pWinding->p[j - 1], pWinding->p[j], vec3_origin );
+	}
+	FreeWinding( pWinding );
+}
+
+void AmbientRays_AddDispTriangle( int nFace, const Vector &v0, const Vector &v1, const Vector &v2,
+								  const Vector2D &luxel0, const Vector2D &luxel1, const Vector2D &luxel2 )
+{
+	int nID = s_AmbientTriangles.AddToTail();
+	AmbientTriangle_t &tri = s_AmbientTriangles[nID];
+	tri.m_nFace = nFace;
+	tri.m_bCullBack = false;
+	tri.m_bHasLuxel = true;
+	tri.m_bDisp = true;
+	tri.m_vecOrigin = v0;
+	tri.m_vecEdge1 = v1 - v0;
+	tri.m_vecEdge2 = v2 - v0;
+	tri.m_LuxelCoords[0] = luxel0;
+	tri.m_LuxelCoords[1] = luxel1;
+	tri.m_LuxelCoords[2] = luxel2;
+
+	s_pAmbientEnv->AddTriangle( nID, v0, v1, v2, vec3_origin );
+}
+
+
+void AmbientRays_Build()
+{
+	AmbientRays_Free();
+
+	if ( !g_bAmbientKDTree || !nummodels )
+		return;
+
+	Msg( "Setting up ambient ray-trace acceleration structure... " );
+	float start = Plat_FloatTime();
+
+	s_pAmbientEnv = new RayTracingEnvironment;
+	s_pAmbientEnv->Flags |= RTE_FLAGS_DONT_STORE_TRIANGLE_COLORS | RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS;
+	s_pAmbientEnv->m_nBuildThreads = numthreads;
+
+	// Only the world, which is all the BSP walk sees
+	for ( int i = 0; i < dmodels[0].numfaces; ++i )
+	{
+		int iFace = dmodels[0].firstface + i;
+		if ( g_pFaces[iFace].dispinfo == -1 )
+		{
+			AddFaceTriangles( iFace );
+		}
+		else
+		{
+			CVRADDispColl *pDispTree;
+			StaticDispMgr()->GetDispSurf( iFace, &pDispTree );
+			pDispTree->AddPolysForAmbientRays();
+		}
+	}
+
+	if ( s_AmbientTriangles.Count() )
+	{
+		s_pAmbientEnv->SetupAccelerationStructure();
+	}
+
+	float end = Plat_FloatTime();
+	Msg( "Done (%.2f seconds, %d triangles)\n", end - start, s_AmbientTriangles.Count() );
+
+	VRadProfile_SetValue( "ambient_triangles", s_AmbientTriangles.Count() );
+}
+
+
+//-----------------------------------------------------------------------------
+// Fills in where a ray hit a triangle, the way CLightSurface does
+//-----------------------------------------------------------------------------
+static void SetAmbientRayHit( const AmbientTriangle_t &tri, const Vector &vecHit, float flHitFrac, AmbientRayHit_t &hit )
+{
+	dface_t *pFace = &g_pFaces[tri.m_nFace];
+
+	hit.m_pSurface = pFace;
+	hit.m_flHitFrac = flHitFrac;
+	hit.m_bHasLuxel = tri.m_bHasLuxel;
+	hit.m_LuxelCoord.Init( 0.0f, 0.0f );
+
+	if ( !tri.m_bHasLuxel )
+		return;
+
+	if ( tri.m_bDisp )
+	{
+		// Barycentric coordinates of the hit
+		Vector vecToHit = vecHit - tri.m_vecOrigin;
+		float d00 = DotProduct( tri.m_vecEdge1, tri.m_vecEdge1 );
+		float d01 = DotProduct( tri.m_vecEdge1, tri.m_vecEdge2 );
+		float d11 = DotProduct( tri.m_vecEdge2, tri.m_vecEdge2 );
+		float d20 = DotProduct( vecToHit, tri.m_vecEdge1 );
+		float d21 = DotProduct( vecToHit, tri.m_vecEdge2 );
+		float flDenom = d00 * d11 - d01 * d01;
+		if ( flDenom == 0.0f )
+		{
+			hit.m_LuxelCoord = tri.m_LuxelCoords[0];
+			return;
+		}
+
+		float u = ( d11 * d20 - d01 * d21 ) / flDenom;
+		float v = ( d00 * d21 - d01 * d20 ) / flDenom;
+		hit.m_LuxelCoord = tri.m_LuxelCoords[0] +
+			( tri.m_LuxelCoords[1] - tri.m_LuxelCoords[0] ) * u +
+			( tri.m_LuxelCoords[2] - tri.m_LuxelCoords[0] ) * v;
+	}
+	else
+	{
+		texinfo_t *pTex = &texinfo[pFace->texinfo];
+		float s = DotProduct( vecHit.Base(), pTex->lightmapVecsLuxelsPerWorldUnits[0] ) +
+			pTex->lightmapVecsLuxelsPerWorldUnits[0][3];
+		float t = DotProduct( vecHit.Base(), pTex->lightmapVecsLuxelsPerWorldUnits[1] ) +
+			pTex->lightmapVecsLuxelsPerWorldUnits[1][3];
+
+		hit.m_LuxelCoord.x = s - pFace->m_LightmapTextureMinsInLuxels[0];
+		hit.m_LuxelCoord.y = t - pFace->m_LightmapTextureMinsInLuxels[1];
+	}
+}
+
+static inline int DirectionSignMask( const Vector &vecDir )
+{
+	return ( vecDir.x < 0.0f ) | ( ( vecDir.y < 0.0f ) << 1 ) | ( ( vecDir.z < 0.0f ) << 2 );
+}
+
+
+bool AmbientRays_Trace( const Vector &vStart, const Vector *pDirections, int nRays, float flLength, AmbientRayHit_t *pHits )
+{
+	if ( !s_pAmbientEnv )
+		return false;
+
+	for ( int i = 0; i < nRays; ++i )
+	{
+		pHits[i].m_pSurface = NULL;
+		pHits[i].m_flHitFrac = 1.0f;
+		pHits[i].m_bHasLuxel = false;
+	}
+
+	if ( !s_AmbientTriangles.Count() || nRays <= 0 )
+		return true;
+
+	// Rays heading the same way go in the same packets, so they can be traced
+	// as wide as the cpu allows
+	CUtlVector<int> pending;
+	pending.EnsureCapacity( nRays );
+	for ( int nSignMask = 0; nSignMask < 8; ++nSignMask )
+	{
+		for ( int i = 0; i < nRays; ++i )
+		{
+			if ( DirectionSignMask( pDirections[i] ) == nSignMask )
+			{
+				pending.AddToTail( i );
+			}
+		}
+	}
+
+	CUtlVector<float> rayTMin;
+	rayTMin.SetCount( nRays );
+	for ( int i = 0; i < nRays; ++i )
+	{
+		rayTMin[i] = 0.0f;
+	}
+
+	CUtlVector< FourRays, CUtlMemoryAligned< FourRays, 16 > > rays;
+	CUtlVector< fltx4, CUtlMemoryAligned< fltx4, 16 > > tMin, tMax;
+	CUtlVector< RayTracingResult, CUtlMemoryAligned< RayTracingResult, 16 > > results;
+	CUtlVector<int> passThrough;
+
+	while ( pending.Count() )
+	{
+		// Pad the last packet with copies of the last ray
+		int nQuads = ( pending.Count() + 3 ) / 4;
+		rays.SetCount( nQuads );
+		tMin.SetCount( nQuads );
+		tMax.SetCount( nQuads );
+		results.SetCount( nQuads );
+		for ( int q = 0; q < nQuads; ++q )
+		{
+			Vector directions[4];
+			float flTMin[4];
+			for ( int k = 0; k < 4; ++k )
+			{
+				int iRay = pending[ MIN( q * 4 + k, pending.Count() - 1 ) ];
+				directions[k] = pDirections[iRay];
+				flTMin[k] = rayTMin[iRay];
+			}
+			rays[q].origin.DuplicateVector( vStart );
+			rays[q].direction.LoadAndSwizzle( directions[0], directions[1], directions[2], directions[3] );
+			tMin[q] = LoadUnalignedSIMD( flTMin );
+			tMax[q] = ReplicateX4( flLength );
+		}
+
+		s_pAmbientEnv->TraceRayPackets( rays.Base(), tMin.Base(), tMax.Base(), nQuads, results.Base() );
+		VRadProfile_CountRays( pending.Count() );
+
+		passThrough.RemoveAll();
+		for ( int i = 0; i < pending.Count(); ++i )
+		{
+			int iRay = pending[i];
+			const RayTracingResult &result = results[i / 4];
+			int nHitID = result.HitIds[i & 3];
+			float flHitDist = SubFloat( result.HitDistance, i & 3 );
+			if ( nHitID == -1 || flHitDist >= flLength )
+				continue;
+
+			const AmbientTriangle_t &tri = s_AmbientTriangles[ s_pAmbientEnv->OptimizedTriangleList[nHitID].m_Data.m_IntersectData.m_nTriangleID ];
+			if ( tri.m_bCullBack && DotProduct( dplanes[g_pFaces[tri.m_nFace].planenum].normal, pDirections[iRay] ) > 0 )
+			{
+				rayTMin[iRay] = flHitDist + AMBIENTRAY_PASSTHROUGH_EPSILON;
+				passThrough.AddToTail( iRay );
+				continue;
+			}
+
+			Vector vecHit;
+			VectorMA( vStart, flHitDist, pDirections[iRay], vecHit );
+			SetAmbientRayHit( tri, vecHit, flHitDist / flLength, pHits[iRay] );
+		}
+
+		pending.RemoveAll();
+		pending.AddVectorToTail( passThrough );
+	}
+
+	return true;
+}
+
+
+void AmbientRays_Free()
+{
+	delete s_pAmbientEnv;
+	s_pAmbientEnv = NULL;
+	s_AmbientTriangles.Purge();
+}
@@ -0,0 +1,54 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Kd-tree of the world's faces for the ambient gathers.
+//
+// Leaf ambient cubes and detail props shoot NUMVERTEXNORMALS rays per sample
+// and read the lightmap wherever each ray lands. g_RtEnv is built from brush
+// sides, so its hits can't say which face or luxel they are on. This tree holds
+// the surfaces CLightSurface walks instead: the world's faces, minus the ones
+// it passes through, and the displacement triangles. Each triangle maps back to
+// its face, and the luxel is found the same way the BSP walk finds it.
+//
+//=============================================================================//
+
+#ifndef AMBIENTRAYS_H
+#define AMBIENTRAYS_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "mathlib/vector.h"
+#include "mathlib/vector2d.h"
+
+struct dface_t;
+
+
+extern bool g_bAmbientKDTree;				// cleared by -noambientkdtree
+
+
+// Where an ambient ray landed
+struct AmbientRayHit_t
+{
+	dface_t		*m_pSurface;				// NULL if the ray didn't hit anything
+	float		m_flHitFrac;				// fraction of the ray
+	Vector2D	m_LuxelCoord;
+	bool		m_bHasLuxel;				// false for sky, which uses the face average
+};
+
+
+// Builds the tree once the faces and displacements are loaded. Does nothing
+// if g_bAmbientKDTree is off.
+void AmbientRays_Build();
+
+// Called by the displacements while the tree is built
+void AmbientRays_AddDispTriangle( int nFace, const Vector &v0, const Vector &v1, const Vector &v2,
+								  const Vector2D &luxel0, const Vector2D &luxel1, const Vector2D &luxel2 );
+
+// Traces nRays rays of length flLength from vStart along the unit pDirections.
+// Returns false, without touching pHits, if the tree wasn't built.
+bool AmbientRays_Trace( const Vector &vStart, const Vector *pDirections, int nRays, float flLength, AmbientRayHit_t *pHits );
+
+void AmbientRays_Free();
+
+
+#endif // AMBIENTRAYS_H
@@ -141,15 +141,17 @@ void ComputeAmbientFromSphericalSamples( int iThread, const Vector &vStart, Vect
 	// Figure out the color that rays hit when shot out from this position.
 	Vector radcolor[NUMVERTEXNORMALS];
 	float tanTheta = tan(VERTEXNORMAL_CONE_INNER_ANGLE);
+	float flLength = COORD_EXTENT * 1.74;
+
+	// See what surfaces the rays hit, all at once so they can be traced in packets
+	AmbientRayHit_t hits[NUMVERTEXNORMALS];
+	FindAmbientRayHits( iThread, vStart, g_anorms, NUMVERTEXNORMALS, flLength, hits );
 
 	for ( int i = 0; i < NUMVERTEXNORMALS; i++ )
 	{
-		Vector vEnd = vStart + g_anorms[i] * (COORD_EXTENT * 1.74);
-
-		// Now that we've got a ray, see what surface we've hit
 		Vector lightStyleColors[MAX_LIGHTSTYLES];
 		lightStyleColors[0].Init();	// We only care about light style 0 here.
-		CalcRayAmbientLighting( iThread, vStart, vEnd, tanTheta, lightStyleColors );
+		AddAmbientRayHitLighting( hits[i], flLength, tanTheta, lightStyleColors );
 
 		radcolor[i] = lightStyleColors[0];
 	}
@@ -570,7 +572,7 @@ static void ThreadComputeLeafAmbient( int iThread, void *pUserData )
 	CUtlVector<ambientsample_t> list;
 	while (1)
 	{
-		int leafID = GetThreadWork ();
+		int leafID = GetThreadWork( iThread );
 		if (leafID == -1)
 			break;
 		list.RemoveAll();
@@ -0,0 +1,336 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Spatial index of the direct lights. See lightcull.h.
+//
+//=============================================================================//
+
+#include "vrad.h"
+#include "lightcull.h"
+#include "vradprofile.h"
+
+
+// Cells are at least this big, and the grid is at most LIGHTCULL_MAX_GRID cells
+// along each axis.
+#define LIGHTCULL_MIN_CELL_SIZE		256.0f
+#define LIGHTCULL_MAX_GRID			64
+
+// Lights that would go in more cells than this are treated as reaching everywhere.
+#define LIGHTCULL_MAX_LIGHT_CELLS	4096
+
+
+// Below a luxel intensity of about 0.001 a light changes no 8 bit lightmap value,
+// even near black.
+float g_flLightCullThreshold = 0.001f;
+
+LightCullCounters_t g_LightCullCounters[MAX_TOOL_THREADS+1];
+
+
+struct CullLight_t
+{
+	directlight_t	*m_pLight;
+	Vector			m_vecOrigin;
+	float			m_flRadius;
+};
+
+static bool s_bBuilt = false;
+static CUtlVector<CullLight_t> s_Lights;		// in activelights order
+static CUtlVector<int> s_GlobalLights;			// lights that reach everywhere
+
+static Vector s_vecGridMins;
+static float s_flCellSize;
+static int s_nGridSize[3];
+static CUtlVector<int> s_CellStart;				// first index into s_CellLights of each cell, plus one past the last
+static CUtlVector<int> s_CellLights;
+
+
+//-----------------------------------------------------------------------------
+// Distance past which a light adds nothing, or FLT_MAX if it has no limit
+//-----------------------------------------------------------------------------
+static float LightInfluenceRadius( directlight_t *dl )
+{
+	if ( dl->light.type == emit_skylight || dl->light.type == emit_skyambient )
+		return FLT_MAX;
+
+	float flRadius = FLT_MAX;
+
+	// Lights with a hard falloff fade to zero
+	if ( dl->m_flEndFadeDistance > dl->m_flStartFadeDistance )
+	{
+		flRadius = dl->m_flEndFadeDistance;
+	}
+
+	if ( g_flLightCullThreshold <= 0.0f )
+		return flRadius;
+
+	// The dot products and spotlight cone only ever scale the falloff down, so
+	// past the distance where intensity / attenuation drops below the threshold
+	// the light can't get above it either.
+	float flMaxIntensity = MAX( fabs( dl->light.intensity.x ), MAX( fabs( dl->light.intensity.y ), fabs( dl->light.intensity.z ) ) );
+	float flAttenuation = flMaxIntensity / g_flLightCullThreshold;
+
+	float a, b, c;
+	if ( dl->light.type == emit_surface )
+	{
+		a = 1.0f;
+		b = 0.0f;
+		c = 0.0f;
+	}
+	else
+	{
+		a = dl->light.quadratic_attn;
+		b = dl->light.linear_attn;
+		c = dl->light.constant_attn;
+	}
+
+	// An attenuation that doesn't keep growing never gets the light below the threshold
+	if ( a < 0.0f || b < 0.0f || c < 0.0f || ( a == 0.0f && b == 0.0f ) )
+		return flRadius;
+
+	// Distances are clamped to 1 when lighting
+	float flDist = 1.0f;
+	if ( flAttenuation > c )
+	{
+		if ( a > 0.0f )
+		{
+			flDist = ( -b + sqrt( b * b + 4.0f * a * ( flAttenuation - c ) ) ) / ( 2.0f * a );
+		}
+		else
+		{
+			flDist = ( flAttenuation - c ) / b;
+		}
+	}
+
+	return MIN( flRadius, MAX( flDist, 1.0f ) );
+}
+
+static inline bool IsSphereTouchingBox( const Vector &vecCenter, float flRadius, const Vector &mins, const Vector &maxs )
+{
+	float flDistSqr = 0.0f;
+	for ( int i = 0; i < 3; ++i )
+	{
+		float flDelta = 0.0f;
+		if ( vecCenter[i] < mins[i] )
+		{
+			flDelta = mins[i] - vecCenter[i];
+		}
+		else if ( vecCenter[i] > maxs[i] )
+		{
+			flDelta = vecCenter[i] - maxs[i];
+		}
+		flDistSqr += flDelta * flDelta;
+	}
+	return flDistSqr <= flRadius * flRadius;
+}
+
+//-----------------------------------------------------------------------------
+// Cells covering a box, clamped to the grid. Boxes outside of it clamp to the
+// cells on its border, which is fine since lights clamp the same way.
+//-----------------------------------------------------------------------------
+static void GetCellRange( const Vector &mins, const Vector &maxs, int *pMins, int *pMaxs )
+{
+	for ( int i = 0; i < 3; ++i )
+	{
+		pMins[i] = MIN( MAX( (int)floor( ( mins[i] - s_vecGridMins[i] ) / s_flCellSize ), 0 ), s_nGridSize[i] - 1 );
+		pMaxs[i] = MIN( MAX( (int)floor( ( maxs[i] - s_vecGridMins[i] ) / s_flCellSize ), 0 ), s_nGridSize[i] - 1 );
+	}
+}
+
+static int __cdecl CompareLightIndices( const int *pA, const int *pB )
+{
+	return *pA - *pB;
+}
+
+static inline int CellIndex( int x, int y, int z )
+{
+	return x + s_nGridSize[0] * ( y + s_nGridSize[1] * z );
+}
+
+
+void LightCull_Build()
+{
+	LightCull_Free();
+
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		CullLight_t &light = s_Lights[s_Lights.AddToTail()];
+		light.m_pLight = dl;
+		light.m_vecOrigin = dl->light.origin;
+		light.m_flRadius = LightInfluenceRadius( dl );
+	}
+
+	// Grid over the world
+	Vector vecExtent = dmodels[0].maxs - dmodels[0].mins;
+	float flMaxExtent = MAX( vecExtent.x, MAX( vecExtent.y, vecExtent.z ) );
+	s_flCellSize = MAX( LIGHTCULL_MIN_CELL_SIZE, flMaxExtent / LIGHTCULL_MAX_GRID );
+	s_vecGridMins = dmodels[0].mins;
+	int nCells = 1;
+	for ( int i = 0; i < 3; ++i )
+	{
+		s_nGridSize[i] = MIN( MAX( (int)ceil( vecExtent[i] / s_flCellSize ), 1 ), LIGHTCULL_MAX_GRID );
+		nCells *= s_nGridSize[i];
+	}
+
+	// Count the lights in each cell, then fill them in
+	CUtlVector<int> cellCounts;
+	cellCounts.SetCount( nCells + 1 );
+	memset( cellCounts.Base(), 0, cellCounts.Count() * sizeof(int) );
+
+	for ( int nPass = 0; nPass < 2; ++nPass )
+	{
+		for ( int iLight = 0; iLight < s_Lights.Count(); ++iLight )
+		{
+			const CullLight_t &light = s_Lights[iLight];
+			if ( light.m_flRadius == FLT_MAX )
+			{
+				if ( nPass == 0 )
+				{
+					s_GlobalLights.AddToTail( iLight );
+				}
+				continue;
+			}
+
+			Vector vecRadius( light.m_flRadius, light.m_flRadius, light.m_flRadius );
+			int cellMins[3], cellMaxs[3];
+			GetCellRange( light.m_vecOrigin - vecRadius, light.m_vecOrigin + vecRadius, cellMins, cellMaxs );
+
+			int nLightCells = ( cellMaxs[0] - cellMins[0] + 1 ) * ( cellMaxs[1] - cellMins[1] + 1 ) * ( cellMaxs[2] - cellMins[2] + 1 );
+			if ( nLightCells > LIGHTCULL_MAX_LIGHT_CELLS )
+			{
+				if ( nPass == 0 )
+				{
+					s_GlobalLights.AddToTail( iLight );
+				}
+				continue;
+			}
+
+			for ( int z = cellMins[2]; z <= cellMaxs[2]; ++z )
+			{
+				for ( int y = cellMins[1]; y <= cellMaxs[1]; ++y )
+				{
+					for ( int x = cellMins[0]; x <= cellMaxs[0]; ++x )
+					{
+						int iCell = CellIndex( x, y, z );
+						if ( nPass == 0 )
+						{
+							++cellCounts[iCell];
+						}
+						else
+						{
+							s_CellLights[s_CellStart[iCell] + cellCounts[iCell]++] = iLight;
+						}
+					}
+				}
+			}
+		}
+
+		if ( nPass == 0 )
+		{
+			s_CellStart.SetCount( nCells + 1 );
+			s_CellStart[0] = 0;
+			for ( int iCell = 0; iCell < nCells; ++iCell )
+			{
+				s_CellStart[iCell + 1] = s_CellStart[iCell] + cellCounts[iCell];
+			}
+			s_CellLights.SetCount( s_CellStart[nCells] );
+			memset( cellCounts.Base(), 0, cellCounts.Count() * sizeof(int) );
+		}
+	}
+
+	s_bBuilt = true;
+
+	qprintf( "Light culling: %d lights in a %dx%dx%d grid of %.0f unit cells, %d reach everywhere\n",
+		s_Lights.Count(), s_nGridSize[0], s_nGridSize[1], s_nGridSize[2], s_flCellSize, s_GlobalLights.Count() );
+}
+
+
+void LightCull_GetLightsInBox( const Vector &mins, const Vector &maxs, CUtlVector<directlight_t*> &lights )
+{
+	lights.RemoveAll();
+
+	if ( !s_bBuilt )
+	{
+		for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+		{
+			lights.AddToTail( dl );
+		}
+		return;
+	}
+
+	CUtlVector<int> candidates;
+	candidates.AddVectorToTail( s_GlobalLights );
+
+	int cellMins[3], cellMaxs[3];
+	GetCellRange( mins, maxs, cellMins, cellMaxs );
+	for ( int z = cellMins[2]; z <= cellMaxs[2]; ++z )
+	{
+		for ( int y = cellMins[1]; y <= cellMaxs[1]; ++y )
+		{
+			for ( int x = cellMins[0]; x <= cellMaxs[0]; ++x )
+			{
+				int iCell = CellIndex( x, y, z );
+				int nCellLights = s_CellStart[iCell + 1] - s_CellStart[iCell];
+				if ( nCellLights > 0 )
+				{
+					candidates.AddMultipleToTail( nCellLights, &s_CellLights[s_CellStart[iCell]] );
+				}
+			}
+		}
+	}
+
+	// Back into activelights order, without the lights that were in several cells
+	candidates.Sort( CompareLightIndices );
+
+	int iPrev = -1;
+	for ( int i = 0; i < candidates.Count(); ++i )
+	{
+		int iLight = candidates[i];
+		if ( iLight == iPrev )
+			continue;
+		iPrev = iLight;
+
+		const CullLight_t &light = s_Lights[iLight];
+		if ( light.m_flRadius == FLT_MAX || IsSphereTouchingBox( light.m_vecOrigin, light.m_flRadius, mins, maxs ) )
+		{
+			lights.AddToTail( light.m_pLight );
+		}
+	}
+}
+
+
+void LightCull_Report()
+{
+	LightCullCounters_t total;
+	memset( &total, 0, sizeof(total) );
+	for ( int i = 0; i <= MAX_TOOL_THREADS; ++i )
+	{
+		total.m_nFaces += g_LightCullCounters[i].m_nFaces;
+		total.m_nFaceLights += g_LightCullCounters[i].m_nFaceLights;
+		total.m_nEvaluated += g_LightCullCounters[i].m_nEvaluated;
+		total.m_nContributing += g_LightCullCounters[i].m_nContributing;
+	}
+	memset( g_LightCullCounters, 0, sizeof(g_LightCullCounters) );
+
+	// Nothing was lit here, the workers did it
+	if ( total.m_nFaces == 0 )
+		return;
+
+	double flLightsPerFace = (double)total.m_nFaceLights / total.m_nFaces;
+	double flContributing = total.m_nEvaluated ? (double)total.m_nContributing / total.m_nEvaluated : 0.0;
+	Msg( "Lights per face: %.1f of %d after culling, %.0f evaluations, %.0f%% of them contributed\n",
+		flLightsPerFace, s_Lights.Count(), (double)total.m_nEvaluated, flContributing * 100.0 );
+
+	VRadProfile_SetValue( "lights", s_Lights.Count() );
+	VRadProfile_SetValue( "lights_per_face", flLightsPerFace );
+	VRadProfile_SetValue( "light_evaluations", (double)total.m_nEvaluated );
+	VRadProfile_SetValue( "light_evaluations_contributing", (double)total.m_nContributing );
+}
+
+
+void LightCull_Free()
+{
+	s_bBuilt = false;
+	s_Lights.Purge();
+	s_GlobalLights.Purge();
+	s_CellStart.Purge();
+	s_CellLights.Purge();
+}
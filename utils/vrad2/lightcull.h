@@ -0,0 +1,54 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Spatial index of the direct lights, so each face only gathers the
+// lights that can reach it.
+//
+// Every light gets a sphere outside of which it adds nothing: the end of the
+// fade for lights with a hard falloff, otherwise the distance where its
+// brightest color drops below -lightcullthreshold. Sky lights and lights
+// without a falloff reach everywhere. Spheres are binned into a uniform grid,
+// and a query returns the lights whose sphere touches a box, in the same order
+// as activelights so the lighting adds up the same way.
+//
+//=============================================================================//
+
+#ifndef LIGHTCULL_H
+#define LIGHTCULL_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier1/utlvector.h"
+#include "threads.h"
+
+struct directlight_t;
+
+
+extern float g_flLightCullThreshold;			// -lightcullthreshold
+
+struct LightCullCounters_t
+{
+	int64	m_nFaces;
+	int64	m_nFaceLights;				// lights returned for the faces
+	int64	m_nEvaluated;				// lights gathered at a group of 4 samples
+	int64	m_nContributing;			// ... that added light to one of them
+	char	m_Pad[32];					// keep each thread's counters on their own cache line
+};
+
+extern LightCullCounters_t g_LightCullCounters[MAX_TOOL_THREADS+1];
+
+
+// Bins activelights. Call once the list of lights is final, before BuildFacelights.
+void LightCull_Build();
+
+// Fills in the lights that can reach anything in the box, in activelights order.
+void LightCull_GetLightsInBox( const Vector &mins, const Vector &maxs, CUtlVector<directlight_t*> &lights );
+
+// Prints how many lights the faces evaluated and how many of them contributed,
+// and adds it to the current profile stage. Clears the counters.
+void LightCull_Report();
+
+void LightCull_Free();
+
+
+#endif // LIGHTCULL_H
@@ -22,6 +22,10 @@
 #include "mathlib/quantize.h"
 #include "bitmap/imageformat.h"
 #include "coordsize.h"
+#include "relightcache.h"
+#include "vradprofile.h"
+#include "lightcull.h"
+#include "tier1/utlpriorityqueue.h"
 
 enum
 {
@@ -78,13 +82,11 @@ inline FourVectors operator+( const FourVectors &a, const FourVectors &b )			//<
 	return result;
 }
 
-fltx4 CalculateAmbientOcclusion4( const FourVectors &position4, const FourVectors &normal4, int static_prop_index_to_ignore )
+// Adds the ambient occlusion rays for 4 points to sums.m_Sums[iSum], each weighted
+// by its cosine, and returns the most they can add up to
+static fltx4 AddAmbientOcclusionRays4( const FourVectors &position4, const FourVectors &normal4, int static_prop_index_to_ignore,
+									   ShadowRaySums_t &sums, int iSum )
 {
-	if ( g_bNoAO )
-	{
-		return Four_Ones;
-	}
-
 	DirectionalSampler_t sampler;
 	int nSamples = 32;
 	if ( do_fast )
@@ -92,7 +94,6 @@ fltx4 CalculateAmbientOcclusion4( const FourVectors &position4, const FourVector
 		nSamples /= 2;
 	}
 
-	fltx4 totalVisible = Four_Zeros;
 	fltx4 totalPossibleVisible = Four_Zeros;
 	for ( int i = 0; i < nSamples; i++ )
 	{
@@ -114,12 +115,14 @@ fltx4 CalculateAmbientOcclusion4( const FourVectors &position4, const FourVector
 		rayEnd += rayStart;
 
 		// Raytrace for visibility function
-		fltx4 fractionVisible = Four_Ones;
-		TestLine_IgnoreSky( rayStart, rayEnd, &fractionVisible, static_prop_index_to_ignore );
-		totalVisible = AddSIMD( totalVisible, MulSIMD( fractionVisible, absRayDotN ) );
+		ShadowRay_AddVisible( sums, iSum, 1, &absRayDotN, SHADOW_RAY_IGNORE_SKY, rayStart, rayEnd, static_prop_index_to_ignore );
 		totalPossibleVisible = AddSIMD( totalPossibleVisible, absRayDotN );
 	}
+	return totalPossibleVisible;
+}
 
+static fltx4 FinishAmbientOcclusion4( const fltx4 &totalVisible, const fltx4 &totalPossibleVisible )
+{
 	fltx4 ao = DivSIMD( totalVisible, totalPossibleVisible );
 	ao = MulSIMD( ao, ao ); // Square ao term - This is an artistic choice by the CS:GO team
 	return ao;
@@ -1114,6 +1117,8 @@ void FreeDLights()
 	gSkyLight = NULL;
 	gAmbient = NULL;
 
+	LightCull_Free();
+
 	directlight_t *pNext;
 	for( directlight_t *pCur=activelights; pCur; pCur=pNext )
 	{
@@ -1779,8 +1784,25 @@ void ExportDirectLightsToWorldLights()
 #define NSAMPLES_SUN_AREA_LIGHT 150							// number of samples to take for an
                                                             // non-point sun light
 
+// The shadow rays to a light and the ambient occlusion rays, summed up for
+// FinishSampleLightSSE
+enum
+{
+	SAMPLE_SUM_VISIBLE = 0,						// one per normal
+	SAMPLE_SUM_AO = NUM_BUMP_VECTS + 1,
+};
+
+struct SSE_sampleLightVisibility_t
+{
+	ShadowRaySums_t	m_Sums;
+	fltx4			m_AOPossible;				// the most SAMPLE_SUM_AO can add up to
+	int				m_nSkySamples;				// sun rays, for emit_skylight
+	bool			m_bLit;						// false when the light can't reach the points at all
+	bool			m_bAO;
+};
+
 // Helper function - gathers light from sun (emit_skylight)
-void GatherSampleSkyLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int facenum,
+static void BeginSampleSkyLightSSE( SSE_sampleLightOutput_t &out, SSE_sampleLightVisibility_t &vis, directlight_t *dl, int facenum,
 							 FourVectors const& pos, FourVectors *pNormals, int normalCount, int iThread,
 							 int nLFlags, int static_prop_index_to_ignore,
 							 float flEpsilon )
@@ -1809,9 +1831,6 @@ void GatherSampleSkyLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, i
 			nsamples /= 4;
 	}
 
-	fltx4 totalFractionVisible = Four_Zeros;
-	fltx4 fractionVisible = Four_Zeros;
-
 	DirectionalSampler_t sampler;
 
 	for ( int d = 0; d < nsamples; d++ )
@@ -1831,15 +1850,14 @@ void GatherSampleSkyLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, i
 		delta4.DuplicateVector ( delta );
 		delta4 += pos;
 
-		TestLine_DoesHitSky ( pos, delta4, &fractionVisible, true, static_prop_index_to_ignore );
-
-		totalFractionVisible = AddSIMD ( totalFractionVisible, fractionVisible );
+		ShadowRay_AddVisible( vis.m_Sums, SAMPLE_SUM_VISIBLE, 1, NULL, SHADOW_RAY_DOES_HIT_SKY, pos, delta4, static_prop_index_to_ignore );
 	}
 
-	fltx4 seeAmount = MulSIMD ( totalFractionVisible, ReplicateX4 ( 1.0f / nsamples ) );
-	out.m_flDot[0] = MulSIMD ( dot, seeAmount );
+	// FinishSampleLightSSE scales these by how much of the sun is seen
+	vis.m_nSkySamples = nsamples;
+	vis.m_bLit = true;
+	out.m_flDot[0] = dot;
 	out.m_flFalloff = Four_Ones;
-	//out.m_flSunAmount = MulSIMD ( seeAmount, ReplicateX4( 10000.0f ) );
 	for ( int i = 1; i < normalCount; i++ )
 	{
 		if ( bIgnoreNormals )
@@ -1849,14 +1867,12 @@ void GatherSampleSkyLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, i
 			out.m_flDot[i] = NegSIMD( pNormals[i] * dl->light.normal );
 			out.m_flDot[i] = MaxSIMD( out.m_flDot[i], Four_Zeros );
 			out.m_flDot[i] = SoftenCosineTerm( out.m_flDot[i] );
-			out.m_flDot[i] = MulSIMD( out.m_flDot[i], seeAmount );
 		}
 	}
-	out.m_flSunAmount = MulSIMD( out.m_flDot[0], out.m_flFalloff );
 }
 
 // Helper function - gathers light from ambient sky light
-void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int facenum,
+static void BeginSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, SSE_sampleLightVisibility_t &vis, directlight_t *dl, int facenum,
 							   FourVectors const& pos, FourVectors *pNormals, int normalCount, int iThread,
 							   int nLFlags, int static_prop_index_to_ignore,
 							   float flEpsilon )
@@ -1866,13 +1882,11 @@ void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl,
 	bool force_fast = ( nLFlags & GATHERLFLAGS_FORCE_FAST ) != 0;
 
 	fltx4 sumdot = Four_Zeros;
-	fltx4 ambient_intensity[NUM_BUMP_VECTS+1];
 	fltx4 possibleHitCount[NUM_BUMP_VECTS+1];
 	fltx4 dots[NUM_BUMP_VECTS+1];
 
 	for ( int i = 0; i < normalCount; i++ )
 	{
-		ambient_intensity[i] = Four_Zeros;
 		possibleHitCount[i] = Four_Zeros;
 	}
 
@@ -1926,16 +1940,11 @@ void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl,
 		offset *= -flEpsilon;
 		surfacePos -= offset;
 
-		fltx4 fractionVisible = Four_Ones;
-		TestLine_DoesHitSky( surfacePos, delta, &fractionVisible, true, static_prop_index_to_ignore );
-		for ( int i = 0; i < normalCount; i++ )
-		{
-			fltx4 addedAmount = MulSIMD( fractionVisible, dots[i] );
-			ambient_intensity[i] = AddSIMD( ambient_intensity[i], addedAmount );
-		}
-
+		// adds up the ambient intensity for each normal
+		ShadowRay_AddVisible( vis.m_Sums, SAMPLE_SUM_VISIBLE, normalCount, dots, SHADOW_RAY_DOES_HIT_SKY, surfacePos, delta, static_prop_index_to_ignore );
 	}
 
+	vis.m_bLit = true;
 	out.m_flFalloff = Four_Ones;
 	for ( int i = 0; i < normalCount; i++ )
 	{
@@ -1944,13 +1953,12 @@ void GatherSampleAmbientSkySSE( SSE_sampleLightOutput_t &out, directlight_t *dl,
 		factor = MulSIMD( factor, possibleHitCount[i] );
 		out.m_flDot[i] = MulSIMD( factor, sumdot );
 		out.m_flDot[i] = ReciprocalSIMD( out.m_flDot[i] );
-		out.m_flDot[i] = MulSIMD( ambient_intensity[i], out.m_flDot[i] );
 	}
 	out.m_flSunAmount = Four_Zeros;
 }
 
 // Helper function - gathers light from area lights, spot lights, and point lights
-void GatherSampleStandardLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int facenum,
+static void BeginSampleStandardLightSSE( SSE_sampleLightOutput_t &out, SSE_sampleLightVisibility_t &vis, directlight_t *dl, int facenum,
 								  FourVectors const& pos, FourVectors *pNormals, int normalCount, int iThread,
 								  int nLFlags, int static_prop_index_to_ignore,
 								  float flEpsilon )
@@ -2089,9 +2097,8 @@ void GatherSampleStandardLightSSE( SSE_sampleLightOutput_t &out, directlight_t *
 	}
 
 	// Raytrace for visibility function
-	fltx4 fractionVisible = Four_Ones;
-	TestLine( pos, src, &fractionVisible, static_prop_index_to_ignore);
-	dot = MulSIMD( fractionVisible, dot );
+	ShadowRay_AddVisible( vis.m_Sums, SAMPLE_SUM_VISIBLE, 1, NULL, SHADOW_RAY_TESTLINE, pos, src, static_prop_index_to_ignore );
+	vis.m_bLit = true;
 	out.m_flDot[0] = dot;
 
 	for ( int i = 1; i < normalCount; i++ )
@@ -2107,17 +2114,12 @@ void GatherSampleStandardLightSSE( SSE_sampleLightOutput_t &out, directlight_t *
 	out.m_flSunAmount = Four_Zeros; //MulSIMD( out.m_flDot[0], out.m_flFalloff );
 }
 
-// returns dot product with normal and delta
-// dl - light
-// pos - position of sample
-// normal - surface normal of sample
-// out.m_flDot[] - returned dot products with light vector and each normal
-// out.m_flFalloff - amount of light falloff
-void GatherSampleLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int facenum,
-					   FourVectors const& pos, FourVectors *pNormals, int normalCount, int iThread,
-					   int nLFlags,
-					   int static_prop_index_to_ignore,
-					   float flEpsilon )
+// Starts gathering a light at 4 points. Works out everything but how much of the
+// light the points see, and adds the shadow rays for that to vis, which traces them
+// right away unless the thread is batching its shadow rays.
+static void BeginSampleLightSSE( SSE_sampleLightOutput_t &out, SSE_sampleLightVisibility_t &vis, directlight_t *dl, int facenum,
+								 FourVectors const& pos, FourVectors *pNormals, int normalCount, int iThread,
+								 int nLFlags = 0, int static_prop_index_to_ignore = -1, float flEpsilon = 0.0f )
 {
 	for ( int b = 0; b < normalCount; b++ )
 		out.m_flDot[b] = Four_Zeros;
@@ -2125,29 +2127,82 @@ void GatherSampleLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int
 	out.m_flSunAmount = Four_Zeros;
 	Assert( normalCount <= (NUM_BUMP_VECTS+1) );
 
+	for ( int i = 0; i < SHADOW_RAY_MAX_SUMS; i++ )
+		vis.m_Sums.m_Sums[i] = Four_Zeros;
+	vis.m_Sums.m_nRays = 0;
+	vis.m_nSkySamples = 1;
+	vis.m_bLit = false;
+	vis.m_bAO = false;
+
 	// skylights work fundamentally differently than normal lights
 	switch( dl->light.type )
 	{
 	case emit_skylight:
-		GatherSampleSkyLightSSE( out, dl, facenum, pos, pNormals, normalCount,
-		                         iThread, nLFlags, static_prop_index_to_ignore, flEpsilon );
+		BeginSampleSkyLightSSE( out, vis, dl, facenum, pos, pNormals, normalCount,
+		                        iThread, nLFlags, static_prop_index_to_ignore, flEpsilon );
 		break;
 	case emit_skyambient:
-		GatherSampleAmbientSkySSE( out, dl, facenum, pos, pNormals, normalCount,
-		                           iThread, nLFlags, static_prop_index_to_ignore, flEpsilon );
+		BeginSampleAmbientSkySSE( out, vis, dl, facenum, pos, pNormals, normalCount,
+		                          iThread, nLFlags, static_prop_index_to_ignore, flEpsilon );
 		break;
 	case emit_point:
 	case emit_surface:
 	case emit_spotlight:
-		GatherSampleStandardLightSSE( out, dl, facenum, pos, pNormals, normalCount,
-		                              iThread, nLFlags, static_prop_index_to_ignore, flEpsilon );
+		BeginSampleStandardLightSSE( out, vis, dl, facenum, pos, pNormals, normalCount,
+		                             iThread, nLFlags, static_prop_index_to_ignore, flEpsilon );
 		break;
 	default:
 		Error ("Bad dl->light.type");
 	}
 
+	// Nothing to occlude
+	if ( !vis.m_bLit )
+		return;
+
 	// Don't calculate ambient occlusion for objects that ignore normals for gathering light
-	fltx4 ao = ( nLFlags & GATHERLFLAGS_IGNORE_NORMALS ) == 0 ? CalculateAmbientOcclusion4( pos, *pNormals, static_prop_index_to_ignore ) : Four_Ones;
+	vis.m_bAO = !g_bNoAO && ( nLFlags & GATHERLFLAGS_IGNORE_NORMALS ) == 0;
+	if ( vis.m_bAO )
+	{
+		vis.m_AOPossible = AddAmbientOcclusionRays4( pos, *pNormals, static_prop_index_to_ignore, vis.m_Sums, SAMPLE_SUM_AO );
+	}
+}
+
+// Applies the visibility BeginSampleLightSSE's shadow rays added up to
+static void FinishSampleLightSSE( SSE_sampleLightOutput_t &out, SSE_sampleLightVisibility_t const &vis, directlight_t *dl,
+								  int normalCount, int nLFlags = 0 )
+{
+	if ( !vis.m_bLit )
+		return;
+
+	const fltx4 *pVisible = vis.m_Sums.m_Sums + SAMPLE_SUM_VISIBLE;
+	switch( dl->light.type )
+	{
+	case emit_skylight:
+		{
+			fltx4 seeAmount = MulSIMD ( pVisible[0], ReplicateX4 ( 1.0f / vis.m_nSkySamples ) );
+			out.m_flDot[0] = MulSIMD ( out.m_flDot[0], seeAmount );
+			if ( ( nLFlags & GATHERLFLAGS_IGNORE_NORMALS ) == 0 )
+			{
+				for ( int i = 1; i < normalCount; i++ )
+				{
+					out.m_flDot[i] = MulSIMD( out.m_flDot[i], seeAmount );
+				}
+			}
+			out.m_flSunAmount = MulSIMD( out.m_flDot[0], out.m_flFalloff );
+		}
+		break;
+	case emit_skyambient:
+		for ( int i = 0; i < normalCount; i++ )
+		{
+			out.m_flDot[i] = MulSIMD( pVisible[i], out.m_flDot[i] );
+		}
+		break;
+	default:
+		out.m_flDot[0] = MulSIMD( pVisible[0], out.m_flDot[0] );
+		break;
+	}
+
+	fltx4 ao = vis.m_bAO ? FinishAmbientOcclusion4( vis.m_Sums.m_Sums[SAMPLE_SUM_AO], vis.m_AOPossible ) : Four_Ones;
 
 	out.m_flSunAmount = MulSIMD( out.m_flSunAmount, ao );
 
@@ -2164,7 +2219,23 @@ void GatherSampleLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int
 		out.m_flDot[n] = AndSIMD( out.m_flDot[n], notZero );
 		out.m_flDot[n] = MulSIMD( out.m_flDot[n], ao );
 	}
+}
 
+// returns dot product with normal and delta
+// dl - light
+// pos - position of sample
+// normal - surface normal of sample
+// out.m_flDot[] - returned dot products with light vector and each normal
+// out.m_flFalloff - amount of light falloff
+void GatherSampleLightSSE( SSE_sampleLightOutput_t &out, directlight_t *dl, int facenum,
+					   FourVectors const& pos, FourVectors *pNormals, int normalCount, int iThread,
+					   int nLFlags,
+					   int static_prop_index_to_ignore,
+					   float flEpsilon )
+{
+	SSE_sampleLightVisibility_t vis;
+	BeginSampleLightSSE( out, vis, dl, facenum, pos, pNormals, normalCount, iThread, nLFlags, static_prop_index_to_ignore, flEpsilon );
+	FinishSampleLightSSE( out, vis, dl, normalCount, nLFlags );
 }
 
 /*
@@ -2604,82 +2675,168 @@ static void ComputeIlluminationPointAndNormalsSSE( lightinfo_t const& l, FourVec
 //-----------------------------------------------------------------------------
 // Iterates over all lights and computes lighting at up to 4 sample points
 //-----------------------------------------------------------------------------
-static void GatherSampleLightAt4Points( SSE_SampleInfo_t& info, int sampleIdx, int numSamples )
+static bool GetLightPVSMask( SSE_SampleInfo_t& info, directlight_t *dl, int numSamples, fltx4 &dotMask )
 {
-	SSE_sampleLightOutput_t out;
-
-	// Iterate over all direct lights and add them to the particular sample
-	for (directlight_t *dl = activelights; dl != NULL; dl = dl->next)
+	// is this lights cluster visible?
+	dotMask = Four_Zeros;
+	bool bVisible = false;
+	for( int s = 0; s < numSamples; s++ )
 	{
-		// is this lights cluster visible?
-		fltx4 dotMask = Four_Zeros;
-		bool skipLight = true;
-		for( int s = 0; s < numSamples; s++ )
+		if( PVSCheck( dl->pvs, info.m_Clusters[s] ) )
 		{
-			if( PVSCheck( dl->pvs, info.m_Clusters[s] ) )
-			{
-				dotMask = SetComponentSIMD( dotMask, s, 1.0f );
-				skipLight = false;
-			}
+			dotMask = SetComponentSIMD( dotMask, s, 1.0f );
+			bVisible = true;
 		}
-		if ( skipLight )
-			continue;
+	}
+	return bVisible;
+}
 
-		GatherSampleLightSSE( out, dl, info.m_FaceNum, info.m_Points, info.m_PointNormals, info.m_NormalCount, info.m_iThread );
+static void AddSampleLightAt4Points( SSE_SampleInfo_t& info, directlight_t *dl, SSE_sampleLightOutput_t const &out,
+									 fltx4 const &dotMask, FourVectors const &points, int sampleIdx, int numSamples )
+{
+	LightCullCounters_t &counters = g_LightCullCounters[info.m_iThread];
+	++counters.m_nEvaluated;
 
-		// Apply the PVS check filter and compute falloff x dot
-		fltx4 fxdot[NUM_BUMP_VECTS + 1];
-		skipLight = true;
-		for ( int b = 0; b < info.m_NormalCount; b++ )
+	// Apply the PVS check filter and compute falloff x dot
+	fltx4 fxdot[NUM_BUMP_VECTS + 1];
+	bool skipLight = true;
+	for ( int b = 0; b < info.m_NormalCount; b++ )
+	{
+		fxdot[b] = MulSIMD( out.m_flDot[b], dotMask );
+		fxdot[b] = MulSIMD( fxdot[b], out.m_flFalloff );
+		if ( !IsAllZeros( fxdot[b] ) )
 		{
-			fxdot[b] = MulSIMD( out.m_flDot[b], dotMask );
-			fxdot[b] = MulSIMD( fxdot[b], out.m_flFalloff );
-			if ( !IsAllZeros( fxdot[b] ) )
-			{
-				skipLight = false;
-			}
+			skipLight = false;
 		}
-		if ( skipLight )
-			continue;
+	}
+	if ( skipLight )
+		return;
 
-		// Figure out the lightstyle for this particular sample
-		int lightStyleIndex = FindOrAllocateLightstyleSamples( info.m_pFace, info.m_pFaceLight,
-			dl->light.style, info.m_NormalCount );
-		if (lightStyleIndex < 0)
+	++counters.m_nContributing;
+
+	// Figure out the lightstyle for this particular sample
+	int lightStyleIndex = FindOrAllocateLightstyleSamples( info.m_pFace, info.m_pFaceLight,
+		dl->light.style, info.m_NormalCount );
+	if (lightStyleIndex < 0)
+	{
+		if (info.m_WarnFace != info.m_FaceNum)
 		{
-			if (info.m_WarnFace != info.m_FaceNum)
-			{
-				Warning ("\nWARNING: Too many light styles on a face at (%f, %f, %f)\n",
-					info.m_Points.x.m128_f32[0], info.m_Points.y.m128_f32[0], info.m_Points.z.m128_f32[0] );
-				info.m_WarnFace = info.m_FaceNum;
-			}
-			continue;
+			Warning ("\nWARNING: Too many light styles on a face at (%f, %f, %f)\n",
+				points.x.m128_f32[0], points.y.m128_f32[0], points.z.m128_f32[0] );
+			info.m_WarnFace = info.m_FaceNum;
 		}
+		return;
+	}
 
-		// pLightmaps is an array of the lightmaps for each normal direction,
-		// here's where the result of the sample gathering goes
-		LightingValue_t** pLightmaps = info.m_pFaceLight->light[lightStyleIndex];
+	// pLightmaps is an array of the lightmaps for each normal direction,
+	// here's where the result of the sample gathering goes
+	LightingValue_t** pLightmaps = info.m_pFaceLight->light[lightStyleIndex];
 
-		// Incremental lighting only cares about lightstyle zero
-		if( g_pIncremental && (dl->light.style == 0) )
+	// Incremental lighting only cares about lightstyle zero
+	if( g_pIncremental && (dl->light.style == 0) )
+	{
+		for ( int i = 0; i < numSamples; i++ )
 		{
-			for ( int i = 0; i < numSamples; i++ )
-			{
-				g_pIncremental->AddLightToFace( dl->m_IncrementalID, info.m_FaceNum, sampleIdx + i,
-					info.m_LightmapSize, SubFloat( fxdot[0], i ), info.m_iThread );
-			}
+			g_pIncremental->AddLightToFace( dl->m_IncrementalID, info.m_FaceNum, sampleIdx + i,
+				info.m_LightmapSize, SubFloat( fxdot[0], i ), info.m_iThread );
 		}
+	}
 
-		for( int n = 0; n < info.m_NormalCount; ++n )
+	if ( g_bIncrementalLighting )
+	{
+		RelightCache_AddLightToFace( info.m_FaceNum, dl->index );
+	}
+
+	for( int n = 0; n < info.m_NormalCount; ++n )
+	{
+		for ( int i = 0; i < numSamples; i++ )
 		{
-			for ( int i = 0; i < numSamples; i++ )
-			{
-				pLightmaps[n][sampleIdx + i].AddLight( SubFloat( fxdot[n], i ), dl->light.intensity, SubFloat( out.m_flSunAmount, i ) );
-			}
+			pLightmaps[n][sampleIdx + i].AddLight( SubFloat( fxdot[n], i ), dl->light.intensity, SubFloat( out.m_flSunAmount, i ) );
 		}
 	}
 }
 
+static void GatherSampleLightAt4Points( SSE_SampleInfo_t& info, int sampleIdx, int numSamples )
+{
+	SSE_sampleLightOutput_t out;
+
+	// Iterate over the lights that can reach the face and add them to the particular sample
+	for ( int iLight = 0; iLight < info.m_nLights; ++iLight )
+	{
+		directlight_t *dl = info.m_ppLights[iLight];
+
+		fltx4 dotMask;
+		if ( !GetLightPVSMask( info, dl, numSamples, dotMask ) )
+			continue;
+
+		GatherSampleLightSSE( out, dl, info.m_FaceNum, info.m_Points, info.m_PointNormals, info.m_NormalCount, info.m_iThread );
+		AddSampleLightAt4Points( info, dl, out, dotMask, info.m_Points, sampleIdx, numSamples );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// The same with the shadow rays batched: the lights are gathered at a group of
+// points up to their shadow rays, which get traced later with the rest of the
+// batch, and then added to the lightmaps in the same order as above.
+//-----------------------------------------------------------------------------
+struct PendingSampleGroup_t
+{
+	FourVectors	m_Points;
+	int			m_nSample;
+	int			m_nSamples;
+};
+
+struct PendingSampleLight_t
+{
+	SSE_sampleLightOutput_t		m_Out;
+	SSE_sampleLightVisibility_t	m_Visibility;
+	fltx4						m_DotMask;
+	directlight_t				*m_pLight;
+	int							m_nGroup;
+};
+
+typedef CUtlVector< PendingSampleGroup_t, CUtlMemoryAligned< PendingSampleGroup_t, 16 > > PendingSampleGroupList_t;
+typedef CUtlVector< PendingSampleLight_t, CUtlMemoryAligned< PendingSampleLight_t, 16 > > PendingSampleLightList_t;
+
+static void BeginSampleLightAt4Points( SSE_SampleInfo_t& info, int sampleIdx, int numSamples,
+									   PendingSampleGroupList_t &groups, PendingSampleLightList_t &lights )
+{
+	int nGroup = groups.AddToTail();
+	groups[nGroup].m_Points = info.m_Points;
+	groups[nGroup].m_nSample = sampleIdx;
+	groups[nGroup].m_nSamples = numSamples;
+
+	for ( int iLight = 0; iLight < info.m_nLights; ++iLight )
+	{
+		directlight_t *dl = info.m_ppLights[iLight];
+
+		fltx4 dotMask;
+		if ( !GetLightPVSMask( info, dl, numSamples, dotMask ) )
+			continue;
+
+		PendingSampleLight_t &pending = lights[lights.AddToTail()];
+		pending.m_DotMask = dotMask;
+		pending.m_pLight = dl;
+		pending.m_nGroup = nGroup;
+
+		ShadowRays_SetBatchKey( iLight );
+		BeginSampleLightSSE( pending.m_Out, pending.m_Visibility, dl, info.m_FaceNum, info.m_Points, info.m_PointNormals, info.m_NormalCount, info.m_iThread );
+	}
+}
+
+static void FinishSampleLightAt4Points( SSE_SampleInfo_t& info, PendingSampleGroupList_t &groups, PendingSampleLightList_t &lights )
+{
+	for ( int i = 0; i < lights.Count(); ++i )
+	{
+		PendingSampleLight_t &pending = lights[i];
+		const PendingSampleGroup_t &group = groups[pending.m_nGroup];
+
+		ShadowRays_AddTracedVisible( pending.m_Visibility.m_Sums );
+		FinishSampleLightSSE( pending.m_Out, pending.m_Visibility, pending.m_pLight, info.m_NormalCount );
+		AddSampleLightAt4Points( info, pending.m_pLight, pending.m_Out, pending.m_DotMask, group.m_Points, group.m_nSample, group.m_nSamples );
+	}
+}
+
 
 
 //-----------------------------------------------------------------------------
@@ -2698,9 +2855,11 @@ static void ResampleLightAt4Points( SSE_SampleInfo_t& info, int lightStyleIndex,
 		}
 	}
 
-	// Iterate over all direct lights and add them to the particular sample
-	for (directlight_t *dl = activelights; dl != NULL; dl = dl->next)
+	// Iterate over the lights that can reach the face and add them to the particular sample
+	for ( int iLight = 0; iLight < info.m_nLights; ++iLight )
 	{
+		directlight_t *dl = info.m_ppLights[iLight];
+
 		if ((flags & AMBIENT_ONLY) && (dl->light.type != emit_skyambient))
 			continue;
 
@@ -2794,10 +2953,93 @@ bool PointsInWinding ( FourVectors const & point, winding_t *w, int &invalidBits
 }
 
 //-----------------------------------------------------------------------------
-// Perform supersampling at a particular point
+// Adaptive supersampling
+//
+// A luxel with a high gradient gets its ambient light supersampled on a 2x2
+// grid, and its direct light supersampled in rounds of 4 points on an 8x8 grid,
+// one point in each quarter of the luxel per round so that every round covers
+// the whole luxel. Each luxel gets SUPERSAMPLE_MIN_ROUNDS rounds, and the rest
+// of the face's budget goes, a round at a time, to the luxels whose mean still
+// has the largest error, which are the ones on shadow edges. A luxel stops
+// once the error of its mean is below g_flSupersampleContrast in perceptual
+// intensity, or after SUPERSAMPLE_MAX_ROUNDS rounds.
+//-----------------------------------------------------------------------------
+#define SUPERSAMPLE_GRID_SIZE	8
+#define SUPERSAMPLE_MIN_ROUNDS	2
+#define SUPERSAMPLE_MAX_ROUNDS	( SUPERSAMPLE_GRID_SIZE * SUPERSAMPLE_GRID_SIZE / 4 )
+
+// Order the points in a quarter of the luxel are visited in, x + 4 * y, so
+// that the first few rounds are spread out over it
+static const int s_SupersampleCellOrder[16] = { 0, 10, 2, 8, 5, 15, 7, 13, 1, 11, 3, 9, 4, 14, 6, 12 };
+
+struct SupersampleLuxel_t
+{
+	LightingValue_t	m_Direct[NUM_BUMP_VECTS+1];
+	LightingValue_t	m_Ambient[NUM_BUMP_VECTS+1];
+	int				m_nDirectSamples;
+	int				m_nAmbientSamples;
+	int				m_nRounds;
+
+	// Running mean and sum of squared differences of the perceptual intensity
+	// of the direct samples
+	float			m_flMean;
+	float			m_flM2;
+};
+
+struct SupersampleStats_t
+{
+	int64	m_nFaces;
+	int64	m_nLuxels;
+	int64	m_nSupersampledLuxels;
+	int64	m_nConvergedLuxels;				// stopped below the contrast threshold
+	int64	m_nDirectSamples;
+	int64	m_nAmbientSamples;
+	int64	m_nBudgetLimitedFaces;			// ran out of budget with luxels left to refine
+	char	m_Pad[8];						// keep each thread's stats on their own cache line
+};
+
+static SupersampleStats_t s_SupersampleStats[MAX_TOOL_THREADS+1];
+
+// Rays traced for each face by BuildFacelights, and how many of them were supersampling
+static int s_nFaceRays[MAX_MAP_FACES];
+static int s_nFaceSupersampleRays[MAX_MAP_FACES];
+
+static SupersampleStats_t &GetSupersampleStats()
+{
+	int iThread = GetCurrentThreadIndex();
+	return s_SupersampleStats[( iThread >= 0 ) ? iThread : THREADINDEX_MAIN];
+}
+
+static inline float PerceptualIntensity( float flIntensity )
+{
+	// convert to a linear perception space
+	return pow( flIntensity / 256.0, 1.0 / 2.2 );
+}
+
+//-----------------------------------------------------------------------------
+// Standard error of a luxel's direct light, or -1 when it needs no more samples
+//-----------------------------------------------------------------------------
+static float SupersampleError( const SupersampleLuxel_t &luxel )
+{
+	if ( luxel.m_nRounds >= SUPERSAMPLE_MAX_ROUNDS )
+		return -1.0f;
+
+	// Not enough samples landed inside the luxel to tell yet. If that's still
+	// so after the minimum rounds, the luxel is mostly outside its winding and
+	// more rounds would mostly miss it too.
+	if ( luxel.m_nDirectSamples < 2 )
+		return ( luxel.m_nRounds < SUPERSAMPLE_MIN_ROUNDS ) ? FLT_MAX : -1.0f;
+
+	float flVariance = luxel.m_flM2 / ( luxel.m_nDirectSamples - 1 );
+	float flError = sqrt( flVariance / luxel.m_nDirectSamples );
+	return ( flError < g_flSupersampleContrast ) ? -1.0f : flError;
+}
+
+//-----------------------------------------------------------------------------
+// Supersample the ambient light of a luxel
 //-----------------------------------------------------------------------------
-static int SupersampleLightAtPoint( lightinfo_t& l, SSE_SampleInfo_t& info,
-									int sampleIndex, int lightStyleIndex, LightingValue_t *pLight, int flags )
+static void SupersampleAmbientLight( lightinfo_t& l, SSE_SampleInfo_t& info,
+									 int sampleIndex, int lightStyleIndex, SupersampleLuxel_t &luxel )
 {
 	sample_t& sample = info.m_pFaceLight->sample[sampleIndex];
 
@@ -2806,104 +3048,113 @@ static int SupersampleLightAtPoint( lightinfo_t& l, SSE_SampleInfo_t& info,
 	WorldToLuxelSpace( &l, sample.pos, temp );
 	Vector sampleLightOrigin( temp[0], temp[1], 0.0f );
 
-	// Some parameters related to supersampling
-	float sampleWidth = ( flags & NON_AMBIENT_ONLY ) ? 4 : 2;
-	float cscale = 1.0f / sampleWidth;
-	float csshift = -((sampleWidth - 1) * cscale) / 2.0;
-
-	// Clear out the light values
-	for (int i = 0; i < info.m_NormalCount; ++i )
-		pLight[i].Zero();
-
-	int subsampleCount = 0;
+	float cscale = 0.5f;
+	float csshift = -0.25f;
 
 	FourVectors superSampleNormal;
 	superSampleNormal.DuplicateVector( sample.normal );
 
+	FourVectors superSampleOffsets;
+	superSampleOffsets.LoadAndSwizzle( Vector( csshift, csshift, 0 ), Vector( csshift, csshift + cscale, 0),
+									   Vector( csshift + cscale, csshift, 0 ), Vector( csshift + cscale, csshift + cscale, 0 ) );
 	FourVectors superSampleLightCoord;
-	FourVectors superSamplePosition;
-
-	if ( flags & NON_AMBIENT_ONLY )
-	{
-		float aRow[4];
-		for ( int coord = 0; coord < 4; ++coord )
-			aRow[coord] = csshift + coord * cscale;
-		fltx4 sseRow = LoadUnalignedSIMD( aRow );
-
-		for (int s = 0; s < 4; ++s)
-		{
-			// make sure the coordinate is inside of the sample's winding and when normalizing
-			// below use the number of samples used, not just numsamples and some of them
-			// will be skipped if they are not inside of the winding
-			superSampleLightCoord.DuplicateVector( sampleLightOrigin );
-			superSampleLightCoord.x = AddSIMD( superSampleLightCoord.x, ReplicateX4( aRow[s] ) );
-			superSampleLightCoord.y = AddSIMD( superSampleLightCoord.y, sseRow );
+	superSampleLightCoord.DuplicateVector( sampleLightOrigin );
+	superSampleLightCoord += superSampleOffsets;
 
-			// Figure out where the supersample exists in the world, and make sure
-			// it lies within the sample winding
-			LuxelSpaceToWorld( &l, superSampleLightCoord[0], superSampleLightCoord[1], superSamplePosition );
+	FourVectors superSamplePosition;
+	LuxelSpaceToWorld( &l, superSampleLightCoord[0], superSampleLightCoord[1], superSamplePosition );
 
-			// A winding should exist only if the sample wasn't a uniform luxel, or if g_bDumpPatches is true.
-			int invalidBits = 0;
-			if ( sample.w && !PointsInWinding( superSamplePosition, sample.w, invalidBits ) )
-				continue;
+	int invalidBits = 0;
+	if ( sample.w && !PointsInWinding( superSamplePosition, sample.w, invalidBits ) )
+		return;
 
-			// Compute the super-sample illumination point and normal
-			// We're assuming the flat normal is the same for all supersamples
-			ComputeIlluminationPointAndNormalsSSE( l, superSamplePosition, superSampleNormal, &info, 4 );
+	ComputeIlluminationPointAndNormalsSSE( l, superSamplePosition, superSampleNormal, &info, 4 );
 
-			// Resample the non-ambient light at this point...
-			LightingValue_t result[4][NUM_BUMP_VECTS+1];
-			ResampleLightAt4Points( info, lightStyleIndex, NON_AMBIENT_ONLY, result );
+	LightingValue_t result[4][NUM_BUMP_VECTS+1];
+	ResampleLightAt4Points( info, lightStyleIndex, AMBIENT_ONLY, result );
 
-			// Got more subsamples
-			for ( int i = 0; i < 4; i++ )
+	// Got more subsamples
+	for ( int i = 0; i < 4; i++ )
+	{
+		if ( !( ( invalidBits >> i ) & 0x1 ) )
+		{
+			for ( int n = 0; n < info.m_NormalCount; ++n )
 			{
-				if ( !( ( invalidBits >> i ) & 0x1 ) )
-				{
-					for ( int n = 0; n < info.m_NormalCount; ++n )
-					{
-						pLight[n].AddLight( result[i][n] );
-					}
-					++subsampleCount;
-				}
+				luxel.m_Ambient[n].AddLight( result[i][n] );
 			}
+			++luxel.m_nAmbientSamples;
 		}
 	}
-	else
+}
+
+//-----------------------------------------------------------------------------
+// Supersample the direct light of a luxel at the next round of points. Returns
+// the number of points traced, which is 0 when none are inside the winding.
+//-----------------------------------------------------------------------------
+static int SupersampleDirectLight( lightinfo_t& l, SSE_SampleInfo_t& info,
+									int sampleIndex, int lightStyleIndex, SupersampleLuxel_t &luxel )
+{
+	sample_t& sample = info.m_pFaceLight->sample[sampleIndex];
+
+	Vector2D temp;
+	WorldToLuxelSpace( &l, sample.pos, temp );
+	Vector sampleLightOrigin( temp[0], temp[1], 0.0f );
+
+	// One point in each quarter of the luxel
+	Vector offsets[4];
+	for ( int q = 0; q < 4; ++q )
 	{
-		FourVectors superSampleOffsets;
-		superSampleOffsets.LoadAndSwizzle( Vector( csshift, csshift, 0 ), Vector( csshift, csshift + cscale, 0),
-		                                   Vector( csshift + cscale, csshift, 0 ), Vector( csshift + cscale, csshift + cscale, 0 ) );
-		superSampleLightCoord.DuplicateVector( sampleLightOrigin );
-		superSampleLightCoord += superSampleOffsets;
+		int cell = s_SupersampleCellOrder[( luxel.m_nRounds + 4 * q ) & 15];
+		int x = ( q & 1 ) * ( SUPERSAMPLE_GRID_SIZE / 2 ) + ( cell & 3 );
+		int y = ( q >> 1 ) * ( SUPERSAMPLE_GRID_SIZE / 2 ) + ( cell >> 2 );
+		offsets[q].Init( ( x + 0.5f ) / SUPERSAMPLE_GRID_SIZE - 0.5f, ( y + 0.5f ) / SUPERSAMPLE_GRID_SIZE - 0.5f, 0.0f );
+	}
+	++luxel.m_nRounds;
+
+	FourVectors superSampleNormal;
+	superSampleNormal.DuplicateVector( sample.normal );
 
-		LuxelSpaceToWorld( &l, superSampleLightCoord[0], superSampleLightCoord[1], superSamplePosition );
+	FourVectors superSampleOffsets;
+	superSampleOffsets.LoadAndSwizzle( offsets[0], offsets[1], offsets[2], offsets[3] );
+	FourVectors superSampleLightCoord;
+	superSampleLightCoord.DuplicateVector( sampleLightOrigin );
+	superSampleLightCoord += superSampleOffsets;
+
+	// Figure out where the supersamples exist in the world, and make sure
+	// they lie within the sample winding
+	FourVectors superSamplePosition;
+	LuxelSpaceToWorld( &l, superSampleLightCoord[0], superSampleLightCoord[1], superSamplePosition );
 
-		int invalidBits = 0;
-		if ( sample.w && !PointsInWinding( superSamplePosition, sample.w, invalidBits ) )
-			return 0;
+	// A winding should exist only if the sample wasn't a uniform luxel, or if g_bDumpPatches is true.
+	int invalidBits = 0;
+	if ( sample.w && !PointsInWinding( superSamplePosition, sample.w, invalidBits ) )
+		return 0;
 
-		ComputeIlluminationPointAndNormalsSSE( l, superSamplePosition, superSampleNormal, &info, 4 );
+	// Compute the super-sample illumination point and normal
+	// We're assuming the flat normal is the same for all supersamples
+	ComputeIlluminationPointAndNormalsSSE( l, superSamplePosition, superSampleNormal, &info, 4 );
 
-		LightingValue_t result[4][NUM_BUMP_VECTS+1];
-		ResampleLightAt4Points( info, lightStyleIndex, AMBIENT_ONLY, result );
+	// Resample the non-ambient light at this point...
+	LightingValue_t result[4][NUM_BUMP_VECTS+1];
+	ResampleLightAt4Points( info, lightStyleIndex, NON_AMBIENT_ONLY, result );
+
+	for ( int i = 0; i < 4; i++ )
+	{
+		if ( ( invalidBits >> i ) & 0x1 )
+			continue;
 
-		// Got more subsamples
-		for ( int i = 0; i < 4; i++ )
+		for ( int n = 0; n < info.m_NormalCount; ++n )
 		{
-			if ( !( ( invalidBits >> i ) & 0x1 ) )
-			{
-				for ( int n = 0; n < info.m_NormalCount; ++n )
-				{
-					pLight[n].AddLight( result[i][n] );
-				}
-				++subsampleCount;
-			}
+			luxel.m_Direct[n].AddLight( result[i][n] );
 		}
-	}
+		++luxel.m_nDirectSamples;
 
-	return subsampleCount;
+		float flIntensity = PerceptualIntensity( result[i][0].Intensity() );
+		float flDelta = flIntensity - luxel.m_flMean;
+		luxel.m_flMean += flDelta / luxel.m_nDirectSamples;
+		luxel.m_flM2 += flDelta * ( flIntensity - luxel.m_flMean );
+	}
+	return 4;
 }
 
 
@@ -2978,13 +3229,47 @@ static void ComputeSampleIntensities( SSE_SampleInfo_t& info, LightingValue_t **
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Stores the supersampled light of a luxel back in the lightmap
+//-----------------------------------------------------------------------------
+static void ResolveSupersampledLuxel( SSE_SampleInfo_t& info, int sampleIndex, const SupersampleLuxel_t &luxel,
+									  LightingValue_t **ppLightSamples, float* pSampleIntensity )
+{
+	// Because of sampling problems, small area triangles may have no samples.
+	// In this case, just use what we already have
+	if ( luxel.m_nAmbientSamples == 0 || luxel.m_nDirectSamples == 0 )
+		return;
+
+	// Add the ambient + directional terms together, stick it back into the lightmap
+	for (int n = 0; n < info.m_NormalCount; ++n)
+	{
+		ppLightSamples[n][sampleIndex].Zero();
+		ppLightSamples[n][sampleIndex].AddWeighted( luxel.m_Direct[n], 1.0f / luxel.m_nDirectSamples );
+		ppLightSamples[n][sampleIndex].AddWeighted( luxel.m_Ambient[n], 1.0f / luxel.m_nAmbientSamples );
+	}
+
+	// Recompute the luxel intensity based on the supersampling
+	ComputeLuxelIntensity( info, sampleIndex, ppLightSamples, pSampleIntensity );
+}
+
+struct SupersampleQueueEntry_t
+{
+	int		m_nSample;
+	float	m_flError;
+};
+
+static bool SupersampleQueueLessFunc( SupersampleQueueEntry_t const &src1, SupersampleQueueEntry_t const &src2 )
+{
+	return src1.m_flError < src2.m_flError;
+}
+
 //-----------------------------------------------------------------------------
 // Perform supersampling on a particular lightstyle
 //-----------------------------------------------------------------------------
 static void BuildSupersampleFaceLights( lightinfo_t& l, SSE_SampleInfo_t& info, int lightstyleIndex )
 {
-	LightingValue_t pAmbientLight[NUM_BUMP_VECTS+1];
-	LightingValue_t pDirectLight[NUM_BUMP_VECTS+1];
+	SupersampleStats_t &stats = GetSupersampleStats();
+	int numsamples = info.m_pFaceLight->numsamples;
 
 	// This is used to make sure we don't supersample a light sample more than once
 	int processedSampleSize = info.m_LightmapSize * sizeof(bool);
@@ -2993,7 +3278,7 @@ static void BuildSupersampleFaceLights( lightinfo_t& l, SSE_SampleInfo_t& info,
 
 	// This is used to compute a simple gradient computation of the light samples
 	// We're going to store the maximum intensity of all bumped samples at each sample location
-	float* pGradient = (float*)stackalloc( info.m_pFaceLight->numsamples * sizeof(float) );
+	float* pGradient = (float*)stackalloc( numsamples * sizeof(float) );
 	float* pSampleIntensity = (float*)stackalloc( info.m_NormalCount * info.m_LightmapSize * sizeof(float) );
 
 	// Compute the maximum intensity of all lighting associated with this lightstyle
@@ -3001,10 +3286,15 @@ static void BuildSupersampleFaceLights( lightinfo_t& l, SSE_SampleInfo_t& info,
 	LightingValue_t **ppLightSamples = info.m_pFaceLight->light[lightstyleIndex];
 	ComputeSampleIntensities( info, ppLightSamples, pSampleIntensity );
 
+	// Supersampled light of the luxels that get supersampled
+	CUtlVector<SupersampleLuxel_t> luxels;
+	CUtlVector<int> supersampled;
+	int nTraced = 0;
+
 	Vector *pVisualizePass = NULL;
 	if (debug_extra)
 	{
-		int visualizationSize = info.m_pFaceLight->numsamples * sizeof(Vector);
+		int visualizationSize = numsamples * sizeof(Vector);
 		pVisualizePass = (Vector*)stackalloc( visualizationSize );
 		memset( pVisualizePass, 0, visualizationSize );
 	}
@@ -3026,7 +3316,7 @@ static void BuildSupersampleFaceLights( lightinfo_t& l, SSE_SampleInfo_t& info,
 
 		// Now check all of the samples and supersample those which we have
 		// marked as having high gradients
-		for (int i=0 ; i<info.m_pFaceLight->numsamples; ++i)
+		for (int i=0 ; i<numsamples; ++i)
 		{
 			// Don't supersample the same sample twice
 			if (pHasProcessedSample[i])
@@ -3050,39 +3340,81 @@ static void BuildSupersampleFaceLights( lightinfo_t& l, SSE_SampleInfo_t& info,
 				pVisualizePass[i][2] = (pass & 4) * 64;
 			}
 
-			// Supersample the ambient light for each bump direction vector
-			int ambientSupersampleCount = SupersampleLightAtPoint( l, info, i, lightstyleIndex, pAmbientLight, AMBIENT_ONLY );
+			SupersampleLuxel_t &luxel = luxels[luxels.AddToTail()];
+			memset( &luxel, 0, sizeof(luxel) );
+			supersampled.AddToTail( i );
 
-			// Supersample the non-ambient light for each bump direction vector
-			int directSupersampleCount = SupersampleLightAtPoint( l, info, i, lightstyleIndex, pDirectLight, NON_AMBIENT_ONLY );
+			// Supersample the ambient light for each bump direction vector
+			SupersampleAmbientLight( l, info, i, lightstyleIndex, luxel );
 
-			// Because of sampling problems, small area triangles may have no samples.
-			// In this case, just use what we already have
-			if ( ambientSupersampleCount > 0 && directSupersampleCount > 0 )
+			// Supersample the non-ambient light for each bump direction vector,
+			// enough to get an idea of how much it varies over the luxel
+			for ( int round = 0; round < SUPERSAMPLE_MIN_ROUNDS; ++round )
 			{
-				// Add the ambient + directional terms together, stick it back into the lightmap
-				for (int n = 0; n < info.m_NormalCount; ++n)
-				{
-					ppLightSamples[n][i].Zero();
-					ppLightSamples[n][i].AddWeighted( pDirectLight[n],1.0f / directSupersampleCount );
-					ppLightSamples[n][i].AddWeighted( pAmbientLight[n], 1.0f / ambientSupersampleCount );
-				}
-
-				// Recompute the luxel intensity based on the supersampling
-				ComputeLuxelIntensity( info, i, ppLightSamples, pSampleIntensity );
+				nTraced += SupersampleDirectLight( l, info, i, lightstyleIndex, luxel );
 			}
 
+			ResolveSupersampledLuxel( info, i, luxel, ppLightSamples, pSampleIntensity );
 		}
 
 		// We've finished another pass
 		pass++;
 	}
 
+	// Spend the rest of the budget on the luxels whose light is least certain
+	int nBudget = (int)( g_flSupersampleBudget * luxels.Count() ) - nTraced;
+	CUtlPriorityQueue<SupersampleQueueEntry_t> queue( 0, luxels.Count(), SupersampleQueueLessFunc );
+	for ( int i = 0; i < luxels.Count(); ++i )
+	{
+		SupersampleQueueEntry_t entry;
+		entry.m_nSample = i;
+		entry.m_flError = SupersampleError( luxels[i] );
+		if ( entry.m_flError >= 0.0f )
+		{
+			queue.Insert( entry );
+		}
+	}
+
+	while ( nBudget >= 4 && queue.Count() )
+	{
+		SupersampleQueueEntry_t entry = queue.ElementAtHead();
+		queue.RemoveAtHead();
+
+		nBudget -= SupersampleDirectLight( l, info, supersampled[entry.m_nSample], lightstyleIndex, luxels[entry.m_nSample] );
+
+		entry.m_flError = SupersampleError( luxels[entry.m_nSample] );
+		if ( entry.m_flError >= 0.0f )
+		{
+			queue.Insert( entry );
+		}
+	}
+
+	for ( int i = 0; i < luxels.Count(); ++i )
+	{
+		const SupersampleLuxel_t &luxel = luxels[i];
+		ResolveSupersampledLuxel( info, supersampled[i], luxel, ppLightSamples, pSampleIntensity );
+
+		stats.m_nDirectSamples += luxel.m_nDirectSamples;
+		stats.m_nAmbientSamples += luxel.m_nAmbientSamples;
+		if ( luxel.m_nRounds < SUPERSAMPLE_MAX_ROUNDS && luxel.m_nDirectSamples >= 2 && SupersampleError( luxel ) < 0.0f )
+		{
+			++stats.m_nConvergedLuxels;
+		}
+	}
+
+	++stats.m_nFaces;
+	stats.m_nLuxels += numsamples;
+	stats.m_nSupersampledLuxels += luxels.Count();
+	if ( queue.Count() )
+	{
+		++stats.m_nBudgetLimitedFaces;
+	}
+
 	if (debug_extra)
 	{
 		// Copy colors representing which supersample pass the sample was messed with
 		// into the actual lighting values so we can visualize it
-		for (int i=0 ; i<info.m_pFaceLight->numsamples ; ++i)
+		for (int i=0 ; i<numsamples ; ++i)
 		{
 			for (int j = 0; j <info.m_NormalCount; ++j)
 			{
@@ -3092,6 +3424,83 @@ static void BuildSupersampleFaceLights( lightinfo_t& l, SSE_SampleInfo_t& info,
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Prints how many rays the faces took and how supersampling spent its budget,
+// and adds them to the current profile stage. Clears them for the next run.
+//-----------------------------------------------------------------------------
+static int __cdecl CompareFaceRays( const int *pA, const int *pB )
+{
+	return *pA - *pB;
+}
+
+void ReportSupersampleStats()
+{
+	SupersampleStats_t total;
+	memset( &total, 0, sizeof(total) );
+	for ( int i = 0; i <= MAX_TOOL_THREADS; ++i )
+	{
+		const SupersampleStats_t &stats = s_SupersampleStats[i];
+		total.m_nFaces += stats.m_nFaces;
+		total.m_nLuxels += stats.m_nLuxels;
+		total.m_nSupersampledLuxels += stats.m_nSupersampledLuxels;
+		total.m_nConvergedLuxels += stats.m_nConvergedLuxels;
+		total.m_nDirectSamples += stats.m_nDirectSamples;
+		total.m_nAmbientSamples += stats.m_nAmbientSamples;
+		total.m_nBudgetLimitedFaces += stats.m_nBudgetLimitedFaces;
+	}
+	memset( s_SupersampleStats, 0, sizeof(s_SupersampleStats) );
+
+	CUtlVector<int> faceRays;
+	int64 nRays = 0;
+	int64 nSupersampleRays = 0;
+	for ( int i = 0; i < numfaces; ++i )
+	{
+		if ( s_nFaceRays[i] == 0 )
+			continue;
+
+		faceRays.AddToTail( s_nFaceRays[i] );
+		nRays += s_nFaceRays[i];
+		nSupersampleRays += s_nFaceSupersampleRays[i];
+	}
+	memset( s_nFaceRays, 0, sizeof(s_nFaceRays) );
+	memset( s_nFaceSupersampleRays, 0, sizeof(s_nFaceSupersampleRays) );
+
+	// Nothing was lit here, the workers did it
+	if ( faceRays.Count() == 0 )
+		return;
+
+	faceRays.Sort( CompareFaceRays );
+	int nMedian = faceRays[faceRays.Count() / 2];
+	int n90th = faceRays[( faceRays.Count() * 9 ) / 10];
+	int nMax = faceRays.Tail();
+	double flMean = (double)nRays / faceRays.Count();
+
+	Msg( "Rays per face: %.1f mean, %d median, %d 90th percentile, %d max (%d faces)\n",
+		flMean, nMedian, n90th, nMax, faceRays.Count() );
+
+	VRadProfile_SetValue( "faces_lit", faceRays.Count() );
+	VRadProfile_SetValue( "rays_per_face_mean", flMean );
+	VRadProfile_SetValue( "rays_per_face_median", nMedian );
+	VRadProfile_SetValue( "rays_per_face_90th", n90th );
+	VRadProfile_SetValue( "rays_per_face_max", nMax );
+
+	if ( total.m_nFaces == 0 )
+		return;
+
+	double flSupersampleShare = nRays ? (double)nSupersampleRays / nRays : 0.0;
+	double flSamplesPerLuxel = total.m_nSupersampledLuxels ? (double)total.m_nDirectSamples / total.m_nSupersampledLuxels : 0.0;
+	Msg( "Supersampling: %d of %d luxels, %.1f direct samples each, %d converged, %d faces out of budget, %.0f%% of rays\n",
+		(int)total.m_nSupersampledLuxels, (int)total.m_nLuxels, flSamplesPerLuxel, (int)total.m_nConvergedLuxels,
+		(int)total.m_nBudgetLimitedFaces, flSupersampleShare * 100.0 );
+
+	VRadProfile_SetValue( "supersampled_luxels", (double)total.m_nSupersampledLuxels );
+	VRadProfile_SetValue( "supersample_converged_luxels", (double)total.m_nConvergedLuxels );
+	VRadProfile_SetValue( "supersample_direct_samples", (double)total.m_nDirectSamples );
+	VRadProfile_SetValue( "supersample_ambient_samples", (double)total.m_nAmbientSamples );
+	VRadProfile_SetValue( "supersample_budget_limited_faces", (double)total.m_nBudgetLimitedFaces );
+	VRadProfile_SetValue( "supersample_ray_share", flSupersampleShare );
+}
+
 void InitLightinfo( lightinfo_t *pl, int facenum )
 {
 	dface_t		*f;
@@ -3172,6 +3581,41 @@ static void InitSampleInfo( lightinfo_t const& l, int iThread, SSE_SampleInfo_t&
 	}
 }
 
+//-----------------------------------------------------------------------------
+// Shadow ray packets a face records before they get traced, with -batchrays
+//-----------------------------------------------------------------------------
+#define SHADOW_RAY_BATCH_PACKETS	2048
+
+//-----------------------------------------------------------------------------
+// Finds the lights that can reach any of the points a face gets lit at
+//-----------------------------------------------------------------------------
+static void GetFaceLights( lightinfo_t& l, SSE_SampleInfo_t& info, CUtlVector<directlight_t*> &lights )
+{
+	Vector mins, maxs;
+	ClearBounds( mins, maxs );
+
+	facelight_t *fl = info.m_pFaceLight;
+	for ( int i = 0; i < fl->numsamples; ++i )
+	{
+		AddPointToBounds( fl->sample[i].pos, mins, maxs );
+	}
+
+	// Supersamples can be anywhere on the face
+	if ( !info.m_IsDispFace )
+	{
+		winding_t *w = WindingFromFace( l.face, l.modelorg );
+		for ( int i = 0; i < w->numpoints; ++i )
+		{
+			AddPointToBounds( w->p[i], mins, maxs );
+		}
+		FreeWinding( w );
+	}
+
+	// The points get moved a unit off the face before they're lit
+	Vector vecBloat( 2.0f, 2.0f, 2.0f );
+	LightCull_GetLightsInBox( mins - vecBloat, maxs + vecBloat, lights );
+}
+
 void BuildFacelights (int iThread, int facenum)
 {
 	lightinfo_t	l;
@@ -3214,11 +3658,20 @@ void BuildFacelights (int iThread, int facenum)
 		return;
 
 	fl = &facelight[facenum];
+	int64 nStartRays = VRadProfile_GetThreadRays();
 
 	InitLightinfo( &l, facenum );
 	CalcPoints( &l, fl, facenum );
 	InitSampleInfo( l, iThread, sampleInfo );
 
+	// Only gather the lights that can reach the face
+	CUtlVector<directlight_t*> faceLights;
+	GetFaceLights( l, sampleInfo, faceLights );
+	sampleInfo.m_ppLights = faceLights.Base();
+	sampleInfo.m_nLights = faceLights.Count();
+	++g_LightCullCounters[iThread].m_nFaces;
+	g_LightCullCounters[iThread].m_nFaceLights += faceLights.Count();
+
 	// Allocate sample positions/normals to SSE
 	int numGroups = ( fl->numsamples & 0x3) ? ( fl->numsamples / 4 ) + 1 : ( fl->numsamples / 4 );
 
@@ -3226,7 +3679,11 @@ void BuildFacelights (int iThread, int facenum)
 	f->styles[0] = 0;
 	AllocateLightstyleSamples( fl, 0, sampleInfo.m_NormalCount );
 
-	// sample the lights at each sample location
+	// sample the lights at each sample location. With -batchrays the groups are
+	// gathered until they have enough shadow rays, which are then traced together
+	// and the groups finished.
+	PendingSampleGroupList_t pendingGroups;
+	PendingSampleLightList_t pendingLights;
 	for ( int grp = 0; grp < numGroups; ++grp )
 	{
 		int nSample = 4 * grp;
@@ -3254,8 +3711,27 @@ void BuildFacelights (int iThread, int facenum)
 				sample[k].normal = sampleInfo.m_PointNormals[0].Vec( k );
 		}
 
-		// Iterate over all the lights and add their contribution to this group of spots
-		GatherSampleLightAt4Points( sampleInfo, nSample, numSamples );
+		if ( !g_bBatchShadowRays )
+		{
+			// Iterate over all the lights and add their contribution to this group of spots
+			GatherSampleLightAt4Points( sampleInfo, nSample, numSamples );
+			continue;
+		}
+
+		if ( !pendingGroups.Count() )
+		{
+			ShadowRays_BeginRecord();
+		}
+		BeginSampleLightAt4Points( sampleInfo, nSample, numSamples, pendingGroups, pendingLights );
+
+		if ( grp == numGroups - 1 || ShadowRays_GetRecordedCount() >= SHADOW_RAY_BATCH_PACKETS )
+		{
+			ShadowRays_Flush();
+			FinishSampleLightAt4Points( sampleInfo, pendingGroups, pendingLights );
+			ShadowRays_End();
+			pendingGroups.RemoveAll();
+			pendingLights.RemoveAll();
+		}
 	}
 
 	// Tell the incremental light manager that we're done with this face.
@@ -3276,6 +3752,8 @@ void BuildFacelights (int iThread, int facenum)
 	// get rid of the -extra functionality on displacement surfaces
 	if (do_extra && !sampleInfo.m_IsDispFace)
 	{
+		int64 nSupersampleStartRays = VRadProfile_GetThreadRays();
+
 		// For each lightstyle, perform a supersampling pass
 		for ( int i = 0; i < MAXLIGHTMAPS; ++i )
 		{
@@ -3285,8 +3763,12 @@ void BuildFacelights (int iThread, int facenum)
 
 			BuildSupersampleFaceLights( l, sampleInfo, i );
 		}
+
+		s_nFaceSupersampleRays[facenum] = (int)( VRadProfile_GetThreadRays() - nSupersampleStartRays );
 	}
 
+	s_nFaceRays[facenum] = (int)( VRadProfile_GetThreadRays() - nStartRays );
+
 	if (!g_bUseMPI)
 	{
 		//
@@ -127,6 +127,8 @@ struct SSE_SampleInfo_t
 	int          m_NumSamples;
 	int          m_NumSampleGroups;
 	int	        m_Clusters[4];
+	directlight_t **m_ppLights;				// the lights that can reach the face
+	int			m_nLights;
 	FourVectors	m_Points;
 	FourVectors	m_PointNormals[ NUM_BUMP_VECTS + 1 ];
 };
@@ -0,0 +1,778 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Lightmap atlas packer. See lightmappacker.h.
+//
+//=============================================================================//
+
+#include "vrad.h"
+#include "lightmappacker.h"
+#include "imagepacker.h"
+
+
+const char *LightmapPackHeuristicName( LightmapPackHeuristic_t heuristic )
+{
+	switch ( heuristic )
+	{
+	case LIGHTMAP_PACK_SKYLINE_BOTTOM_LEFT:	return "skyline bottom-left";
+	case LIGHTMAP_PACK_SKYLINE_MIN_WASTE:	return "skyline min waste";
+	case LIGHTMAP_PACK_MAXRECTS_SHORT_SIDE:	return "maxrects short side";
+	case LIGHTMAP_PACK_MAXRECTS_AREA:		return "maxrects area";
+	}
+	return "unknown";
+}
+
+
+CLightmapPacker::CLightmapPacker()
+{
+	Reset( 0, 0, LIGHTMAP_PACK_SKYLINE_BOTTOM_LEFT );
+}
+
+void CLightmapPacker::Reset( int nWidth, int nHeight, LightmapPackHeuristic_t heuristic )
+{
+	m_Heuristic = heuristic;
+	m_nWidth = nWidth;
+	m_nHeight = nHeight;
+	m_nAreaUsed = 0;
+	m_nMinimumHeight = 0;
+	m_nFailedWidth = nWidth + 1;
+	m_nFailedHeight = nHeight + 1;
+
+	m_Skyline.RemoveAll();
+	m_FreeRects.RemoveAll();
+	if ( nWidth <= 0 || nHeight <= 0 )
+		return;
+
+	if ( heuristic == LIGHTMAP_PACK_SKYLINE_BOTTOM_LEFT || heuristic == LIGHTMAP_PACK_SKYLINE_MIN_WASTE )
+	{
+		SkylineNode_t &node = m_Skyline[m_Skyline.AddToTail()];
+		node.m_nX = 0;
+		node.m_nY = 0;
+		node.m_nWidth = nWidth;
+	}
+	else
+	{
+		PackRect_t &rect = m_FreeRects[m_FreeRects.AddToTail()];
+		rect.m_nX = 0;
+		rect.m_nY = 0;
+		rect.m_nWidth = nWidth;
+		rect.m_nHeight = nHeight;
+	}
+}
+
+bool CLightmapPacker::AddBlock( int nWidth, int nHeight, int *pX, int *pY )
+{
+	if ( nWidth <= 0 || nHeight <= 0 )
+		return false;
+
+	// If a block this big couldn't fit, a bigger one won't either
+	if ( nWidth >= m_nFailedWidth && nHeight >= m_nFailedHeight )
+		return false;
+
+	bool bFit;
+	if ( m_Skyline.Count() )
+	{
+		bFit = SkylineAddBlock( nWidth, nHeight, pX, pY );
+	}
+	else
+	{
+		bFit = MaxRectsAddBlock( nWidth, nHeight, pX, pY );
+	}
+
+	if ( !bFit )
+	{
+		// Only remember it if both sides are smaller; a 1x10 block failing
+		// doesn't mean a 10x1 block will
+		if ( nWidth <= m_nFailedWidth && nHeight <= m_nFailedHeight )
+		{
+			m_nFailedWidth = nWidth;
+			m_nFailedHeight = nHeight;
+		}
+		return false;
+	}
+
+	m_nAreaUsed += nWidth * nHeight;
+	m_nMinimumHeight = MAX( m_nMinimumHeight, *pY + nHeight );
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Where a block would go if its left edge was at the start of skyline node
+// iNode, and how much area it would leave empty under it
+//-----------------------------------------------------------------------------
+bool CLightmapPacker::SkylineFit( int iNode, int nWidth, int nHeight, int *pY, int *pWaste ) const
+{
+	int x = m_Skyline[iNode].m_nX;
+	if ( x + nWidth > m_nWidth )
+		return false;
+
+	// The block rests on the highest node under it
+	int y = 0;
+	int nWidthLeft = nWidth;
+	for ( int i = iNode; nWidthLeft > 0; ++i )
+	{
+		y = MAX( y, m_Skyline[i].m_nY );
+		if ( y + nHeight > m_nHeight )
+			return false;
+		nWidthLeft -= m_Skyline[i].m_nWidth;
+	}
+
+	int nWaste = 0;
+	nWidthLeft = nWidth;
+	for ( int i = iNode; nWidthLeft > 0; ++i )
+	{
+		int nCovered = MIN( nWidthLeft, m_Skyline[i].m_nWidth );
+		nWaste += ( y - m_Skyline[i].m_nY ) * nCovered;
+		nWidthLeft -= nCovered;
+	}
+
+	*pY = y;
+	*pWaste = nWaste;
+	return true;
+}
+
+bool CLightmapPacker::SkylineAddBlock( int nWidth, int nHeight, int *pX, int *pY )
+{
+	int iBest = -1;
+	int nBestTop = INT_MAX;
+	int nBestSecondary = INT_MAX;
+	int nBestY = 0;
+	for ( int i = 0; i < m_Skyline.Count(); ++i )
+	{
+		int y, nWaste;
+		if ( !SkylineFit( i, nWidth, nHeight, &y, &nWaste ) )
+			continue;
+
+		int nTop = y + nHeight;
+		bool bBetter;
+		if ( m_Heuristic == LIGHTMAP_PACK_SKYLINE_MIN_WASTE )
+		{
+			bBetter = ( nWaste < nBestSecondary ) || ( nWaste == nBestSecondary && nTop < nBestTop );
+			if ( bBetter )
+			{
+				nBestSecondary = nWaste;
+			}
+		}
+		else
+		{
+			bBetter = ( nTop < nBestTop ) || ( nTop == nBestTop && m_Skyline[i].m_nWidth < nBestSecondary );
+			if ( bBetter )
+			{
+				nBestSecondary = m_Skyline[i].m_nWidth;
+			}
+		}
+
+		if ( bBetter )
+		{
+			iBest = i;
+			nBestTop = nTop;
+			nBestY = y;
+		}
+	}
+
+	if ( iBest == -1 )
+		return false;
+
+	*pX = m_Skyline[iBest].m_nX;
+	*pY = nBestY;
+
+	// The block's top becomes a new node, and covers up the ones under it
+	SkylineNode_t node;
+	node.m_nX = *pX;
+	node.m_nY = nBestY + nHeight;
+	node.m_nWidth = nWidth;
+	m_Skyline.InsertBefore( iBest, node );
+
+	int nRight = node.m_nX + node.m_nWidth;
+	for ( int i = iBest + 1; i < m_Skyline.Count(); )
+	{
+		SkylineNode_t &next = m_Skyline[i];
+		if ( next.m_nX >= nRight )
+			break;
+
+		int nOverlap = nRight - next.m_nX;
+		if ( nOverlap >= next.m_nWidth )
+		{
+			m_Skyline.Remove( i );
+			continue;
+		}
+
+		next.m_nX += nOverlap;
+		next.m_nWidth -= nOverlap;
+		break;
+	}
+
+	// Merge neighbours at the same height
+	for ( int i = 0; i < m_Skyline.Count() - 1; )
+	{
+		if ( m_Skyline[i].m_nY == m_Skyline[i + 1].m_nY )
+		{
+			m_Skyline[i].m_nWidth += m_Skyline[i + 1].m_nWidth;
+			m_Skyline.Remove( i + 1 );
+			continue;
+		}
+		++i;
+	}
+
+	return true;
+}
+
+
+bool CLightmapPacker::MaxRectsAddBlock( int nWidth, int nHeight, int *pX, int *pY )
+{
+	int iBest = -1;
+	int nBestPrimary = INT_MAX;
+	int nBestSecondary = INT_MAX;
+	for ( int i = 0; i < m_FreeRects.Count(); ++i )
+	{
+		const PackRect_t &rect = m_FreeRects[i];
+		if ( rect.m_nWidth < nWidth || rect.m_nHeight < nHeight )
+			continue;
+
+		int nLeftoverX = rect.m_nWidth - nWidth;
+		int nLeftoverY = rect.m_nHeight - nHeight;
+		int nShortSide = MIN( nLeftoverX, nLeftoverY );
+		int nLongSide = MAX( nLeftoverX, nLeftoverY );
+
+		int nPrimary, nSecondary;
+		if ( m_Heuristic == LIGHTMAP_PACK_MAXRECTS_AREA )
+		{
+			nPrimary = rect.m_nWidth * rect.m_nHeight - nWidth * nHeight;
+			nSecondary = nShortSide;
+		}
+		else
+		{
+			nPrimary = nShortSide;
+			nSecondary = nLongSide;
+		}
+
+		if ( nPrimary < nBestPrimary || ( nPrimary == nBestPrimary && nSecondary < nBestSecondary ) )
+		{
+			iBest = i;
+			nBestPrimary = nPrimary;
+			nBestSecondary = nSecondary;
+		}
+	}
+
+	if ( iBest == -1 )
+		return false;
+
+	PackRect_t used;
+	used.m_nX = m_FreeRects[iBest].m_nX;
+	used.m_nY = m_FreeRects[iBest].m_nY;
+	used.m_nWidth = nWidth;
+	used.m_nHeight = nHeight;
+
+	MaxRectsSplit( used );
+	MaxRectsPrune();
+
+	*pX = used.m_nX;
+	*pY = used.m_nY;
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Replaces each free rectangle that overlaps the block with the up to four
+// maximal rectangles around it
+//-----------------------------------------------------------------------------
+void CLightmapPacker::MaxRectsSplit( const PackRect_t &used )
+{
+	int nCount = m_FreeRects.Count();
+	for ( int i = 0; i < nCount; )
+	{
+		PackRect_t rect = m_FreeRects[i];
+		if ( used.m_nX >= rect.m_nX + rect.m_nWidth || used.m_nX + used.m_nWidth <= rect.m_nX ||
+			 used.m_nY >= rect.m_nY + rect.m_nHeight || used.m_nY + used.m_nHeight <= rect.m_nY )
+		{
+			++i;
+			continue;
+		}
+
+		if ( used.m_nX > rect.m_nX )
+		{
+			PackRect_t &left = m_FreeRects[m_FreeRects.AddToTail()];
+			left = rect;
+			left.m_nWidth = used.m_nX - rect.m_nX;
+		}
+		if ( used.m_nX + used.m_nWidth < rect.m_nX + rect.m_nWidth )
+		{
+			PackRect_t &right = m_FreeRects[m_FreeRects.AddToTail()];
+			right = rect;
+			right.m_nX = used.m_nX + used.m_nWidth;
+			right.m_nWidth = rect.m_nX + rect.m_nWidth - right.m_nX;
+		}
+		if ( used.m_nY > rect.m_nY )
+		{
+			PackRect_t &below = m_FreeRects[m_FreeRects.AddToTail()];
+			below = rect;
+			below.m_nHeight = used.m_nY - rect.m_nY;
+		}
+		if ( used.m_nY + used.m_nHeight < rect.m_nY + rect.m_nHeight )
+		{
+			PackRect_t &above = m_FreeRects[m_FreeRects.AddToTail()];
+			above = rect;
+			above.m_nY = used.m_nY + used.m_nHeight;
+			above.m_nHeight = rect.m_nY + rect.m_nHeight - above.m_nY;
+		}
+
+		// Move the last of the old rectangles into this slot
+		m_FreeRects[i] = m_FreeRects[nCount - 1];
+		m_FreeRects.Remove( nCount - 1 );
+		--nCount;
+	}
+}
+
+static inline bool IsRectInside( int x, int y, int w, int h, int ox, int oy, int ow, int oh )
+{
+	return x >= ox && y >= oy && x + w <= ox + ow && y + h <= oy + oh;
+}
+
+//-----------------------------------------------------------------------------
+// Removes free rectangles that are inside another one
+//-----------------------------------------------------------------------------
+void CLightmapPacker::MaxRectsPrune()
+{
+	for ( int i = 0; i < m_FreeRects.Count(); ++i )
+	{
+		for ( int j = i + 1; j < m_FreeRects.Count(); )
+		{
+			const PackRect_t &a = m_FreeRects[i];
+			const PackRect_t &b = m_FreeRects[j];
+			if ( IsRectInside( a.m_nX, a.m_nY, a.m_nWidth, a.m_nHeight, b.m_nX, b.m_nY, b.m_nWidth, b.m_nHeight ) )
+			{
+				m_FreeRects.FastRemove( i );
+				--i;
+				break;
+			}
+			if ( IsRectInside( b.m_nX, b.m_nY, b.m_nWidth, b.m_nHeight, a.m_nX, a.m_nY, a.m_nWidth, a.m_nHeight ) )
+			{
+				m_FreeRects.FastRemove( j );
+				continue;
+			}
+			++j;
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Packing lists of blocks
+//-----------------------------------------------------------------------------
+struct PackOrder_t
+{
+	int		m_nGroup;
+	int		m_nHeight;
+	int		m_nWidth;
+	int		m_nBlock;
+};
+
+static int __cdecl ComparePackOrder( const PackOrder_t *pA, const PackOrder_t *pB )
+{
+	if ( pA->m_nGroup != pB->m_nGroup )
+		return pA->m_nGroup - pB->m_nGroup;
+	if ( pA->m_nHeight != pB->m_nHeight )
+		return pB->m_nHeight - pA->m_nHeight;
+	if ( pA->m_nWidth != pB->m_nWidth )
+		return pB->m_nWidth - pA->m_nWidth;
+	return pA->m_nBlock - pB->m_nBlock;
+}
+
+static int PackBlockList( LightmapPackBlock_t *pBlocks, const int *pIndices, int nIndices, int nPageWidth, int nPageHeight,
+						  LightmapPackHeuristic_t heuristic, LightmapPackStats_t *pStats )
+{
+	// Tallest first, so each row of blocks wastes little above the shorter ones
+	CUtlVector<PackOrder_t> order;
+	order.SetCount( nIndices );
+	for ( int i = 0; i < nIndices; ++i )
+	{
+		const LightmapPackBlock_t &block = pBlocks[pIndices[i]];
+		order[i].m_nGroup = 0;
+		order[i].m_nHeight = block.m_nHeight;
+		order[i].m_nWidth = block.m_nWidth;
+		order[i].m_nBlock = pIndices[i];
+	}
+	order.Sort( ComparePackOrder );
+
+	CUtlVector<CLightmapPacker> pages;
+	int64 nBlockArea = 0;
+	for ( int i = 0; i < order.Count(); ++i )
+	{
+		LightmapPackBlock_t &block = pBlocks[order[i].m_nBlock];
+		block.m_nPage = -1;
+		block.m_nX = block.m_nY = 0;
+
+		if ( block.m_nWidth > nPageWidth || block.m_nHeight > nPageHeight )
+			continue;
+
+		int iPage;
+		for ( iPage = 0; iPage < pages.Count(); ++iPage )
+		{
+			if ( pages[iPage].AddBlock( block.m_nWidth, block.m_nHeight, &block.m_nX, &block.m_nY ) )
+				break;
+		}
+
+		if ( iPage == pages.Count() )
+		{
+			pages.AddToTail();
+			pages[iPage].Reset( nPageWidth, nPageHeight, heuristic );
+			if ( !pages[iPage].AddBlock( block.m_nWidth, block.m_nHeight, &block.m_nX, &block.m_nY ) )
+			{
+				// Can only happen to empty blocks
+				pages.Remove( iPage );
+				continue;
+			}
+		}
+
+		block.m_nPage = iPage;
+		nBlockArea += block.m_nWidth * block.m_nHeight;
+	}
+
+	if ( pStats )
+	{
+		pStats->m_nPages = pages.Count();
+		pStats->m_nBlockArea = nBlockArea;
+		pStats->m_nUsedArea = 0;
+		if ( pages.Count() )
+		{
+			pStats->m_nUsedArea = (int64)( pages.Count() - 1 ) * nPageWidth * nPageHeight +
+				(int64)pages.Tail().GetMinimumHeight() * nPageWidth;
+		}
+	}
+
+	return pages.Count();
+}
+
+int PackLightmapBlocks( LightmapPackBlock_t *pBlocks, int nBlocks, int nPageWidth, int nPageHeight,
+						LightmapPackHeuristic_t heuristic, LightmapPackStats_t *pStats )
+{
+	CUtlVector<int> indices;
+	indices.SetCount( nBlocks );
+	for ( int i = 0; i < nBlocks; ++i )
+	{
+		indices[i] = i;
+	}
+	return PackBlockList( pBlocks, indices.Base(), nBlocks, nPageWidth, nPageHeight, heuristic, pStats );
+}
+
+
+// Work shared with the threads in PackLightmapGroups
+static LightmapPackBlock_t *s_pPackBlocks;
+static CUtlVector<int> s_PackGroupStart;		// first index into s_PackGroupBlocks of each group, plus one past the last
+static CUtlVector<int> s_PackGroupBlocks;
+static CUtlVector<LightmapPackStats_t> s_PackGroupStats;
+static int s_nPackPageWidth;
+static int s_nPackPageHeight;
+static LightmapPackHeuristic_t s_PackHeuristic;
+
+static void PackLightmapGroup( int iThread, int iGroup )
+{
+	int nStart = s_PackGroupStart[iGroup];
+	int nCount = s_PackGroupStart[iGroup + 1] - nStart;
+	if ( nCount == 0 )
+	{
+		memset( &s_PackGroupStats[iGroup], 0, sizeof( LightmapPackStats_t ) );
+		return;
+	}
+
+	PackBlockList( s_pPackBlocks, &s_PackGroupBlocks[nStart], nCount, s_nPackPageWidth, s_nPackPageHeight,
+		s_PackHeuristic, &s_PackGroupStats[iGroup] );
+}
+
+void PackLightmapGroups( CUtlVector<LightmapPackBlock_t> &blocks, int nGroups, int nPageWidth, int nPageHeight,
+						 LightmapPackHeuristic_t heuristic, bool bThreaded, LightmapPackStats_t *pStats )
+{
+	// Bucket the blocks by group
+	s_PackGroupStart.SetCount( nGroups + 1 );
+	memset( s_PackGroupStart.Base(), 0, s_PackGroupStart.Count() * sizeof( int ) );
+	for ( int i = 0; i < blocks.Count(); ++i )
+	{
+		Assert( blocks[i].m_nGroup >= 0 && blocks[i].m_nGroup < nGroups );
+		++s_PackGroupStart[blocks[i].m_nGroup + 1];
+	}
+	for ( int iGroup = 0; iGroup < nGroups; ++iGroup )
+	{
+		s_PackGroupStart[iGroup + 1] += s_PackGroupStart[iGroup];
+	}
+
+	CUtlVector<int> nextBlock;
+	nextBlock.SetCount( nGroups );
+	memcpy( nextBlock.Base(), s_PackGroupStart.Base(), nGroups * sizeof( int ) );
+	s_PackGroupBlocks.SetCount( blocks.Count() );
+	for ( int i = 0; i < blocks.Count(); ++i )
+	{
+		s_PackGroupBlocks[nextBlock[blocks[i].m_nGroup]++] = i;
+	}
+
+	s_pPackBlocks = blocks.Base();
+	s_PackGroupStats.SetCount( nGroups );
+	s_nPackPageWidth = nPageWidth;
+	s_nPackPageHeight = nPageHeight;
+	s_PackHeuristic = heuristic;
+
+	if ( bThreaded )
+	{
+		RunThreadsOnIndividual( nGroups, false, PackLightmapGroup );
+	}
+	else
+	{
+		for ( int iGroup = 0; iGroup < nGroups; ++iGroup )
+		{
+			PackLightmapGroup( THREADINDEX_MAIN, iGroup );
+		}
+	}
+
+	if ( pStats )
+	{
+		memset( pStats, 0, sizeof( *pStats ) );
+		for ( int iGroup = 0; iGroup < nGroups; ++iGroup )
+		{
+			pStats->m_nPages += s_PackGroupStats[iGroup].m_nPages;
+			pStats->m_nBlockArea += s_PackGroupStats[iGroup].m_nBlockArea;
+			pStats->m_nUsedArea += s_PackGroupStats[iGroup].m_nUsedArea;
+		}
+	}
+
+	s_pPackBlocks = NULL;
+	s_PackGroupStart.Purge();
+	s_PackGroupBlocks.Purge();
+	s_PackGroupStats.Purge();
+}
+
+
+//-----------------------------------------------------------------------------
+// Benchmark
+//-----------------------------------------------------------------------------
+
+// The engine's lightmap page size
+#define PACKBENCH_PAGE_WIDTH	512
+#define PACKBENCH_PAGE_HEIGHT	256
+
+// Each configuration is packed this many times and the fastest run is kept
+#define PACKBENCH_RUNS			5
+
+//-----------------------------------------------------------------------------
+// CImagePacker the way the engine drives it: blocks in face order, each on the
+// first page with room
+//-----------------------------------------------------------------------------
+static void PackWithImagePacker( CUtlVector<LightmapPackBlock_t> &blocks, bool bSortByHeight, LightmapPackStats_t &stats )
+{
+	memset( &stats, 0, sizeof( stats ) );
+
+	// Group by group, keeping face order within each one unless sorting
+	CUtlVector<PackOrder_t> order;
+	order.SetCount( blocks.Count() );
+	for ( int i = 0; i < blocks.Count(); ++i )
+	{
+		order[i].m_nGroup = blocks[i].m_nGroup;
+		order[i].m_nHeight = bSortByHeight ? blocks[i].m_nHeight : 0;
+		order[i].m_nWidth = bSortByHeight ? blocks[i].m_nWidth : 0;
+		order[i].m_nBlock = i;
+	}
+	order.Sort( ComparePackOrder );
+
+	CUtlVector<CImagePacker> pages;
+	CUtlVector<int> pageTops;			// CImagePacker doesn't say how much of a page it used
+	for ( int i = 0; i <= order.Count(); ++i )
+	{
+		// Done with a group
+		if ( i == order.Count() || ( i > 0 && order[i].m_nGroup != order[i - 1].m_nGroup ) )
+		{
+			if ( pages.Count() )
+			{
+				stats.m_nPages += pages.Count();
+				stats.m_nUsedArea += (int64)( pages.Count() - 1 ) * PACKBENCH_PAGE_WIDTH * PACKBENCH_PAGE_HEIGHT +
+					(int64)pageTops.Tail() * PACKBENCH_PAGE_WIDTH;
+			}
+			pages.RemoveAll();
+			pageTops.RemoveAll();
+
+			if ( i == order.Count() )
+				break;
+		}
+
+		LightmapPackBlock_t &block = blocks[order[i].m_nBlock];
+		block.m_nPage = -1;
+		if ( block.m_nWidth > PACKBENCH_PAGE_WIDTH || block.m_nHeight > PACKBENCH_PAGE_HEIGHT )
+			continue;
+
+		int iPage;
+		for ( iPage = 0; iPage < pages.Count(); ++iPage )
+		{
+			if ( pages[iPage].AddBlock( block.m_nWidth, block.m_nHeight, &block.m_nX, &block.m_nY ) )
+				break;
+		}
+		if ( iPage == pages.Count() )
+		{
+			pages.AddToTail();
+			pageTops.AddToTail( 0 );
+			pages[iPage].Reset( PACKBENCH_PAGE_WIDTH, PACKBENCH_PAGE_HEIGHT );
+			if ( !pages[iPage].AddBlock( block.m_nWidth, block.m_nHeight, &block.m_nX, &block.m_nY ) )
+			{
+				// CImagePacker keeps the last two rows of a page free
+				pages.Remove( iPage );
+				pageTops.Remove( iPage );
+				continue;
+			}
+		}
+
+		block.m_nPage = iPage;
+		pageTops[iPage] = MAX( pageTops[iPage], block.m_nY + block.m_nHeight );
+		stats.m_nBlockArea += block.m_nWidth * block.m_nHeight;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Counts blocks that overlap another one or stick out of their page
+//-----------------------------------------------------------------------------
+static int CountBadBlocks( const CUtlVector<LightmapPackBlock_t> &blocks )
+{
+	// Page by page; the page goes in the height slot so the sort keeps them together
+	CUtlVector<PackOrder_t> order;
+	for ( int i = 0; i < blocks.Count(); ++i )
+	{
+		if ( blocks[i].m_nPage == -1 )
+			continue;
+
+		PackOrder_t &entry = order[order.AddToTail()];
+		entry.m_nGroup = blocks[i].m_nGroup;
+		entry.m_nHeight = blocks[i].m_nPage;
+		entry.m_nWidth = 0;
+		entry.m_nBlock = i;
+	}
+	order.Sort( ComparePackOrder );
+
+	int nBad = 0;
+	CUtlVector<unsigned char> pageUsed;
+	pageUsed.SetCount( PACKBENCH_PAGE_WIDTH * PACKBENCH_PAGE_HEIGHT );
+	for ( int i = 0; i < order.Count(); ++i )
+	{
+		if ( i == 0 || order[i].m_nGroup != order[i - 1].m_nGroup || order[i].m_nHeight != order[i - 1].m_nHeight )
+		{
+			memset( pageUsed.Base(), 0, pageUsed.Count() );
+		}
+
+		const LightmapPackBlock_t &block = blocks[order[i].m_nBlock];
+		if ( block.m_nX < 0 || block.m_nY < 0 || block.m_nX + block.m_nWidth > PACKBENCH_PAGE_WIDTH ||
+			 block.m_nY + block.m_nHeight > PACKBENCH_PAGE_HEIGHT )
+		{
+			++nBad;
+			continue;
+		}
+
+		bool bOverlaps = false;
+		for ( int y = block.m_nY; y < block.m_nY + block.m_nHeight; ++y )
+		{
+			unsigned char *pRow = &pageUsed[y * PACKBENCH_PAGE_WIDTH];
+			for ( int x = block.m_nX; x < block.m_nX + block.m_nWidth; ++x )
+			{
+				bOverlaps |= ( pRow[x] != 0 );
+				pRow[x] = 1;
+			}
+		}
+		if ( bOverlaps )
+		{
+			++nBad;
+		}
+	}
+	return nBad;
+}
+
+static void PrintPackStats( const char *pName, const LightmapPackStats_t &stats, double flTime, double flThreadedTime = -1.0 )
+{
+	double flFill = stats.m_nUsedArea ? 100.0 * stats.m_nBlockArea / stats.m_nUsedArea : 0.0;
+	if ( flThreadedTime >= 0.0 )
+	{
+		Msg( "  %-24s %6d pages  %5.1f%% fill  %8.2f ms  %8.2f ms threaded\n", pName, stats.m_nPages, flFill,
+			flTime * 1000.0, flThreadedTime * 1000.0 );
+	}
+	else
+	{
+		Msg( "  %-24s %6d pages  %5.1f%% fill  %8.2f ms\n", pName, stats.m_nPages, flFill, flTime * 1000.0 );
+	}
+}
+
+void RunLightmapPackBenchmark()
+{
+	// Each lit face's lightmap, grouped by material. Bumped faces store all
+	// their lightmaps side by side.
+	CUtlVector<LightmapPackBlock_t> blocks;
+	CUtlVector<int> materialGroup;
+	materialGroup.SetCount( numtexdata );
+	for ( int i = 0; i < numtexdata; ++i )
+	{
+		materialGroup[i] = -1;
+	}
+	int nGroups = 0;
+
+	for ( int iFace = 0; iFace < numfaces; ++iFace )
+	{
+		dface_t *pFace = &g_pFaces[iFace];
+		texinfo_t *pTex = &texinfo[pFace->texinfo];
+		if ( pTex->flags & ( SURF_SKY | SURF_NOLIGHT ) )
+			continue;
+
+		int lightmapMins[2], lightmapSize[2];
+		CalcFaceExtents( pFace, lightmapMins, lightmapSize );
+
+		LightmapPackBlock_t &block = blocks[blocks.AddToTail()];
+		block.m_nWidth = lightmapSize[0] + 1;
+		block.m_nHeight = lightmapSize[1] + 1;
+		if ( pTex->flags & SURF_BUMPLIGHT )
+		{
+			block.m_nWidth *= NUM_BUMP_VECTS + 1;
+		}
+
+		int &nGroup = materialGroup[pTex->texdata];
+		if ( nGroup == -1 )
+		{
+			nGroup = nGroups++;
+		}
+		block.m_nGroup = nGroup;
+		block.m_nPage = -1;
+		block.m_nX = block.m_nY = 0;
+	}
+
+	Msg( "Lightmap packing benchmark: %d face lightmaps in %d materials, %dx%d pages, %d threads\n",
+		blocks.Count(), nGroups, PACKBENCH_PAGE_WIDTH, PACKBENCH_PAGE_HEIGHT, numthreads );
+	if ( !blocks.Count() )
+		return;
+
+	for ( int nSorted = 0; nSorted < 2; ++nSorted )
+	{
+		LightmapPackStats_t stats;
+		double flBest = FLT_MAX;
+		for ( int nRun = 0; nRun < PACKBENCH_RUNS; ++nRun )
+		{
+			double start = Plat_FloatTime();
+			PackWithImagePacker( blocks, nSorted != 0, stats );
+			flBest = MIN( flBest, Plat_FloatTime() - start );
+		}
+		PrintPackStats( nSorted ? "CImagePacker by height" : "CImagePacker face order", stats, flBest );
+	}
+
+	for ( int nHeuristic = 0; nHeuristic < LIGHTMAP_PACK_HEURISTIC_COUNT; ++nHeuristic )
+	{
+		LightmapPackHeuristic_t heuristic = (LightmapPackHeuristic_t)nHeuristic;
+
+		LightmapPackStats_t stats;
+		double flBest = FLT_MAX;
+		double flBestThreaded = FLT_MAX;
+		for ( int nRun = 0; nRun < PACKBENCH_RUNS; ++nRun )
+		{
+			double start = Plat_FloatTime();
+			PackLightmapGroups( blocks, nGroups, PACKBENCH_PAGE_WIDTH, PACKBENCH_PAGE_HEIGHT, heuristic, false, &stats );
+			flBest = MIN( flBest, Plat_FloatTime() - start );
+
+			start = Plat_FloatTime();
+			PackLightmapGroups( blocks, nGroups, PACKBENCH_PAGE_WIDTH, PACKBENCH_PAGE_HEIGHT, heuristic, true, &stats );
+			flBestThreaded = MIN( flBestThreaded, Plat_FloatTime() - start );
+		}
+		PrintPackStats( LightmapPackHeuristicName( heuristic ), stats, flBest, flBestThreaded );
+
+		int nBad = CountBadBlocks( blocks );
+		if ( nBad )
+		{
+			Warning( "    %d blocks overlap or are off their page!\n", nBad );
+		}
+	}
+}
@@ -0,0 +1,125 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Lightmap atlas packer.
+//
+// CLightmapPacker fills one page with either a skyline, which keeps the top
+// edge of what has been placed so far, or MaxRects, which keeps every maximal
+// free rectangle and can fill the holes a skyline leaves behind. Blocks are
+// never rotated since lightmaps can't be.
+//
+// PackLightmapBlocks packs a list of blocks, tallest first, onto as many pages
+// as it takes. PackLightmapGroups does that for independent groups of blocks,
+// such as each material's lightmaps, on all threads.
+//
+//=============================================================================//
+
+#ifndef LIGHTMAPPACKER_H
+#define LIGHTMAPPACKER_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "tier1/utlvector.h"
+
+
+enum LightmapPackHeuristic_t
+{
+	LIGHTMAP_PACK_SKYLINE_BOTTOM_LEFT = 0,	// lowest spot on the skyline, then leftmost
+	LIGHTMAP_PACK_SKYLINE_MIN_WASTE,		// spot leaving the least area under the block
+	LIGHTMAP_PACK_MAXRECTS_SHORT_SIDE,		// free rectangle with the smallest leftover side
+	LIGHTMAP_PACK_MAXRECTS_AREA,			// smallest free rectangle the block fits in
+
+	LIGHTMAP_PACK_HEURISTIC_COUNT
+};
+
+const char *LightmapPackHeuristicName( LightmapPackHeuristic_t heuristic );
+
+
+//-----------------------------------------------------------------------------
+// Packs a single page
+//-----------------------------------------------------------------------------
+class CLightmapPacker
+{
+public:
+	CLightmapPacker();
+
+	void Reset( int nWidth, int nHeight, LightmapPackHeuristic_t heuristic );
+	bool AddBlock( int nWidth, int nHeight, int *pX, int *pY );
+
+	int GetAreaUsed() const			{ return m_nAreaUsed; }
+	int GetMinimumHeight() const	{ return m_nMinimumHeight; }	// rows that have anything in them
+
+private:
+	struct SkylineNode_t
+	{
+		int		m_nX;
+		int		m_nY;
+		int		m_nWidth;
+	};
+
+	struct PackRect_t
+	{
+		int		m_nX;
+		int		m_nY;
+		int		m_nWidth;
+		int		m_nHeight;
+	};
+
+	bool SkylineFit( int iNode, int nWidth, int nHeight, int *pY, int *pWaste ) const;
+	bool SkylineAddBlock( int nWidth, int nHeight, int *pX, int *pY );
+	bool MaxRectsAddBlock( int nWidth, int nHeight, int *pX, int *pY );
+	void MaxRectsSplit( const PackRect_t &used );
+	void MaxRectsPrune();
+
+	LightmapPackHeuristic_t	m_Heuristic;
+	int		m_nWidth;
+	int		m_nHeight;
+	int		m_nAreaUsed;
+	int		m_nMinimumHeight;
+
+	// Smallest block that didn't fit, so blocks at least that big fail right away
+	int		m_nFailedWidth;
+	int		m_nFailedHeight;
+
+	CUtlVector<SkylineNode_t>	m_Skyline;
+	CUtlVector<PackRect_t>		m_FreeRects;
+};
+
+
+struct LightmapPackBlock_t
+{
+	int		m_nWidth;
+	int		m_nHeight;
+	int		m_nGroup;			// for PackLightmapGroups
+
+	// Filled in by the packing. m_nPage is -1 if the block is bigger than a page.
+	int		m_nPage;
+	int		m_nX;
+	int		m_nY;
+};
+
+struct LightmapPackStats_t
+{
+	int		m_nPages;
+	int64	m_nBlockArea;		// luxels in the blocks that were placed
+	int64	m_nUsedArea;		// full pages, plus the used rows of each group's last page
+};
+
+
+// Packs the blocks onto pages numbered from 0, placing each on the first page
+// with room. Returns the number of pages.
+int PackLightmapBlocks( LightmapPackBlock_t *pBlocks, int nBlocks, int nPageWidth, int nPageHeight,
+						LightmapPackHeuristic_t heuristic, LightmapPackStats_t *pStats = NULL );
+
+// Packs each group, 0 to nGroups-1, onto its own pages, numbered from 0 within
+// the group. Groups are packed in parallel when bThreaded is set.
+void PackLightmapGroups( CUtlVector<LightmapPackBlock_t> &blocks, int nGroups, int nPageWidth, int nPageHeight,
+						 LightmapPackHeuristic_t heuristic, bool bThreaded, LightmapPackStats_t *pStats = NULL );
+
+// -packbench: packs the map's face lightmaps, grouped by material the way the
+// engine groups them, with CImagePacker and each heuristic, and prints fill
+// rates and times.
+void RunLightmapPackBenchmark();
+
+
+#endif // LIGHTMAPPACKER_H
@@ -22,6 +22,7 @@
 #include "bsplib.h"
 #include "consolewnd.h"
 #include "vismat.h"
+#include "transfermatrix.h"
 #include "vmpi_filesystem.h"
 #include "vmpi_dispatch.h"
 #include "utllinkedlist.h"
@@ -280,6 +281,7 @@ void RunMPIBuildFacelights()
 void MPI_ReceiveVisLeafsResults( uint64 iWorkUnit, MessageBuffer *pBuf, int iWorker )
 {
 	int patchesInCluster = 0;
+	CUtlVector<byte> encodedRow;
 	
 	pBuf->read(&patchesInCluster, sizeof(patchesInCluster));
 	
@@ -292,11 +294,19 @@ void MPI_ReceiveVisLeafsResults( uint64 iWorkUnit, MessageBuffer *pBuf, int iWor
 		int numtransfers;
 		pBuf->read( &numtransfers, sizeof(numtransfers) );
 		patch->numtransfers = numtransfers;
-		if (numtransfers) 
+		if (numtransfers && (g_bFloatTransfers || g_bCompareTransfers)) 
 		{
 			patch->transfers = new transfer_t[numtransfers];
 			pBuf->read(patch->transfers, numtransfers * sizeof(transfer_t));
 		}
+		if (numtransfers && !g_bFloatTransfers)
+		{
+			int nRowBytes;
+			pBuf->read( &nRowBytes, sizeof(nRowBytes) );
+			encodedRow.SetCount( nRowBytes );
+			pBuf->read( encodedRow.Base(), nRowBytes );
+			TransferMatrix_AddEncodedRow( patchnum, encodedRow.Base(), nRowBytes );
+		}
 		
 		total_transfer += numtransfers;
 		if (max_transfer < numtransfers) 
@@ -330,7 +340,17 @@ void MPI_AddPatchData( int iThread, int patchnum, CPatch *patch )
 		++pData->m_nPatchesInCluster;
 		pData->m_pVisLeafsMB->write(&patchnum, sizeof(patchnum));
 		pData->m_pVisLeafsMB->write(&patch->numtransfers, sizeof(patch->numtransfers));
-		pData->m_pVisLeafsMB->write( patch->transfers, patch->numtransfers * sizeof(transfer_t) );
+		if ( patch->numtransfers && ( g_bFloatTransfers || g_bCompareTransfers ) )
+		{
+			pData->m_pVisLeafsMB->write( patch->transfers, patch->numtransfers * sizeof(transfer_t) );
+		}
+		if ( patch->numtransfers && !g_bFloatTransfers )
+		{
+			int nRowBytes;
+			const byte *pRow = TransferMatrix_GetEncodedRow( patchnum, &nRowBytes );
+			pData->m_pVisLeafsMB->write( &nRowBytes, sizeof(nRowBytes) );
+			pData->m_pVisLeafsMB->write( pRow, nRowBytes );
+		}
 	}
 }
 
@@ -13,6 +13,7 @@
 #include "utlrbtree.h"
 #include "mathlib/VMatrix.h"
 #include "macro_texture.h"
+#include "relightcache.h"
 
 
 void WorldToLuxelSpace( lightinfo_t const *l, Vector const &world, Vector2D &coord )
@@ -658,6 +659,10 @@ void FinalLightFace( int iThread, int facenum )
     if ( texinfo[f->texinfo].flags & TEX_SPECIAL)
         return;
 
+	// -incremental keeps the cached lightmaps of faces it isn't relighting
+	if ( RelightCache_RestoreFace( facenum ) )
+		return;
+
 	fl = &facelight[facenum];
 
 
@@ -715,7 +720,9 @@ void FinalLightFace( int iThread, int facenum )
 			}
 		}
 
-		if (numbounce > 0 && k == 0)
+		// a partial -incremental relight doesn't bounce, the faces keep their cached bounce
+		bool bCachedBounce = ( numbounce > 0 && k == 0 && RelightCache_IsPartial() );
+		if (numbounce > 0 && k == 0 && !bCachedBounce)
 		{
 			// currently only radiosity light non-displacement surfaces!
 			if( !bDisp )
@@ -784,6 +791,19 @@ void FinalLightFace( int iThread, int facenum )
 				{
 					lb[bumpSample].AddLight( v[bumpSample] );
 				}
+
+				if ( g_bIncrementalLighting )
+				{
+					RelightCache_SetBounce( facenum, j, v, bumpSampleCount );
+				}
+			}
+			else if (bCachedBounce)
+			{
+				RelightCache_GetBounce( facenum, j, v, bumpSampleCount );
+				for( bumpSample = 0; bumpSample < bumpSampleCount; ++bumpSample )
+				{
+					lb[bumpSample].AddLight( v[bumpSample] );
+				}
 			}
 
 			if ( bDisp && g_bDumpPatches )
@@ -0,0 +1,1138 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Cache of the last compile's lighting for -incremental. See relightcache.h.
+//
+//=============================================================================//
+
+#include "vrad.h"
+#include "lightmap.h"
+#include "relightcache.h"
+#include "lightcull.h"
+#include "checksum_crc.h"
+#include "tier1/utlbuffer.h"
+
+
+#define RELIGHT_CACHE_ID		MAKEID('V','R','L','C')
+#define RELIGHT_CACHE_VERSION	2				// bump when the layout or what goes into a hash changes
+
+// Shadow casters are hashed per cell of this size, a changed cell relights
+// every face that can see it.
+#define RELIGHT_CELL_SIZE		256.0f
+
+// Past this fraction of the lit faces a full compile isn't much slower and gets
+// the bounce right.
+#define RELIGHT_MAX_FRACTION	0.5f
+
+
+bool g_bIncrementalLighting = false;
+
+
+int GetVisCache( int lastoffset, int cluster, byte *pvs );
+
+
+struct RelightCacheHeader_t
+{
+	int32	m_nId;
+	int32	m_nVersion;
+	CRC32_t	m_nOptions;					// HashOptions
+	int32	m_nIncrementalCompiles;		// since the bounce was last computed
+	int32	m_nLights;
+	int32	m_nCells;
+	int32	m_nFaces;
+	int32	m_nLightmapBytes;
+	int32	m_nBounce;
+	int32	m_nFaceLights;
+};
+
+struct RelightCell_t
+{
+	int		m_nKey;						// CellKey of the triangles' centers
+	CRC32_t	m_nHash;					// sum of the triangle hashes, so the order doesn't matter
+	int		m_nTriangles;
+	Vector	m_vecMins;					// of the whole triangles
+	Vector	m_vecMaxs;
+};
+
+struct RelightCachedFace_t
+{
+	CRC32_t	m_nKey;						// HashFace
+	CRC32_t	m_nNeighborKeys;			// sum of the neighbors' keys, so the order doesn't matter
+	byte	m_Styles[MAXLIGHTMAPS];
+	Vector	m_vecAvgBounce;
+	int		m_iLightmap;				// average colors and lightmaps, laid out as in pdlightdata
+	int		m_nLightmapBytes;
+	int		m_iBounce;					// per luxel and bump vector
+	int		m_nBounce;
+	int		m_iLights;					// index of each light that reaches the face
+	int		m_nLights;
+};
+
+struct RelightFace_t
+{
+	CRC32_t		m_nKey;
+	CRC32_t		m_nNeighborKeys;
+	int			m_iCached;				// -1 if the face is new
+	bool		m_bRelight;				// gets new lightmaps, otherwise they come from the cache
+	Vector		m_vecMins;
+	Vector		m_vecMaxs;
+	int			m_iFirstCluster;		// into s_FaceClusters
+	int			m_nClusters;
+
+	CUtlVector<int>				m_Lights;		// dl->index, while relighting
+	CUtlVector<ColorRGBExp32>	m_Bounce;
+};
+
+struct RelightKey_t
+{
+	uint32	m_nKey;
+	int		m_nIndex;
+};
+
+
+static CUtlVector<RelightCell_t>		s_Cells;
+static CUtlVector<RelightFace_t>		s_RelightFaces;
+static CUtlVector<int>					s_FaceClusters;
+static CUtlVector<CRC32_t>				s_LightHashes;		// by dl->index
+static bool								s_bPartial = false;
+static int								s_nIncrementalCompiles = 0;
+
+// the cache being compared against
+static CUtlVector<CRC32_t>				s_CachedLightHashes;
+static CUtlVector<int>					s_CachedLightToLight;	// -1 if it changed or went away
+static CUtlVector<RelightCell_t>		s_CachedCells;
+static CUtlVector<RelightCachedFace_t>	s_CachedFaces;
+static CUtlVector<byte>					s_CachedLightmaps;
+static CUtlVector<ColorRGBExp32>		s_CachedBounce;
+static CUtlVector<int>					s_CachedFaceLights;
+
+
+//-----------------------------------------------------------------------------
+// Hashes
+//-----------------------------------------------------------------------------
+template< class T >
+static inline void HashValue( CRC32_t &crc, const T &value )
+{
+	CRC32_ProcessBuffer( &crc, &value, sizeof( value ) );
+}
+
+// The options that change the lighting without changing a face or light.
+static CRC32_t HashOptions()
+{
+	CRC32_t crc;
+	CRC32_Init( &crc );
+	HashValue( crc, g_bHDR );
+	HashValue( crc, numbounce );
+	HashValue( crc, do_fast );
+	HashValue( crc, do_extra );
+	HashValue( crc, extrapasses );
+	HashValue( crc, g_flSupersampleBudget );
+	HashValue( crc, g_flSupersampleContrast );
+	HashValue( crc, g_flLightCullThreshold );
+	HashValue( crc, do_centersamples );
+	HashValue( crc, dlight_map );
+	HashValue( crc, lightscale );
+	HashValue( crc, ambient );
+	HashValue( crc, maxlight );
+	HashValue( crc, coring );
+	HashValue( crc, gamma_value );
+	HashValue( crc, indirect_sun );
+	HashValue( crc, smoothing_threshold );
+	HashValue( crc, dispchop );
+	HashValue( crc, maxchop );
+	HashValue( crc, g_flSkySampleScale );
+	HashValue( crc, g_SunAngularExtent );
+	HashValue( crc, g_flMaxDispSampleSize );
+	HashValue( crc, g_bLargeDispSampleRadius );
+	HashValue( crc, g_bFastAmbient );
+	HashValue( crc, g_bTextureShadows );
+	HashValue( crc, g_bStaticPropPolys );
+	CRC32_Final( &crc );
+	return crc;
+}
+
+static CRC32_t HashLight( const directlight_t *dl )
+{
+	CRC32_t crc;
+	CRC32_Init( &crc );
+	HashValue( crc, dl->light );
+	HashValue( crc, dl->m_flStartFadeDistance );
+	HashValue( crc, dl->m_flEndFadeDistance );
+	HashValue( crc, dl->m_flCapDist );
+	CRC32_Final( &crc );
+	return crc;
+}
+
+static const Vector &FaceVertex( const dface_t *f, int iEdge )
+{
+	int se = dsurfedges[f->firstedge + iEdge];
+	int v = ( se < 0 ) ? dedges[-se].v[1] : dedges[se].v[0];
+	return dvertexes[v].point;
+}
+
+// Everything about a face that goes into its lightmap layout and lighting,
+// but not its index, which changes whenever vbsp runs.
+static CRC32_t HashFace( int facenum )
+{
+	dface_t *f = &g_pFaces[facenum];
+
+	CRC32_t crc;
+	CRC32_Init( &crc );
+
+	texinfo_t tx = texinfo[f->texinfo];
+	int iTexData = tx.texdata;
+	tx.texdata = 0;
+	HashValue( crc, tx );
+	if ( iTexData >= 0 )
+	{
+		const dtexdata_t *pTexData = &dtexdata[iTexData];
+		const char *pMaterial = TexDataStringTable_GetString( pTexData->nameStringTableID );
+		HashValue( crc, pTexData->reflectivity );
+		CRC32_ProcessBuffer( &crc, pMaterial, Q_strlen( pMaterial ) );
+	}
+
+	HashValue( crc, dplanes[f->planenum].normal );
+	HashValue( crc, dplanes[f->planenum].dist );
+	HashValue( crc, f->side );
+	HashValue( crc, f->numedges );
+	for ( int i = 0; i < f->numedges; i++ )
+	{
+		HashValue( crc, FaceVertex( f, i ) );
+	}
+	HashValue( crc, f->m_LightmapTextureMinsInLuxels );
+	HashValue( crc, f->m_LightmapTextureSizeInLuxels );
+	HashValue( crc, face_offset[facenum] );
+
+	float flMinLight = FloatForKey( face_entity[facenum], "_minlight" );
+	HashValue( crc, flMinLight );
+
+	if ( f->dispinfo != -1 )
+	{
+		const ddispinfo_t &disp = g_dispinfo[f->dispinfo];
+		HashValue( crc, disp.power );
+		HashValue( crc, disp.startPosition );
+		CRC32_ProcessBuffer( &crc, &g_DispVerts[disp.m_iDispVertStart], disp.NumVerts() * sizeof( CDispVert ) );
+	}
+
+	CRC32_Final( &crc );
+	return crc;
+}
+
+
+//-----------------------------------------------------------------------------
+// Matching
+//-----------------------------------------------------------------------------
+static int CompareRelightKeys( const void *pLeft, const void *pRight )
+{
+	const RelightKey_t *pA = (const RelightKey_t *)pLeft;
+	const RelightKey_t *pB = (const RelightKey_t *)pRight;
+	if ( pA->m_nKey != pB->m_nKey )
+		return ( pA->m_nKey < pB->m_nKey ) ? -1 : 1;
+	return pA->m_nIndex - pB->m_nIndex;
+}
+
+// Pairs up equal keys. pAToB[a] is the index of the b it was paired with, or -1.
+static void MatchKeys( CUtlVector<RelightKey_t> &a, CUtlVector<RelightKey_t> &b, int *pAToB )
+{
+	qsort( a.Base(), a.Count(), sizeof( RelightKey_t ), CompareRelightKeys );
+	qsort( b.Base(), b.Count(), sizeof( RelightKey_t ), CompareRelightKeys );
+
+	int i = 0, j = 0;
+	while ( i < a.Count() && j < b.Count() )
+	{
+		if ( a[i].m_nKey < b[j].m_nKey )
+		{
+			i++;
+		}
+		else if ( a[i].m_nKey > b[j].m_nKey )
+		{
+			j++;
+		}
+		else
+		{
+			pAToB[ a[i].m_nIndex ] = b[j].m_nIndex;
+			i++;
+			j++;
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Shadow casters
+//-----------------------------------------------------------------------------
+static int CellKey( const Vector &vecPoint )
+{
+	int nKey = 0;
+	for ( int i = 0; i < 3; i++ )
+	{
+		int n = (int)floor( vecPoint[i] / RELIGHT_CELL_SIZE ) + 512;
+		nKey |= MIN( MAX( n, 0 ), 1023 ) << ( 10 * i );
+	}
+	return nKey;
+}
+
+static int CompareRelightCells( const void *pLeft, const void *pRight )
+{
+	const RelightCell_t *pA = (const RelightCell_t *)pLeft;
+	const RelightCell_t *pB = (const RelightCell_t *)pRight;
+	return pA->m_nKey - pB->m_nKey;
+}
+
+void RelightCache_HashOccluders()
+{
+	CUtlVector<RelightCell_t> triangles;
+	triangles.SetSize( g_RtEnv.OptimizedTriangleList.Count() );
+	for ( int i = 0; i < triangles.Count(); i++ )
+	{
+		// the id is the face or prop index, which doesn't say anything about the shadow
+		TriGeometryData_t &tri = g_RtEnv.OptimizedTriangleList[i].m_Data.m_GeometryData;
+		RelightCell_t &cell = triangles[i];
+
+		CRC32_Init( &cell.m_nHash );
+		CRC32_ProcessBuffer( &cell.m_nHash, tri.m_VertexCoordData, sizeof( tri.m_VertexCoordData ) );
+		HashValue( cell.m_nHash, tri.m_nFlags );
+		CRC32_Final( &cell.m_nHash );
+
+		cell.m_nTriangles = 1;
+		cell.m_vecMins = tri.Vertex( 0 );
+		cell.m_vecMaxs = tri.Vertex( 0 );
+		for ( int v = 1; v < 3; v++ )
+		{
+			VectorMin( cell.m_vecMins, tri.Vertex( v ), cell.m_vecMins );
+			VectorMax( cell.m_vecMaxs, tri.Vertex( v ), cell.m_vecMaxs );
+		}
+		cell.m_nKey = CellKey( ( tri.Vertex( 0 ) + tri.Vertex( 1 ) + tri.Vertex( 2 ) ) / 3.0f );
+	}
+
+	qsort( triangles.Base(), triangles.Count(), sizeof( RelightCell_t ), CompareRelightCells );
+
+	s_Cells.RemoveAll();
+	for ( int i = 0; i < triangles.Count(); i++ )
+	{
+		const RelightCell_t &tri = triangles[i];
+		if ( !s_Cells.Count() || s_Cells.Tail().m_nKey != tri.m_nKey )
+		{
+			s_Cells.AddToTail( tri );
+			continue;
+		}
+
+		RelightCell_t &cell = s_Cells.Tail();
+		cell.m_nHash += tri.m_nHash;
+		cell.m_nTriangles++;
+		VectorMin( cell.m_vecMins, tri.m_vecMins, cell.m_vecMins );
+		VectorMax( cell.m_vecMaxs, tri.m_vecMaxs, cell.m_vecMaxs );
+	}
+}
+
+static void AddClustersInBox( int iNode, const Vector &vecMins, const Vector &vecMaxs, CUtlVector<int> &clusters )
+{
+	Vector vecCenter = ( vecMins + vecMaxs ) * 0.5f;
+	Vector vecExtents = vecMaxs - vecCenter;
+
+	while ( iNode >= 0 )
+	{
+		const dnode_t *pNode = &dnodes[iNode];
+		const dplane_t *pPlane = &dplanes[pNode->planenum];
+
+		float flDist = DotProduct( vecCenter, pPlane->normal ) - pPlane->dist;
+		float flRadius = fabs( pPlane->normal.x * vecExtents.x ) + fabs( pPlane->normal.y * vecExtents.y ) +
+			fabs( pPlane->normal.z * vecExtents.z );
+
+		if ( flDist >= flRadius )
+		{
+			iNode = pNode->children[0];
+		}
+		else if ( flDist <= -flRadius )
+		{
+			iNode = pNode->children[1];
+		}
+		else
+		{
+			AddClustersInBox( pNode->children[0], vecMins, vecMaxs, clusters );
+			iNode = pNode->children[1];
+		}
+	}
+
+	int iCluster = dleafs[-1 - iNode].cluster;
+	if ( iCluster >= 0 && clusters.Find( iCluster ) < 0 )
+	{
+		clusters.AddToTail( iCluster );
+	}
+}
+
+// Marks the clusters around every cell whose shadow casters differ from the cache's.
+static int MarkChangedClusters( CUtlVector<byte> &changedClusters )
+{
+	CUtlVector<int> clusters;
+	int nChangedCells = 0;
+
+	int i = 0, j = 0;
+	while ( i < s_Cells.Count() || j < s_CachedCells.Count() )
+	{
+		const RelightCell_t *pCell = ( i < s_Cells.Count() ) ? &s_Cells[i] : NULL;
+		const RelightCell_t *pCached = ( j < s_CachedCells.Count() ) ? &s_CachedCells[j] : NULL;
+
+		Vector vecMins, vecMaxs;
+		if ( pCell && ( !pCached || pCell->m_nKey < pCached->m_nKey ) )
+		{
+			vecMins = pCell->m_vecMins;
+			vecMaxs = pCell->m_vecMaxs;
+			i++;
+		}
+		else if ( !pCell || pCached->m_nKey < pCell->m_nKey )
+		{
+			vecMins = pCached->m_vecMins;
+			vecMaxs = pCached->m_vecMaxs;
+			j++;
+		}
+		else
+		{
+			i++;
+			j++;
+			if ( pCell->m_nHash == pCached->m_nHash && pCell->m_nTriangles == pCached->m_nTriangles )
+				continue;
+
+			VectorMin( pCell->m_vecMins, pCached->m_vecMins, vecMins );
+			VectorMax( pCell->m_vecMaxs, pCached->m_vecMaxs, vecMaxs );
+		}
+
+		nChangedCells++;
+		clusters.RemoveAll();
+		AddClustersInBox( dmodels[0].headnode, vecMins - Vector( 1, 1, 1 ), vecMaxs + Vector( 1, 1, 1 ), clusters );
+		for ( int k = 0; k < clusters.Count(); k++ )
+		{
+			changedClusters[ clusters[k] >> 3 ] |= 1 << ( clusters[k] & 7 );
+		}
+	}
+
+	return nChangedCells;
+}
+
+
+//-----------------------------------------------------------------------------
+// Loading and saving
+//-----------------------------------------------------------------------------
+template< class T >
+static void GetCacheArray( CUtlBuffer &buf, CUtlVector<T> &array, int nCount )
+{
+	array.SetSize( nCount );
+	buf.Get( array.Base(), nCount * sizeof( T ) );
+}
+
+template< class T >
+static void PutCacheArray( CUtlBuffer &buf, const CUtlVector<T> &array )
+{
+	buf.Put( array.Base(), array.Count() * sizeof( T ) );
+}
+
+static bool LoadCache( const char *pFilename, const char **ppFailReason )
+{
+	CUtlBuffer buf;
+	if ( !g_pFileSystem->ReadFile( pFilename, NULL, buf ) )
+	{
+		*ppFailReason = "there isn't one yet";
+		return false;
+	}
+
+	RelightCacheHeader_t header;
+	buf.Get( &header, sizeof( header ) );
+	if ( !buf.IsValid() || header.m_nId != RELIGHT_CACHE_ID || header.m_nVersion != RELIGHT_CACHE_VERSION )
+	{
+		*ppFailReason = "it's from a different version of vrad";
+		return false;
+	}
+
+	if ( header.m_nOptions != HashOptions() )
+	{
+		*ppFailReason = "the last compile used different options";
+		return false;
+	}
+
+	if ( header.m_nLights < 0 || header.m_nCells < 0 || header.m_nFaces < 0 ||
+		 header.m_nLightmapBytes < 0 || header.m_nBounce < 0 || header.m_nFaceLights < 0 )
+	{
+		*ppFailReason = "it's corrupt";
+		return false;
+	}
+
+	int64 nBytes = (int64)header.m_nLights * sizeof( CRC32_t ) + (int64)header.m_nCells * sizeof( RelightCell_t ) +
+		(int64)header.m_nFaces * sizeof( RelightCachedFace_t ) + header.m_nLightmapBytes +
+		(int64)header.m_nBounce * sizeof( ColorRGBExp32 ) + (int64)header.m_nFaceLights * sizeof( int );
+	if ( buf.TellMaxPut() - buf.TellGet() < nBytes )
+	{
+		*ppFailReason = "it's truncated";
+		return false;
+	}
+
+	GetCacheArray( buf, s_CachedLightHashes, header.m_nLights );
+	GetCacheArray( buf, s_CachedCells, header.m_nCells );
+	GetCacheArray( buf, s_CachedFaces, header.m_nFaces );
+	GetCacheArray( buf, s_CachedLightmaps, header.m_nLightmapBytes );
+	GetCacheArray( buf, s_CachedBounce, header.m_nBounce );
+	GetCacheArray( buf, s_CachedFaceLights, header.m_nFaceLights );
+
+	for ( int i = 0; i < s_CachedFaces.Count(); i++ )
+	{
+		const RelightCachedFace_t &cached = s_CachedFaces[i];
+		if ( cached.m_iLightmap < 0 || cached.m_nLightmapBytes < 0 || cached.m_iLightmap + cached.m_nLightmapBytes > header.m_nLightmapBytes ||
+			 cached.m_iBounce < 0 || cached.m_nBounce < 0 || cached.m_iBounce + cached.m_nBounce > header.m_nBounce ||
+			 cached.m_iLights < 0 || cached.m_nLights < 0 || cached.m_iLights + cached.m_nLights > header.m_nFaceLights )
+		{
+			*ppFailReason = "it's corrupt";
+			return false;
+		}
+	}
+
+	for ( int i = 0; i < s_CachedFaceLights.Count(); i++ )
+	{
+		if ( s_CachedFaceLights[i] < 0 || s_CachedFaceLights[i] >= header.m_nLights )
+		{
+			*ppFailReason = "it's corrupt";
+			return false;
+		}
+	}
+
+	s_nIncrementalCompiles = header.m_nIncrementalCompiles;
+	return true;
+}
+
+static int CountStyles( const dface_t *f )
+{
+	int nStyles;
+	for ( nStyles = 0; nStyles < MAXLIGHTMAPS; nStyles++ )
+	{
+		if ( f->styles[nStyles] == 255 )
+			break;
+	}
+	return nStyles;
+}
+
+// The face's average colors and lightmaps in pdlightdata, which start at
+// lightofs - CountStyles * 4.
+static int GetLightmapBytes( const dface_t *f )
+{
+	if ( f->lightofs == -1 )
+		return 0;
+
+	int nStyles = CountStyles( f );
+	int nBumps = ( texinfo[f->texinfo].flags & SURF_BUMPLIGHT ) ? NUM_BUMP_VECTS + 1 : 1;
+	int nLuxels = ( f->m_LightmapTextureSizeInLuxels[0] + 1 ) * ( f->m_LightmapTextureSizeInLuxels[1] + 1 );
+	return nStyles * 4 + nLuxels * 4 * nStyles * nBumps;
+}
+
+bool RelightCache_Save( const char *pFilename )
+{
+	CUtlVector<RelightCachedFace_t> faces;
+	CUtlVector<byte> lightmaps;
+	CUtlVector<ColorRGBExp32> bounce;
+	CUtlVector<int> faceLights;
+
+	faces.SetSize( s_RelightFaces.Count() );
+	for ( int facenum = 0; facenum < s_RelightFaces.Count(); facenum++ )
+	{
+		const RelightFace_t &face = s_RelightFaces[facenum];
+		const dface_t *f = &g_pFaces[facenum];
+		RelightCachedFace_t &out = faces[facenum];
+
+		out.m_nKey = face.m_nKey;
+		out.m_nNeighborKeys = face.m_nNeighborKeys;
+		memcpy( out.m_Styles, f->styles, sizeof( out.m_Styles ) );
+		out.m_iLightmap = lightmaps.Count();
+		out.m_iBounce = bounce.Count();
+		out.m_iLights = faceLights.Count();
+
+		if ( !face.m_bRelight && face.m_iCached >= 0 )
+		{
+			// kept its cached lighting
+			const RelightCachedFace_t &cached = s_CachedFaces[face.m_iCached];
+			out.m_vecAvgBounce = cached.m_vecAvgBounce;
+			out.m_nLightmapBytes = cached.m_nLightmapBytes;
+			out.m_nBounce = cached.m_nBounce;
+			lightmaps.AddMultipleToTail( cached.m_nLightmapBytes, &s_CachedLightmaps[cached.m_iLightmap] );
+			bounce.AddMultipleToTail( cached.m_nBounce, &s_CachedBounce[cached.m_iBounce] );
+
+			for ( int i = 0; i < cached.m_nLights; i++ )
+			{
+				int iLight = s_CachedLightToLight[ s_CachedFaceLights[cached.m_iLights + i] ];
+				if ( iLight >= 0 )
+				{
+					faceLights.AddToTail( iLight );
+				}
+			}
+			out.m_nLights = faceLights.Count() - out.m_iLights;
+			continue;
+		}
+
+		out.m_nLightmapBytes = GetLightmapBytes( f );
+		if ( out.m_nLightmapBytes )
+		{
+			lightmaps.AddMultipleToTail( out.m_nLightmapBytes, &(*pdlightdata)[f->lightofs - CountStyles( f ) * 4] );
+		}
+
+		out.m_nBounce = face.m_Bounce.Count();
+		bounce.AddMultipleToTail( face.m_Bounce.Count(), face.m_Bounce.Base() );
+
+		// the average of the unbumped bounce, for estimating new faces' bounce
+		out.m_vecAvgBounce.Init();
+		int nBumps = ( texinfo[f->texinfo].flags & SURF_BUMPLIGHT ) ? NUM_BUMP_VECTS + 1 : 1;
+		int nLuxels = face.m_Bounce.Count() / nBumps;
+		for ( int i = 0; i < nLuxels; i++ )
+		{
+			Vector vecBounce;
+			ColorRGBExp32ToVector( face.m_Bounce[i * nBumps], vecBounce );
+			out.m_vecAvgBounce += vecBounce;
+		}
+		if ( nLuxels )
+		{
+			out.m_vecAvgBounce /= nLuxels;
+		}
+
+		out.m_nLights = face.m_Lights.Count();
+		faceLights.AddMultipleToTail( face.m_Lights.Count(), face.m_Lights.Base() );
+	}
+
+	RelightCacheHeader_t header;
+	memset( &header, 0, sizeof( header ) );
+	header.m_nId = RELIGHT_CACHE_ID;
+	header.m_nVersion = RELIGHT_CACHE_VERSION;
+	header.m_nOptions = HashOptions();
+	header.m_nIncrementalCompiles = s_bPartial ? s_nIncrementalCompiles + 1 : 0;
+	header.m_nLights = s_LightHashes.Count();
+	header.m_nCells = s_Cells.Count();
+	header.m_nFaces = faces.Count();
+	header.m_nLightmapBytes = lightmaps.Count();
+	header.m_nBounce = bounce.Count();
+	header.m_nFaceLights = faceLights.Count();
+
+	CUtlBuffer buf;
+	buf.Put( &header, sizeof( header ) );
+	PutCacheArray( buf, s_LightHashes );
+	PutCacheArray( buf, s_Cells );
+	PutCacheArray( buf, faces );
+	PutCacheArray( buf, lightmaps );
+	PutCacheArray( buf, bounce );
+	PutCacheArray( buf, faceLights );
+
+	if ( !g_pFileSystem->WriteFile( pFilename, NULL, buf ) )
+	{
+		Warning( "Couldn't write %s\n", pFilename );
+		return false;
+	}
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Deciding what to relight
+//-----------------------------------------------------------------------------
+static bool IsLitFace( int facenum )
+{
+	return !( texinfo[g_pFaces[facenum].texinfo].flags & TEX_SPECIAL ) &&
+		g_FacePatches.Element( facenum ) != g_FacePatches.InvalidIndex();
+}
+
+static void InitRelightFaces()
+{
+	s_RelightFaces.Purge();
+	s_FaceClusters.Purge();
+	s_RelightFaces.SetSize( numfaces );
+
+	CUtlVector<int> clusters;
+	for ( int facenum = 0; facenum < numfaces; facenum++ )
+	{
+		RelightFace_t &face = s_RelightFaces[facenum];
+		const dface_t *f = &g_pFaces[facenum];
+
+		face.m_nKey = HashFace( facenum );
+		face.m_iCached = -1;
+		face.m_bRelight = true;
+
+		face.m_vecMins = face.m_vecMaxs = FaceVertex( f, 0 );
+		for ( int i = 1; i < f->numedges; i++ )
+		{
+			VectorMin( face.m_vecMins, FaceVertex( f, i ), face.m_vecMins );
+			VectorMax( face.m_vecMaxs, FaceVertex( f, i ), face.m_vecMaxs );
+		}
+
+		if ( f->dispinfo != -1 )
+		{
+			// a displacement can move as far as its longest offset
+			const ddispinfo_t &disp = g_dispinfo[f->dispinfo];
+			float flMaxDist = 0.0f;
+			for ( int i = 0; i < disp.NumVerts(); i++ )
+			{
+				flMaxDist = MAX( flMaxDist, fabs( g_DispVerts[disp.m_iDispVertStart + i].m_flDist ) );
+			}
+			face.m_vecMins -= Vector( flMaxDist, flMaxDist, flMaxDist );
+			face.m_vecMaxs += Vector( flMaxDist, flMaxDist, flMaxDist );
+		}
+		face.m_vecMins += face_offset[facenum];
+		face.m_vecMaxs += face_offset[facenum];
+
+		clusters.RemoveAll();
+		AddClustersInBox( dmodels[0].headnode, face.m_vecMins - Vector( 1, 1, 1 ), face.m_vecMaxs + Vector( 1, 1, 1 ), clusters );
+		face.m_iFirstCluster = s_FaceClusters.Count();
+		face.m_nClusters = clusters.Count();
+		s_FaceClusters.AddVectorToTail( clusters );
+	}
+
+	for ( int facenum = 0; facenum < numfaces; facenum++ )
+	{
+		RelightFace_t &face = s_RelightFaces[facenum];
+		const faceneighbor_t *fn = &faceneighbor[facenum];
+		face.m_nNeighborKeys = 0;
+		for ( int i = 0; i < fn->numneighbors; i++ )
+		{
+			face.m_nNeighborKeys += s_RelightFaces[ fn->neighbor[i] ].m_nKey;
+		}
+	}
+
+	s_LightHashes.SetSize( numdlights );
+	memset( s_LightHashes.Base(), 0, s_LightHashes.Count() * sizeof( CRC32_t ) );
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		s_LightHashes[dl->index] = HashLight( dl );
+	}
+}
+
+static bool FaceSeesClusters( const RelightFace_t &face, const byte *pClusters )
+{
+	// a face outside the world could be seeing anything
+	if ( !face.m_nClusters )
+		return true;
+
+	for ( int i = 0; i < face.m_nClusters; i++ )
+	{
+		if ( PVSCheck( pClusters, s_FaceClusters[face.m_iFirstCluster + i] ) )
+			return true;
+	}
+	return false;
+}
+
+static void FillBounce( int facenum, const Vector &vecBounce )
+{
+	const dface_t *f = &g_pFaces[facenum];
+	int nBumps = ( texinfo[f->texinfo].flags & SURF_BUMPLIGHT ) ? NUM_BUMP_VECTS + 1 : 1;
+	int nLuxels = ( f->m_LightmapTextureSizeInLuxels[0] + 1 ) * ( f->m_LightmapTextureSizeInLuxels[1] + 1 );
+
+	ColorRGBExp32 color;
+	VectorToColorRGBExp32( vecBounce, color );
+
+	CUtlVector<ColorRGBExp32> &bounce = s_RelightFaces[facenum].m_Bounce;
+	bounce.SetSize( nLuxels * nBumps );
+	for ( int i = 0; i < bounce.Count(); i++ )
+	{
+		bounce[i] = color;
+	}
+}
+
+// Relit faces keep the bounce they got in the last full compile. New ones get
+// the average bounce of the unchanged faces in the clusters they touch.
+static void SetupRelitBounce()
+{
+	if ( numbounce == 0 )
+		return;
+
+	CUtlVector<Vector> clusterBounce;
+	CUtlVector<float> clusterWeight;
+	clusterBounce.SetSize( dvis->numclusters );
+	clusterWeight.SetSize( dvis->numclusters );
+	memset( clusterBounce.Base(), 0, clusterBounce.Count() * sizeof( Vector ) );
+	memset( clusterWeight.Base(), 0, clusterWeight.Count() * sizeof( float ) );
+
+	Vector vecTotalBounce( 0, 0, 0 );
+	float flTotalWeight = 0.0f;
+	for ( int facenum = 0; facenum < numfaces; facenum++ )
+	{
+		const RelightFace_t &face = s_RelightFaces[facenum];
+		if ( face.m_iCached < 0 )
+			continue;
+
+		const RelightCachedFace_t &cached = s_CachedFaces[face.m_iCached];
+		if ( !cached.m_nBounce )
+			continue;
+
+		float flWeight = cached.m_nBounce;
+		for ( int i = 0; i < face.m_nClusters; i++ )
+		{
+			int iCluster = s_FaceClusters[face.m_iFirstCluster + i];
+			clusterBounce[iCluster] += cached.m_vecAvgBounce * flWeight;
+			clusterWeight[iCluster] += flWeight;
+		}
+		vecTotalBounce += cached.m_vecAvgBounce * flWeight;
+		flTotalWeight += flWeight;
+	}
+
+	for ( int facenum = 0; facenum < numfaces; facenum++ )
+	{
+		RelightFace_t &face = s_RelightFaces[facenum];
+		if ( !face.m_bRelight )
+			continue;
+
+		if ( face.m_iCached >= 0 )
+		{
+			const RelightCachedFace_t &cached = s_CachedFaces[face.m_iCached];
+			if ( cached.m_nBounce )
+			{
+				face.m_Bounce.CopyArray( &s_CachedBounce[cached.m_iBounce], cached.m_nBounce );
+				continue;
+			}
+		}
+
+		Vector vecBounce( 0, 0, 0 );
+		float flWeight = 0.0f;
+		for ( int i = 0; i < face.m_nClusters; i++ )
+		{
+			int iCluster = s_FaceClusters[face.m_iFirstCluster + i];
+			vecBounce += clusterBounce[iCluster];
+			flWeight += clusterWeight[iCluster];
+		}
+		if ( flWeight == 0.0f )
+		{
+			vecBounce = vecTotalBounce;
+			flWeight = flTotalWeight;
+		}
+		FillBounce( facenum, ( flWeight > 0.0f ) ? vecBounce / flWeight : vecBounce );
+	}
+}
+
+bool RelightCache_Begin( const char *pFilename )
+{
+	s_bPartial = false;
+	s_nIncrementalCompiles = 0;
+	InitRelightFaces();
+
+	const char *pFailReason = "";
+	if ( !LoadCache( pFilename, &pFailReason ) )
+	{
+		Msg( "incremental: lighting everything, no usable cache in %s (%s)\n", pFilename, pFailReason );
+		return false;
+	}
+
+	// pair up the faces and lights that didn't change
+	CUtlVector<RelightKey_t> keys, cachedKeys;
+	CUtlVector<int> faceToCached;
+	keys.SetSize( numfaces );
+	faceToCached.SetSize( numfaces );
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		keys[i].m_nKey = s_RelightFaces[i].m_nKey;
+		keys[i].m_nIndex = i;
+		faceToCached[i] = -1;
+	}
+	cachedKeys.SetSize( s_CachedFaces.Count() );
+	for ( int i = 0; i < s_CachedFaces.Count(); i++ )
+	{
+		cachedKeys[i].m_nKey = s_CachedFaces[i].m_nKey;
+		cachedKeys[i].m_nIndex = i;
+	}
+	MatchKeys( keys, cachedKeys, faceToCached.Base() );
+
+	keys.SetSize( s_LightHashes.Count() );
+	for ( int i = 0; i < s_LightHashes.Count(); i++ )
+	{
+		keys[i].m_nKey = s_LightHashes[i];
+		keys[i].m_nIndex = i;
+	}
+	cachedKeys.SetSize( s_CachedLightHashes.Count() );
+	s_CachedLightToLight.SetSize( s_CachedLightHashes.Count() );
+	for ( int i = 0; i < s_CachedLightHashes.Count(); i++ )
+	{
+		cachedKeys[i].m_nKey = s_CachedLightHashes[i];
+		cachedKeys[i].m_nIndex = i;
+		s_CachedLightToLight[i] = -1;
+	}
+	MatchKeys( cachedKeys, keys, s_CachedLightToLight.Base() );
+
+	CUtlVector<bool> lightMatched;
+	lightMatched.SetSize( s_LightHashes.Count() );
+	memset( lightMatched.Base(), 0, lightMatched.Count() * sizeof( bool ) );
+	int nRemovedLights = 0;
+	for ( int i = 0; i < s_CachedLightToLight.Count(); i++ )
+	{
+		if ( s_CachedLightToLight[i] >= 0 )
+		{
+			lightMatched[ s_CachedLightToLight[i] ] = true;
+		}
+		else
+		{
+			nRemovedLights++;
+		}
+	}
+
+	CUtlVector<directlight_t *> addedLights;
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		if ( !lightMatched[dl->index] )
+		{
+			addedLights.AddToTail( dl );
+		}
+	}
+
+	// find the clusters that can see a shadow caster that changed
+	int nClusterBytes = ( dvis->numclusters + 7 ) / 8;
+	CUtlVector<byte> changedClusters, seesChange, pvs;
+	changedClusters.SetSize( nClusterBytes + 1 );
+	seesChange.SetSize( nClusterBytes + 1 );
+	pvs.SetSize( nClusterBytes + 1 );
+	memset( changedClusters.Base(), 0, changedClusters.Count() );
+	memset( seesChange.Base(), 0, seesChange.Count() );
+
+	int nChangedCells = MarkChangedClusters( changedClusters );
+	if ( nChangedCells )
+	{
+		for ( int iCluster = 0; iCluster < dvis->numclusters; iCluster++ )
+		{
+			GetVisCache( -1, iCluster, pvs.Base() );
+			for ( int i = 0; i < nClusterBytes; i++ )
+			{
+				if ( pvs[i] & changedClusters[i] )
+				{
+					seesChange[iCluster >> 3] |= 1 << ( iCluster & 7 );
+					break;
+				}
+			}
+		}
+	}
+
+	// decide which faces get relit
+	int nLitFaces = 0, nNewFaces = 0, nRemovedFaces = s_CachedFaces.Count(), nRelight = 0;
+	for ( int facenum = 0; facenum < numfaces; facenum++ )
+	{
+		RelightFace_t &face = s_RelightFaces[facenum];
+		face.m_iCached = faceToCached[facenum];
+		face.m_bRelight = false;
+
+		if ( !IsLitFace( facenum ) )
+			continue;
+		nLitFaces++;
+
+		if ( face.m_iCached < 0 )
+		{
+			face.m_bRelight = true;
+			nNewFaces++;
+			continue;
+		}
+
+		const RelightCachedFace_t &cached = s_CachedFaces[face.m_iCached];
+
+		// a neighbor that went away was smoothed against and bounced light here
+		face.m_bRelight = ( cached.m_nNeighborKeys != face.m_nNeighborKeys );
+
+		for ( int i = 0; i < cached.m_nLights && !face.m_bRelight; i++ )
+		{
+			face.m_bRelight = ( s_CachedLightToLight[ s_CachedFaceLights[cached.m_iLights + i] ] < 0 );
+		}
+		for ( int i = 0; i < addedLights.Count() && !face.m_bRelight; i++ )
+		{
+			face.m_bRelight = FaceSeesClusters( face, addedLights[i]->pvs );
+		}
+		if ( nChangedCells && !face.m_bRelight )
+		{
+			face.m_bRelight = FaceSeesClusters( face, seesChange.Base() );
+		}
+	}
+
+	// a new face changes the smoothed normals of the faces next to it
+	for ( int facenum = 0; facenum < numfaces; facenum++ )
+	{
+		if ( s_RelightFaces[facenum].m_iCached >= 0 || !IsLitFace( facenum ) )
+			continue;
+
+		const faceneighbor_t *fn = &faceneighbor[facenum];
+		for ( int i = 0; i < fn->numneighbors; i++ )
+		{
+			if ( IsLitFace( fn->neighbor[i] ) )
+			{
+				s_RelightFaces[ fn->neighbor[i] ].m_bRelight = true;
+			}
+		}
+	}
+
+	for ( int facenum = 0; facenum < numfaces; facenum++ )
+	{
+		if ( s_RelightFaces[facenum].m_bRelight )
+			nRelight++;
+	}
+
+	for ( int facenum = 0; facenum < numfaces; facenum++ )
+	{
+		if ( faceToCached[facenum] >= 0 )
+			nRemovedFaces--;
+	}
+
+	Msg( "incremental: %d of %d lights changed or added, %d removed, %d of %d faces new, %d removed, %d shadow casting cells changed\n",
+		addedLights.Count(), s_LightHashes.Count(), nRemovedLights, nNewFaces, nLitFaces, nRemovedFaces, nChangedCells );
+
+	if ( nRelight > RELIGHT_MAX_FRACTION * nLitFaces )
+	{
+		Msg( "incremental: lighting everything, %d of %d faces would need relighting\n", nRelight, nLitFaces );
+		for ( int facenum = 0; facenum < numfaces; facenum++ )
+		{
+			s_RelightFaces[facenum].m_bRelight = true;
+		}
+		return false;
+	}
+
+	CUtlVector<int> dispFaces;
+	for ( int facenum = 0; facenum < numfaces; facenum++ )
+	{
+		if ( g_pFaces[facenum].dispinfo != -1 )
+		{
+			dispFaces.AddToTail( facenum );
+		}
+	}
+
+	// the relit faces sample their neighbors' direct light to smooth their edges,
+	// so light those too, but keep their cached lightmaps
+	g_FacesVisibleToLights.SetSize( numfaces/8 + 1 );
+	memset( g_FacesVisibleToLights.Base(), 0, g_FacesVisibleToLights.Count() );
+	for ( int facenum = 0; facenum < numfaces; facenum++ )
+	{
+		const RelightFace_t &face = s_RelightFaces[facenum];
+		if ( !face.m_bRelight )
+			continue;
+
+		g_FacesVisibleToLights[facenum >> 3] |= 1 << ( facenum & 7 );
+
+		const faceneighbor_t *fn = &faceneighbor[facenum];
+		for ( int i = 0; i < fn->numneighbors; i++ )
+		{
+			int iNeighbor = fn->neighbor[i];
+			g_FacesVisibleToLights[iNeighbor >> 3] |= 1 << ( iNeighbor & 7 );
+		}
+
+		// displacements smooth against any displacement they touch
+		if ( g_pFaces[facenum].dispinfo == -1 )
+			continue;
+
+		for ( int i = 0; i < dispFaces.Count(); i++ )
+		{
+			int iOther = dispFaces[i];
+			const RelightFace_t &other = s_RelightFaces[iOther];
+			if ( face.m_vecMins.x <= other.m_vecMaxs.x + 1.0f && face.m_vecMaxs.x >= other.m_vecMins.x - 1.0f &&
+				 face.m_vecMins.y <= other.m_vecMaxs.y + 1.0f && face.m_vecMaxs.y >= other.m_vecMins.y - 1.0f &&
+				 face.m_vecMins.z <= other.m_vecMaxs.z + 1.0f && face.m_vecMaxs.z >= other.m_vecMins.z - 1.0f )
+			{
+				g_FacesVisibleToLights[iOther >> 3] |= 1 << ( iOther & 7 );
+			}
+		}
+	}
+
+	SetupRelitBounce();
+
+	Msg( "incremental: relighting %d of %d faces", nRelight, nLitFaces );
+	if ( numbounce > 0 )
+	{
+		Msg( ", bounced light is from the compile %d incremental compile%s ago", s_nIncrementalCompiles + 1,
+			s_nIncrementalCompiles ? "s" : "" );
+	}
+	Msg( "\n" );
+
+	s_bPartial = true;
+	return true;
+}
+
+bool RelightCache_IsPartial()
+{
+	return s_bPartial;
+}
+
+
+//-----------------------------------------------------------------------------
+// Lighting
+//-----------------------------------------------------------------------------
+void RelightCache_AddLightToFace( int facenum, int iLight )
+{
+	if ( !s_RelightFaces.Count() || !s_RelightFaces[facenum].m_bRelight )
+		return;
+
+	// the lights come in the same order for every group of samples
+	CUtlVector<int> &lights = s_RelightFaces[facenum].m_Lights;
+	if ( lights.Count() && lights.Tail() == iLight )
+		return;
+	if ( lights.Find( iLight ) < 0 )
+	{
+		lights.AddToTail( iLight );
+	}
+}
+
+void RelightCache_RestoreStyles()
+{
+	if ( !s_bPartial )
+		return;
+
+	for ( int facenum = 0; facenum < numfaces; facenum++ )
+	{
+		const RelightFace_t &face = s_RelightFaces[facenum];
+		if ( !face.m_bRelight && face.m_iCached >= 0 )
+		{
+			memcpy( g_pFaces[facenum].styles, s_CachedFaces[face.m_iCached].m_Styles, sizeof( g_pFaces[facenum].styles ) );
+		}
+	}
+}
+
+bool RelightCache_RestoreFace( int facenum )
+{
+	if ( !s_bPartial )
+		return false;
+
+	const RelightFace_t &face = s_RelightFaces[facenum];
+	if ( face.m_bRelight || face.m_iCached < 0 )
+		return false;
+
+	const dface_t *f = &g_pFaces[facenum];
+	const RelightCachedFace_t &cached = s_CachedFaces[face.m_iCached];
+	if ( !cached.m_nLightmapBytes )
+		return true;
+
+	Assert( cached.m_nLightmapBytes == GetLightmapBytes( f ) );
+	memcpy( &(*pdlightdata)[f->lightofs - CountStyles( f ) * 4], &s_CachedLightmaps[cached.m_iLightmap], cached.m_nLightmapBytes );
+	return true;
+}
+
+void RelightCache_SetBounce( int facenum, int iLuxel, const LightingValue_t *pBounce, int nBumps )
+{
+	if ( !s_RelightFaces.Count() )
+		return;
+
+	CUtlVector<ColorRGBExp32> &bounce = s_RelightFaces[facenum].m_Bounce;
+	if ( bounce.Count() != facelight[facenum].numluxels * nBumps )
+	{
+		bounce.SetSize( facelight[facenum].numluxels * nBumps );
+	}
+
+	for ( int i = 0; i < nBumps; i++ )
+	{
+		VectorToColorRGBExp32( pBounce[i].m_vecLighting, bounce[iLuxel * nBumps + i] );
+	}
+}
+
+void RelightCache_GetBounce( int facenum, int iLuxel, LightingValue_t *pBounce, int nBumps )
+{
+	const CUtlVector<ColorRGBExp32> &bounce = s_RelightFaces[facenum].m_Bounce;
+	for ( int i = 0; i < nBumps; i++ )
+	{
+		pBounce[i].Zero();
+		if ( ( iLuxel + 1 ) * nBumps <= bounce.Count() )
+		{
+			ColorRGBExp32ToVector( bounce[iLuxel * nBumps + i], pBounce[i].m_vecLighting );
+		}
+	}
+}
+
+void RelightCache_Free()
+{
+	s_bPartial = false;
+	s_Cells.Purge();
+	s_RelightFaces.Purge();
+	s_FaceClusters.Purge();
+	s_LightHashes.Purge();
+	s_CachedLightHashes.Purge();
+	s_CachedLightToLight.Purge();
+	s_CachedCells.Purge();
+	s_CachedFaces.Purge();
+	s_CachedLightmaps.Purge();
+	s_CachedBounce.Purge();
+	s_CachedFaceLights.Purge();
+}
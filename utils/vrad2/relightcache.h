@@ -0,0 +1,69 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Cache of the last compile's lighting for -incremental.
+//
+// Every compile with -incremental saves each face's finished lightmaps, the
+// bounced light it received and which lights reached it, keyed by a hash of the
+// face's geometry and texture, along with a hash of every light and of the
+// shadow casting triangles in each cell of a world grid. The next -incremental
+// compile compares the map against that and only relights the faces which
+// changed, which a new, changed or removed light reaches, or which can see
+// geometry that changed. Everything else keeps its lightmaps from the cache.
+//
+// Bounced light isn't recomputed for a partial relight. Relit faces reuse the
+// bounced light they got in the last full compile, and new faces get the
+// average bounce of the faces around them, so bounce from changed lights is
+// only approximate until the next compile without -incremental.
+//
+//=============================================================================//
+
+#ifndef RELIGHTCACHE_H
+#define RELIGHTCACHE_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+struct LightingValue_t;
+
+
+extern bool g_bIncrementalLighting;				// -incremental
+
+
+// Hashes the shadow casting triangles. Call after they've all been added to
+// g_RtEnv and before its acceleration structure is built.
+void RelightCache_HashOccluders();
+
+// Loads the cache and works out which faces need relighting, once the direct
+// lights exist. Returns true and fills in g_FacesVisibleToLights if only some
+// faces need it, false when everything has to be lit (no usable cache, or too
+// much has changed). Either way the lighting gets recorded for RelightCache_Save.
+bool RelightCache_Begin( const char *pFilename );
+
+// True between a RelightCache_Begin that returned true and RelightCache_Free.
+// Bounce isn't run and FinalLightFace uses the cached bounced light.
+bool RelightCache_IsPartial();
+
+// Records that light dl->index reaches a face. Only call from the thread
+// lighting the face.
+void RelightCache_AddLightToFace( int facenum, int iLight );
+
+// Puts back the light styles of the faces that keep their cached lightmaps,
+// which BuildFacelights clears. Call before PrecompLightmapOffsets.
+void RelightCache_RestoreStyles();
+
+// Copies a face's cached lightmaps into pdlightdata if it isn't being relit.
+// Returns false if FinalLightFace has to build them.
+bool RelightCache_RestoreFace( int facenum );
+
+// The bounced light of a luxel, one value per bump vector. Set stores what the
+// bounce computed, Get returns the cached value during a partial relight.
+void RelightCache_SetBounce( int facenum, int iLuxel, const LightingValue_t *pBounce, int nBumps );
+void RelightCache_GetBounce( int facenum, int iLuxel, LightingValue_t *pBounce, int nBumps );
+
+// Writes the cache for the next compile, once FinalLightFace is done.
+bool RelightCache_Save( const char *pFilename );
+
+void RelightCache_Free();
+
+
+#endif // RELIGHTCACHE_H
@@ -11,6 +11,7 @@
 
 #include "vrad.h"
 #include "trace.h"
+#include "vradprofile.h"
 #include "Cmodel.h"
 #include "mathlib/vmatrix.h"
 
@@ -148,21 +149,19 @@ public:
 	}
 };
 
-void TestLine( const FourVectors& start, const FourVectors& stop,
-               fltx4 *pFractionVisible, int static_prop_index_to_ignore )
+static void InitTestLineRays( FourVectors const& start, FourVectors const& stop, FourRays &rays, fltx4 &len )
 {
-	FourRays myrays;
-	myrays.origin = start;
-	myrays.direction = stop;
-	myrays.direction -= myrays.origin;
-	fltx4 len = myrays.direction.length();
-	myrays.direction *= ReciprocalSIMD( len );
-
-	RayTracingResult rt_result;
-	CCoverageCountTexture coverageCallback;
-
-	g_RtEnv.Trace4Rays(myrays, Four_Zeros, len, &rt_result, TRACE_ID_STATICPROP | static_prop_index_to_ignore, g_bTextureShadows ? &coverageCallback : 0 );
+	rays.origin = start;
+	rays.direction = stop;
+	rays.direction -= rays.origin;
+	len = rays.direction.length();
+	rays.direction *= ReciprocalSIMD( len );
+}
 
+// How much of each of TestLine's rays got through. pCoverage is the callback the
+// packet was traced with, when there are texture shadows.
+static fltx4 GetTestLineVisibility( const RayTracingResult &rt_result, const fltx4 &len, CCoverageCountTexture *pCoverage )
+{
 	// Assume we can see the targets unless we get hits
 	float visibility[4];
 	for ( int i = 0; i < 4; i++ )
@@ -174,26 +173,30 @@ void TestLine( const FourVectors& start, const FourVectors& stop,
 			visibility[i] = 0.0f;
 		}
 	}
-	*pFractionVisible = LoadUnalignedSIMD( visibility );
-	if ( g_bTextureShadows )
-		*pFractionVisible = MinSIMD( *pFractionVisible, coverageCallback.GetFractionVisible() );
+	fltx4 fractionVisible = LoadUnalignedSIMD( visibility );
+	if ( pCoverage )
+		fractionVisible = MinSIMD( fractionVisible, pCoverage->GetFractionVisible() );
+	return fractionVisible;
 }
 
-void TestLine_IgnoreSky( const FourVectors& start, const FourVectors& stop,
-						 fltx4 *pFractionVisible, int static_prop_index_to_ignore )
+void TestLine( const FourVectors& start, const FourVectors& stop,
+               fltx4 *pFractionVisible, int static_prop_index_to_ignore )
 {
 	FourRays myrays;
-	myrays.origin = start;
-	myrays.direction = stop;
-	myrays.direction -= myrays.origin;
-	fltx4 len = myrays.direction.length();
-	myrays.direction *= ReciprocalSIMD( len );
+	fltx4 len;
+	InitTestLineRays( start, stop, myrays, len );
 
 	RayTracingResult rt_result;
 	CCoverageCountTexture coverageCallback;
 
-	g_RtEnv.Trace4Rays( myrays, Four_Zeros, len, &rt_result, TRACE_ID_STATICPROP | static_prop_index_to_ignore, g_bTextureShadows ? &coverageCallback : 0 );
+	g_RtEnv.Trace4Rays(myrays, Four_Zeros, len, &rt_result, TRACE_ID_STATICPROP | static_prop_index_to_ignore, g_bTextureShadows ? &coverageCallback : 0 );
+	VRadProfile_CountRays( 4 );
+
+	*pFractionVisible = GetTestLineVisibility( rt_result, len, g_bTextureShadows ? &coverageCallback : NULL );
+}
 
+static fltx4 GetTestLine_IgnoreSkyVisibility( const RayTracingResult &rt_result, const fltx4 &len, CCoverageCountTexture *pCoverage )
+{
 	// Assume we can see the targets unless we get hits
 	float visibility[4];
 
@@ -215,9 +218,26 @@ void TestLine_IgnoreSky( const FourVectors& start, const FourVectors& stop,
 				visibility[i] = 0.0f;
 		}
 	}
-	*pFractionVisible = LoadUnalignedSIMD( visibility );
-	if ( g_bTextureShadows )
-		*pFractionVisible = MinSIMD( *pFractionVisible, coverageCallback.GetFractionVisible() );
+	fltx4 fractionVisible = LoadUnalignedSIMD( visibility );
+	if ( pCoverage )
+		fractionVisible = MinSIMD( fractionVisible, pCoverage->GetFractionVisible() );
+	return fractionVisible;
+}
+
+void TestLine_IgnoreSky( const FourVectors& start, const FourVectors& stop,
+						 fltx4 *pFractionVisible, int static_prop_index_to_ignore )
+{
+	FourRays myrays;
+	fltx4 len;
+	InitTestLineRays( start, stop, myrays, len );
+
+	RayTracingResult rt_result;
+	CCoverageCountTexture coverageCallback;
+
+	g_RtEnv.Trace4Rays( myrays, Four_Zeros, len, &rt_result, TRACE_ID_STATICPROP | static_prop_index_to_ignore, g_bTextureShadows ? &coverageCallback : 0 );
+	VRadProfile_CountRays( 4 );
+
+	*pFractionVisible = GetTestLine_IgnoreSkyVisibility( rt_result, len, g_bTextureShadows ? &coverageCallback : NULL );
 }
 
 /*
@@ -388,25 +408,12 @@ void DM_ClipBoxToBrush( CToolTrace *trace, const Vector& mins, const Vector& max
 	}
 }
 
-void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
-	fltx4 *pFractionVisible, bool canRecurse, int static_prop_to_skip, bool bDoDebug )
+// How much of each of TestLine_DoesHitSky's rays got through. Rays that reach the
+// sky go on into the 3D skyboxes when canRecurse is set.
+static fltx4 GetTestLine_DoesHitSkyVisibility( FourVectors const& start, FourVectors const& stop,
+	const RayTracingResult &rt_result, const fltx4 &len, CCoverageCountTexture *pCoverage,
+	bool canRecurse, int static_prop_to_skip, bool bDoDebug )
 {
-	FourRays myrays;
-	myrays.origin = start;
-	myrays.direction = stop;
-	myrays.direction -= myrays.origin;
-	fltx4 len = myrays.direction.length();
-	myrays.direction *= ReciprocalSIMD( len );
-	RayTracingResult rt_result;
-	CCoverageCountTexture coverageCallback;
-
-	g_RtEnv.Trace4Rays(myrays, Four_Zeros, len, &rt_result, TRACE_ID_STATICPROP | static_prop_to_skip, g_bTextureShadows? &coverageCallback : 0);
-
-	if ( bDoDebug )
-	{
-		WriteTrace( "trace.txt", myrays, rt_result );
-	}
-
 	float aOcclusion[4];
 	for ( int i = 0; i < 4; i++ )
 	{
@@ -420,8 +427,8 @@ void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
 		}
 	}
 	fltx4 occlusion = LoadUnalignedSIMD( aOcclusion );
-	if (g_bTextureShadows)
-		occlusion = MaxSIMD ( occlusion, coverageCallback.GetCoverage() );
+	if ( pCoverage )
+		occlusion = MaxSIMD ( occlusion, pCoverage->GetCoverage() );
 
 	bool fullyOccluded = ( TestSignSIMD( CmpGeSIMD( occlusion, Four_Ones ) ) == 0xF );
 
@@ -453,9 +460,10 @@ void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
 						skystop = dir;
 						skystop *= MAX_TRACE_LENGTH;
 						skystop += skystart;
-						TestLine_DoesHitSky ( skystart, skystop, pFractionVisible, false, static_prop_to_skip, bDoDebug );
+						fltx4 fractionVisible;
+						TestLine_DoesHitSky ( skystart, skystop, &fractionVisible, false, static_prop_to_skip, bDoDebug );
 						occlusion = AddSIMD ( occlusion, Four_Ones );
-						occlusion = SubSIMD ( occlusion, *pFractionVisible );
+						occlusion = SubSIMD ( occlusion, fractionVisible );
 					}
 				}
 			}
@@ -464,7 +472,282 @@ void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
 
 	occlusion = MaxSIMD( occlusion, Four_Zeros );
 	occlusion = MinSIMD( occlusion, Four_Ones );
-	*pFractionVisible = SubSIMD( Four_Ones, occlusion );
+	return SubSIMD( Four_Ones, occlusion );
+}
+
+void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
+	fltx4 *pFractionVisible, bool canRecurse, int static_prop_to_skip, bool bDoDebug )
+{
+	FourRays myrays;
+	fltx4 len;
+	InitTestLineRays( start, stop, myrays, len );
+	RayTracingResult rt_result;
+	CCoverageCountTexture coverageCallback;
+
+	g_RtEnv.Trace4Rays(myrays, Four_Zeros, len, &rt_result, TRACE_ID_STATICPROP | static_prop_to_skip, g_bTextureShadows? &coverageCallback : 0);
+	VRadProfile_CountRays( 4 );
+
+	if ( bDoDebug )
+	{
+		WriteTrace( "trace.txt", myrays, rt_result );
+	}
+
+	*pFractionVisible = GetTestLine_DoesHitSkyVisibility( start, stop, rt_result, len, g_bTextureShadows ? &coverageCallback : NULL,
+		canRecurse, static_prop_to_skip, bDoDebug );
+}
+
+
+//-----------------------------------------------------------------------------
+// Shadow ray batching
+//-----------------------------------------------------------------------------
+enum ShadowRayStreamMode_t
+{
+	SHADOW_RAYS_OFF = 0,
+	SHADOW_RAYS_RECORDING,
+	SHADOW_RAYS_TRACED,
+};
+
+struct ShadowRay_t
+{
+	FourVectors	m_Start;
+	FourVectors	m_Stop;
+	fltx4		m_FractionVisible;
+	fltx4		m_Weights[SHADOW_RAY_MAX_SUMS];
+	int			m_nType;
+	int			m_nStaticPropToSkip;
+	int			m_iFirstSum;
+	int			m_nSums;
+	bool		m_bWeighted;
+	bool		m_bCanRecurse;
+};
+
+struct ShadowRaySortKey_t
+{
+	uint64		m_nKey;
+	int			m_nRay;
+};
+
+struct ShadowRayStream_t
+{
+	int			m_nMode;
+	int			m_nBatchKey;
+	int			m_nBatchRays;				// recorded since the batch key was set
+	int			m_nAddedRays;				// handed back by ShadowRays_AddTracedVisible
+	CUtlVector< ShadowRay_t, CUtlMemoryAligned< ShadowRay_t, 16 > > m_Rays;
+	CUtlVector< ShadowRaySortKey_t > m_SortKeys;
+
+	// the rays in sorted order, for TraceRayPackets
+	CUtlMemoryAligned<FourRays, 16>			m_Packets;
+	CUtlMemoryAligned<fltx4, 16>			m_TMin;
+	CUtlMemoryAligned<fltx4, 16>			m_TMax;
+	CUtlMemoryAligned<RayTracingResult, 16>	m_Results;
+};
+
+static ShadowRayStream_t s_ShadowRayStreams[MAX_TOOL_THREADS+1];
+
+static ShadowRayStream_t &GetThreadShadowRayStream()
+{
+	int iThread = GetCurrentThreadIndex();
+	return s_ShadowRayStreams[( iThread >= 0 ) ? iThread : THREADINDEX_MAIN];
+}
+
+static void TraceShadowRay( int nType, FourVectors const& start, FourVectors const& stop,
+							fltx4 *pFractionVisible, int static_prop_to_skip, bool canRecurse )
+{
+	switch ( nType )
+	{
+	case SHADOW_RAY_TESTLINE:
+		TestLine( start, stop, pFractionVisible, static_prop_to_skip );
+		break;
+	case SHADOW_RAY_IGNORE_SKY:
+		TestLine_IgnoreSky( start, stop, pFractionVisible, static_prop_to_skip );
+		break;
+	case SHADOW_RAY_DOES_HIT_SKY:
+		TestLine_DoesHitSky( start, stop, pFractionVisible, canRecurse, static_prop_to_skip, false );
+		break;
+	default:
+		Assert( 0 );
+		*pFractionVisible = Four_Ones;
+		break;
+	}
+}
+
+static inline void AddVisible( ShadowRaySums_t &sums, int iFirstSum, int nSums, const fltx4 *pWeights, const fltx4 &fractionVisible )
+{
+	for ( int i = 0; i < nSums; i++ )
+	{
+		fltx4 &sum = sums.m_Sums[iFirstSum + i];
+		sum = AddSIMD( sum, pWeights ? MulSIMD( fractionVisible, pWeights[i] ) : fractionVisible );
+	}
+}
+
+void ShadowRay_AddVisible( ShadowRaySums_t &sums, int iFirstSum, int nSums, const fltx4 *pWeights,
+						   int nType, FourVectors const& start, FourVectors const& stop,
+						   int static_prop_to_skip, bool canRecurse )
+{
+	Assert( iFirstSum >= 0 && iFirstSum + nSums <= SHADOW_RAY_MAX_SUMS );
+
+	ShadowRayStream_t &stream = GetThreadShadowRayStream();
+	if ( stream.m_nMode != SHADOW_RAYS_RECORDING )
+	{
+		fltx4 fractionVisible;
+		TraceShadowRay( nType, start, stop, &fractionVisible, static_prop_to_skip, canRecurse );
+		AddVisible( sums, iFirstSum, nSums, pWeights, fractionVisible );
+		return;
+	}
+
+	ShadowRay_t &ray = stream.m_Rays[stream.m_Rays.AddToTail()];
+	ray.m_Start = start;
+	ray.m_Stop = stop;
+	ray.m_nType = nType;
+	ray.m_nStaticPropToSkip = static_prop_to_skip;
+	ray.m_iFirstSum = iFirstSum;
+	ray.m_nSums = nSums;
+	ray.m_bWeighted = ( pWeights != NULL );
+	ray.m_bCanRecurse = canRecurse;
+	for ( int i = 0; pWeights && i < nSums; i++ )
+	{
+		ray.m_Weights[i] = pWeights[i];
+	}
+	++sums.m_nRays;
+
+	// Rays to the same light, and the same sample of it, go together, and
+	// after that ones heading the same way
+	Vector vecDir = stop.Vec( 0 ) - start.Vec( 0 );
+	int nSignMask = ( vecDir.x < 0.0f ) | ( ( vecDir.y < 0.0f ) << 1 ) | ( ( vecDir.z < 0.0f ) << 2 );
+
+	ShadowRaySortKey_t &key = stream.m_SortKeys[stream.m_SortKeys.AddToTail()];
+	key.m_nKey = ( (uint64)stream.m_nBatchKey << 40 ) | ( (uint64)( stream.m_nBatchRays & 0xFFFFFF ) << 16 ) | nSignMask;
+	key.m_nRay = stream.m_Rays.Count() - 1;
+	++stream.m_nBatchRays;
+}
+
+static int __cdecl CompareShadowRaySortKeys( const ShadowRaySortKey_t *pA, const ShadowRaySortKey_t *pB )
+{
+	if ( pA->m_nKey != pB->m_nKey )
+		return ( pA->m_nKey < pB->m_nKey ) ? -1 : 1;
+	return pA->m_nRay - pB->m_nRay;
+}
+
+void ShadowRays_BeginRecord()
+{
+	ShadowRayStream_t &stream = GetThreadShadowRayStream();
+	Assert( stream.m_nMode == SHADOW_RAYS_OFF );
+	stream.m_nMode = SHADOW_RAYS_RECORDING;
+	stream.m_nBatchKey = 0;
+	stream.m_nBatchRays = 0;
+	stream.m_Rays.RemoveAll();
+	stream.m_SortKeys.RemoveAll();
+}
+
+void ShadowRays_SetBatchKey( int nKey )
+{
+	ShadowRayStream_t &stream = GetThreadShadowRayStream();
+	stream.m_nBatchKey = nKey;
+	stream.m_nBatchRays = 0;
+}
+
+int ShadowRays_GetRecordedCount()
+{
+	ShadowRayStream_t &stream = GetThreadShadowRayStream();
+	return ( stream.m_nMode == SHADOW_RAYS_RECORDING ) ? stream.m_Rays.Count() : 0;
+}
+
+void ShadowRays_Flush()
+{
+	ShadowRayStream_t &stream = GetThreadShadowRayStream();
+	Assert( stream.m_nMode == SHADOW_RAYS_RECORDING );
+
+	// so nothing traced from here on gets recorded, such as the 3D skybox rays
+	stream.m_nMode = SHADOW_RAYS_TRACED;
+	stream.m_nAddedRays = 0;
+
+	stream.m_SortKeys.Sort( CompareShadowRaySortKeys );
+	int nRays = stream.m_SortKeys.Count();
+
+	if ( g_bTextureShadows )
+	{
+		// the coverage callbacks only know about one packet at a time
+		for ( int i = 0; i < nRays; ++i )
+		{
+			ShadowRay_t &ray = stream.m_Rays[stream.m_SortKeys[i].m_nRay];
+			TraceShadowRay( ray.m_nType, ray.m_Start, ray.m_Stop, &ray.m_FractionVisible, ray.m_nStaticPropToSkip, ray.m_bCanRecurse );
+		}
+		return;
+	}
+
+	stream.m_Packets.EnsureCapacity( nRays );
+	stream.m_TMin.EnsureCapacity( nRays );
+	stream.m_TMax.EnsureCapacity( nRays );
+	stream.m_Results.EnsureCapacity( nRays );
+	for ( int i = 0; i < nRays; ++i )
+	{
+		const ShadowRay_t &ray = stream.m_Rays[stream.m_SortKeys[i].m_nRay];
+		InitTestLineRays( ray.m_Start, ray.m_Stop, stream.m_Packets[i], stream.m_TMax[i] );
+		stream.m_TMin[i] = Four_Zeros;
+	}
+
+	// neighbouring packets that head the same way get traced together, as long as
+	// they skip the same static prop
+	int iFirst = 0;
+	while ( iFirst < nRays )
+	{
+		int nSkip = stream.m_Rays[stream.m_SortKeys[iFirst].m_nRay].m_nStaticPropToSkip;
+		int iEnd = iFirst + 1;
+		while ( iEnd < nRays && stream.m_Rays[stream.m_SortKeys[iEnd].m_nRay].m_nStaticPropToSkip == nSkip )
+		{
+			iEnd++;
+		}
+		g_RtEnv.TraceRayPackets( stream.m_Packets.Base() + iFirst, stream.m_TMin.Base() + iFirst, stream.m_TMax.Base() + iFirst,
+			iEnd - iFirst, stream.m_Results.Base() + iFirst, TRACE_ID_STATICPROP | nSkip );
+		iFirst = iEnd;
+	}
+	VRadProfile_CountRays( 4 * nRays );
+
+	for ( int i = 0; i < nRays; ++i )
+	{
+		ShadowRay_t &ray = stream.m_Rays[stream.m_SortKeys[i].m_nRay];
+		const RayTracingResult &rt_result = stream.m_Results[i];
+		const fltx4 &len = stream.m_TMax[i];
+		switch ( ray.m_nType )
+		{
+		case SHADOW_RAY_TESTLINE:
+			ray.m_FractionVisible = GetTestLineVisibility( rt_result, len, NULL );
+			break;
+		case SHADOW_RAY_IGNORE_SKY:
+			ray.m_FractionVisible = GetTestLine_IgnoreSkyVisibility( rt_result, len, NULL );
+			break;
+		case SHADOW_RAY_DOES_HIT_SKY:
+			ray.m_FractionVisible = GetTestLine_DoesHitSkyVisibility( ray.m_Start, ray.m_Stop, rt_result, len, NULL,
+				ray.m_bCanRecurse, ray.m_nStaticPropToSkip, false );
+			break;
+		default:
+			Assert( 0 );
+			ray.m_FractionVisible = Four_Ones;
+			break;
+		}
+	}
+}
+
+void ShadowRays_AddTracedVisible( ShadowRaySums_t &sums )
+{
+	// in the order the rays were recorded, so the sums add up exactly as if
+	// they'd been traced right away
+	ShadowRayStream_t &stream = GetThreadShadowRayStream();
+	Assert( stream.m_nMode == SHADOW_RAYS_TRACED && stream.m_nAddedRays + sums.m_nRays <= stream.m_Rays.Count() );
+	for ( int i = 0; i < sums.m_nRays; i++ )
+	{
+		const ShadowRay_t &ray = stream.m_Rays[stream.m_nAddedRays++];
+		AddVisible( sums, ray.m_iFirstSum, ray.m_nSums, ray.m_bWeighted ? ray.m_Weights : NULL, ray.m_FractionVisible );
+	}
+	sums.m_nRays = 0;
+}
+
+void ShadowRays_End()
+{
+	ShadowRayStream_t &stream = GetThreadShadowRayStream();
+	Assert( stream.m_nMode == SHADOW_RAYS_TRACED && stream.m_nAddedRays == stream.m_Rays.Count() );
+	stream.m_nMode = SHADOW_RAYS_OFF;
 }
 
 
@@ -0,0 +1,1116 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compact storage for the patch to patch transfers. See transfermatrix.h.
+//
+//=============================================================================//
+
+#include "vrad.h"
+#include "transfermatrix.h"
+#include "tier0/threadtools.h"
+#include "threads.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+// Rows are collected in blocks of this size until TransferMatrix_Finish packs them.
+#define TRANSFER_BLOCK_SIZE		(32*1024*1024)
+
+// Blocks start on this boundary in the spill file so that each one can be mapped on its
+// own. It's the allocation granularity on Windows and a multiple of the page size elsewhere.
+#define TRANSFER_SPILL_ALIGN	(64*1024)
+
+// The weights are stored relative to the largest weight in their row. The code is the
+// top 16 bits of the float's exponent and mantissa, offset so that 0xffff is 1.0. That
+// keeps 11 mantissa bits (0.05% error) over 32 octaves and decodes with a shift and an add.
+#define TRANSFER_CODE_SHIFT		12
+#define TRANSFER_CODE_BASE		( 0x3f800000 - ( 0xffff << TRANSFER_CODE_SHIFT ) )
+
+// The bump cosines use 15 bits of the same kind of code, 9 mantissa bits over 2^-32 to
+// 2^32 since dividing by the normal's cosine makes them large at grazing angles. 0 is 0.
+// The top bit of a transfer's first code is set when the other patch is behind the
+// receiver, which makes element 0 zero and the others negative.
+#define BUMP_COSINE_SHIFT		14
+#define BUMP_COSINE_BASE		( 0x4f800000 - ( 0x7fff << BUMP_COSINE_SHIFT ) )
+#define BUMP_COSINE_BEHIND		0x8000
+
+union TransferFloatBits_t
+{
+	float	f;
+	uint32	i;
+};
+
+struct TransferBlock_t
+{
+	byte	*m_pData;				// NULL once it's been written to the spill file
+	int		m_nSize;
+	int		m_nUsed;
+	int		m_nPending;				// rows handed out but not encoded yet
+
+	int64	m_nFileOffset;			// -1 until it's been spilled
+	int		m_iNextInFile;
+	byte	*m_pView;				// mapped while rows in it are being gathered
+	int		m_nViewRefs;
+};
+
+static CUtlVector<TransferBlock_t>	s_TransferBlocks;
+static int							s_iCurrentBlock = -1;
+static int64						s_nBlockMemory = 0;
+static CThreadFastMutex				s_TransferBlockMutex;
+
+static CUtlVector<int>				s_TransferRowBlock;				// -1 for patches without transfers
+static CUtlVector<int>				s_TransferRowOffset;
+static CUtlVector<int>				s_TransferRowBytes;
+static CUtlVector<const byte *>		s_TransferRows;					// set by TransferMatrix_Finish unless spilled
+static byte							*s_pTransferMatrix = NULL;
+static int64						s_nTransferMatrixBytes = 0;
+
+// Once the blocks use more than the memory budget every finished block is appended to
+// the spill file and freed. The gather maps them back in file order, two at a time.
+static int64						s_nMemoryBudget = 0;			// 0 for no limit
+static char							s_szSpillFile[MAX_PATH] = "";
+static FILE							*s_pSpillFile = NULL;			// while the rows are being added
+static int64						s_nSpillFileSize = 0;
+static int							s_iLastSpilledBlock = -1;
+static bool							s_bSpilled = false;				// rows are read from the spill file
+static CUtlVector<int>				s_GatherOrder;					// patches in spill file order
+static CThreadFastMutex				s_SpillViewMutex;
+#ifdef _WIN32
+static HANDLE						s_hSpillFile = INVALID_HANDLE_VALUE;
+static HANDLE						s_hSpillMapping = NULL;
+#else
+static int							s_nSpillFile = -1;
+#endif
+
+// The shooting matrix is the transpose, one row per source patch, split into
+// partitions by receiver so that each thread can shoot into its own receivers.
+struct ShootPartition_t
+{
+	int					m_nFirstReceiver;
+	int					m_nReceivers;
+	byte				*m_pData;				// exactly m_nUsed bytes
+	int64				m_nUsed;
+	CUtlVector<int64>	m_ColumnOffset;			// per source patch, -1 when empty
+	CUtlVector<int>		m_ColumnCount;
+};
+
+static CUtlVector<ShootPartition_t>	s_ShootPartitions;
+static int64						s_nShootScratchBytes = 0;
+
+static uint16						*s_pBumpCosineCodes = NULL;		// three per transfer
+static int64						s_nBumpCosineCodes = 0;
+static CUtlVector<int64>			s_BumpCosineRows;				// first code of each patch, -1 if not cached
+static CUtlVector<bool>				s_BumpCosineRowDone;
+
+
+static inline uint16 EncodeTransferWeight( float flRelative )
+{
+	TransferFloatBits_t bits;
+	bits.f = flRelative;
+	if ( bits.i <= TRANSFER_CODE_BASE )
+		return 0;
+	uint32 nCode = ( bits.i - TRANSFER_CODE_BASE + ( 1 << ( TRANSFER_CODE_SHIFT - 1 ) ) ) >> TRANSFER_CODE_SHIFT;
+	return ( nCode > 0xffff ) ? 0xffff : nCode;
+}
+
+static inline float DecodeTransferWeight( uint16 nCode )
+{
+	TransferFloatBits_t bits;
+	bits.i = ( (uint32)nCode << TRANSFER_CODE_SHIFT ) + TRANSFER_CODE_BASE;
+	return bits.f;
+}
+
+static inline uint16 EncodeBumpCosine( float flCosine )
+{
+	TransferFloatBits_t bits;
+	bits.f = fabs( flCosine );
+	if ( bits.i <= BUMP_COSINE_BASE )
+		return 0;
+	uint32 nCode = ( bits.i - BUMP_COSINE_BASE + ( 1 << ( BUMP_COSINE_SHIFT - 1 ) ) ) >> BUMP_COSINE_SHIFT;
+	return ( nCode > 0x7fff ) ? 0x7fff : nCode;
+}
+
+static inline float DecodeBumpCosine( uint16 nCode )
+{
+	nCode &= 0x7fff;
+	if ( !nCode )
+		return 0.0f;
+	TransferFloatBits_t bits;
+	bits.i = ( (uint32)nCode << BUMP_COSINE_SHIFT ) + BUMP_COSINE_BASE;
+	return bits.f;
+}
+
+static inline int VarIntBytes( uint32 n )
+{
+	int nBytes = 1;
+	while ( n >= 0x80 )
+	{
+		n >>= 7;
+		nBytes++;
+	}
+	return nBytes;
+}
+
+
+//-----------------------------------------------------------------------------
+// Spill file
+//-----------------------------------------------------------------------------
+static void OpenSpillFile()
+{
+	s_pSpillFile = fopen( s_szSpillFile, "wb" );
+	if ( !s_pSpillFile )
+		Error( "Couldn't create %s\n", s_szSpillFile );
+	s_nSpillFileSize = 0;
+	s_iLastSpilledBlock = -1;
+	Msg( "Transfers need more than %d megs, spilling them to %s\n", (int)( s_nMemoryBudget / ( 1024*1024 ) ), s_szSpillFile );
+}
+
+// Call with s_TransferBlockMutex held
+static void WriteSpillBlock( int iBlock )
+{
+	static const byte zeros[TRANSFER_SPILL_ALIGN] = { 0 };
+
+	TransferBlock_t &block = s_TransferBlocks[iBlock];
+	Assert( block.m_pData && !block.m_nPending );
+
+	int nPadding = ( TRANSFER_SPILL_ALIGN - ( block.m_nUsed % TRANSFER_SPILL_ALIGN ) ) % TRANSFER_SPILL_ALIGN;
+	if ( fwrite( block.m_pData, block.m_nUsed, 1, s_pSpillFile ) != 1 ||
+		 ( nPadding && fwrite( zeros, nPadding, 1, s_pSpillFile ) != 1 ) )
+	{
+		Error( "Couldn't write %s, is the disk full?\n", s_szSpillFile );
+	}
+
+	block.m_nFileOffset = s_nSpillFileSize;
+	s_nSpillFileSize += block.m_nUsed + nPadding;
+	if ( s_iLastSpilledBlock >= 0 )
+	{
+		s_TransferBlocks[s_iLastSpilledBlock].m_iNextInFile = iBlock;
+	}
+	s_iLastSpilledBlock = iBlock;
+
+	free( block.m_pData );
+	block.m_pData = NULL;
+	s_nBlockMemory -= block.m_nSize;
+}
+
+// Call with s_TransferBlockMutex held
+static void WriteFinishedSpillBlocks()
+{
+	for ( int i = 0; i < s_TransferBlocks.Count(); i++ )
+	{
+		if ( i != s_iCurrentBlock && s_TransferBlocks[i].m_pData && !s_TransferBlocks[i].m_nPending )
+		{
+			WriteSpillBlock( i );
+		}
+	}
+}
+
+static bool OpenSpillFileMapping()
+{
+#ifdef _WIN32
+	s_hSpillFile = CreateFileA( s_szSpillFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	if ( s_hSpillFile == INVALID_HANDLE_VALUE )
+		return false;
+	s_hSpillMapping = CreateFileMappingA( s_hSpillFile, NULL, PAGE_READONLY, 0, 0, NULL );
+	return s_hSpillMapping != NULL;
+#else
+	s_nSpillFile = open( s_szSpillFile, O_RDONLY );
+	return s_nSpillFile != -1;
+#endif
+}
+
+static void CloseSpillFile()
+{
+	if ( s_pSpillFile )
+	{
+		fclose( s_pSpillFile );
+		s_pSpillFile = NULL;
+	}
+#ifdef _WIN32
+	if ( s_hSpillMapping )
+	{
+		CloseHandle( s_hSpillMapping );
+		s_hSpillMapping = NULL;
+	}
+	if ( s_hSpillFile != INVALID_HANDLE_VALUE )
+	{
+		CloseHandle( s_hSpillFile );
+		s_hSpillFile = INVALID_HANDLE_VALUE;
+	}
+#else
+	if ( s_nSpillFile != -1 )
+	{
+		close( s_nSpillFile );
+		s_nSpillFile = -1;
+	}
+#endif
+	if ( s_nSpillFileSize )
+	{
+		remove( s_szSpillFile );
+		s_nSpillFileSize = 0;
+	}
+}
+
+// Call with s_SpillViewMutex held
+static void MapSpillBlock( int iBlock )
+{
+	TransferBlock_t &block = s_TransferBlocks[iBlock];
+	Assert( !block.m_pView && block.m_nFileOffset >= 0 );
+
+#ifdef _WIN32
+	block.m_pView = (byte *)MapViewOfFile( s_hSpillMapping, FILE_MAP_READ,
+		(DWORD)( block.m_nFileOffset >> 32 ), (DWORD)block.m_nFileOffset, block.m_nUsed );
+#else
+	void *pView = mmap( NULL, block.m_nUsed, PROT_READ, MAP_SHARED, s_nSpillFile, block.m_nFileOffset );
+	block.m_pView = ( pView != MAP_FAILED ) ? (byte *)pView : NULL;
+#endif
+	if ( !block.m_pView )
+		Error( "Couldn't map %s\n", s_szSpillFile );
+}
+
+// Call with s_SpillViewMutex held
+static void UnmapSpillBlock( int iBlock )
+{
+	TransferBlock_t &block = s_TransferBlocks[iBlock];
+	Assert( block.m_pView && !block.m_nViewRefs );
+
+#ifdef _WIN32
+	UnmapViewOfFile( block.m_pView );
+#else
+	munmap( block.m_pView, block.m_nUsed );
+#endif
+	block.m_pView = NULL;
+}
+
+// Has the OS start reading a mapped block in so it's there by the time the gather gets to it.
+static void PrefetchSpillBlock( int iBlock )
+{
+	TransferBlock_t &block = s_TransferBlocks[iBlock];
+
+#ifdef _WIN32
+	// PrefetchVirtualMemory is Windows 8 and later
+	struct PrefetchRange_t
+	{
+		void	*m_pAddress;
+		SIZE_T	m_nBytes;
+	};
+	typedef BOOL (WINAPI *PrefetchVirtualMemoryFn_t)( HANDLE, ULONG_PTR, PrefetchRange_t *, ULONG );
+	static PrefetchVirtualMemoryFn_t s_pfnPrefetchVirtualMemory =
+		(PrefetchVirtualMemoryFn_t)GetProcAddress( GetModuleHandleA( "kernel32.dll" ), "PrefetchVirtualMemory" );
+	if ( s_pfnPrefetchVirtualMemory )
+	{
+		PrefetchRange_t range = { block.m_pView, (SIZE_T)block.m_nUsed };
+		s_pfnPrefetchVirtualMemory( GetCurrentProcess(), 1, &range, 0 );
+	}
+#else
+	madvise( block.m_pView, block.m_nUsed, MADV_WILLNEED );
+#endif
+}
+
+static const byte *AcquireSpilledRow( int ndxPatch, int *piBlock )
+{
+	int iBlock = s_TransferRowBlock[ndxPatch];
+	Assert( iBlock >= 0 );
+
+	AUTO_LOCK( s_SpillViewMutex );
+
+	TransferBlock_t &block = s_TransferBlocks[iBlock];
+	if ( !block.m_pView )
+	{
+		MapSpillBlock( iBlock );
+
+		// the gather goes through the file in order, so drop the blocks that nobody's
+		// reading other than the next one, and start reading the next one in
+		int iNext = block.m_iNextInFile;
+		for ( int i = 0; i < s_TransferBlocks.Count(); i++ )
+		{
+			if ( i != iBlock && i != iNext && s_TransferBlocks[i].m_pView && !s_TransferBlocks[i].m_nViewRefs )
+			{
+				UnmapSpillBlock( i );
+			}
+		}
+		if ( iNext >= 0 && !s_TransferBlocks[iNext].m_pView )
+		{
+			MapSpillBlock( iNext );
+			PrefetchSpillBlock( iNext );
+		}
+	}
+	block.m_nViewRefs++;
+
+	*piBlock = iBlock;
+	return block.m_pView + s_TransferRowOffset[ndxPatch];
+}
+
+static void ReleaseSpilledRow( int iBlock )
+{
+	AUTO_LOCK( s_SpillViewMutex );
+	Assert( s_TransferBlocks[iBlock].m_nViewRefs > 0 );
+	s_TransferBlocks[iBlock].m_nViewRefs--;
+}
+
+static int CompareSpilledRows( const void *pLeft, const void *pRight )
+{
+	int ndxLeft = *(const int *)pLeft;
+	int ndxRight = *(const int *)pRight;
+	int iLeftBlock = s_TransferRowBlock[ndxLeft];
+	int iRightBlock = s_TransferRowBlock[ndxRight];
+
+	// patches without transfers go at the end
+	if ( ( iLeftBlock < 0 ) != ( iRightBlock < 0 ) )
+		return ( iLeftBlock < 0 ) ? 1 : -1;
+	if ( iLeftBlock < 0 )
+		return ndxLeft - ndxRight;
+
+	int64 nLeft = s_TransferBlocks[iLeftBlock].m_nFileOffset + s_TransferRowOffset[ndxLeft];
+	int64 nRight = s_TransferBlocks[iRightBlock].m_nFileOffset + s_TransferRowOffset[ndxRight];
+	return ( nLeft < nRight ) ? -1 : ( nLeft > nRight ) ? 1 : 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// Building the matrix
+//-----------------------------------------------------------------------------
+static byte *AllocTransferRow( int ndxPatch, int nBytes )
+{
+	AUTO_LOCK( s_TransferBlockMutex );
+
+	if ( s_iCurrentBlock < 0 || s_TransferBlocks[s_iCurrentBlock].m_nUsed + nBytes > s_TransferBlocks[s_iCurrentBlock].m_nSize )
+	{
+		TransferBlock_t block;
+		block.m_nSize = MAX( nBytes, TRANSFER_BLOCK_SIZE );
+		block.m_pData = (byte *)malloc( block.m_nSize );
+		if ( !block.m_pData )
+			Error( "Memory allocation failure" );
+		block.m_nUsed = 0;
+		block.m_nPending = 0;
+		block.m_nFileOffset = -1;
+		block.m_iNextInFile = -1;
+		block.m_pView = NULL;
+		block.m_nViewRefs = 0;
+		s_iCurrentBlock = s_TransferBlocks.AddToTail( block );
+		s_nBlockMemory += block.m_nSize;
+
+		if ( !s_pSpillFile && s_nMemoryBudget && s_nBlockMemory > s_nMemoryBudget )
+		{
+			OpenSpillFile();
+		}
+		if ( s_pSpillFile )
+		{
+			WriteFinishedSpillBlocks();
+		}
+	}
+
+	TransferBlock_t &block = s_TransferBlocks[s_iCurrentBlock];
+	s_TransferRowBlock[ndxPatch] = s_iCurrentBlock;
+	s_TransferRowOffset[ndxPatch] = block.m_nUsed;
+	s_TransferRowBytes[ndxPatch] = nBytes;
+
+	byte *pRow = block.m_pData + block.m_nUsed;
+	block.m_nUsed += nBytes;
+	block.m_nPending++;
+	return pRow;
+}
+
+// Once a spilling block has been retired and all its rows are encoded it goes to the file.
+static void FinishTransferRow( int ndxPatch )
+{
+	AUTO_LOCK( s_TransferBlockMutex );
+
+	int iBlock = s_TransferRowBlock[ndxPatch];
+	TransferBlock_t &block = s_TransferBlocks[iBlock];
+	block.m_nPending--;
+	if ( s_pSpillFile && iBlock != s_iCurrentBlock && !block.m_nPending )
+	{
+		WriteSpillBlock( iBlock );
+	}
+}
+
+static void FreeTransferBlocks()
+{
+	for ( int i = 0; i < s_TransferBlocks.Count(); i++ )
+	{
+		if ( s_TransferBlocks[i].m_pView )
+		{
+			s_TransferBlocks[i].m_nViewRefs = 0;
+			UnmapSpillBlock( i );
+		}
+		free( s_TransferBlocks[i].m_pData );
+	}
+	s_TransferBlocks.Purge();
+	s_iCurrentBlock = -1;
+	s_nBlockMemory = 0;
+}
+
+
+void TransferMatrix_Init( int nPatches, int64 nMemoryBudget, const char *pSpillFile )
+{
+	TransferMatrix_Free();
+
+	s_nMemoryBudget = ( pSpillFile && pSpillFile[0] ) ? nMemoryBudget : 0;
+	Q_strncpy( s_szSpillFile, pSpillFile ? pSpillFile : "", sizeof( s_szSpillFile ) );
+
+	s_TransferRowBlock.SetCount( nPatches );
+	s_TransferRowOffset.SetCount( nPatches );
+	s_TransferRowBytes.SetCount( nPatches );
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		s_TransferRowBlock[i] = -1;
+		s_TransferRowOffset[i] = 0;
+		s_TransferRowBytes[i] = 0;
+	}
+}
+
+
+void TransferMatrix_Free()
+{
+	TransferMatrix_FreeRows();
+	TransferMatrix_FreeShootingMatrix();
+
+	s_TransferRowBlock.Purge();
+	s_TransferRowOffset.Purge();
+	s_TransferRowBytes.Purge();
+}
+
+
+void TransferMatrix_FreeRows()
+{
+	FreeTransferBlocks();
+	CloseSpillFile();
+	s_bSpilled = false;
+	s_GatherOrder.Purge();
+
+	free( s_pTransferMatrix );
+	s_pTransferMatrix = NULL;
+	s_nTransferMatrixBytes = 0;
+	s_TransferRows.Purge();
+
+	free( s_pBumpCosineCodes );
+	s_pBumpCosineCodes = NULL;
+	s_nBumpCosineCodes = 0;
+	s_BumpCosineRows.Purge();
+	s_BumpCosineRowDone.Purge();
+}
+
+
+static int GetEncodedRowSize( const transfer_t *pTransfers, int nTransfers )
+{
+	int nBytes = sizeof( float ) + nTransfers * sizeof( uint16 );
+	int nPrevPatch = 0;
+	for ( int i = 0; i < nTransfers; i++ )
+	{
+		Assert( pTransfers[i].patch >= nPrevPatch );
+		nBytes += VarIntBytes( pTransfers[i].patch - nPrevPatch );
+		nPrevPatch = pTransfers[i].patch;
+	}
+	return ( nBytes + 3 ) & ~3;
+}
+
+static void EncodeRow( byte *pRow, int nBytes, const transfer_t *pTransfers, int nTransfers, float flScale )
+{
+	float flMax = 0.0f;
+	for ( int i = 0; i < nTransfers; i++ )
+	{
+		flMax = MAX( flMax, pTransfers[i].transfer );
+	}
+	*(float *)pRow = flMax * flScale;
+
+	uint16 *pCodes = (uint16 *)( pRow + sizeof( float ) );
+	float flOOMax = ( flMax > 0.0f ) ? 1.0f / flMax : 0.0f;
+	for ( int i = 0; i < nTransfers; i++ )
+	{
+		pCodes[i] = EncodeTransferWeight( pTransfers[i].transfer * flOOMax );
+	}
+
+	byte *pDeltas = (byte *)( pCodes + nTransfers );
+	int nPrevPatch = 0;
+	for ( int i = 0; i < nTransfers; i++ )
+	{
+		uint32 nDelta = pTransfers[i].patch - nPrevPatch;
+		nPrevPatch = pTransfers[i].patch;
+		while ( nDelta >= 0x80 )
+		{
+			*pDeltas++ = ( nDelta & 0x7f ) | 0x80;
+			nDelta >>= 7;
+		}
+		*pDeltas++ = nDelta;
+	}
+	while ( pDeltas < pRow + nBytes )
+	{
+		*pDeltas++ = 0;
+	}
+}
+
+
+void TransferMatrix_AddRow( int ndxPatch, const transfer_t *pTransfers, int nTransfers, float flScale )
+{
+	if ( nTransfers <= 0 )
+		return;
+
+	// size the row first so it can be encoded straight into the block
+	int nBytes = GetEncodedRowSize( pTransfers, nTransfers );
+	byte *pRow = AllocTransferRow( ndxPatch, nBytes );
+	EncodeRow( pRow, nBytes, pTransfers, nTransfers, flScale );
+	FinishTransferRow( ndxPatch );
+}
+
+
+const byte *TransferMatrix_GetEncodedRow( int ndxPatch, int *pnBytes )
+{
+	// only used by VMPI workers, which never spill
+	Assert( !s_pSpillFile && !s_bSpilled );
+
+	*pnBytes = s_TransferRowBytes[ndxPatch];
+	int iBlock = s_TransferRowBlock[ndxPatch];
+	if ( iBlock < 0 )
+		return NULL;
+	if ( s_TransferRows.Count() )
+		return s_TransferRows[ndxPatch];
+	return s_TransferBlocks[iBlock].m_pData + s_TransferRowOffset[ndxPatch];
+}
+
+
+void TransferMatrix_AddEncodedRow( int ndxPatch, const byte *pRow, int nBytes )
+{
+	if ( nBytes <= 0 )
+		return;
+
+	byte *pCopy = AllocTransferRow( ndxPatch, nBytes );
+	memcpy( pCopy, pRow, nBytes );
+	FinishTransferRow( ndxPatch );
+}
+
+
+void TransferMatrix_Finish()
+{
+	Assert( !s_pTransferMatrix && !s_bSpilled );
+
+	int nPatches = s_TransferRowBlock.Count();
+
+	if ( s_pSpillFile )
+	{
+		// write out the rest and read everything back through the mapping
+		s_iCurrentBlock = -1;
+		WriteFinishedSpillBlocks();
+		fclose( s_pSpillFile );
+		s_pSpillFile = NULL;
+		if ( !OpenSpillFileMapping() )
+			Error( "Couldn't map %s\n", s_szSpillFile );
+		s_bSpilled = true;
+
+		// hand the patches to the gather in file order so that it reads the file from start to end
+		s_GatherOrder.SetCount( nPatches );
+		for ( int i = 0; i < nPatches; i++ )
+		{
+			s_GatherOrder[i] = i;
+		}
+		qsort( s_GatherOrder.Base(), nPatches, sizeof( int ), CompareSpilledRows );
+		return;
+	}
+
+	int64 nTotal = 0;
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		nTotal += s_TransferRowBytes[i];
+	}
+
+	// rows in patch order, so the gather, which walks the patches in order, reads it sequentially
+	s_pTransferMatrix = (byte *)malloc( MAX( nTotal, 4 ) );
+	if ( !s_pTransferMatrix )
+		Error( "Memory allocation failure" );
+
+	s_TransferRows.SetCount( nPatches );
+	byte *pOut = s_pTransferMatrix;
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		int iBlock = s_TransferRowBlock[i];
+		if ( iBlock < 0 )
+		{
+			s_TransferRows[i] = NULL;
+			continue;
+		}
+		memcpy( pOut, s_TransferBlocks[iBlock].m_pData + s_TransferRowOffset[i], s_TransferRowBytes[i] );
+		s_TransferRows[i] = pOut;
+		pOut += s_TransferRowBytes[i];
+	}
+	s_nTransferMatrixBytes = nTotal;
+
+	FreeTransferBlocks();
+}
+
+
+int64 TransferMatrix_GetMemoryUsed()
+{
+	int nRowBytes = 3 * sizeof( int ) + ( s_bSpilled ? sizeof( int ) : sizeof( const byte * ) );
+	return s_nTransferMatrixBytes + s_TransferRowBlock.Count() * (int64)nRowBytes;
+}
+
+
+int64 TransferMatrix_GetSpillFileSize()
+{
+	return s_bSpilled ? s_nSpillFileSize : 0;
+}
+
+
+int TransferMatrix_GetGatherPatch( int iWork )
+{
+	return s_GatherOrder.Count() ? s_GatherOrder[iWork] : iWork;
+}
+
+
+void TransferMatrix_InitBumpCosines( int64 nMaxBytes )
+{
+	free( s_pBumpCosineCodes );
+	s_pBumpCosineCodes = NULL;
+	s_nBumpCosineCodes = 0;
+
+	int nPatches = s_TransferRowBlock.Count();
+	s_BumpCosineRows.SetCount( nPatches );
+	s_BumpCosineRowDone.SetCount( nPatches );
+
+	// nMaxBytes includes the row table, as TransferMatrix_GetBumpCosineMemoryUsed does
+	int64 nRowTableBytes = nPatches * (int64)( sizeof( int64 ) + sizeof( bool ) );
+	int64 nMaxCodes = MAX( nMaxBytes - nRowTableBytes, 0 ) / ( 3 * sizeof( uint16 ) );
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		s_BumpCosineRows[i] = -1;
+		s_BumpCosineRowDone[i] = false;
+
+		int nTransfers = g_Patches[i].numtransfers;
+		if ( !g_Patches[i].needsBumpmap || !nTransfers || s_nBumpCosineCodes + nTransfers > nMaxCodes )
+			continue;
+		s_BumpCosineRows[i] = s_nBumpCosineCodes * 3;
+		s_nBumpCosineCodes += nTransfers;
+	}
+
+	if ( s_nBumpCosineCodes )
+	{
+		s_pBumpCosineCodes = (uint16 *)malloc( s_nBumpCosineCodes * 3 * sizeof( uint16 ) );
+		if ( !s_pBumpCosineCodes )
+			Error( "Memory allocation failure" );
+	}
+}
+
+
+bool TransferMatrix_CanCacheBumpCosines( int ndxPatch )
+{
+	return s_BumpCosineRows.IsValidIndex( ndxPatch ) && s_BumpCosineRows[ndxPatch] >= 0;
+}
+
+
+bool TransferMatrix_HasBumpCosines( int ndxPatch )
+{
+	return s_BumpCosineRowDone.IsValidIndex( ndxPatch ) && s_BumpCosineRowDone[ndxPatch];
+}
+
+
+void TransferMatrix_SetBumpCosines( int ndxPatch, int nFirst, int nCount, const fltx4 *pBumpCosines )
+{
+	Assert( TransferMatrix_CanCacheBumpCosines( ndxPatch ) );
+
+	uint16 *pCodes = s_pBumpCosineCodes + s_BumpCosineRows[ndxPatch] + nFirst * 3;
+	for ( int i = 0; i < nCount; i++, pCodes += 3 )
+	{
+		pCodes[0] = EncodeBumpCosine( SubFloat( pBumpCosines[i], 1 ) );
+		pCodes[1] = EncodeBumpCosine( SubFloat( pBumpCosines[i], 2 ) );
+		pCodes[2] = EncodeBumpCosine( SubFloat( pBumpCosines[i], 3 ) );
+		if ( SubFloat( pBumpCosines[i], 0 ) == 0.0f )
+		{
+			pCodes[0] |= BUMP_COSINE_BEHIND;
+		}
+	}
+
+	if ( nFirst + nCount == g_Patches[ndxPatch].numtransfers )
+	{
+		s_BumpCosineRowDone[ndxPatch] = true;
+	}
+}
+
+
+int64 TransferMatrix_GetBumpCosineMemoryUsed()
+{
+	return s_nBumpCosineCodes * 3 * sizeof( uint16 ) +
+		s_BumpCosineRows.Count() * (int64)( sizeof( int64 ) + sizeof( bool ) );
+}
+
+
+//-----------------------------------------------------------------------------
+// Shooting matrix
+//-----------------------------------------------------------------------------
+
+// Counts the transfers in each column of one receiver range and works out each
+// column's encoded size, which is left in m_ColumnOffset until the partition is
+// allocated.
+static void SizeShootPartition( int iThread, int iPartition )
+{
+	ShootPartition_t &partition = s_ShootPartitions[iPartition];
+	int nPatches = s_TransferRowBlock.Count();
+	int nFirst = partition.m_nFirstReceiver;
+	int nEnd = nFirst + partition.m_nReceivers;
+
+	int pPatches[TRANSFER_READ_BATCH];
+	float pTransfers[TRANSFER_READ_BATCH];
+	int nRead;
+
+	// the last receiver in each column, for the deltas EncodeRow writes
+	CUtlVector<int> lastReceiver;
+	lastReceiver.SetCount( nPatches );
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		lastReceiver[i] = 0;
+		partition.m_ColumnCount[i] = 0;
+		partition.m_ColumnOffset[i] = 0;
+	}
+
+	for ( int j = nFirst; j < nEnd; j++ )
+	{
+		CTransferRowReader reader( j, false );
+		while ( ( nRead = reader.Read( pPatches, pTransfers, TRANSFER_READ_BATCH ) ) > 0 )
+		{
+			for ( int k = 0; k < nRead; k++ )
+			{
+				int i = pPatches[k];
+				partition.m_ColumnCount[i]++;
+				partition.m_ColumnOffset[i] += VarIntBytes( j - lastReceiver[i] );
+				lastReceiver[i] = j;
+			}
+		}
+	}
+
+	// the same sizes GetEncodedRowSize gives
+	partition.m_nUsed = 0;
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		int nCount = partition.m_ColumnCount[i];
+		if ( nCount )
+		{
+			int64 nBytes = ( sizeof( float ) + nCount * sizeof( uint16 ) + partition.m_ColumnOffset[i] + 3 ) & ~3;
+			partition.m_ColumnOffset[i] = partition.m_nUsed;
+			partition.m_nUsed += nBytes;
+		}
+		else
+		{
+			partition.m_ColumnOffset[i] = -1;
+		}
+	}
+}
+
+// Transposes one receiver range into its data, which SizeShootPartition sized. The
+// columns are gathered a group at a time into a scratch buffer so that it never
+// needs more than its share of the scratch budget.
+static void EncodeShootPartition( int iThread, int iPartition )
+{
+	ShootPartition_t &partition = s_ShootPartitions[iPartition];
+	int nPatches = s_TransferRowBlock.Count();
+	int nFirst = partition.m_nFirstReceiver;
+	int nEnd = nFirst + partition.m_nReceivers;
+
+	int pPatches[TRANSFER_READ_BATCH];
+	float pTransfers[TRANSFER_READ_BATCH];
+	int nRead;
+
+	int64 nMaxScratch = MAX( s_nShootScratchBytes / s_ShootPartitions.Count(), (int64)TRANSFER_BLOCK_SIZE ) / sizeof( transfer_t );
+	CUtlVector<transfer_t> scratch;
+	CUtlVector<int> cursor;
+	cursor.SetCount( nPatches );
+
+	int nFirstColumn = 0;
+	while ( nFirstColumn < nPatches )
+	{
+		// as many columns as fit, and always at least one
+		int64 nScratch = 0;
+		int nEndColumn = nFirstColumn;
+		while ( nEndColumn < nPatches &&
+			( nEndColumn == nFirstColumn || nScratch + partition.m_ColumnCount[nEndColumn] <= nMaxScratch ) )
+		{
+			cursor[nEndColumn] = nScratch;
+			nScratch += partition.m_ColumnCount[nEndColumn];
+			nEndColumn++;
+		}
+		scratch.SetCount( nScratch );
+
+		// the rows are read in receiver order, so each column comes out sorted
+		for ( int j = nFirst; j < nEnd; j++ )
+		{
+			CTransferRowReader reader( j, false );
+			while ( ( nRead = reader.Read( pPatches, pTransfers, TRANSFER_READ_BATCH ) ) > 0 )
+			{
+				for ( int k = 0; k < nRead; k++ )
+				{
+					int i = pPatches[k];
+					if ( i < nFirstColumn || i >= nEndColumn )
+						continue;
+					transfer_t &transfer = scratch[cursor[i]++];
+					transfer.patch = j;
+					transfer.transfer = pTransfers[k];
+				}
+			}
+		}
+
+		const transfer_t *pColumn = scratch.Base();
+		for ( int i = nFirstColumn; i < nEndColumn; i++ )
+		{
+			int nCount = partition.m_ColumnCount[i];
+			if ( nCount )
+			{
+				int nBytes = GetEncodedRowSize( pColumn, nCount );
+				Assert( partition.m_ColumnOffset[i] + nBytes <= partition.m_nUsed );
+				EncodeRow( partition.m_pData + partition.m_ColumnOffset[i], nBytes, pColumn, nCount, 1.0f );
+				pColumn += nCount;
+			}
+		}
+		nFirstColumn = nEndColumn;
+	}
+}
+
+
+bool TransferMatrix_BuildShootingMatrix( int nPartitions, int64 nScratchBytes, int64 nMaxBytes, int64 *pnBytes )
+{
+	TransferMatrix_FreeShootingMatrix();
+
+	int nPatches = s_TransferRowBlock.Count();
+	int64 nTotal = 0;
+	for ( int j = 0; j < nPatches; j++ )
+	{
+		nTotal += g_Patches[j].numtransfers;
+	}
+
+	// receiver ranges with about the same number of transfers each. each keeps its
+	// own column tables, so the threads building them don't share cache lines.
+	nPartitions = clamp( nPartitions, 1, MAX( nPatches, 1 ) );
+	s_ShootPartitions.SetCount( nPartitions );
+	int j = 0;
+	int64 nSoFar = 0;
+	for ( int iPartition = 0; iPartition < nPartitions; iPartition++ )
+	{
+		ShootPartition_t &partition = s_ShootPartitions[iPartition];
+		partition.m_nFirstReceiver = j;
+		int64 nTarget = ( iPartition + 1 == nPartitions ) ? nTotal : nTotal * ( iPartition + 1 ) / nPartitions;
+		while ( j < nPatches && ( nSoFar < nTarget || iPartition + 1 == nPartitions ) )
+		{
+			nSoFar += g_Patches[j].numtransfers;
+			j++;
+		}
+		partition.m_nReceivers = j - partition.m_nFirstReceiver;
+		partition.m_pData = NULL;
+		partition.m_nUsed = 0;
+		partition.m_ColumnOffset.SetCount( nPatches );
+		partition.m_ColumnCount.SetCount( nPatches );
+	}
+	s_nShootScratchBytes = nScratchBytes;
+
+	RunThreadsOnIndividual( nPartitions, false, SizeShootPartition );
+
+	int64 nBytes = TransferMatrix_GetShootingMemoryUsed();
+	for ( int iPartition = 0; iPartition < nPartitions; iPartition++ )
+	{
+		nBytes += s_ShootPartitions[iPartition].m_nUsed;
+	}
+	if ( pnBytes )
+	{
+		*pnBytes = nBytes;
+	}
+	if ( nMaxBytes )
+	{
+		if ( nBytes > nMaxBytes )
+		{
+			TransferMatrix_FreeShootingMatrix();
+			return false;
+		}
+		s_nShootScratchBytes = MIN( s_nShootScratchBytes, nMaxBytes - nBytes );
+	}
+
+	for ( int iPartition = 0; iPartition < nPartitions; iPartition++ )
+	{
+		ShootPartition_t &partition = s_ShootPartitions[iPartition];
+		if ( partition.m_nUsed )
+		{
+			partition.m_pData = (byte *)malloc( partition.m_nUsed );
+			if ( !partition.m_pData )
+				Error( "Memory allocation failure" );
+		}
+	}
+
+	RunThreadsOnIndividual( nPartitions, false, EncodeShootPartition );
+	return true;
+}
+
+
+void TransferMatrix_FreeShootingMatrix()
+{
+	for ( int i = 0; i < s_ShootPartitions.Count(); i++ )
+	{
+		free( s_ShootPartitions[i].m_pData );
+	}
+	s_ShootPartitions.Purge();
+}
+
+
+int TransferMatrix_GetShootingPartitionCount()
+{
+	return s_ShootPartitions.Count();
+}
+
+
+int64 TransferMatrix_GetShootingMemoryUsed()
+{
+	int64 nBytes = 0;
+	for ( int i = 0; i < s_ShootPartitions.Count(); i++ )
+	{
+		const ShootPartition_t &partition = s_ShootPartitions[i];
+		nBytes += partition.m_ColumnOffset.NumAllocated() * (int64)sizeof( int64 ) +
+			partition.m_ColumnCount.NumAllocated() * (int64)sizeof( int );
+		if ( partition.m_pData )
+		{
+			nBytes += partition.m_nUsed;
+		}
+	}
+	return nBytes;
+}
+
+
+CTransferRowReader::CTransferRowReader()
+{
+	m_nRemaining = 0;
+	m_nPatch = 0;
+	m_pFloatTransfers = NULL;
+	m_pCodes = NULL;
+	m_pDeltas = NULL;
+	m_pBumpCodes = NULL;
+	m_flScale = 0.0f;
+	m_iSpillBlock = -1;
+}
+
+
+void CTransferRowReader::InitEncodedRow( const byte *pRow, int nTransfers )
+{
+	m_nRemaining = nTransfers;
+	m_flScale = *(const float *)pRow;
+	m_pCodes = (const uint16 *)( pRow + sizeof( float ) );
+	m_pDeltas = (const byte *)( m_pCodes + m_nRemaining );
+}
+
+
+CTransferRowReader::CTransferRowReader( int ndxPatch, bool bFloatTransfers )
+{
+	CPatch *pPatch = &g_Patches[ndxPatch];
+
+	m_nRemaining = pPatch->numtransfers;
+	m_nPatch = 0;
+	m_pFloatTransfers = NULL;
+	m_pCodes = NULL;
+	m_pDeltas = NULL;
+	m_pBumpCodes = NULL;
+	m_flScale = 0.0f;
+	m_iSpillBlock = -1;
+
+	if ( !m_nRemaining )
+		return;
+
+	if ( bFloatTransfers )
+	{
+		m_pFloatTransfers = pPatch->transfers;
+		Assert( m_pFloatTransfers );
+		return;
+	}
+
+	const byte *pRow = s_bSpilled ? AcquireSpilledRow( ndxPatch, &m_iSpillBlock ) : s_TransferRows[ndxPatch];
+	Assert( pRow );
+	InitEncodedRow( pRow, m_nRemaining );
+
+	if ( TransferMatrix_HasBumpCosines( ndxPatch ) )
+	{
+		m_pBumpCodes = s_pBumpCosineCodes + s_BumpCosineRows[ndxPatch];
+	}
+}
+
+
+CTransferRowReader::~CTransferRowReader()
+{
+	if ( m_iSpillBlock >= 0 )
+	{
+		ReleaseSpilledRow( m_iSpillBlock );
+	}
+}
+
+
+int CTransferRowReader::Read( int *pPatches, float *pTransfers, int nMax )
+{
+	int nCount = MIN( nMax, m_nRemaining );
+	m_nRemaining -= nCount;
+
+	if ( m_pFloatTransfers )
+	{
+		for ( int i = 0; i < nCount; i++ )
+		{
+			pPatches[i] = m_pFloatTransfers[i].patch;
+			pTransfers[i] = m_pFloatTransfers[i].transfer;
+		}
+		m_pFloatTransfers += nCount;
+		return nCount;
+	}
+
+	const byte *pDeltas = m_pDeltas;
+	int nPatch = m_nPatch;
+	for ( int i = 0; i < nCount; i++ )
+	{
+		uint32 nDelta = *pDeltas++;
+		if ( nDelta & 0x80 )
+		{
+			nDelta &= 0x7f;
+			int nShift = 7;
+			uint32 nByte;
+			do
+			{
+				nByte = *pDeltas++;
+				nDelta |= ( nByte & 0x7f ) << nShift;
+				nShift += 7;
+			} while ( nByte & 0x80 );
+		}
+		nPatch += nDelta;
+
+		pPatches[i] = nPatch;
+		pTransfers[i] = DecodeTransferWeight( m_pCodes[i] ) * m_flScale;
+	}
+	m_pCodes += nCount;
+	m_pDeltas = pDeltas;
+	m_nPatch = nPatch;
+	return nCount;
+}
+
+
+int CTransferRowReader::Read( int *pPatches, float *pTransfers, fltx4 *pBumpCosines, int nMax )
+{
+	Assert( m_pBumpCodes || !m_nRemaining );
+
+	const uint16 *pBumpCodes = m_pBumpCodes;
+	int nCount = Read( pPatches, pTransfers, nMax );
+	for ( int i = 0; i < nCount; i++, pBumpCodes += 3 )
+	{
+		float flSign = 1.0f;
+		float flFront = 1.0f;
+		if ( pBumpCodes[0] & BUMP_COSINE_BEHIND )
+		{
+			flSign = -1.0f;
+			flFront = 0.0f;
+		}
+		SubFloat( pBumpCosines[i], 0 ) = flFront;
+		SubFloat( pBumpCosines[i], 1 ) = flSign * DecodeBumpCosine( pBumpCodes[0] );
+		SubFloat( pBumpCosines[i], 2 ) = flSign * DecodeBumpCosine( pBumpCodes[1] );
+		SubFloat( pBumpCosines[i], 3 ) = flSign * DecodeBumpCosine( pBumpCodes[2] );
+	}
+	m_pBumpCodes = pBumpCodes;
+	return nCount;
+}
+
+
+CShootingColumnReader::CShootingColumnReader( int ndxPatch, int iPartition )
+{
+	const ShootPartition_t &partition = s_ShootPartitions[iPartition];
+	int nCount = partition.m_ColumnCount[ndxPatch];
+	if ( nCount )
+	{
+		InitEncodedRow( partition.m_pData + partition.m_ColumnOffset[ndxPatch], nCount );
+	}
+}
@@ -0,0 +1,141 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compact storage for the patch to patch transfers (form factors).
+//
+// Each patch's transfers are one row of a compressed sparse row matrix. A row is
+// sorted by patch index and stores a float scale, then a 16 bit logarithmic code
+// per transfer, then the patch index deltas as variable length integers. Rows
+// are collected into large blocks while the vis matrix is built and packed into
+// one buffer, in patch order, by TransferMatrix_Finish.
+//
+// When the blocks outgrow the memory budget they're written to a spill file
+// instead, in the order they fill up, which follows the vis matrix's cluster
+// order. The gather then maps the file back in a block at a time, prefetching the
+// next one, and visits the patches in file order (TransferMatrix_GetGatherPatch).
+//
+//=============================================================================//
+
+#ifndef TRANSFERMATRIX_H
+#define TRANSFERMATRIX_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "mathlib/ssemath.h"
+
+struct transfer_t;
+
+// Patches per CTransferRowReader::Read call in the gather loops.
+#define TRANSFER_READ_BATCH		256
+
+
+// nMemoryBudget is how many bytes of rows can be kept in memory before they spill
+// to pSpillFile, 0 for no limit.
+void TransferMatrix_Init( int nPatches, int64 nMemoryBudget = 0, const char *pSpillFile = NULL );
+
+// Also deletes the spill file.
+void TransferMatrix_Free();
+
+// Frees the rows and the bump cosines but keeps the shooting matrix.
+void TransferMatrix_FreeRows();
+
+// Encodes a patch's transfers, which must be sorted by patch index. Each transfer's
+// weight is pTransfers[i].transfer * flScale. Thread safe.
+void TransferMatrix_AddRow( int ndxPatch, const transfer_t *pTransfers, int nTransfers, float flScale );
+
+// Raw access to the encoded rows, used to send them between VMPI workers.
+const byte *TransferMatrix_GetEncodedRow( int ndxPatch, int *pnBytes );
+void TransferMatrix_AddEncodedRow( int ndxPatch, const byte *pRow, int nBytes );
+
+// Packs the rows into a single buffer, or finishes the spill file and maps it.
+// Call once all the rows have been added.
+void TransferMatrix_Finish();
+
+// Size of the packed matrix including the row offsets. Spilled rows don't count.
+int64 TransferMatrix_GetMemoryUsed();
+
+// 0 unless the rows were spilled.
+int64 TransferMatrix_GetSpillFileSize();
+
+// The patch to gather for work item iWork, so that the gather reads spilled rows
+// sequentially. The identity when nothing was spilled.
+int TransferMatrix_GetGatherPatch( int iWork );
+
+
+// The bump cosines of a transfer are the cosines between the direction to the other
+// patch and the receiving patch's bump basis normals, divided by the cosine with the
+// patch normal, as used by the bump mapped gather. Element 0 is 1, or 0 when the other
+// patch is behind the receiver. They don't change between bounces, so the first bounce
+// stores them for as many bump mapped patches as fit in nMaxBytes.
+void TransferMatrix_InitBumpCosines( int64 nMaxBytes );
+bool TransferMatrix_CanCacheBumpCosines( int ndxPatch );
+bool TransferMatrix_HasBumpCosines( int ndxPatch );
+
+// Stores transfers nFirst to nFirst+nCount-1 of a patch. The row is usable once
+// the last transfer has been stored.
+void TransferMatrix_SetBumpCosines( int ndxPatch, int nFirst, int nCount, const fltx4 *pBumpCosines );
+
+int64 TransferMatrix_GetBumpCosineMemoryUsed();
+
+
+// The shooting matrix is the transpose of the transfer matrix, one row per source
+// patch listing the patches that gather from it, for the progressive solver. Each
+// row is split into nPartitions ranges of receivers with about the same number of
+// transfers, so threads can shoot into separate receivers. The rows are read a
+// receiver range at a time and transposed in up to nScratchBytes of memory.
+// The columns are counted first and each partition is allocated once at its
+// exact size. If that comes to more than nMaxBytes (when nonzero) nothing is
+// built and it returns false; either way *pnBytes gets the size it needs.
+bool TransferMatrix_BuildShootingMatrix( int nPartitions, int64 nScratchBytes, int64 nMaxBytes = 0, int64 *pnBytes = NULL );
+void TransferMatrix_FreeShootingMatrix();
+int TransferMatrix_GetShootingPartitionCount();
+int64 TransferMatrix_GetShootingMemoryUsed();
+
+
+//-----------------------------------------------------------------------------
+// Decodes a patch's transfers in batches, either from the transfer matrix or
+// from the patch's float transfer list. Keeps a spilled row mapped while it
+// exists.
+//-----------------------------------------------------------------------------
+class CTransferRowReader
+{
+public:
+	CTransferRowReader( int ndxPatch, bool bFloatTransfers );
+	~CTransferRowReader();
+
+	// Fills in up to nMax patch indices and weights, returns how many were
+	// written. Returns 0 at the end of the row.
+	int Read( int *pPatches, float *pTransfers, int nMax );
+
+	// Also fills in the cached bump cosines. Only for patches with
+	// TransferMatrix_HasBumpCosines.
+	int Read( int *pPatches, float *pTransfers, fltx4 *pBumpCosines, int nMax );
+
+protected:
+	CTransferRowReader();
+	void InitEncodedRow( const byte *pRow, int nTransfers );
+
+private:
+	const transfer_t	*m_pFloatTransfers;
+	const uint16		*m_pCodes;
+	const byte			*m_pDeltas;
+	const uint16		*m_pBumpCodes;
+	float				m_flScale;
+	int					m_nPatch;
+	int					m_nRemaining;
+	int					m_iSpillBlock;
+};
+
+
+//-----------------------------------------------------------------------------
+// Reads one partition of a row of the shooting matrix. The patches are the
+// receivers and the weights are their transfers from the source patch.
+//-----------------------------------------------------------------------------
+class CShootingColumnReader : public CTransferRowReader
+{
+public:
+	CShootingColumnReader( int ndxPatch, int iPartition );
+};
+
+
+#endif // TRANSFERMATRIX_H
@@ -8,6 +8,7 @@
 
 #include "vrad.h"
 #include "vmpi.h"
+#include "vradprofile.h"
 #ifdef MPI
 #include "messbuf.h"
 static MessageBuffer mb;
@@ -19,6 +20,9 @@ extern char		source[MAX_PATH];
 extern char		vismatfile[_MAX_PATH];
 extern char		incrementfile[_MAX_PATH];
 extern qboolean	incremental;
+extern char		visclusterstatsfile[_MAX_PATH];
+extern int		total_transfer;
+extern int		max_transfer;
 
 /*
 ===================================================================
@@ -34,61 +38,198 @@ Use the PVS to accelerate if available
 #define PLANE_TEST_EPSILON  0.01 // patch must be this much in front of the plane to be considered "in front"
 #define PATCH_FACE_OFFSET  0.1 // push patch origins off from the face by this amount to avoid self collisions
 
-#define STREAM_SIZE 512
+// Visibility rays are queued across patch rows and traced once at least this many are waiting.
+#define VIS_BATCH_RAYS			8192
 
+// Clusters are split up so there are about this many work units per thread.
+#define VIS_UNITS_PER_THREAD	8
+
+
+typedef void (*PatchCallback_t)( int iThread, int patchnum, CPatch *patch );
+
+
+//-----------------------------------------------------------------------------
+// Per thread totals, merged once the vis matrix is done.
+//-----------------------------------------------------------------------------
+struct VisMatrixThreadStats_t
+{
+	int64	m_nRays;
+	int64	m_nTransfers;
+	int		m_nMaxTransfers;
+	char	m_Pad[64];					// keep each thread's totals on its own cache line
+};
+
+static VisMatrixThreadStats_t g_VisMatrixThreadStats[MAX_TOOL_THREADS+1];
+
+
+//-----------------------------------------------------------------------------
+// Queues the visibility tests of several patch rows, traces them together in
+// packets of rays with the same direction signs, then makes each row's transfers.
+//-----------------------------------------------------------------------------
 class CTransferMaker
 {
 public:
 
-	CTransferMaker( transfer_t *all_transfers );
-	~CTransferMaker();
+	CTransferMaker( transfer_t *all_transfers, int iThread, PatchCallback_t PatchCB );
+
+	// Starts the tests for a patch. Its transfers are made by a later Flush.
+	void BeginRow( int ndxPatch );
 
-	FORCEINLINE void TestMakeTransfer( Vector start, Vector stop, int ndxShooter, int ndxReciever )
+	FORCEINLINE void TestMakeTransfer( const Vector &start, const Vector &stop, int ndxShooter, int ndxReciever )
 	{
-		g_RtEnv.AddToRayStream( m_RayStream, start, stop, &m_pResults[m_nTests] );
-		m_pShooterPatches[m_nTests] = ndxShooter;
-		m_pRecieverPatches[m_nTests] = ndxReciever;
-		++m_nTests;
+		Assert( ndxShooter == m_Rows.Tail() );
+
+		Vector delta;
+		VectorSubtract( stop, start, delta );
+		int nOctant = ( delta.x < 0 ) | ( ( delta.y < 0 ) << 1 ) | ( ( delta.z < 0 ) << 2 );
+
+		VisRay_t &ray = m_OctantRays[nOctant][m_OctantRays[nOctant].AddToTail()];
+		ray.m_vStart = start;
+		ray.m_vDelta = delta;
+		ray.m_iTest = m_Receivers.AddToTail( ndxReciever );
 	}
 
-	void Finish();
+	// Traces the queued tests if there are enough of them to fill the packets well.
+	void FlushIfFull();
+
+	// Traces everything queued and makes the transfers of every row begun so far.
+	void Flush();
 
 private:
 
-	int m_nTests;
-	RayTracingSingleResult *m_pResults;
-	int *m_pShooterPatches;
-	int *m_pRecieverPatches;
-	RayStream m_RayStream;
-	transfer_t *m_AllTransfers;
+	struct VisRay_t
+	{
+		Vector	m_vStart;
+		Vector	m_vDelta;
+		int		m_iTest;
+	};
+
+	transfer_t					*m_AllTransfers;
+	int							m_iThread;
+	PatchCallback_t				m_PatchCB;
+
+	CUtlVector<int>				m_Rows;				// patch of each row
+	CUtlVector<int>				m_RowFirstTest;
+	CUtlVector<int>				m_Receivers;		// per test
+	CUtlVector<byte>			m_Visible;			// per test
+	CUtlVector<VisRay_t>		m_OctantRays[8];	// tests by direction signs
+
+	CUtlMemoryAligned<FourRays, 16>			m_Packets;
+	CUtlMemoryAligned<fltx4, 16>			m_TMin;
+	CUtlMemoryAligned<fltx4, 16>			m_TMax;
+	CUtlMemoryAligned<RayTracingResult, 16>	m_Results;
+	CUtlVector<int>							m_PacketTests;	// 4 per packet
 };
 
-CTransferMaker::CTransferMaker( transfer_t *all_transfers ) :
-	m_nTests( 0 ), m_AllTransfers( all_transfers )
+CTransferMaker::CTransferMaker( transfer_t *all_transfers, int iThread, PatchCallback_t PatchCB ) :
+	m_AllTransfers( all_transfers ), m_iThread( iThread ), m_PatchCB( PatchCB )
+{
+}
+
+void CTransferMaker::BeginRow( int ndxPatch )
 {
-	m_pResults = (RayTracingSingleResult *)calloc( 1, MAX_PATCHES * sizeof ( RayTracingSingleResult ) );
-	m_pShooterPatches = (int *)calloc( 1, MAX_PATCHES * sizeof( int ) );
-	m_pRecieverPatches = (int *)calloc( 1, MAX_PATCHES * sizeof( int ) );
+	m_Rows.AddToTail( ndxPatch );
+	m_RowFirstTest.AddToTail( m_Receivers.Count() );
 }
 
-CTransferMaker::~CTransferMaker()
+void CTransferMaker::FlushIfFull()
 {
-	free ( m_pResults );
-	free ( m_pShooterPatches );
-	free (m_pRecieverPatches );
+	if ( m_Receivers.Count() >= VIS_BATCH_RAYS )
+	{
+		Flush();
+	}
 }
 
-void CTransferMaker::Finish()
+void CTransferMaker::Flush()
 {
-	g_RtEnv.FinishRayStream( m_RayStream );
-	for ( int i = 0; i < m_nTests; ++i )
+	int nTests = m_Receivers.Count();
+
+	// pack the rays into groups of 4 an octant at a time, so that whole runs of
+	// packets have the same direction signs and can be traced 8 or 16 wide
+	int nPackets = 0;
+	for ( int nOctant = 0; nOctant < 8; nOctant++ )
 	{
-		if ( m_pResults[i].HitID == -1 || m_pResults[i].HitDistance >= m_pResults[i].ray_length )
+		nPackets += ( m_OctantRays[nOctant].Count() + 3 ) / 4;
+	}
+	m_Packets.EnsureCapacity( nPackets );
+	m_TMin.EnsureCapacity( nPackets );
+	m_TMax.EnsureCapacity( nPackets );
+	m_Results.EnsureCapacity( nPackets );
+	m_PacketTests.SetCount( nPackets * 4 );
+
+	int iPacket = 0;
+	for ( int nOctant = 0; nOctant < 8; nOctant++ )
+	{
+		const CUtlVector<VisRay_t> &rays = m_OctantRays[nOctant];
+		for ( int i = 0; i < rays.Count(); i += 4, iPacket++ )
 		{
-			MakeTransfer( m_pShooterPatches[i], m_pRecieverPatches[i], m_AllTransfers );
+			FourRays &packet = m_Packets[iPacket];
+			for ( int j = 0; j < 4; j++ )
+			{
+				// fill in a partial packet with copies of its last ray
+				const VisRay_t &ray = rays[ MIN( i + j, rays.Count() - 1 ) ];
+				packet.origin.X( j ) = ray.m_vStart.x;
+				packet.origin.Y( j ) = ray.m_vStart.y;
+				packet.origin.Z( j ) = ray.m_vStart.z;
+				packet.direction.X( j ) = ray.m_vDelta.x;
+				packet.direction.Y( j ) = ray.m_vDelta.y;
+				packet.direction.Z( j ) = ray.m_vDelta.z;
+				m_PacketTests[iPacket * 4 + j] = ray.m_iTest;
+			}
+
+			// same as RayTracingEnvironment::FlushStreamEntry
+			fltx4 tmax = packet.direction.length();
+			packet.direction *= ReciprocalSaturateSIMD( tmax );
+			m_TMin[iPacket] = Four_Zeros;
+			m_TMax[iPacket] = tmax;
+		}
+		m_OctantRays[nOctant].RemoveAll();
+	}
+
+	g_RtEnv.TraceRayPackets( m_Packets.Base(), m_TMin.Base(), m_TMax.Base(), nPackets, m_Results.Base() );
+	VRadProfile_CountRays( nTests );
+
+	m_Visible.SetCount( nTests );
+	for ( iPacket = 0; iPacket < nPackets; iPacket++ )
+	{
+		const RayTracingResult &result = m_Results[iPacket];
+		for ( int j = 0; j < 4; j++ )
+		{
+			m_Visible[ m_PacketTests[iPacket * 4 + j] ] = ( result.HitIds[j] == -1 ) ||
+				( SubFloat( result.HitDistance, j ) >= SubFloat( m_TMax[iPacket], j ) );
+		}
+	}
+
+	// make the transfers a row at a time, in the order the tests were added
+	VisMatrixThreadStats_t &stats = g_VisMatrixThreadStats[m_iThread];
+	for ( int iRow = 0; iRow < m_Rows.Count(); iRow++ )
+	{
+		int ndxPatch = m_Rows[iRow];
+		int iLastTest = ( iRow + 1 < m_Rows.Count() ) ? m_RowFirstTest[iRow + 1] : nTests;
+		for ( int iTest = m_RowFirstTest[iRow]; iTest < iLastTest; iTest++ )
+		{
+			if ( m_Visible[iTest] )
+			{
+				MakeTransfer( ndxPatch, m_Receivers[iTest], m_AllTransfers );
+			}
 		}
+
+		// do the transfers
+		MakeScales( ndxPatch, m_AllTransfers );
+
+		CPatch *patch = &g_Patches.Element( ndxPatch );
+		stats.m_nTransfers += patch->numtransfers;
+		stats.m_nMaxTransfers = MAX( stats.m_nMaxTransfers, patch->numtransfers );
+
+		// Let MPI aggregate the data if it's being used.
+		if ( m_PatchCB )
+			m_PatchCB( m_iThread, ndxPatch, patch );
 	}
-	m_nTests = 0;
+	stats.m_nRays += nTests;
+
+	m_Rows.RemoveAll();
+	m_RowFirstTest.RemoveAll();
+	m_Receivers.RemoveAll();
 }
 
 
@@ -376,59 +517,83 @@ BuildVisLeafs
 ===========
 */
 
+//-----------------------------------------------------------------------------
+// A run of patches from one cluster. Big clusters are split into several so
+// that they don't hold up the end of the stage.
+//-----------------------------------------------------------------------------
+struct VisWorkUnit_t
+{
+	int		m_iCluster;
+	int		m_iFirstPatch;				// into g_VisUnitPatches
+	int		m_nPatches;
+	double	m_flCost;					// estimated rays
+
+	// filled in by the thread that runs the unit
+	float	m_flTime;
+	int64	m_nRays;
+	int64	m_nTransfers;
+};
+
+static CUtlVector<VisWorkUnit_t>	g_VisWorkUnits;
+static CUtlVector<int>				g_VisUnitPatches;
+static CUtlVector<int>				g_VisClusterPatchCount;
+static CUtlVector<int>				g_VisClusterVisiblePatches;		// patches in each cluster's pvs
+
+
 transfer_t* BuildVisLeafs_Start()
 {
 	return (transfer_t *)calloc( 1,  MAX_PATCHES * sizeof( transfer_t ) );
 }
 
 
-// If PatchCB is non-null, it is called after each row is generated (used by MPI).
-void BuildVisLeafs_Cluster( 
-	int threadnum,
+static void GetClusterPatches( int iCluster, CUtlVector<int> &patches )
+{
+	for ( int ndxPatch = clusterChildren.Element( iCluster ); ndxPatch != g_Patches.InvalidIndex(); 
+		ndxPatch = g_Patches[ndxPatch].ndxNextClusterChild )
+	{
+		patches.AddToTail( ndxPatch );
+	}
+}
+
+
+// Builds the rows of some of the patches in a cluster.
+static void BuildVisPatches( 
+	int threadnum, 
 	transfer_t *transfers, 
+	CTransferMaker &transferMaker, 
 	int iCluster, 
-	void (*PatchCB)(int iThread, int patchnum, CPatch *patch)
-	)
+	const int *pPatches, 
+	int nPatches )
 {
 	byte	pvs[(MAX_MAP_CLUSTERS+7)/8];
-	CPatch	*patch;
-	int		head;
-	unsigned	patchnum;
 	
 	DecompressVis( &dvisdata[ dvis->bitofs[ iCluster ][DVIS_PVS] ], pvs);
-	head = 0;
-
-	CTransferMaker transferMaker( transfers );
 
-	// light every patch in the cluster
-	if( clusterChildren.Element( iCluster ) != clusterChildren.InvalidIndex() )
+	// light every patch
+	for ( int i = 0; i < nPatches; i++ )
 	{
-		CPatch *pNextPatch;
-		for( patch = &g_Patches.Element( clusterChildren.Element( iCluster ) ); patch; patch = pNextPatch )
-		{
-			//
-			// next patch
-			//
-			pNextPatch = NULL;
-			if( patch->ndxNextClusterChild != g_Patches.InvalidIndex() )
-			{
-				pNextPatch = &g_Patches.Element( patch->ndxNextClusterChild );
-			}
-			
-			patchnum = patch - g_Patches.Base();
-
-			// build to all other world clusters
-			BuildVisRow (patchnum, pvs, head, transfers, transferMaker, threadnum );
-			transferMaker.Finish();
-			
-			// do the transfers
-			MakeScales( patchnum, transfers );
-
-			// Let MPI aggregate the data if it's being used.
-			if ( PatchCB )
-				PatchCB( threadnum, patchnum, patch );
-		}
+		// build to all other world clusters
+		transferMaker.BeginRow( pPatches[i] );
+		BuildVisRow( pPatches[i], pvs, 0, transfers, transferMaker, threadnum );
+		transferMaker.FlushIfFull();
 	}
+	transferMaker.Flush();
+}
+
+
+// If PatchCB is non-null, it is called after each row is generated (used by MPI).
+void BuildVisLeafs_Cluster( 
+	int threadnum,
+	transfer_t *transfers, 
+	int iCluster, 
+	void (*PatchCB)(int iThread, int patchnum, CPatch *patch)
+	)
+{
+	CUtlVector<int> patches;
+	GetClusterPatches( iCluster, patches );
+
+	CTransferMaker transferMaker( transfers, threadnum, PatchCB );
+	BuildVisPatches( threadnum, transfers, transferMaker, iCluster, patches.Base(), patches.Count() );
 }
 
 
@@ -441,25 +606,217 @@ void BuildVisLeafs_End( transfer_t *transfers )
 void BuildVisLeafs( int threadnum, void *pUserData )
 {
 	transfer_t *transfers = BuildVisLeafs_Start();
+	CTransferMaker transferMaker( transfers, threadnum, NULL );
+	const VisMatrixThreadStats_t &stats = g_VisMatrixThreadStats[threadnum];
 	
 	while ( 1 )
 	{
-		//
-		// build a minimal BSP tree that only
-		// covers areas relevent to the PVS
-		//
-		// JAY: Now this returns a cluster index
-		int iCluster = GetThreadWork();
-		if ( iCluster == -1 )
+		int iUnit = GetThreadWork( threadnum );
+		if ( iUnit == -1 )
 			break;
 
-		BuildVisLeafs_Cluster( threadnum, transfers, iCluster, NULL );
+		VisWorkUnit_t &unit = g_VisWorkUnits[iUnit];
+		double flStart = Plat_FloatTime();
+		int64 nRays = stats.m_nRays;
+		int64 nTransfers = stats.m_nTransfers;
+
+		BuildVisPatches( threadnum, transfers, transferMaker, unit.m_iCluster, 
+			&g_VisUnitPatches[unit.m_iFirstPatch], unit.m_nPatches );
+
+		unit.m_flTime = Plat_FloatTime() - flStart;
+		unit.m_nRays = stats.m_nRays - nRays;
+		unit.m_nTransfers = stats.m_nTransfers - nTransfers;
 	}
 	
 	BuildVisLeafs_End( transfers );
 }
 
 
+static int CompareVisWorkUnitCost( const void *pLeft, const void *pRight )
+{
+	double flLeft = ( (const VisWorkUnit_t *)pLeft )->m_flCost;
+	double flRight = ( (const VisWorkUnit_t *)pRight )->m_flCost;
+	return ( flLeft < flRight ) ? 1 : ( ( flLeft > flRight ) ? -1 : 0 );
+}
+
+
+//-----------------------------------------------------------------------------
+// A patch's row costs about one ray per patch in its pvs, so a cluster costs
+// its patch count times the patches it can see. Clusters that cost more than
+// a fair share are split into several units, and the units are handed out
+// most expensive first so the stage doesn't end waiting on one big cluster.
+//-----------------------------------------------------------------------------
+static void BuildVisWorkUnits()
+{
+	int nClusters = dvis->numclusters;
+
+	g_VisUnitPatches.RemoveAll();
+	CUtlVector<int> clusterFirstPatch;
+	clusterFirstPatch.SetCount( nClusters );
+	g_VisClusterPatchCount.SetCount( nClusters );
+	for ( int iCluster = 0; iCluster < nClusters; iCluster++ )
+	{
+		clusterFirstPatch[iCluster] = g_VisUnitPatches.Count();
+		GetClusterPatches( iCluster, g_VisUnitPatches );
+		g_VisClusterPatchCount[iCluster] = g_VisUnitPatches.Count() - clusterFirstPatch[iCluster];
+	}
+
+	CUtlVector<double> clusterCost;
+	clusterCost.SetCount( nClusters );
+	g_VisClusterVisiblePatches.SetCount( nClusters );
+	double flTotalCost = 0.0;
+	byte pvs[(MAX_MAP_CLUSTERS+7)/8];
+	for ( int iCluster = 0; iCluster < nClusters; iCluster++ )
+	{
+		int nVisible = 0;
+		if ( g_VisClusterPatchCount[iCluster] )
+		{
+			DecompressVis( &dvisdata[ dvis->bitofs[ iCluster ][DVIS_PVS] ], pvs );
+			for ( int j = 0; j < nClusters; j++ )
+			{
+				if ( pvs[j>>3] & ( 1 << ( j & 7 ) ) )
+				{
+					nVisible += g_VisClusterPatchCount[j];
+				}
+			}
+		}
+		g_VisClusterVisiblePatches[iCluster] = nVisible;
+		clusterCost[iCluster] = (double)g_VisClusterPatchCount[iCluster] * nVisible;
+		flTotalCost += clusterCost[iCluster];
+	}
+
+	double flUnitCost = flTotalCost / ( numthreads * VIS_UNITS_PER_THREAD );
+
+	g_VisWorkUnits.RemoveAll();
+	for ( int iCluster = 0; iCluster < nClusters; iCluster++ )
+	{
+		int nPatches = g_VisClusterPatchCount[iCluster];
+		if ( !nPatches )
+			continue;
+
+		int nUnits = 1;
+		if ( flUnitCost > 0.0 )
+		{
+			nUnits = MIN( MAX( (int)ceil( clusterCost[iCluster] / flUnitCost ), 1 ), nPatches );
+		}
+		for ( int i = 0; i < nUnits; i++ )
+		{
+			VisWorkUnit_t &unit = g_VisWorkUnits[ g_VisWorkUnits.AddToTail() ];
+			int iFirst = nPatches * i / nUnits;
+			unit.m_iCluster = iCluster;
+			unit.m_iFirstPatch = clusterFirstPatch[iCluster] + iFirst;
+			unit.m_nPatches = nPatches * ( i + 1 ) / nUnits - iFirst;
+			unit.m_flCost = clusterCost[iCluster] * unit.m_nPatches / nPatches;
+			unit.m_flTime = 0.0f;
+			unit.m_nRays = 0;
+			unit.m_nTransfers = 0;
+		}
+	}
+
+	qsort( g_VisWorkUnits.Base(), g_VisWorkUnits.Count(), sizeof( VisWorkUnit_t ), CompareVisWorkUnitCost );
+}
+
+
+//-----------------------------------------------------------------------------
+// Per cluster totals of the work units, with the cluster's bounds so slow
+// areas can be found in the map.
+//-----------------------------------------------------------------------------
+struct VisClusterStats_t
+{
+	int		m_iCluster;
+	int		m_nUnits;
+	float	m_flTime;
+	int64	m_nRays;
+	int64	m_nTransfers;
+};
+
+static int CompareVisClusterTime( const void *pLeft, const void *pRight )
+{
+	float flLeft = ( (const VisClusterStats_t *)pLeft )->m_flTime;
+	float flRight = ( (const VisClusterStats_t *)pRight )->m_flTime;
+	return ( flLeft < flRight ) ? 1 : ( ( flLeft > flRight ) ? -1 : 0 );
+}
+
+static void GetClusterBounds( int iCluster, Vector &mins, Vector &maxs )
+{
+	ClearBounds( mins, maxs );
+	const clusterlist_t &leaves = g_ClusterLeaves[iCluster];
+	for ( int i = 0; i < leaves.leafCount; i++ )
+	{
+		const dleaf_t *leaf = &dleafs[ leaves.leafs[i] ];
+		AddPointToBounds( Vector( leaf->mins[0], leaf->mins[1], leaf->mins[2] ), mins, maxs );
+		AddPointToBounds( Vector( leaf->maxs[0], leaf->maxs[1], leaf->maxs[2] ), mins, maxs );
+	}
+}
+
+static void WriteVisClusterStats()
+{
+	CUtlVector<VisClusterStats_t> clusters;
+	clusters.SetCount( dvis->numclusters );
+	for ( int iCluster = 0; iCluster < clusters.Count(); iCluster++ )
+	{
+		VisClusterStats_t &cluster = clusters[iCluster];
+		cluster.m_iCluster = iCluster;
+		cluster.m_nUnits = 0;
+		cluster.m_flTime = 0.0f;
+		cluster.m_nRays = 0;
+		cluster.m_nTransfers = 0;
+	}
+	for ( int i = 0; i < g_VisWorkUnits.Count(); i++ )
+	{
+		const VisWorkUnit_t &unit = g_VisWorkUnits[i];
+		VisClusterStats_t &cluster = clusters[unit.m_iCluster];
+		cluster.m_nUnits++;
+		cluster.m_flTime += unit.m_flTime;
+		cluster.m_nRays += unit.m_nRays;
+		cluster.m_nTransfers += unit.m_nTransfers;
+	}
+	qsort( clusters.Base(), clusters.Count(), sizeof( VisClusterStats_t ), CompareVisClusterTime );
+
+	FileHandle_t out = g_pFileSystem->Open( visclusterstatsfile, "w" );
+	if ( !out )
+	{
+		Warning( "Couldn't open %s\n", visclusterstatsfile );
+		return;
+	}
+
+	CmdLib_FPrintf( out, "cluster,seconds,units,patches,visible patches,rays,transfers,mins x,mins y,mins z,maxs x,maxs y,maxs z\n" );
+	double flThreadTime = 0.0;
+	for ( int i = 0; i < clusters.Count(); i++ )
+	{
+		const VisClusterStats_t &cluster = clusters[i];
+		flThreadTime += cluster.m_flTime;
+		if ( !cluster.m_nUnits )
+			continue;
+
+		Vector mins, maxs;
+		GetClusterBounds( cluster.m_iCluster, mins, maxs );
+		CmdLib_FPrintf( out, "%d,%.4f,%d,%d,%d,%lld,%lld,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f\n",
+			cluster.m_iCluster, cluster.m_flTime, cluster.m_nUnits, 
+			g_VisClusterPatchCount[cluster.m_iCluster], g_VisClusterVisiblePatches[cluster.m_iCluster],
+			cluster.m_nRays, cluster.m_nTransfers, 
+			mins.x, mins.y, mins.z, maxs.x, maxs.y, maxs.z );
+	}
+	g_pFileSystem->Close( out );
+
+	Msg( "Slowest vis matrix clusters (all of them are in %s):\n", visclusterstatsfile );
+	for ( int i = 0; i < MIN( clusters.Count(), 10 ); i++ )
+	{
+		const VisClusterStats_t &cluster = clusters[i];
+		if ( !cluster.m_nUnits )
+			break;
+
+		Vector mins, maxs;
+		GetClusterBounds( cluster.m_iCluster, mins, maxs );
+		Vector center = ( mins + maxs ) * 0.5f;
+		Msg( "  cluster %5d: %7.2fs (%4.1f%%), %5d patches, %9lld rays, around (%.0f %.0f %.0f)\n",
+			cluster.m_iCluster, cluster.m_flTime, 
+			( flThreadTime > 0.0 ) ? 100.0 * cluster.m_flTime / flThreadTime : 0.0,
+			g_VisClusterPatchCount[cluster.m_iCluster], cluster.m_nRays, center.x, center.y, center.z );
+	}
+}
+
+
 /*
 ==============
 BuildVisMatrix
@@ -467,17 +824,47 @@ BuildVisMatrix
 */
 void BuildVisMatrix (void)
 {
+	VRAD_PROFILE_STAGE( "BuildVisMatrix" );
+
+	memset( g_VisMatrixThreadStats, 0, sizeof( g_VisMatrixThreadStats ) );
+
 	if ( g_bUseMPI )
 	{
 		RunMPIBuildVisLeafs();
 	}
 	else 
 	{
-		RunThreadsOn (dvis->numclusters, true, BuildVisLeafs);
+		BuildVisWorkUnits();
+
+		double flStart = Plat_FloatTime();
+		RunThreadsOn( g_VisWorkUnits.Count(), true, BuildVisLeafs );
+		double flElapsed = Plat_FloatTime() - flStart;
+
+		// merge the threads' totals
+		int64 nRays = 0;
+		for ( int i = 0; i < ARRAYSIZE( g_VisMatrixThreadStats ); i++ )
+		{
+			const VisMatrixThreadStats_t &stats = g_VisMatrixThreadStats[i];
+			nRays += stats.m_nRays;
+			total_transfer += (int)stats.m_nTransfers;
+			max_transfer = MAX( max_transfer, stats.m_nMaxTransfers );
+		}
+
+		Msg( "vis matrix: %d work units from %d clusters, %lld rays in %.1f seconds (%.2f million rays/sec, %d wide packets)\n",
+			g_VisWorkUnits.Count(), dvis->numclusters, nRays, flElapsed, 
+			( flElapsed > 0.0 ) ? nRays / flElapsed * 1e-6 : 0.0, RayTrace_GetPacketSize() );
+
+		if ( g_bVisClusterStats )
+		{
+			WriteVisClusterStats();
+		}
 	}
 }
 
 void FreeVisMatrix (void)
 {
-
+	g_VisWorkUnits.Purge();
+	g_VisUnitPatches.Purge();
+	g_VisClusterPatchCount.Purge();
+	g_VisClusterVisiblePatches.Purge();
 }
@@ -12,13 +12,21 @@
 #include "physdll.h"
 #include "lightmap.h"
 #include "tier1/strtools.h"
+#include "tier1/utlbuffer.h"
 #include "vmpi.h"
 #include "macro_texture.h"
 #include "vmpi_tools_shared.h"
 #include "leaf_ambient_lighting.h"
+#include "transfermatrix.h"
+#include "vradprofile.h"
+#include "relightcache.h"
+#include "lightcull.h"
+#include "ambientrays.h"
+#include "lightmappacker.h"
 #include "tools_minidump.h"
 #include "loadcmdline.h"
 #include "byteswap.h"
+#include "vstdlib/random.h"
 
 #define ALLOWDEBUGOPTIONS (1 || _DEBUG)
 
@@ -57,6 +65,20 @@ float		g_MaxDispPatchRadius = 1500.0f;			// Maximum radius allowed for displacem
 qboolean	g_bDumpPatches;
 bool	    bDumpNormals = false;
 bool		g_bDumpRtEnv = false;
+bool		g_bExactKDTree = false;
+bool		g_bKDTreeBenchmark = false;
+bool		g_bPackBenchmark = false;
+bool		g_bKDTreeCache = true;
+bool		g_bFloatTransfers = false;
+bool		g_bCompareTransfers = false;
+bool		g_bBounceBenchmark = false;
+int			g_nBumpCosineCacheMB = 1024;
+int			g_nTransferBudgetMB = 0;
+bool		g_bProgressiveRadiosity = false;
+float		g_flProgressiveTolerance = 0.001f;
+bool		g_bCompareSolvers = false;
+bool		g_bVisClusterStats = false;
+bool		g_bProfile = false;
 bool		bRed2Black = true;
 bool		g_bFastAmbient = false;
 bool        g_bNoSkyRecurse = false;
@@ -80,6 +102,11 @@ char		level_lights[MAX_PATH] = "";
 
 char		vismatfile[_MAX_PATH] = "";
 char		incrementfile[_MAX_PATH] = "";
+char		kdtreecachefile[_MAX_PATH] = "";
+char		transferspillfile[_MAX_PATH] = "";
+char		visclusterstatsfile[_MAX_PATH] = "";
+char		profilefile[_MAX_PATH] = "";
+char		relightcachefile[_MAX_PATH] = "";
 
 IIncremental *g_pIncremental = 0;
 bool		g_bInterrupt = false;	// Wsed with background lighting in WC. Tells VRAD
@@ -102,6 +129,9 @@ bool		debug_extra = false;
 qboolean	do_fast = false;
 qboolean	do_centersamples = false;
 int			extrapasses = 4;
+float		g_flSupersampleBudget = 16.0f;		// direct supersamples per supersampled luxel
+float		g_flSupersampleContrast = 0.01f;	// stop supersampling a luxel below this error
+bool		g_bBatchShadowRays = false;
 float		smoothing_threshold = 0.7071067; // cos(45.0*(M_PI/180))
 // Cosine of smoothing angle(in radians)
 float		coring = 1.0;	// Light threshold to force to blackness(minimizes lightmaps)
@@ -1180,6 +1210,11 @@ void MakeTransfer( int ndxPatch1, int ndxPatch2, transfer_t *all_transfers )
 }
 
 
+static int CompareTransfersByPatch( const void *pLeft, const void *pRight )
+{
+	return ( (const transfer_t *)pLeft )->patch - ( (const transfer_t *)pRight )->patch;
+}
+
 void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 {
 	int		j;
@@ -1194,15 +1229,9 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 	// copy the transfers out
 	if (patch->numtransfers)
 	{
-		if (patch->numtransfers > max_transfer)
-		{
-			max_transfer = patch->numtransfers;
-		}
-
-
-		patch->transfers = ( transfer_t* )calloc (1, patch->numtransfers * sizeof(transfer_t));
-		if (!patch->transfers)
-			Error ("Memory allocation failure");
+		// sort by patch so the gather reads emitlight and g_Patches in order, and so
+		// the patch index deltas in the transfer matrix stay small
+		qsort( all_transfers, patch->numtransfers, sizeof( transfer_t ), CompareTransfersByPatch );
 
 		// get total transfer energy
 		t2 = all_transfers;
@@ -1219,16 +1248,24 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 		else
 			total = 1.0f/M_PI;
 
-		t = patch->transfers;
-		t2 = all_transfers;
-		for (j=0 ; j<patch->numtransfers ; j++, t++, t2++)
+		if ( g_bFloatTransfers || g_bCompareTransfers )
 		{
-			t->transfer = t2->transfer*total;
-			t->patch = t2->patch;
+			patch->transfers = ( transfer_t* )calloc (1, patch->numtransfers * sizeof(transfer_t));
+			if (!patch->transfers)
+				Error ("Memory allocation failure");
+
+			t = patch->transfers;
+			t2 = all_transfers;
+			for (j=0 ; j<patch->numtransfers ; j++, t++, t2++)
+			{
+				t->transfer = t2->transfer*total;
+				t->patch = t2->patch;
+			}
 		}
-		if (patch->numtransfers > max_transfer)
+
+		if ( !g_bFloatTransfers )
 		{
-			max_transfer = patch->numtransfers;
+			TransferMatrix_AddRow( ndxPatch, all_transfers, patch->numtransfers, total );
 		}
 	}
 	else
@@ -1236,10 +1273,6 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 		// Error - patch has no transfers
 		// patch->totallight[2] = 255;
 	}
-
-	ThreadLock ();
-	total_transfer += patch->numtransfers;
-	ThreadUnlock ();
 }
 
 /*
@@ -1315,6 +1348,215 @@ void WriteRTEnv (const char *name)
 	g_pFileSystem->Close( out );
 }
 
+//-----------------------------------------------------------------------------
+// kd-tree benchmark (-kdtreebench). Builds the scene's acceleration structure with the
+// exact and binned builders and reports build time and trace throughput for each, then
+// compares tracing 4, 8 and 16 rays at a time.
+//-----------------------------------------------------------------------------
+#define KDBENCH_RAY_PACKETS 262144
+#define KDBENCH_BATCH_QUADS 16
+
+static void CopyRTEnvTriangles( RayTracingEnvironment &dest, uint32 flags )
+{
+	dest.Flags = g_RtEnv.Flags | flags;
+	dest.m_nBuildThreads = numthreads;
+	dest.MakeRoomForTriangles( g_RtEnv.OptimizedTriangleList.Count() );
+	for( int i = 0; i < g_RtEnv.OptimizedTriangleList.Count(); i++ )
+	{
+		CacheOptimizedTriangle &tri = g_RtEnv.OptimizedTriangleList[i];
+		Vector color( 1, 1, 1 );
+		if ( !( g_RtEnv.Flags & RTE_FLAGS_DONT_STORE_TRIANGLE_COLORS ) )
+			color = g_RtEnv.GetTriangleColor( i );
+		int material = 0;
+		if ( !( g_RtEnv.Flags & RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS ) )
+			material = g_RtEnv.GetTriangleMaterial( i );
+		dest.AddTriangle( tri.m_Data.m_GeometryData.m_nTriangleID, tri.Vertex( 0 ), tri.Vertex( 1 ), tri.Vertex( 2 ),
+			color, tri.m_Data.m_GeometryData.m_nFlags, material );
+	}
+}
+
+static void MakeBenchmarkRays( const Vector &mins, const Vector &maxs, bool bCoherent,
+							   CUtlVector<Vector> &origins, CUtlVector<Vector> &dirs )
+{
+	CUniformRandomStream random;
+	random.SetSeed( bCoherent ? 1 : 2 );
+	origins.SetCount( 4 * KDBENCH_RAY_PACKETS );
+	dirs.SetCount( 4 * KDBENCH_RAY_PACKETS );
+	for ( int i = 0; i < origins.Count(); i++ )
+	{
+		// coherent packets share an origin and have nearly the same direction. they are made
+		// 16 rays wide so that the wide packet tracers see them as one packet too
+		if ( !bCoherent || ( i & 15 ) == 0 )
+		{
+			origins[i].Init( random.RandomFloat( mins.x, maxs.x ), random.RandomFloat( mins.y, maxs.y ),
+				random.RandomFloat( mins.z, maxs.z ) );
+			dirs[i].Init( random.RandomFloat( -1, 1 ), random.RandomFloat( -1, 1 ), random.RandomFloat( -1, 1 ) );
+		}
+		else
+		{
+			origins[i] = origins[i - 1];
+			dirs[i] = dirs[i - 1] + Vector( random.RandomFloat( -0.01, 0.01 ), random.RandomFloat( -0.01, 0.01 ),
+				random.RandomFloat( -0.01, 0.01 ) );
+		}
+		VectorNormalize( dirs[i] );
+	}
+}
+
+// traces with RayTracingEnvironment::TraceRayPackets using the given packet size. A packet
+// size of 4 is the same as calling Trace4Rays for each group.
+static double TraceBenchmarkRays( RayTracingEnvironment &env, const CUtlVector<Vector> &origins,
+								  const CUtlVector<Vector> &dirs, CUtlVector<float> &hitDists,
+								  int nPacketRays = 4 )
+{
+	RayTrace_SetPacketSize( nPacketRays );
+
+	hitDists.SetCount( origins.Count() );
+	FourRays rays[KDBENCH_BATCH_QUADS];
+	fltx4 TMin[KDBENCH_BATCH_QUADS], TMax[KDBENCH_BATCH_QUADS];
+	RayTracingResult results[KDBENCH_BATCH_QUADS];
+	for ( int q = 0; q < KDBENCH_BATCH_QUADS; q++ )
+	{
+		TMin[q] = Four_Zeros;
+		TMax[q] = ReplicateX4( 1.0e9 );
+	}
+
+	double start = Plat_FloatTime();
+	for ( int i = 0; i < origins.Count(); i += 4 * KDBENCH_BATCH_QUADS )
+	{
+		for ( int q = 0; q < KDBENCH_BATCH_QUADS; q++ )
+		{
+			int r = i + 4 * q;
+			rays[q].origin.LoadAndSwizzle( origins[r], origins[r + 1], origins[r + 2], origins[r + 3] );
+			rays[q].direction.LoadAndSwizzle( dirs[r], dirs[r + 1], dirs[r + 2], dirs[r + 3] );
+		}
+		env.TraceRayPackets( rays, TMin, TMax, KDBENCH_BATCH_QUADS, results );
+		for ( int q = 0; q < KDBENCH_BATCH_QUADS; q++ )
+		{
+			for ( int j = 0; j < 4; j++ )
+			{
+				hitDists[i + 4 * q + j] = ( results[q].HitIds[j] == -1 ) ? -1.0f : SubFloat( results[q].HitDistance, j );
+			}
+		}
+	}
+	double flTime = Plat_FloatTime() - start;
+
+	RayTrace_SetPacketSize( 0 );
+	return flTime;
+}
+
+static void RunKDTreeBenchmark()
+{
+	Msg( "kd-tree benchmark: %d triangles, %d threads\n", g_RtEnv.OptimizedTriangleList.Count(), numthreads );
+
+	RayTracingEnvironment exactEnv, binnedEnv;
+	CopyRTEnvTriangles( exactEnv, RTE_FLAGS_EXACT_TREE_GENERATION );
+	CopyRTEnvTriangles( binnedEnv, 0 );
+
+	double start = Plat_FloatTime();
+	exactEnv.SetupAccelerationStructure();
+	double flExactBuild = Plat_FloatTime() - start;
+	start = Plat_FloatTime();
+	binnedEnv.SetupAccelerationStructure();
+	double flBinnedBuild = Plat_FloatTime() - start;
+
+	Msg( "  build        exact %8.2fs (%d nodes)   binned %8.2fs (%d nodes)\n",
+		flExactBuild, exactEnv.OptimizedKDTree.Count(), flBinnedBuild, binnedEnv.OptimizedKDTree.Count() );
+
+	for ( int nCoherent = 1; nCoherent >= 0; nCoherent-- )
+	{
+		CUtlVector<Vector> origins, dirs;
+		MakeBenchmarkRays( exactEnv.m_MinBound, exactEnv.m_MaxBound, nCoherent != 0, origins, dirs );
+
+		CUtlVector<float> exactDists, binnedDists;
+		double flExactTrace = TraceBenchmarkRays( exactEnv, origins, dirs, exactDists );
+		double flBinnedTrace = TraceBenchmarkRays( binnedEnv, origins, dirs, binnedDists );
+
+		int nMismatches = 0;
+		for ( int i = 0; i < exactDists.Count(); i++ )
+		{
+			if ( fabs( exactDists[i] - binnedDists[i] ) > 0.01f )
+				nMismatches++;
+		}
+
+		Msg( "  %-10s   exact %8.2f Mrays/s       binned %8.2f Mrays/s    (%d of %d hits differ)\n",
+			nCoherent ? "coherent" : "incoherent",
+			origins.Count() / ( 1.0e6 * max( flExactTrace, 1.0e-6 ) ),
+			origins.Count() / ( 1.0e6 * max( flBinnedTrace, 1.0e-6 ) ),
+			nMismatches, origins.Count() );
+	}
+
+	// packet widths. results have to match the 4 wide tracer exactly.
+	int nMaxPacketRays = RayTrace_SetPacketSize( 16 );
+	RayTrace_SetPacketSize( 0 );
+	Msg( "  packet tracing (widest supported: %d rays)\n", nMaxPacketRays );
+	for ( int nCoherent = 1; nCoherent >= 0; nCoherent-- )
+	{
+		CUtlVector<Vector> origins, dirs;
+		MakeBenchmarkRays( binnedEnv.m_MinBound, binnedEnv.m_MaxBound, nCoherent != 0, origins, dirs );
+
+		CUtlVector<float> baseDists;
+		double flBaseTrace = TraceBenchmarkRays( binnedEnv, origins, dirs, baseDists, 4 );
+		Msg( "  %-10s    4 rays %8.2f Mrays/s\n", nCoherent ? "coherent" : "incoherent",
+			origins.Count() / ( 1.0e6 * max( flBaseTrace, 1.0e-6 ) ) );
+
+		for ( int nPacketRays = 8; nPacketRays <= nMaxPacketRays; nPacketRays *= 2 )
+		{
+			CUtlVector<float> wideDists;
+			double flWideTrace = TraceBenchmarkRays( binnedEnv, origins, dirs, wideDists, nPacketRays );
+
+			int nMismatches = 0;
+			for ( int i = 0; i < baseDists.Count(); i++ )
+			{
+				if ( memcmp( &baseDists[i], &wideDists[i], sizeof( float ) ) )
+					nMismatches++;
+			}
+
+			Msg( "                %2d rays %8.2f Mrays/s  %5.2fx   (%d of %d results differ)\n", nPacketRays,
+				origins.Count() / ( 1.0e6 * max( flWideTrace, 1.0e-6 ) ),
+				flBaseTrace / max( flWideTrace, 1.0e-6 ), nMismatches, origins.Count() );
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Builds g_RtEnv's acceleration structure, or loads it from the kd-tree cache
+// (<map>.kdtree) when the ray-trace triangles are the same as when it was written.
+//-----------------------------------------------------------------------------
+static void SetupRTEnvAccelerationStructure()
+{
+	if ( !g_bKDTreeCache )
+	{
+		g_RtEnv.SetupAccelerationStructure();
+		return;
+	}
+
+	MD5Value_t sceneHash;
+	g_RtEnv.CalculateSceneHash( sceneHash );
+
+	CUtlBuffer buf;
+	if ( g_pFileSystem->ReadFile( kdtreecachefile, NULL, buf ) )
+	{
+		const char *pFailReason = "";
+		if ( g_RtEnv.LoadAccelerationStructure( buf, sceneHash, &pFailReason ) )
+		{
+			Msg( "(loaded %s) ", kdtreecachefile );
+			return;
+		}
+		Msg( "(not using %s: %s) ", kdtreecachefile, pFailReason );
+	}
+
+	g_RtEnv.SetupAccelerationStructure();
+
+	// vmpi workers use the master's files, only the master writes the cache
+	if ( !g_bUseMPI || g_bMPIMaster )
+	{
+		buf.Purge();
+		g_RtEnv.WriteAccelerationStructure( buf, sceneHash );
+		if ( !g_pFileSystem->WriteFile( kdtreecachefile, NULL, buf ) )
+			Warning( "Couldn't write %s\n", kdtreecachefile );
+	}
+}
+
 void WriteWinding (FileHandle_t out, winding_t *w, Vector& color )
 {
 	int			i;
@@ -1506,66 +1748,85 @@ void PreGetBumpNormalsForDisp( texinfo_t *pTexinfo, Vector &vecU, Vector &vecV,
 	vecV = vecTexV;
 }
 
-void GatherLight (int threadnum, void *pUserData)
+// Accumulated differences between the transfer matrix and the float transfer lists
+// for -comparetransfers, per thread.
+struct TransferCompareStats_t
 {
-	int			i, j, k;
-	transfer_t	*trans;
-	int			num;
-	CPatch		*patch;
-	Vector		sum, v;
+	double	m_flSumDiff;
+	double	m_flSumLight;
+	float	m_flMaxDiff;
+};
 
-	while (1)
+static TransferCompareStats_t g_TransferCompareStats[MAX_TOOL_THREADS+1];
+
+// emitlight * reflectivity of every patch for the current bounce, one fltx4 per patch so
+// that the gather loads each source patch with a single aligned read
+static CUtlMemoryAligned<fltx4, 16> g_PatchExitance;
+
+static bool g_bGatherReference = false;		// use GatherPatchLight, for -bouncebench
+
+static void GetPatchBumpNormals( CPatch *patch, Vector normals[NUM_BUMP_VECTS+1] )
+{
+	// Disps
+	bool bDisp = ( g_pFaces[patch->faceNumber].dispinfo != -1 );
+	if ( bDisp )
 	{
-		j = GetThreadWork ();
-		if (j == -1)
-			break;
+		normals[0] = patch->normal;
+		texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
+		Vector vecTexU, vecTexV;
+		PreGetBumpNormalsForDisp( pTexinfo, vecTexU, vecTexV, normals[0] );
 
-		patch = &g_Patches[j];
+		// use facenormal along with the smooth normal to build the three bump map vectors
+		GetBumpNormals( vecTexU, vecTexV, normals[0], normals[0], &normals[1] );
+	}
+	else
+	{
+		GetPhongNormal( patch->faceNumber, patch->origin, normals[0] );
 
-		trans = patch->transfers;
-		num = patch->numtransfers;
-		if ( patch->needsBumpmap )
-		{
-			Vector delta;
-			Vector bumpSum[NUM_BUMP_VECTS+1];
-			Vector normals[NUM_BUMP_VECTS+1];
+		texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
+		// use facenormal along with the smooth normal to build the three bump map vectors
+		GetBumpNormals( pTexinfo->textureVecsTexelsPerWorldUnits[0],
+			pTexinfo->textureVecsTexelsPerWorldUnits[1], patch->normal,
+			normals[0], &normals[1] );
+	}
 
-			// Disps
-			bool bDisp = ( g_pFaces[patch->faceNumber].dispinfo != -1 );
-			if ( bDisp )
-			{
-				normals[0] = patch->normal;
-				texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
-				Vector vecTexU, vecTexV;
-				PreGetBumpNormalsForDisp( pTexinfo, vecTexU, vecTexV, normals[0] );
+	// force the base lightmap to use the flat normal instead of the phong normal
+	// FIXME: why does the patch not use the phong normal?
+	normals[0] = patch->normal;
+}
 
-				// use facenormal along with the smooth normal to build the three bump map vectors
-				GetBumpNormals( vecTexU, vecTexV, normals[0], normals[0], &normals[1] );
-			}
-			else
-			{
-				GetPhongNormal( patch->faceNumber, patch->origin, normals[0] );
+static void GatherPatchLight( int ndxPatch, bool bFloatTransfers, bumplights_t &light )
+{
+	int			i, k;
+	CPatch		*patch;
+	Vector		sum, v;
+	int			nRead;
+	int			pTransferPatches[TRANSFER_READ_BATCH];
+	float		pTransfers[TRANSFER_READ_BATCH];
 
-				texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
-				// use facenormal along with the smooth normal to build the three bump map vectors
-				GetBumpNormals( pTexinfo->textureVecsTexelsPerWorldUnits[0],
-					pTexinfo->textureVecsTexelsPerWorldUnits[1], patch->normal,
-					normals[0], &normals[1] );
-			}
+	patch = &g_Patches[ndxPatch];
 
-			// force the base lightmap to use the flat normal instead of the phong normal
-			// FIXME: why does the patch not use the phong normal?
-			normals[0] = patch->normal;
+	CTransferRowReader reader( ndxPatch, bFloatTransfers );
+	if ( patch->needsBumpmap )
+	{
+		Vector delta;
+		Vector bumpSum[NUM_BUMP_VECTS+1];
+		Vector normals[NUM_BUMP_VECTS+1];
 
-			for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
-			{
-				VectorFill( bumpSum[i], 0 );
-			}
+		GetPatchBumpNormals( patch, normals );
+
+		for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
+		{
+			VectorFill( bumpSum[i], 0 );
+		}
 
-			float dot;
-			for (k=0 ; k<num ; k++, trans++)
+		float dot;
+		while ( ( nRead = reader.Read( pTransferPatches, pTransfers, TRANSFER_READ_BATCH ) ) > 0 )
+		{
+			for (k=0 ; k<nRead ; k++)
 			{
-				CPatch *patch2 = &g_Patches[trans->patch];
+				int ndxPatch2 = pTransferPatches[k];
+				CPatch *patch2 = &g_Patches[ndxPatch2];
 
 				// get vector to other patch
 				VectorSubtract (patch2->origin, patch->origin, delta);
@@ -1573,11 +1834,11 @@ void GatherLight (int threadnum, void *pUserData)
 				// find light emitted from other patch
 				for(i=0; i<3; i++)
 				{
-					v[i] = emitlight[trans->patch][i] * patch2->reflectivity[i];
+					v[i] = emitlight[ndxPatch2][i] * patch2->reflectivity[i];
 				}
 				// remove normal already factored into transfer steradian
 				float scale = 1.0f / DotProduct (delta, patch->normal);
-				VectorScale( v, trans->transfer * scale, v );
+				VectorScale( v, pTransfers[k] * scale, v );
 
 				Vector bumpTransfer;
 				for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
@@ -1592,76 +1853,761 @@ void GatherLight (int threadnum, void *pUserData)
 					VectorAdd( bumpSum[i], bumpTransfer, bumpSum[i] );
 				}
 			}
-			for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
+		}
+		for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
+		{
+			VectorCopy( bumpSum[i], light.light[i] );
+		}
+	}
+	else
+	{
+		VectorFill( sum, 0 );
+		while ( ( nRead = reader.Read( pTransferPatches, pTransfers, TRANSFER_READ_BATCH ) ) > 0 )
+		{
+			for (k=0 ; k<nRead ; k++)
+			{
+				int ndxPatch2 = pTransferPatches[k];
+				for(i=0; i<3; i++)
+				{
+					v[i] = emitlight[ndxPatch2][i] * g_Patches[ndxPatch2].reflectivity[i];
+				}
+				VectorScale( v, pTransfers[k], v );
+				VectorAdd( sum, v, sum );
+			}
+		}
+		VectorCopy( sum, light.light[0] );
+	}
+}
+
+static FORCEINLINE void AccumulateBumpTransfers( int nCount, const int *pPatches, const float *pTransfers,
+												 const fltx4 *pBumpCosines, fltx4 *pBumpSum )
+{
+	COMPILE_TIME_ASSERT( NUM_BUMP_VECTS == 3 );
+
+	const fltx4 *pExitance = g_PatchExitance.Base();
+	fltx4 sum0 = pBumpSum[0];
+	fltx4 sum1 = pBumpSum[1];
+	fltx4 sum2 = pBumpSum[2];
+	fltx4 sum3 = pBumpSum[3];
+	for ( int k = 0; k < nCount; k++ )
+	{
+		fltx4 light = MulSIMD( ReplicateX4( pTransfers[k] ), pExitance[pPatches[k]] );
+		fltx4 cosines = pBumpCosines[k];
+		sum0 = MaddSIMD( SplatXSIMD( cosines ), light, sum0 );
+		sum1 = MaddSIMD( SplatYSIMD( cosines ), light, sum1 );
+		sum2 = MaddSIMD( SplatZSIMD( cosines ), light, sum2 );
+		sum3 = MaddSIMD( SplatWSIMD( cosines ), light, sum3 );
+	}
+	pBumpSum[0] = sum0;
+	pBumpSum[1] = sum1;
+	pBumpSum[2] = sum2;
+	pBumpSum[3] = sum3;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: GatherPatchLight as sparse matrix-vector products over the transfer
+//          matrix. Each transfer is one madd of the source's exitance per lightmap.
+//          The bump cosines are worked out by the first bounce and read back from
+//          the transfer matrix's cache after that.
+//-----------------------------------------------------------------------------
+static void GatherPatchLightSIMD( int ndxPatch, bumplights_t &light )
+{
+	CPatch		*patch = &g_Patches[ndxPatch];
+	int			nRead;
+	int			pTransferPatches[TRANSFER_READ_BATCH];
+	float		pTransfers[TRANSFER_READ_BATCH];
+
+	CTransferRowReader reader( ndxPatch, false );
+	if ( !patch->needsBumpmap )
+	{
+		const fltx4 *pExitance = g_PatchExitance.Base();
+		fltx4 sum = Four_Zeros;
+		while ( ( nRead = reader.Read( pTransferPatches, pTransfers, TRANSFER_READ_BATCH ) ) > 0 )
+		{
+			for ( int k = 0; k < nRead; k++ )
+			{
+				sum = MaddSIMD( ReplicateX4( pTransfers[k] ), pExitance[pTransferPatches[k]], sum );
+			}
+		}
+		StoreUnaligned3SIMD( light.light[0].Base(), sum );
+		return;
+	}
+
+	fltx4 bumpSum[NUM_BUMP_VECTS+1];
+	fltx4 pBumpCosines[TRANSFER_READ_BATCH];
+	for ( int i = 0; i < NUM_BUMP_VECTS+1; i++ )
+	{
+		bumpSum[i] = Four_Zeros;
+	}
+
+	if ( TransferMatrix_HasBumpCosines( ndxPatch ) )
+	{
+		while ( ( nRead = reader.Read( pTransferPatches, pTransfers, pBumpCosines, TRANSFER_READ_BATCH ) ) > 0 )
+		{
+			AccumulateBumpTransfers( nRead, pTransferPatches, pTransfers, pBumpCosines, bumpSum );
+		}
+	}
+	else
+	{
+		Vector normals[NUM_BUMP_VECTS+1];
+		GetPatchBumpNormals( patch, normals );
+
+		bool bCache = TransferMatrix_CanCacheBumpCosines( ndxPatch );
+		int nFirst = 0;
+		while ( ( nRead = reader.Read( pTransferPatches, pTransfers, TRANSFER_READ_BATCH ) ) > 0 )
+		{
+			for ( int k = 0; k < nRead; k++ )
+			{
+				// get vector to other patch
+				Vector delta;
+				VectorSubtract( g_Patches[pTransferPatches[k]].origin, patch->origin, delta );
+				VectorNormalize( delta );
+
+				// remove normal already factored into transfer steradian
+				float dot = DotProduct( delta, patch->normal );
+				float scale = 1.0f / dot;
+				SubFloat( pBumpCosines[k], 0 ) = ( dot > 0 ) ? 1.0f : 0.0f;
+				for ( int i = 1; i < NUM_BUMP_VECTS+1; i++ )
+				{
+					dot = DotProduct( delta, normals[i] );
+					SubFloat( pBumpCosines[k], i ) = ( dot > 0 ) ? dot * scale : 0.0f;
+				}
+			}
+
+			if ( bCache )
+			{
+				TransferMatrix_SetBumpCosines( ndxPatch, nFirst, nRead, pBumpCosines );
+			}
+			nFirst += nRead;
+
+			AccumulateBumpTransfers( nRead, pTransferPatches, pTransfers, pBumpCosines, bumpSum );
+		}
+	}
+
+	for ( int i = 0; i < NUM_BUMP_VECTS+1; i++ )
+	{
+		StoreUnaligned3SIMD( light.light[i].Base(), bumpSum[i] );
+	}
+}
+
+static void CompareTransferLight( int threadnum, CPatch *patch, const bumplights_t &light, const bumplights_t &floatLight )
+{
+	TransferCompareStats_t &stats = g_TransferCompareStats[threadnum];
+
+	int nLights = patch->needsBumpmap ? NUM_BUMP_VECTS+1 : 1;
+	for ( int i = 0; i < nLights; i++ )
+	{
+		for ( int c = 0; c < 3; c++ )
+		{
+			float flDiff = fabs( light.light[i][c] - floatLight.light[i][c] );
+			stats.m_flSumDiff += flDiff;
+			stats.m_flSumLight += fabs( floatLight.light[i][c] );
+			stats.m_flMaxDiff = MAX( stats.m_flMaxDiff, flDiff );
+		}
+	}
+}
+
+void GatherLight (int threadnum, void *pUserData)
+{
+	int			j;
+
+	while (1)
+	{
+		j = GetThreadWork( threadnum );
+		if (j == -1)
+			break;
+
+		// spilled transfers are gathered in file order
+		j = TransferMatrix_GetGatherPatch( j );
+
+		if ( g_bFloatTransfers || g_bGatherReference )
+		{
+			GatherPatchLight( j, g_bFloatTransfers, addlight[j] );
+			continue;
+		}
+
+		GatherPatchLightSIMD( j, addlight[j] );
+
+		if ( g_bCompareTransfers )
+		{
+			bumplights_t floatLight;
+			GatherPatchLight( j, true, floatLight );
+			CompareTransferLight( threadnum, &g_Patches[j], addlight[j], floatLight );
+		}
+	}
+}
+
+#ifdef _WIN32
+#pragma warning (pop)
+#endif
+
+
+static void UpdatePatchExitance( void )
+{
+	int nPatches = g_Patches.Count();
+	g_PatchExitance.EnsureCapacity( nPatches );
+
+	fltx4 *pExitance = g_PatchExitance.Base();
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		const Vector &reflectivity = g_Patches[i].reflectivity;
+		SubFloat( pExitance[i], 0 ) = emitlight[i].x * reflectivity.x;
+		SubFloat( pExitance[i], 1 ) = emitlight[i].y * reflectivity.y;
+		SubFloat( pExitance[i], 2 ) = emitlight[i].z * reflectivity.z;
+		SubFloat( pExitance[i], 3 ) = 0.0f;
+	}
+}
+
+// Moves the direct light to emitlight so that totallight only gets the bounced light.
+static void InitBounceLight( void )
+{
+	for (int i=0 ; i<g_Patches.Count(); i++)
+	{
+		// totallight has a copy of the direct lighting.  Move it to the emitted light and zero it out (to integrate bounces only)
+		VectorCopy( g_Patches[i].totallight.light[0], emitlight[i] );
+
+		// NOTE: This means that only the bounced light is integrated into totallight!
+		VectorFill( g_Patches[i].totallight.light[0], 0 );
+	}
+}
+
+struct SolverSample_t
+{
+	double	m_flTime;
+	double	m_flEnergy;				// GetBouncedLightEnergy
+};
+
+// Bounced light reaching the leaves, weighted by area.
+static double GetBouncedLightEnergy( void )
+{
+	double flEnergy = 0.0;
+	for ( int i = 0; i < g_Patches.Count(); i++ )
+	{
+		CPatch *patch = &g_Patches[i];
+		if ( patch->child1 == g_Patches.InvalidIndex() )
+		{
+			flEnergy += patch->area * VectorAvg( patch->totallight.light[0] );
+		}
+	}
+	return flEnergy;
+}
+
+/*
+=============
+BounceLight
+=============
+*/
+void BounceLight ( CUtlVector<SolverSample_t> *pHistory = NULL )
+{
+	Vector	added;
+	char		name[64];
+	qboolean	bouncing = numbounce > 0;
+	double		flTotalGather = 0.0, flTotalReference = 0.0;
+	double		flSolveStart = Plat_FloatTime();
+
+	int uiPatchCount = g_Patches.Size();
+
+	if ( bouncing && !g_bFloatTransfers )
+	{
+		// The cache shares -transferbudgetmb with the rows kept in memory, so it
+		// shrinks, or goes away, when the transfers spill.
+		int64 nBumpCacheBytes = (int64)g_nBumpCosineCacheMB * 1024 * 1024;
+		int64 nMatrixBytes = TransferMatrix_GetMemoryUsed();
+		if ( g_nTransferBudgetMB )
+		{
+			int64 nBudgetLeft = (int64)g_nTransferBudgetMB * 1024 * 1024 - nMatrixBytes;
+			nBumpCacheBytes = MIN( nBumpCacheBytes, MAX( nBudgetLeft, 0 ) );
+		}
+		TransferMatrix_InitBumpCosines( nBumpCacheBytes );
+		Msg( "bump cosine cache: %5.1f megs, transfer matrix in memory: %5.1f megs\n",
+			(float)TransferMatrix_GetBumpCosineMemoryUsed() / (1024*1024), (float)nMatrixBytes / (1024*1024) );
+	}
+
+	InitBounceLight();
+
+	unsigned i = 0U;
+	while ( bouncing )
+	{
+		// transfer light from to the leaf patches from other patches via transfers
+		// this moves shooter->emitlight to receiver->addlight
+		if ( !g_bFloatTransfers )
+		{
+			UpdatePatchExitance();
+		}
+
+		double flReference = 0.0;
+		if ( g_bBounceBenchmark && !g_bFloatTransfers )
+		{
+			// the scalar gather, for comparison. the real one below overwrites its results.
+			g_bGatherReference = true;
+			double flStart = Plat_FloatTime();
+			RunThreadsOn (uiPatchCount, false, GatherLight);
+			flReference = Plat_FloatTime() - flStart;
+			g_bGatherReference = false;
+		}
+
+		memset( g_TransferCompareStats, 0, sizeof( g_TransferCompareStats ) );
+		double flStart = Plat_FloatTime();
+		RunThreadsOn (uiPatchCount, true, GatherLight);
+		double flGather = Plat_FloatTime() - flStart;
+
+		if ( g_bCompareTransfers )
+		{
+			TransferCompareStats_t total;
+			memset( &total, 0, sizeof( total ) );
+			for ( int iThread = 0; iThread < MAX_TOOL_THREADS+1; iThread++ )
+			{
+				total.m_flSumDiff += g_TransferCompareStats[iThread].m_flSumDiff;
+				total.m_flSumLight += g_TransferCompareStats[iThread].m_flSumLight;
+				total.m_flMaxDiff = MAX( total.m_flMaxDiff, g_TransferCompareStats[iThread].m_flMaxDiff );
+			}
+			Msg( "\tBounce #%i transfer matrix vs float transfers: %.4f%% average difference, max %.3f\n",
+				i+1, ( total.m_flSumLight > 0 ) ? 100.0 * total.m_flSumDiff / total.m_flSumLight : 0.0, total.m_flMaxDiff );
+		}
+		// move newly received light (addlight) to light to be sent out (emitlight)
+		// start at children and pull light up to parents
+		// light is always received to leaf patches
+		CollectLight( added );
+		if ( pHistory )
+		{
+			SolverSample_t &sample = (*pHistory)[pHistory->AddToTail()];
+			sample.m_flTime = Plat_FloatTime() - flSolveStart;
+			sample.m_flEnergy = GetBouncedLightEnergy();
+		}
+
+		Msg("\tBounce #%i added RGB(%.0f, %.0f, %.0f)\n", i+1, added[0], added[1], added[2] );
+		if ( g_bBounceBenchmark )
+		{
+			if ( flReference > 0.0 )
+				Msg("\tBounce #%i gather %.3fs, scalar gather %.3fs (%.2fx)\n", i+1, flGather, flReference, flReference / MAX( flGather, 1e-6 ) );
+			else
+				Msg("\tBounce #%i gather %.3fs\n", i+1, flGather );
+			flTotalGather += flGather;
+			flTotalReference += flReference;
+		}
+
+		if ( i+1 == numbounce || (added[0] < 1.0 && added[1] < 1.0 && added[2] < 1.0) )
+			bouncing = false;
+
+		i++;
+		if ( g_bDumpPatches && !bouncing && i != 1)
+		{
+			sprintf (name, "bounce%i.txt", i);
+			WriteWorld (name, 0);
+		}
+	}
+
+	if ( g_bBounceBenchmark && i > 0 )
+	{
+		Msg("%d bounces: gather %.3fs, %.3fs per bounce", i, flTotalGather, flTotalGather / i );
+		if ( flTotalReference > 0.0 )
+			Msg(", scalar gather %.3fs, %.3fs per bounce", flTotalReference, flTotalReference / i );
+		Msg("\n");
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Progressive radiosity
+//
+// Southwell iteration: instead of every patch gathering every bounce, the leaf
+// patches holding the most unshot light shoot it through the shooting matrix
+// (the transposed transfers) until the estimated remaining light is below
+// g_flProgressiveTolerance of the bounced light. Light a leaf shoots also goes
+// out through the transfers to its parents, weighted by its share of their area,
+// which is what the gather sees after CollectLight.
+//-----------------------------------------------------------------------------
+
+// Leaves with at least this fraction of the most unshot light shoot together.
+#define PROGRESSIVE_BATCH_FRACTION	0.5f
+
+// Cap on the reflected fraction used to extrapolate the remaining light.
+#define PROGRESSIVE_MAX_REFLECTANCE	0.95f
+
+// Scratch memory for transposing the transfers when there's no -transferbudgetmb.
+#define PROGRESSIVE_SCRATCH_MB		512
+
+// Receivers with bump maps, packed so the shooting doesn't have to touch g_Patches.
+struct ShootBumpReceiver_t
+{
+	fltx4	m_Origin;
+	fltx4	m_NormalX;							// the bump basis, one normal per lane
+	fltx4	m_NormalY;
+	fltx4	m_NormalZ;
+	fltx4	m_Light[NUM_BUMP_VECTS+1];			// received this batch
+};
+
+static CUtlVector<Vector>							g_ShootLight;			// per patch, light shot through its transfers this batch
+static CUtlVector<int>								g_ShootPatches;			// patches with g_ShootLight set
+static CUtlVector<int>								g_ShootBumpReceiver;	// per patch, -1 if it has no bump map
+static CUtlMemoryAligned<ShootBumpReceiver_t, 16>	g_ShootBumpReceivers;
+static CUtlMemoryAligned<fltx4, 16>					g_ShootReceived;		// light received by patches without bump maps
+
+static void ShootLight( int iThread, void *pUserData )
+{
+	int			nRead;
+	int			pReceivers[TRANSFER_READ_BATCH];
+	float		pTransfers[TRANSFER_READ_BATCH];
+
+	COMPILE_TIME_ASSERT( NUM_BUMP_VECTS == 3 );
+
+	fltx4 *pReceived = g_ShootReceived.Base();
+	const int *pBumpReceiver = g_ShootBumpReceiver.Base();
+	ShootBumpReceiver_t *pBumpReceivers = g_ShootBumpReceivers.Base();
+
+	while ( 1 )
+	{
+		int iPartition = GetThreadWork( iThread );
+		if ( iPartition == -1 )
+			break;
+
+		for ( int s = 0; s < g_ShootPatches.Count(); s++ )
+		{
+			int ndxPatch2 = g_ShootPatches[s];
+			CPatch *patch2 = &g_Patches[ndxPatch2];
+			Vector v = g_ShootLight[ndxPatch2] * patch2->reflectivity;
+			fltx4 v4 = LoadUnaligned3SIMD( v.Base() );
+			SubFloat( v4, 3 ) = 0.0f;
+			fltx4 origin2 = LoadUnaligned3SIMD( patch2->origin.Base() );
+
+			CShootingColumnReader reader( ndxPatch2, iPartition );
+			while ( ( nRead = reader.Read( pReceivers, pTransfers, TRANSFER_READ_BATCH ) ) > 0 )
+			{
+				for ( int k = 0; k < nRead; k++ )
+				{
+					int ndxPatch = pReceivers[k];
+					int iBump = pBumpReceiver[ndxPatch];
+					if ( iBump < 0 )
+					{
+						pReceived[ndxPatch] = MaddSIMD( ReplicateX4( pTransfers[k] ), v4, pReceived[ndxPatch] );
+						continue;
+					}
+
+					// the same cosines as GatherPatchLightSIMD, with all four worked out at once
+					ShootBumpReceiver_t &receiver = pBumpReceivers[iBump];
+					fltx4 delta = SubSIMD( origin2, receiver.m_Origin );
+					delta = MulSIMD( delta, ReciprocalSqrtSIMD( Dot3SIMD( delta, delta ) ) );
+					fltx4 dots = MulSIMD( SplatXSIMD( delta ), receiver.m_NormalX );
+					dots = MaddSIMD( SplatYSIMD( delta ), receiver.m_NormalY, dots );
+					dots = MaddSIMD( SplatZSIMD( delta ), receiver.m_NormalZ, dots );
+					fltx4 cosines = AndSIMD( CmpGtSIMD( dots, Four_Zeros ), DivSIMD( dots, SplatXSIMD( dots ) ) );
+
+					fltx4 light = MulSIMD( ReplicateX4( pTransfers[k] ), v4 );
+					receiver.m_Light[0] = MaddSIMD( SplatXSIMD( cosines ), light, receiver.m_Light[0] );
+					receiver.m_Light[1] = MaddSIMD( SplatYSIMD( cosines ), light, receiver.m_Light[1] );
+					receiver.m_Light[2] = MaddSIMD( SplatZSIMD( cosines ), light, receiver.m_Light[2] );
+					receiver.m_Light[3] = MaddSIMD( SplatWSIMD( cosines ), light, receiver.m_Light[3] );
+				}
+			}
+		}
+	}
+}
+
+static bool ProgressiveLight( CUtlVector<SolverSample_t> &history )
+{
+	Vector		added;
+	int			nPatches = g_Patches.Count();
+	double		flStart = Plat_FloatTime();
+
+	if ( numbounce <= 0 )
+	{
+		InitBounceLight();
+		return true;
+	}
+
+	// the shooting matrix can't spill, so with -transferbudgetmb it has to fit in
+	// what the rows in memory leave, since both are around until it's built
+	int64 nMaxBytes = 0;
+	int64 nScratch = (int64)PROGRESSIVE_SCRATCH_MB * 1024 * 1024;
+	if ( g_nTransferBudgetMB )
+	{
+		nMaxBytes = MAX( (int64)g_nTransferBudgetMB * 1024 * 1024 - TransferMatrix_GetMemoryUsed(), (int64)1 );
+		nScratch = nMaxBytes;
+	}
+	int64 nShootBytes = 0;
+	if ( !TransferMatrix_BuildShootingMatrix( numthreads, nScratch, nMaxBytes, &nShootBytes ) )
+	{
+		Warning( "Shooting matrix needs %.1f megs, over the %.1f left in -transferbudgetmb; using the gather solver\n",
+			(float)nShootBytes / (1024*1024), (float)nMaxBytes / (1024*1024) );
+		return false;
+	}
+	Msg( "shooting matrix: %5.1f megs\n", (float)TransferMatrix_GetShootingMemoryUsed() / (1024*1024) );
+
+	// every patch, parents included, starts out emitting its own direct light, so
+	// the first bounce is an ordinary gather
+	InitBounceLight();
+
+	double flShot = 0.0;
+	int nLeaves = 0;
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		if ( g_Patches[i].child1 == g_Patches.InvalidIndex() )
+		{
+			flShot += g_Patches[i].area * VectorAvg( emitlight[i] );
+			nLeaves++;
+		}
+	}
+
+	UpdatePatchExitance();
+	RunThreadsOn( nPatches, true, GatherLight );
+	CollectLight( added );
+	Msg( "\tBounce #1 added RGB(%.0f, %.0f, %.0f)\n", added[0], added[1], added[2] );
+
+	// after that only leaves receive light. emitlight is their unshot light.
+	double flReceived = GetBouncedLightEnergy();
+
+	TransferMatrix_FreeRows();
+
+	g_ShootLight.SetCount( nPatches );
+	g_ShootBumpReceiver.SetCount( nPatches );
+	g_ShootReceived.EnsureCapacity( nPatches );
+	g_ShootBumpReceivers.EnsureCapacity( nLeaves );
+	int nBumpReceivers = 0;
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		CPatch *patch = &g_Patches[i];
+		g_ShootLight[i].Init();
+		g_ShootReceived[i] = Four_Zeros;
+		g_ShootBumpReceiver[i] = -1;
+		if ( patch->needsBumpmap && patch->child1 == g_Patches.InvalidIndex() )
+		{
+			ShootBumpReceiver_t &receiver = g_ShootBumpReceivers[nBumpReceivers];
+			g_ShootBumpReceiver[i] = nBumpReceivers++;
+
+			Vector normals[NUM_BUMP_VECTS+1];
+			GetPatchBumpNormals( patch, normals );
+			receiver.m_Origin = LoadUnaligned3SIMD( patch->origin.Base() );
+			for ( int j = 0; j < NUM_BUMP_VECTS+1; j++ )
+			{
+				SubFloat( receiver.m_NormalX, j ) = normals[j].x;
+				SubFloat( receiver.m_NormalY, j ) = normals[j].y;
+				SubFloat( receiver.m_NormalZ, j ) = normals[j].z;
+				receiver.m_Light[j] = Four_Zeros;
+			}
+		}
+	}
+
+	// flReceived / flShot is how much of the light that's shot comes back, for
+	// extrapolating what's left. numbounce caps the work at about that many gathers.
+	int nShots = 0;
+	int64 nMaxShots = (int64)numbounce * nLeaves;
+	int nBatches = 0;
+	double flReportError = 0.1;
+	double flError = 1.0;
+	while ( 1 )
+	{
+		// move the light received by the last batch to totallight and the unshot light,
+		// and find the leaves with the most unshot light
+		double flUnshot = 0.0;
+		double flEnergy = 0.0;
+		float flMaxPower = 0.0f;
+		for ( int i = 0; i < nPatches; i++ )
+		{
+			CPatch *patch = &g_Patches[i];
+			if ( patch->child1 != g_Patches.InvalidIndex() )
+				continue;
+
+			// sky patches drop what they receive, as in CollectLight
+			bumplights_t &light = addlight[i];
+			if ( g_ShootBumpReceiver[i] >= 0 )
+			{
+				ShootBumpReceiver_t &receiver = g_ShootBumpReceivers[g_ShootBumpReceiver[i]];
+				for ( int j = 0; j < NUM_BUMP_VECTS+1; j++ )
+				{
+					StoreUnaligned3SIMD( light.light[j].Base(), receiver.m_Light[j] );
+					receiver.m_Light[j] = Four_Zeros;
+				}
+			}
+			else
+			{
+				StoreUnaligned3SIMD( light.light[0].Base(), g_ShootReceived[i] );
+				g_ShootReceived[i] = Four_Zeros;
+			}
+			if ( !patch->sky )
+			{
+				int normalCount = patch->needsBumpmap ? NUM_BUMP_VECTS+1 : 1;
+				for ( int j = 0; j < normalCount; j++ )
+				{
+					VectorAdd( patch->totallight.light[j], light.light[j], patch->totallight.light[j] );
+				}
+				VectorAdd( emitlight[i], light.light[0], emitlight[i] );
+				flReceived += patch->area * VectorAvg( light.light[0] );
+			}
+			for ( int j = 0; j < NUM_BUMP_VECTS+1; j++ )
 			{
-				VectorCopy( bumpSum[i], addlight[j].light[i] );
+				VectorFill( light.light[j], 0 );
 			}
+
+			Vector reflected = emitlight[i] * patch->reflectivity;
+			flEnergy += patch->area * VectorAvg( patch->totallight.light[0] );
+			flUnshot += patch->area * VectorAvg( emitlight[i] );
+			flMaxPower = MAX( flMaxPower, patch->area * VectorAvg( reflected ) );
 		}
-		else
+
+		SolverSample_t &sample = history[history.AddToTail()];
+		sample.m_flTime = Plat_FloatTime() - flStart;
+		sample.m_flEnergy = flEnergy;
+
+		// the unshot light and all its bounces, assuming each bounce returns the
+		// same fraction as so far
+		double flReflectance = ( flShot > 0.0 ) ? MIN( flReceived / flShot, (double)PROGRESSIVE_MAX_REFLECTANCE ) : 0.0;
+		double flRemaining = flUnshot * flReflectance / ( 1.0 - flReflectance );
+		flError = ( flEnergy > 0.0 ) ? flRemaining / flEnergy : 0.0;
+		if ( flError < flReportError )
 		{
-			VectorFill( sum, 0 );
-			for (k=0 ; k<num ; k++, trans++)
+			Msg( "\t%d batches, %d shots: estimated error %.3f%%\n", nBatches, nShots, 100.0 * flError );
+			while ( flReportError > flError )
 			{
-				for(i=0; i<3; i++)
+				flReportError *= 0.1;
+			}
+		}
+		if ( flError <= g_flProgressiveTolerance || flMaxPower <= 0.0f )
+			break;
+		if ( nShots >= nMaxShots )
+		{
+			Warning( "Progressive radiosity stopped after %d shots with an estimated error of %.3f%%\n", nShots, 100.0 * flError );
+			break;
+		}
+
+		// pass each shooter's light up to its parents so each patch's transfers are read once
+		float flThreshold = flMaxPower * PROGRESSIVE_BATCH_FRACTION;
+		for ( int i = 0; i < nPatches; i++ )
+		{
+			CPatch *patch = &g_Patches[i];
+			if ( patch->child1 != g_Patches.InvalidIndex() )
+				continue;
+			Vector reflected = emitlight[i] * patch->reflectivity;
+			if ( patch->area * VectorAvg( reflected ) < flThreshold )
+				continue;
+
+			for ( int ndxParent = i; ndxParent != g_Patches.InvalidIndex(); ndxParent = g_Patches[ndxParent].parent )
+			{
+				if ( g_ShootLight[ndxParent] == vec3_origin )
 				{
-					v[i] = emitlight[trans->patch][i] * g_Patches[trans->patch].reflectivity[i];
+					g_ShootPatches.AddToTail( ndxParent );
 				}
-				VectorScale( v, trans->transfer, v );
-				VectorAdd( sum, v, sum );
+				VectorMA( g_ShootLight[ndxParent], patch->area / g_Patches[ndxParent].area, emitlight[i], g_ShootLight[ndxParent] );
 			}
-			VectorCopy( sum, addlight[j].light[0] );
+			flShot += patch->area * VectorAvg( emitlight[i] );
+			emitlight[i].Init();
+			nShots++;
+		}
+
+		RunThreadsOn( TransferMatrix_GetShootingPartitionCount(), false, ShootLight );
+
+		for ( int s = 0; s < g_ShootPatches.Count(); s++ )
+		{
+			g_ShootLight[g_ShootPatches[s]].Init();
 		}
+		g_ShootPatches.RemoveAll();
+		nBatches++;
+	}
+
+	Msg( "Progressive radiosity: %d batches, %d shots (%.1f per leaf patch), estimated error %.3f%%, %.2f seconds\n",
+		nBatches, nShots, nLeaves ? (float)nShots / nLeaves : 0.0f, 100.0 * flError, Plat_FloatTime() - flStart );
+
+	// fill in the parents' totallight
+	for ( int i = 0; i < nPatches; i++ )
+	{
+		emitlight[i].Init();
 	}
+	CollectLight( added );
+
+	TransferMatrix_FreeShootingMatrix();
+	g_ShootLight.Purge();
+	g_ShootPatches.Purge();
+	g_ShootBumpReceiver.Purge();
+	g_ShootBumpReceivers.Purge();
+	g_ShootReceived.Purge();
+	return true;
 }
 
-#ifdef _WIN32
-#pragma warning (pop)
-#endif
+// Time until each solver's bounced light is within flTolerance of flReference.
+static double GetTimeToTolerance( const CUtlVector<SolverSample_t> &history, double flReference, double flTolerance )
+{
+	for ( int i = 0; i < history.Count(); i++ )
+	{
+		if ( flReference - history[i].m_flEnergy <= flTolerance * flReference )
+			return history[i].m_flTime;
+	}
+	return -1.0;
+}
 
+static void PrintTimeToTolerance( const char *pSolver, const CUtlVector<SolverSample_t> &history, double flReference, double flTolerance )
+{
+	double flTime = GetTimeToTolerance( history, flReference, flTolerance );
+	if ( flTime >= 0.0 )
+	{
+		Msg( " %s %8.2fs", pSolver, flTime );
+	}
+	else
+	{
+		Msg( " %s  (never)", pSolver );
+	}
+}
 
 /*
 =============
-BounceLight
+ProgressiveBounceLight
+
+Solves the bounced light with the progressive solver. With -solvercompare the
+current solver is run first from the same direct light and the time each one
+takes to get within a tolerance of the better converged answer is reported.
 =============
 */
-void BounceLight (void)
+void ProgressiveBounceLight( void )
 {
-	Vector	added;
-	char		name[64];
-	qboolean	bouncing = numbounce > 0;
-
-	int uiPatchCount = g_Patches.Size();
-	for (int i=0 ; i<uiPatchCount; i++)
+	if ( g_bFloatTransfers )
 	{
-		// totallight has a copy of the direct lighting.  Move it to the emitted light and zero it out (to integrate bounces only)
-		VectorCopy( g_Patches[i].totallight.light[0], emitlight[i] );
-
-		// NOTE: This means that only the bounced light is integrated into totallight!
-		VectorFill( g_Patches[i].totallight.light[0], 0 );
+		Warning( "-progressive needs the transfer matrix, ignoring it because of -floattransfers\n" );
+		BounceLight();
+		return;
 	}
 
-	unsigned i = 0U;
-	while ( bouncing )
+	CUtlVector<SolverSample_t> jacobiHistory;
+	if ( g_bCompareSolvers )
 	{
-		// transfer light from to the leaf patches from other patches via transfers
-		// this moves shooter->emitlight to receiver->addlight
-		RunThreadsOn (uiPatchCount, true, GatherLight);
-		// move newly received light (addlight) to light to be sent out (emitlight)
-		// start at children and pull light up to parents
-		// light is always received to leaf patches
-		CollectLight( added );
+		int nPatches = g_Patches.Count();
+		CUtlVector<bumplights_t> directLight;
+		directLight.SetCount( nPatches );
+		for ( int i = 0; i < nPatches; i++ )
+		{
+			directLight[i] = g_Patches[i].totallight;
+		}
 
-		Msg("\tBounce #%i added RGB(%.0f, %.0f, %.0f)\n", i+1, added[0], added[1], added[2] );
+		Msg( "Bouncing light with the gather solver for comparison\n" );
+		BounceLight( &jacobiHistory );
 
-		if ( i+1 == numbounce || (added[0] < 1.0 && added[1] < 1.0 && added[2] < 1.0) )
-			bouncing = false;
+		// start over from the direct light
+		for ( int i = 0; i < nPatches; i++ )
+		{
+			g_Patches[i].totallight = directLight[i];
+		}
+	}
 
-		i++;
-		if ( g_bDumpPatches && !bouncing && i != 1)
+	CUtlVector<SolverSample_t> progressiveHistory;
+	if ( !ProgressiveLight( progressiveHistory ) )
+	{
+		// totallight is back to the direct light even when comparing
+		BounceLight();
+		return;
+	}
+
+	if ( g_bCompareSolvers && jacobiHistory.Count() && progressiveHistory.Count() )
+	{
+		// both add light monotonically, so the one that got further is closer to the answer
+		double flReference = MAX( jacobiHistory.Tail().m_flEnergy, progressiveHistory.Tail().m_flEnergy );
+		Msg( "Time to tolerance (bounced light within X%% of the best answer):\n" );
+		static const double s_Tolerances[] = { 0.1, 0.01, 0.001, 0.0001 };
+		for ( int i = 0; i < ARRAYSIZE( s_Tolerances ); i++ )
 		{
-			sprintf (name, "bounce%i.txt", i);
-			WriteWorld (name, 0);
+			Msg( "\t%7.2f%%:", 100.0 * s_Tolerances[i] );
+			PrintTimeToTolerance( "gather", jacobiHistory, flReference, s_Tolerances[i] );
+			PrintTimeToTolerance( "progressive", progressiveHistory, flReference, s_Tolerances[i] );
+			Msg( "\n" );
 		}
+		Msg( "\tfinal: gather %.4f%% short, %.2fs; progressive %.4f%% short, %.2fs\n",
+			( flReference > 0 ) ? 100.0 * ( flReference - jacobiHistory.Tail().m_flEnergy ) / flReference : 0.0, jacobiHistory.Tail().m_flTime,
+			( flReference > 0 ) ? 100.0 * ( flReference - progressiveHistory.Tail().m_flEnergy ) / flReference : 0.0, progressiveHistory.Tail().m_flTime );
 	}
 }
 
@@ -1692,6 +2638,8 @@ RadWorld
 */
 void RadWorld_Start()
 {
+	VRAD_PROFILE_STAGE( "RadWorld_Start" );
+
 	if (luxeldensity < 1.0)
 	{
 		// rescale luxels to be no denser than "luxeldensity"
@@ -1848,6 +2796,14 @@ void BuildFacesVisibleToLights( bool bAllVisible )
 
 void MakeAllScales (void)
 {
+	// only the master keeps the whole matrix, workers just send their rows to it
+	int64 nTransferBudget = 0;
+	if ( !g_bUseMPI || g_bMPIMaster )
+	{
+		nTransferBudget = (int64)g_nTransferBudgetMB * 1024 * 1024;
+	}
+	TransferMatrix_Init( g_Patches.Count(), nTransferBudget, transferspillfile );
+
 	// determine visibility between patches
 	BuildVisMatrix ();
 
@@ -1856,8 +2812,26 @@ void MakeAllScales (void)
 
 	Msg("transfers %d, max %d\n", total_transfer, max_transfer );
 
-	Msg("transfer lists: %5.1f megs\n"
-		, (float)total_transfer * sizeof(transfer_t) / (1024*1024));
+	float flFloatMegs = (float)total_transfer * sizeof(transfer_t) / (1024*1024);
+	if ( g_bFloatTransfers )
+	{
+		Msg("transfer lists: %5.1f megs\n", flFloatMegs );
+		return;
+	}
+
+	TransferMatrix_Finish();
+
+	float flMatrixMegs = (float)TransferMatrix_GetMemoryUsed() / (1024*1024);
+	Msg("transfer matrix: %5.1f megs, %5.1f megs saved over float transfer lists (%.0f%%)\n",
+		flMatrixMegs, flFloatMegs - flMatrixMegs, ( flFloatMegs > 0 ) ? 100.0f * ( 1.0f - flMatrixMegs / flFloatMegs ) : 0.0f );
+	if ( TransferMatrix_GetSpillFileSize() )
+	{
+		Msg("transfer spill file: %5.1f megs in %s\n", (float)TransferMatrix_GetSpillFileSize() / (1024*1024), transferspillfile );
+	}
+	if ( g_bCompareTransfers )
+	{
+		Msg("transfer lists: %5.1f megs\n", flFloatMegs );
+	}
 }
 
 
@@ -1924,10 +2898,13 @@ void MakeAllScales (void)
 
 bool RadWorld_Go()
 {
+	VRAD_PROFILE_STAGE( "RadWorld_Go" );
+
 	g_iCurFace = 0;
 
 	InitMacroTexture( source );
 
+	bool bPartialRelight = false;
 	if( g_pIncremental )
 	{
 		g_pIncremental->PrepareForLighting();
@@ -1935,6 +2912,11 @@ bool RadWorld_Go()
 		// Cull out faces that aren't visible to any of the lights that we're updating with.
 		BuildFacesVisibleToLights( false );
 	}
+	else if ( g_bIncrementalLighting && RelightCache_Begin( relightcachefile ) )
+	{
+		// Only the faces that changed, and their neighbors, get lit.
+		bPartialRelight = true;
+	}
 	else
 	{
 		// Mark all faces visible.. when not doing incremental lighting, it's highly
@@ -1943,7 +2925,13 @@ bool RadWorld_Go()
 		BuildFacesVisibleToLights( true );
 	}
 
+	// bin the lights so faces only gather the ones that reach them
+	LightCull_Build();
+
 	// build initial facelights
+	VRadProfile_BeginStage( "BuildFacelights" );
+	double flFacelightsStart = Plat_FloatTime();
+	int64 nFacelightsStartRays = VRadProfile_GetTotalRays();
 	if (g_bUseMPI)
 	{
 		// RunThreadsOnIndividual (numfaces, true, BuildFacelights);
@@ -1953,11 +2941,23 @@ bool RadWorld_Go()
 	{
 		RunThreadsOnIndividual (numfaces, true, BuildFacelights);
 	}
+	double flFacelightsTime = Plat_FloatTime() - flFacelightsStart;
+	int64 nFacelightsRays = VRadProfile_GetTotalRays() - nFacelightsStartRays;
+	if ( nFacelightsRays > 0 && flFacelightsTime > 0.0 )
+	{
+		Msg( "Direct lighting traced %.0f rays/sec (%s shadow rays)\n",
+			nFacelightsRays / flFacelightsTime, g_bBatchShadowRays ? "batched" : "unbatched" );
+	}
+	ReportSupersampleStats();
+	LightCull_Report();
+	VRadProfile_EndStage();
 
 	// Was the process interrupted?
 	if( g_pIncremental && (g_iCurFace != numfaces) )
 		return false;
 
+	RelightCache_RestoreStyles();
+
 	// Figure out the offset into lightmap data for each face.
 	PrecompLightmapOffsets();
 
@@ -1981,7 +2981,8 @@ bool RadWorld_Go()
 			}
 		}
 
-		if (numbounce > 0)
+		// a partial relight reuses the cached bounce
+		if (numbounce > 0 && !bPartialRelight)
 		{
 			// allocate memory for emitlight/addlight
 			emitlight.SetSize( g_Patches.Size() );
@@ -1992,7 +2993,19 @@ bool RadWorld_Go()
 			MakeAllScales ();
 
 			// spread light around
-			BounceLight ();
+			VRadProfile_BeginStage( "BounceLight" );
+			if ( g_bProgressiveRadiosity )
+			{
+				ProgressiveBounceLight();
+			}
+			else
+			{
+				BounceLight ();
+			}
+			VRadProfile_EndStage();
+
+			// the transfers aren't needed anymore. this also deletes the spill file.
+			TransferMatrix_Free();
 		}
 
 		//
@@ -2005,13 +3018,21 @@ bool RadWorld_Go()
 
 		// blend bounced light into direct light and save
 		VMPI_SetCurrentStage( "FinalLightFace" );
+		VRadProfile_BeginStage( "FinalLightFace" );
 		if ( !g_bUseMPI || g_bMPIMaster )
 			RunThreadsOnIndividual (numfaces, true, FinalLightFace);
+		VRadProfile_EndStage();
 
 		// Distribute the lighting data to workers.
 		VMPI_DistributeLightData();
 
 		Msg("FinalLightFace Done\n"); fflush(stdout);
+
+		if ( g_bIncrementalLighting )
+		{
+			RelightCache_Save( relightcachefile );
+			RelightCache_Free();
+		}
 	}
 
 	return true;
@@ -2057,6 +3078,12 @@ void VRAD_LoadBSP( char const *pFilename )
 		SetLowPriority();
 	}
 
+	if ( g_bIncrementalLighting && g_bUseMPI )
+	{
+		Warning( "-incremental doesn't work with -mpi, lighting everything.\n" );
+		g_bIncrementalLighting = false;
+	}
+
 	Q_StripExtension( pFilename, source, sizeof( source ) );
 	Q_FileBase( source, source, sizeof( source ) );
 	strcpy( level_name, source );
@@ -2104,11 +3131,26 @@ void VRAD_LoadBSP( char const *pFilename )
 
 	strcpy(incrementfile, source);
 	Q_DefaultExtension(incrementfile, ".r0", sizeof(incrementfile));
+	strcpy(kdtreecachefile, source);
+	Q_DefaultExtension(kdtreecachefile, ".kdtree", sizeof(kdtreecachefile));
+	strcpy(transferspillfile, source);
+	Q_DefaultExtension(transferspillfile, ".transfers", sizeof(transferspillfile));
+	strcpy(visclusterstatsfile, source);
+	Q_DefaultExtension(visclusterstatsfile, ".visclusters.csv", sizeof(visclusterstatsfile));
+	strcpy(relightcachefile, source);
+	Q_DefaultExtension(relightcachefile, g_bHDR ? ".hdr.relight" : ".ldr.relight", sizeof(relightcachefile));
+	if ( !profilefile[0] )
+	{
+		strcpy(profilefile, source);
+		Q_DefaultExtension(profilefile, ".vradprofile.json", sizeof(profilefile));
+	}
 	Q_DefaultExtension(source, ".bsp", sizeof( source ));
 
 	Msg( "Loading %s\n", source );
 	VMPI_SetCurrentStage( "LoadBSPFile" );
+	VRadProfile_BeginStage( "LoadBSPFile" );
 	LoadBSPFile (source);
+	VRadProfile_EndStage();
 
 	// Add this bsp to our search path so embedded resources can be found
 	if ( g_bUseMPI && g_bMPIMaster )
@@ -2186,6 +3228,7 @@ void VRAD_LoadBSP( char const *pFilename )
 	}
 
 	// Setup ray tracer
+	VRadProfile_BeginStage( "SetupRayTracing" );
 	AddBrushesForRayTrace();
 	StaticDispMgr()->AddPolysForRayTrace();
 	StaticPropMgr()->AddPolysForRayTrace();
@@ -2194,12 +3237,25 @@ void VRAD_LoadBSP( char const *pFilename )
 	if ( g_bDumpRtEnv )
 		WriteRTEnv("trace.txt");
 
+	if ( g_bIncrementalLighting )
+		RelightCache_HashOccluders();
+
+	if ( g_bKDTreeBenchmark )
+		RunKDTreeBenchmark();
+
+	if ( g_bPackBenchmark )
+		RunLightmapPackBenchmark();
+
 	// Build acceleration structure
 	Msg( "Setting up ray-trace acceleration structure... " );
 	float start = Plat_FloatTime();
-	g_RtEnv.SetupAccelerationStructure();
+	if ( g_bExactKDTree )
+		g_RtEnv.Flags |= RTE_FLAGS_EXACT_TREE_GENERATION;
+	g_RtEnv.m_nBuildThreads = numthreads;
+	SetupRTEnvAccelerationStructure();
 	float end = Plat_FloatTime();
 	Msg( "Done (%.2f seconds)\n", end - start );
+	VRadProfile_EndStage();
 
 #if 0  // To test only k-d build
 	exit(0);
@@ -2220,17 +3276,30 @@ void VRAD_LoadBSP( char const *pFilename )
 
 void VRAD_ComputeOtherLighting()
 {
+	// The detail prop and leaf ambient rays need to know which face they hit
+	{
+		VRAD_PROFILE_STAGE( "SetupAmbientRayTracing" );
+		AmbientRays_Build();
+	}
+
 	// Compute lighting for the bsp file
 	if ( !g_bNoDetailLighting )
 	{
+		VRAD_PROFILE_STAGE( "DetailPropLighting" );
 		ComputeDetailPropLighting( THREADINDEX_MAIN );
 	}
 
-	ComputePerLeafAmbientLighting();
+	{
+		VRAD_PROFILE_STAGE( "LeafAmbientLighting" );
+		ComputePerLeafAmbientLighting();
+	}
+
+	AmbientRays_Free();
 
 	// bake the static props high quality vertex lighting into the bsp
 	if ( !do_fast && g_bStaticPropLighting )
 	{
+		VRAD_PROFILE_STAGE( "StaticPropLighting" );
 		StaticPropMgr()->ComputeLighting( THREADINDEX_MAIN );
 	}
 }
@@ -2249,7 +3318,9 @@ void VRAD_Finish()
 
 	Msg( "Writing %s\n", source );
 	VMPI_SetCurrentStage( "WriteBSPFile" );
+	VRadProfile_BeginStage( "WriteBSPFile" );
 	WriteBSPFile(source);
+	VRadProfile_EndStage();
 
 	if ( g_bDumpPatches )
 	{
@@ -2266,6 +3337,11 @@ void VRAD_Finish()
 
 	StaticPropMgr()->Shutdown();
 
+	if ( g_bThreadStats )
+	{
+		ReportWindingPoolStats();
+	}
+
 	double end = Plat_FloatTime();
 
 	char str[512];
@@ -2353,6 +3429,119 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			g_bDumpRtEnv = true;
 		}
+		else if ( !Q_stricmp( argv[i], "-exactkdtree" ) )
+		{
+			g_bExactKDTree = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-kdtreebench" ) )
+		{
+			g_bKDTreeBenchmark = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-packbench" ) )
+		{
+			g_bPackBenchmark = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-nokdtreecache" ) )
+		{
+			g_bKDTreeCache = false;
+		}
+		else if ( !Q_stricmp( argv[i], "-floattransfers" ) )
+		{
+			g_bFloatTransfers = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-comparetransfers" ) )
+		{
+			g_bCompareTransfers = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-bouncebench" ) )
+		{
+			g_bBounceBenchmark = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-bumpcachemb" ) )
+		{
+			if ( ++i < argc )
+			{
+				g_nBumpCosineCacheMB = Q_atoi( argv[i] );
+				if ( g_nBumpCosineCacheMB < 0 )
+				{
+					Warning( "Error: expected non-negative value after '-bumpcachemb'\n" );
+					return -1;
+				}
+			}
+			else
+			{
+				Warning( "Error: expected a value after '-bumpcachemb'\n" );
+				return -1;
+			}
+		}
+		else if ( !Q_stricmp( argv[i], "-progressive" ) )
+		{
+			g_bProgressiveRadiosity = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-progressivetolerance" ) )
+		{
+			if ( ++i < argc )
+			{
+				g_flProgressiveTolerance = Q_atof( argv[i] );
+				if ( g_flProgressiveTolerance <= 0.0f )
+				{
+					Warning( "Error: expected positive value after '-progressivetolerance'\n" );
+					return -1;
+				}
+			}
+			else
+			{
+				Warning( "Error: expected a value after '-progressivetolerance'\n" );
+				return -1;
+			}
+		}
+		else if ( !Q_stricmp( argv[i], "-solvercompare" ) )
+		{
+			g_bProgressiveRadiosity = true;
+			g_bCompareSolvers = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-profile" ) )
+		{
+			g_bProfile = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-profilefile" ) )
+		{
+			if ( ++i < argc )
+			{
+				g_bProfile = true;
+				Q_strncpy( profilefile, argv[i], sizeof( profilefile ) );
+			}
+			else
+			{
+				Warning( "Error: expected a path after '-profilefile'\n" );
+				return -1;
+			}
+		}
+		else if ( !Q_stricmp( argv[i], "-visclusterstats" ) )
+		{
+			g_bVisClusterStats = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-incremental" ) )
+		{
+			g_bIncrementalLighting = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-transferbudgetmb" ) )
+		{
+			if ( ++i < argc )
+			{
+				g_nTransferBudgetMB = Q_atoi( argv[i] );
+				if ( g_nTransferBudgetMB < 0 )
+				{
+					Warning( "Error: expected non-negative value after '-transferbudgetmb'\n" );
+					return -1;
+				}
+			}
+			else
+			{
+				Warning( "Error: expected a value after '-transferbudgetmb'\n" );
+				return -1;
+			}
+		}
 		else if ( !Q_stricmp( argv[i], "-LargeDispSampleRadius" ) )
 		{
 			g_bLargeDispSampleRadius = true;
@@ -2400,6 +3589,31 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 				return -1;
 			}
 		}
+		else if ( !Q_stricmp( argv[i], "-threadchunk" ) )
+		{
+			if ( ++i < argc )
+			{
+				g_nThreadWorkChunk = Q_atoi( argv[i] );
+				if ( g_nThreadWorkChunk <= 0 )
+				{
+					Warning( "Error: expected positive value after '-threadchunk'\n" );
+					return -1;
+				}
+			}
+			else
+			{
+				Warning( "Error: expected a value after '-threadchunk'\n" );
+				return -1;
+			}
+		}
+		else if ( !Q_stricmp( argv[i], "-threadsteal" ) )
+		{
+			g_bThreadWorkStealing = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-threadstats" ) )
+		{
+			g_bThreadStats = true;
+		}
 		else if ( !Q_stricmp(argv[i], "-lights" ) )
 		{
 			if ( ++i < argc && *argv[i] )
@@ -2420,6 +3634,50 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			debug_extra = true;
 		}
+		else if (!Q_stricmp(argv[i],"-extrabudget"))
+		{
+			if ( ++i < argc )
+			{
+				g_flSupersampleBudget = max( Q_atof( argv[i] ), 8.0f );
+			}
+			else
+			{
+				Warning("Error: expected a value after '-extrabudget'\n" );
+				return -1;
+			}
+		}
+		else if (!Q_stricmp(argv[i],"-extracontrast"))
+		{
+			if ( ++i < argc )
+			{
+				g_flSupersampleContrast = Q_atof( argv[i] );
+			}
+			else
+			{
+				Warning("Error: expected a value after '-extracontrast'\n" );
+				return -1;
+			}
+		}
+		else if (!Q_stricmp(argv[i],"-batchrays"))
+		{
+			g_bBatchShadowRays = true;
+		}
+		else if (!Q_stricmp(argv[i],"-noambientkdtree"))
+		{
+			g_bAmbientKDTree = false;
+		}
+		else if (!Q_stricmp(argv[i],"-lightcullthreshold"))
+		{
+			if ( ++i < argc )
+			{
+				g_flLightCullThreshold = Q_atof( argv[i] );
+			}
+			else
+			{
+				Warning("Error: expected a value after '-lightcullthreshold'\n" );
+				return -1;
+			}
+		}
 		else if ( !Q_stricmp(argv[i], "-fastambient") )
 		{
 			g_bFastAmbient = true;
@@ -2753,13 +4011,67 @@ void PrintUsage( int argc, char **argv )
 		"  -dump           : Write debugging .txt files.\n"
 		"  -dumpnormals    : Write normals to debug files.\n"
 		"  -dumptrace      : Write ray-tracing environment to debug files.\n"
+		"  -exactkdtree    : Build the ray-tracing kd-tree with the slower single-threaded\n"
+		"                    exact split search.\n"
+		"  -kdtreebench    : Compare kd-tree build time and trace speed of the exact and\n"
+		"                    binned builders, and of 4, 8 and 16 ray packets.\n"
+		"  -packbench      : Compare fill rate and time of packing the face lightmaps\n"
+		"                    with CImagePacker and the skyline and maxrects packers.\n"
+		"  -nokdtreecache  : Always build the ray-tracing kd-tree instead of loading it\n"
+		"                    from <map>.kdtree when the scene hasn't changed.\n"
+		"  -floattransfers : Keep the patch transfers as float lists instead of the\n"
+		"                    compressed transfer matrix.\n"
+		"  -comparetransfers : Gather each bounce from both the transfer matrix and the\n"
+		"                    float lists and print how much they differ.\n"
+		"  -bouncebench    : Time each bounce's gather against the scalar gather.\n"
+		"  -bumpcachemb #  : Megabytes of bump cosines to keep between bounces\n"
+		"                    (default 1024).\n"
+		"  -transferbudgetmb # : Megabytes of transfers to keep in memory. Past that they\n"
+		"                    are streamed from <map>.transfers (default 0, no limit).\n"
+		"                    The bump cosine cache only gets what the transfers leave.\n"
+		"  -profile        : Write the time, rays traced and memory used by each stage\n"
+		"                    to <map>.vradprofile.json.\n"
+		"  -profilefile <path> : -profile, written to <path> instead.\n"
+		"  -visclusterstats : Write how long each cluster took in the vis matrix to\n"
+		"                    <map>.visclusters.csv and list the slowest ones.\n"
+		"  -progressive    : Bounce light with progressive (Southwell) shooting instead\n"
+		"                    of gathering every patch each bounce. Its shooting matrix\n"
+		"                    has to fit in -transferbudgetmb, or it falls back to the\n"
+		"                    gather solver.\n"
+		"  -progressivetolerance # : Stop shooting when the estimated remaining bounced\n"
+		"                    light is below this fraction of it (default 0.001).\n"
+		"  -solvercompare  : Run the gather solver and then -progressive and report the\n"
+		"                    time each takes to reach a range of tolerances.\n"
+		"  -incremental    : Only relight the faces that changed lights or geometry reach\n"
+		"                    since the last -incremental compile, using <map>.ldr.relight\n"
+		"                    (or .hdr.relight). Bounced light isn't recomputed when\n"
+		"                    only some faces are relit.\n"
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
+		"  -threadchunk #  : Number of work items each thread takes at a time (default:\n"
+		"                    chosen from the amount of work).\n"
+		"  -threadsteal    : Give each thread its own range of the work, taking work from\n"
+		"                    the other threads when it runs out.\n"
+		"  -threadstats    : Print per-thread busy and idle times for each threaded step,\n"
+		"                    and the per-thread winding allocation counters.\n"
 		"  -lights <file>  : Load a lights file in addition to lights.rad and the\n"
 		"                    level lights file.\n"
 		"  -noextra        : Disable supersampling.\n"
 		"  -debugextra     : Places debugging data in lightmaps to visualize\n"
 		"                    supersampling.\n"
+		"  -extrabudget #  : Average number of direct light samples per supersampled\n"
+		"                    luxel (default 16, at least 8). Luxels on shadow edges\n"
+		"                    get more, smooth ones fewer.\n"
+		"  -extracontrast #: Stop supersampling a luxel once its error is below this\n"
+		"                    perceptual intensity (default 0.01).\n"
+		"  -lightcullthreshold # : Skip lights on faces they can't light by more than\n"
+		"                    this luxel intensity (default 0.001). 0 only skips lights\n"
+		"                    with a hard falloff past where they fade out.\n"
+		"  -batchrays      : Record the direct lighting shadow rays of each face and\n"
+		"                    trace them sorted by light and direction, in wide packets\n"
+		"                    unless -textureshadows is on. Compare the rays/sec.\n"
+		"  -noambientkdtree: Find what the leaf ambient and detail prop rays hit by\n"
+		"                    walking the BSP instead of tracing them in packets.\n"
 		"  -smooth #       : Set the threshold for smoothing groups, in degrees\n"
 		"                    (default 45).\n"
 		"  -dlightmap      : Force direct lighting into different lightmap than\n"
@@ -2851,6 +4163,8 @@ int RunVRAD( int argc, char **argv )
 	// Initialize the filesystem, so additional commandline options can be loaded
 	CmdLib_InitFileSystem( argv[ i ] );
 
+	VRadProfile_BeginStage( "vrad" );
+
 	VRAD_LoadBSP( argv[i] );
 
 	if ( (! onlydetail) && (! g_bOnlyStaticProps ) )
@@ -2862,6 +4176,14 @@ int RunVRAD( int argc, char **argv )
 
 	VRAD_Finish();
 
+	if ( g_bProfile && ( !g_bUseMPI || g_bMPIMaster ) )
+	{
+		if ( VRadProfile_WriteReport( profilefile, source ) )
+		{
+			Msg( "Wrote the profile to %s\n", profilefile );
+		}
+	}
+
 	VMPI_SetCurrentStage( "master done" );
 
 	DeleteCmdLine( argc, argv );
@@ -298,6 +298,15 @@ extern bool g_bStaticPropPolys;
 extern bool g_bTextureShadows;
 extern bool g_bShowStaticPropNormals;
 extern bool g_bDisablePropSelfShadowing;
+extern bool g_bFloatTransfers;
+extern bool g_bCompareTransfers;
+extern bool g_bBounceBenchmark;
+extern int g_nBumpCosineCacheMB;
+extern int g_nTransferBudgetMB;
+extern bool g_bProgressiveRadiosity;
+extern float g_flProgressiveTolerance;
+extern bool g_bCompareSolvers;
+extern bool g_bVisClusterStats;
 
 extern CUtlVector<char const *> g_NonShadowCastingMaterialStrings;
 extern void ForceTextureShadowsOnModel( const char *pModelName );
@@ -329,6 +338,9 @@ extern  qboolean do_extra;
 extern  qboolean do_fast;
 extern  qboolean do_centersamples;
 extern  int extrapasses;
+extern	float g_flSupersampleBudget;
+extern	float g_flSupersampleContrast;
+extern	bool g_bBatchShadowRays;
 extern	Vector ambient;
 extern  float maxlight;
 extern	unsigned numbounce;
@@ -369,6 +381,7 @@ qboolean IsIncremental(char *filename);
 int SaveIncremental(char *filename);
 int PartialHead (void);
 void BuildFacelights (int facenum, int threadnum);
+void ReportSupersampleStats();
 void PrecompLightmapOffsets();
 void FinalLightFace (int threadnum, int facenum);
 void PvsForOrigin (Vector& org, byte *pvs);
@@ -400,6 +413,43 @@ void TestLine_IgnoreSky( FourVectors const& start, FourVectors const& stop, fltx
 void TestLine_DoesHitSky( FourVectors const& start, FourVectors const& stop,
                           fltx4 *pFractionVisible, bool canRecurse = true, int static_prop_to_skip=-1, bool bDoDebug = false );
 
+// Which TestLine function a shadow ray is traced like
+enum ShadowRayType_t
+{
+	SHADOW_RAY_TESTLINE = 0,
+	SHADOW_RAY_IGNORE_SKY,
+	SHADOW_RAY_DOES_HIT_SKY,
+};
+
+// Weighted sums of how much of a set of shadow rays got through
+#define SHADOW_RAY_MAX_SUMS		( NUM_BUMP_VECTS + 2 )
+
+struct ShadowRaySums_t
+{
+	fltx4	m_Sums[SHADOW_RAY_MAX_SUMS];
+	int		m_nRays;						// recorded and not added in yet
+};
+
+// Traces a packet of shadow rays and adds the fraction of each that got through,
+// times pWeights[i] (or 1 when it's NULL), to sums.m_Sums[iFirstSum + i] for nSums
+// sums.
+void ShadowRay_AddVisible( ShadowRaySums_t &sums, int iFirstSum, int nSums, const fltx4 *pWeights,
+						   int nType, FourVectors const& start, FourVectors const& stop,
+						   int static_prop_to_skip = -1, bool canRecurse = true );
+
+// Shadow ray batching for the calling thread. After ShadowRays_BeginRecord,
+// ShadowRay_AddVisible only records its rays. ShadowRays_Flush traces them sorted
+// by batch key, then by the order they came in after the key was set, then by
+// direction, so rays to the same light go together. Then ShadowRays_AddTracedVisible
+// has to be called for each set of sums, in the order they were recorded, before
+// ShadowRays_End.
+void ShadowRays_BeginRecord();
+void ShadowRays_SetBatchKey( int nKey );
+int ShadowRays_GetRecordedCount();
+void ShadowRays_Flush();
+void ShadowRays_AddTracedVisible( ShadowRaySums_t &sums );
+void ShadowRays_End();
+
 // converts any marked brush entities to triangles for shadow casting
 void ExtractBrushEntityShadowCasters ( void );
 void AddBrushesForRayTrace ( void );
@@ -9,6 +9,7 @@
 #include "VRAD_DispColl.h"
 #include "DispColl_Common.h"
 #include "radial.h"
+#include "ambientrays.h"
 #include "CollisionUtils.h"
 #include "tier0\dbg.h"
 
@@ -1075,4 +1076,26 @@ void CVRADDispColl::AddPolysForRayTrace( void )
 		fullCoverage.x = 1.0f;
 		g_RtEnv.AddTriangle( TRACE_ID_OPAQUE, m_aVerts[v[0]], m_aVerts[v[1]], m_aVerts[v[2]], fullCoverage );
 	}
+}
+
+void CVRADDispColl::AddPolysForAmbientRays( void )
+{
+	// Skip the same displacements the ray test in the BSP walk does. The
+	// ambient rays need the lightmap coordinates of the hit
+	if ( CheckFlags( CCoreDispInfo::SURF_NORAY_COLL ) )
+		return;
+
+	if ( !( m_nContents & MASK_OPAQUE ) )
+		return;
+
+	for ( int ndxTri = 0; ndxTri < m_aTris.Size(); ndxTri++ )
+	{
+		CDispCollTri *tri = m_aTris.Base() + ndxTri;
+		int v[3];
+		for ( int ndxv = 0; ndxv < 3; ndxv++ )
+			v[ndxv] = tri->GetVert(ndxv);
+
+		AmbientRays_AddDispTriangle( m_iParent, m_aVerts[v[0]], m_aVerts[v[1]], m_aVerts[v[2]],
+			m_aLuxelCoords[v[0]], m_aLuxelCoords[v[1]], m_aLuxelCoords[v[2]] );
+	}
 }
\ No newline at end of file
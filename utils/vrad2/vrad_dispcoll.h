@@ -55,6 +55,7 @@ public:
 
 	// Raytracing
 	void AddPolysForRayTrace( void );
+	void AddPolysForAmbientRays( void );
 
 protected:
 
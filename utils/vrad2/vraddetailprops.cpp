@@ -18,6 +18,7 @@
 #include "studio.h"
 #include "pacifier.h"
 #include "vraddetailprops.h"
+#include "ambientrays.h"
 #include "mathlib/halton.h"
 #include "messbuf.h"
 #include "byteswap.h"
@@ -574,22 +575,63 @@ bool CastRayInLeaf( int iThread, const Vector &start, const Vector &end, int lea
 }
 
 //-----------------------------------------------------------------------------
-// Computes ambient lighting along a specified ray.
-// Ray represents a cone, tanTheta is the tan of the inner cone angle
+// Finds where a ray lands by walking the BSP
 //-----------------------------------------------------------------------------
-void CalcRayAmbientLighting( int iThread, const Vector &vStart, const Vector &vEnd, float tanTheta, Vector color[MAX_LIGHTSTYLES] )
+static void FindAmbientRayHit( int iThread, const Vector &vStart, const Vector &vEnd, AmbientRayHit_t &hit )
 {
 	Ray_t ray;
 	ray.Init( vStart, vEnd, vec3_origin, vec3_origin );
 
-	directlight_t *pSkyLight = FindAmbientSkyLight();
+	hit.m_pSurface = NULL;
+	hit.m_flHitFrac = 1.0f;
+	hit.m_bHasLuxel = false;
 
 	CLightSurface surfEnum(iThread);
 	if (!surfEnum.FindIntersection( ray ))
 		return;
 
+	hit.m_pSurface = surfEnum.m_pSurface;
+	hit.m_flHitFrac = surfEnum.m_HitFrac;
+	hit.m_bHasLuxel = surfEnum.m_bHasLuxel;
+	if ( surfEnum.m_bHasLuxel )
+	{
+		Vector2DCopy( surfEnum.m_LuxelCoord, hit.m_LuxelCoord );
+	}
+}
+
+void FindAmbientRayHits( int iThread, const Vector &vStart, const Vector *pDirections, int nRays, float flLength, AmbientRayHit_t *pHits )
+{
+	if ( AmbientRays_Trace( vStart, pDirections, nRays, flLength, pHits ) )
+		return;
+
+	for ( int i = 0; i < nRays; i++ )
+	{
+		Vector vEnd;
+		VectorMA( vStart, flLength, pDirections[i], vEnd );
+		FindAmbientRayHit( iThread, vStart, vEnd, pHits[i] );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Computes ambient lighting along a specified ray.
+// Ray represents a cone, tanTheta is the tan of the inner cone angle
+//-----------------------------------------------------------------------------
+void CalcRayAmbientLighting( int iThread, const Vector &vStart, const Vector &vEnd, float tanTheta, Vector color[MAX_LIGHTSTYLES] )
+{
+	AmbientRayHit_t hit;
+	FindAmbientRayHit( iThread, vStart, vEnd, hit );
+	AddAmbientRayHitLighting( hit, vStart.DistTo( vEnd ), tanTheta, color );
+}
+
+void AddAmbientRayHitLighting( const AmbientRayHit_t &hit, float flRayLength, float tanTheta, Vector color[MAX_LIGHTSTYLES] )
+{
+	if ( !hit.m_pSurface )
+		return;
+
+	directlight_t *pSkyLight = FindAmbientSkyLight();
+
 	// compute the approximate radius of a circle centered around the intersection point
-	float dist = ray.m_Delta.Length() * tanTheta * surfEnum.m_HitFrac;
+	float dist = flRayLength * tanTheta * hit.m_flHitFrac;
 
 	// until 20" we use the point sample, then blend in the average until we're covering 40"
 	// This is attempting to model the ray as a cone - in the ideal case we'd simply sample all
@@ -600,7 +642,7 @@ void CalcRayAmbientLighting( int iThread, const Vector &vStart, const Vector &vE
 	// point samples provide accuracy for intersections with near geometry
 	float scaleAvg = RemapValClamped( dist, 20, 40, 0.0f, 1.0f );
 
-	if ( !surfEnum.m_bHasLuxel )
+	if ( !hit.m_bHasLuxel )
 	{
 		// don't have luxel UV, so just use average sample
 		scaleAvg = 1.0;
@@ -609,11 +651,11 @@ void CalcRayAmbientLighting( int iThread, const Vector &vStart, const Vector &vE
 
 	if (scaleAvg != 0)
 	{
-		ComputeLightmapColorFromAverage( surfEnum.m_pSurface, pSkyLight, scaleAvg, color );
+		ComputeLightmapColorFromAverage( hit.m_pSurface, pSkyLight, scaleAvg, color );
 	}
 	if (scaleSample != 0)
 	{
-		ComputeLightmapColorPointSample( surfEnum.m_pSurface, pSkyLight, surfEnum.m_LuxelCoord, scaleSample, color );
+		ComputeLightmapColorPointSample( hit.m_pSurface, pSkyLight, hit.m_LuxelCoord, scaleSample, color );
 	}
 }
 
@@ -626,9 +668,6 @@ static void ComputeAmbientLightingAtPoint( int iThread, const Vector &origin, Ve
 	// This is for speed, although we can add it if it turns out to
 	// be important
 
-	// sample world by casting N rays distributed across a sphere
-	Vector upend;
-
 	int j;
 	for ( j = 0; j < MAX_LIGHTSTYLES; ++j)
 	{
@@ -636,12 +675,15 @@ static void ComputeAmbientLightingAtPoint( int iThread, const Vector &origin, Ve
 	}
 
 	float tanTheta = tan(VERTEXNORMAL_CONE_INNER_ANGLE);
+	float flLength = COORD_EXTENT * 1.74;
+
+	// sample world by casting N rays distributed across a sphere
+	AmbientRayHit_t hits[NUMVERTEXNORMALS];
+	FindAmbientRayHits( iThread, origin, g_anorms, NUMVERTEXNORMALS, flLength, hits );
+
 	for (int i = 0; i < NUMVERTEXNORMALS; i++)
 	{
-		VectorMA( origin, COORD_EXTENT * 1.74, g_anorms[i], upend );
-
-		// Now that we've got a ray, see what surface we've hit
-		CalcRayAmbientLighting( iThread, origin, upend, tanTheta, color );
+		AddAmbientRayHitLighting( hits[i], flLength, tanTheta, color );
 
 //		DumpRayToGlView( ray, surfEnum.m_HitFrac, &color[0], "test.out" );
 	}
@@ -13,6 +13,7 @@
 
 #include "bspfile.h"
 #include "mathlib/anorms.h"
+#include "ambientrays.h"
 
 
 // Calculate the lighting at whatever surface the ray hits.
@@ -26,6 +27,13 @@ void CalcRayAmbientLighting(
 	Vector color[MAX_LIGHTSTYLES]	// The color contribution from each lightstyle.
 	);
 
+// Finds where each ray lands, through the ambient kd-tree when it's built and
+// by walking the BSP otherwise.
+void FindAmbientRayHits( int iThread, const Vector &vStart, const Vector *pDirections, int nRays, float flLength, AmbientRayHit_t *pHits );
+
+// Same as CalcRayAmbientLighting for a ray that has already been traced.
+void AddAmbientRayHitLighting( const AmbientRayHit_t &hit, float flRayLength, float tanTheta, Vector color[MAX_LIGHTSTYLES] );
+
 bool CastRayInLeaf( int iThread, const Vector &start, const Vector &end, int leafIndex, float *pFraction, Vector *pNormal );
 
 void ComputeDetailPropLighting( int iThread );
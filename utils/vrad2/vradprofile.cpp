@@ -0,0 +1,353 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Per stage timings and counters for local vrad runs. See vradprofile.h.
+//
+//=============================================================================//
+
+#include "vrad.h"
+#include "vradprofile.h"
+#include "tier0/memalloc.h"
+
+#ifdef _WIN32
+#include <psapi.h>
+#include <crtdbg.h>
+#else
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+
+
+VRadProfileCounters_t g_VRadProfileCounters[MAX_TOOL_THREADS+1];
+
+
+struct ProfileSample_t
+{
+	double	m_flWallTime;
+	double	m_flCPUTime;				// all threads
+	int64	m_nRays;
+	int64	m_nAllocatedBytes;			// -1 unless the heap keeps count
+	int64	m_nMemory;					// committed on Windows, resident elsewhere
+	int64	m_nPeakMemory;
+};
+
+struct ProfileStage_t
+{
+	const char		*m_pName;
+	int				m_iParent;
+	int				m_nCalls;
+	double			m_flWallTime;
+	double			m_flCPUTime;
+	int64			m_nRays;
+	int64			m_nAllocatedBytes;
+	int64			m_nMemoryGrowth;
+	int64			m_nPeakMemory;
+	ProfileSample_t	m_Start;			// while the stage is open
+};
+
+struct ProfileValue_t
+{
+	const char		*m_pName;
+	int				m_iStage;
+	double			m_flValue;
+};
+
+static CUtlVector<ProfileStage_t>	s_ProfileStages;
+static CUtlVector<ProfileValue_t>	s_ProfileValues;
+static CUtlVector<int>				s_OpenProfileStages;
+
+
+//-----------------------------------------------------------------------------
+// Sampling
+//-----------------------------------------------------------------------------
+static double GetProcessCPUTime()
+{
+#ifdef _WIN32
+	FILETIME creation, exited, kernel, user;
+	if ( !GetProcessTimes( GetCurrentProcess(), &creation, &exited, &kernel, &user ) )
+		return 0.0;
+
+	ULARGE_INTEGER nKernel, nUser;
+	nKernel.LowPart = kernel.dwLowDateTime;
+	nKernel.HighPart = kernel.dwHighDateTime;
+	nUser.LowPart = user.dwLowDateTime;
+	nUser.HighPart = user.dwHighDateTime;
+	return (double)( nKernel.QuadPart + nUser.QuadPart ) * 1e-7;
+#else
+	struct rusage usage;
+	if ( getrusage( RUSAGE_SELF, &usage ) != 0 )
+		return 0.0;
+
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+		( usage.ru_utime.tv_usec + usage.ru_stime.tv_usec ) * 1e-6;
+#endif
+}
+
+static void GetProcessMemory( int64 *pnMemory, int64 *pnPeakMemory )
+{
+	*pnMemory = 0;
+	*pnPeakMemory = 0;
+
+#ifdef _WIN32
+	// K32GetProcessMemoryInfo saves linking psapi where it exists
+	typedef BOOL (WINAPI *GetProcessMemoryInfoFn_t)( HANDLE, PROCESS_MEMORY_COUNTERS *, DWORD );
+	static GetProcessMemoryInfoFn_t s_pfnGetProcessMemoryInfo = NULL;
+	static bool s_bLookedUp = false;
+	if ( !s_bLookedUp )
+	{
+		s_bLookedUp = true;
+		s_pfnGetProcessMemoryInfo = (GetProcessMemoryInfoFn_t)GetProcAddress( GetModuleHandleA( "kernel32.dll" ), "K32GetProcessMemoryInfo" );
+		if ( !s_pfnGetProcessMemoryInfo )
+		{
+			HMODULE hPSAPI = LoadLibraryA( "psapi.dll" );
+			if ( hPSAPI )
+			{
+				s_pfnGetProcessMemoryInfo = (GetProcessMemoryInfoFn_t)GetProcAddress( hPSAPI, "GetProcessMemoryInfo" );
+			}
+		}
+	}
+
+	PROCESS_MEMORY_COUNTERS counters;
+	if ( s_pfnGetProcessMemoryInfo && s_pfnGetProcessMemoryInfo( GetCurrentProcess(), &counters, sizeof( counters ) ) )
+	{
+		*pnMemory = counters.PagefileUsage;
+		*pnPeakMemory = counters.PeakPagefileUsage;
+	}
+#else
+	FILE *fp = fopen( "/proc/self/statm", "r" );
+	if ( fp )
+	{
+		long nPages, nResidentPages;
+		if ( fscanf( fp, "%ld %ld", &nPages, &nResidentPages ) == 2 )
+		{
+			*pnMemory = (int64)nResidentPages * sysconf( _SC_PAGESIZE );
+		}
+		fclose( fp );
+	}
+
+	struct rusage usage;
+	if ( getrusage( RUSAGE_SELF, &usage ) == 0 )
+	{
+		// kilobytes on linux
+		*pnPeakMemory = (int64)usage.ru_maxrss * 1024;
+	}
+	*pnPeakMemory = MAX( *pnPeakMemory, *pnMemory );
+#endif
+}
+
+static int64 GetAllocatedBytes()
+{
+#if defined( _WIN32 ) && defined( _DEBUG )
+	// only the debug heap keeps a running total
+	if ( g_pMemAlloc->IsDebugHeap() )
+	{
+		_CrtMemState state;
+		g_pMemAlloc->CrtMemCheckpoint( &state );
+		return state.lTotalCount;
+	}
+#endif
+	return -1;
+}
+
+static void TakeProfileSample( ProfileSample_t &sample )
+{
+	sample.m_flWallTime = Plat_FloatTime();
+	sample.m_flCPUTime = GetProcessCPUTime();
+
+	sample.m_nRays = 0;
+	for ( int i = 0; i < ARRAYSIZE( g_VRadProfileCounters ); i++ )
+	{
+		sample.m_nRays += g_VRadProfileCounters[i].m_nRays;
+	}
+
+	sample.m_nAllocatedBytes = GetAllocatedBytes();
+	GetProcessMemory( &sample.m_nMemory, &sample.m_nPeakMemory );
+}
+
+
+//-----------------------------------------------------------------------------
+// Stages
+//-----------------------------------------------------------------------------
+void VRadProfile_BeginStage( const char *pName )
+{
+	int iParent = s_OpenProfileStages.Count() ? s_OpenProfileStages.Tail() : -1;
+
+	int iStage;
+	for ( iStage = 0; iStage < s_ProfileStages.Count(); iStage++ )
+	{
+		const ProfileStage_t &stage = s_ProfileStages[iStage];
+		if ( stage.m_iParent == iParent && !Q_strcmp( stage.m_pName, pName ) )
+			break;
+	}
+
+	if ( iStage == s_ProfileStages.Count() )
+	{
+		ProfileStage_t &stage = s_ProfileStages[ s_ProfileStages.AddToTail() ];
+		memset( &stage, 0, sizeof( stage ) );
+		stage.m_pName = pName;
+		stage.m_iParent = iParent;
+	}
+
+	s_OpenProfileStages.AddToTail( iStage );
+	TakeProfileSample( s_ProfileStages[iStage].m_Start );
+}
+
+void VRadProfile_EndStage()
+{
+	// WriteReport closes everything, so scoped stages can end after it
+	if ( !s_OpenProfileStages.Count() )
+		return;
+
+	ProfileSample_t end;
+	TakeProfileSample( end );
+
+	ProfileStage_t &stage = s_ProfileStages[ s_OpenProfileStages.Tail() ];
+	s_OpenProfileStages.RemoveMultipleFromTail( 1 );
+
+	const ProfileSample_t &start = stage.m_Start;
+	stage.m_nCalls++;
+	stage.m_flWallTime += end.m_flWallTime - start.m_flWallTime;
+	stage.m_flCPUTime += end.m_flCPUTime - start.m_flCPUTime;
+	stage.m_nRays += end.m_nRays - start.m_nRays;
+	stage.m_nMemoryGrowth += end.m_nMemory - start.m_nMemory;
+	stage.m_nPeakMemory = MAX( stage.m_nPeakMemory, end.m_nPeakMemory );
+	if ( start.m_nAllocatedBytes >= 0 && end.m_nAllocatedBytes >= 0 )
+	{
+		stage.m_nAllocatedBytes += end.m_nAllocatedBytes - start.m_nAllocatedBytes;
+	}
+	else
+	{
+		stage.m_nAllocatedBytes = -1;
+	}
+}
+
+
+void VRadProfile_SetValue( const char *pName, double flValue )
+{
+	if ( !s_OpenProfileStages.Count() )
+		return;
+
+	int iStage = s_OpenProfileStages.Tail();
+	for ( int i = 0; i < s_ProfileValues.Count(); i++ )
+	{
+		if ( s_ProfileValues[i].m_iStage == iStage && !Q_strcmp( s_ProfileValues[i].m_pName, pName ) )
+		{
+			s_ProfileValues[i].m_flValue = flValue;
+			return;
+		}
+	}
+
+	ProfileValue_t &value = s_ProfileValues[ s_ProfileValues.AddToTail() ];
+	value.m_pName = pName;
+	value.m_iStage = iStage;
+	value.m_flValue = flValue;
+}
+
+
+//-----------------------------------------------------------------------------
+// JSON report
+//-----------------------------------------------------------------------------
+static void WriteJSONString( FileHandle_t fp, const char *pString )
+{
+	CmdLib_FPrintf( fp, "\"" );
+	for ( const char *p = pString; *p; p++ )
+	{
+		if ( *p == '"' || *p == '\\' )
+		{
+			CmdLib_FPrintf( fp, "\\%c", *p );
+		}
+		else if ( (unsigned char)*p < ' ' )
+		{
+			CmdLib_FPrintf( fp, "\\u%04x", (unsigned char)*p );
+		}
+		else
+		{
+			CmdLib_FPrintf( fp, "%c", *p );
+		}
+	}
+	CmdLib_FPrintf( fp, "\"" );
+}
+
+static void WriteProfileStages( FileHandle_t fp, int iParent, int nIndent )
+{
+	bool bFirst = true;
+	for ( int iStage = 0; iStage < s_ProfileStages.Count(); iStage++ )
+	{
+		const ProfileStage_t &stage = s_ProfileStages[iStage];
+		if ( stage.m_iParent != iParent )
+			continue;
+
+		CmdLib_FPrintf( fp, "%s\n%*s{\n%*s\"name\": ", bFirst ? "" : ",", nIndent, "", nIndent + 2, "" );
+		WriteJSONString( fp, stage.m_pName );
+		CmdLib_FPrintf( fp, ",\n" );
+		bFirst = false;
+
+		CmdLib_FPrintf( fp, "%*s\"calls\": %d,\n", nIndent + 2, "", stage.m_nCalls );
+		CmdLib_FPrintf( fp, "%*s\"wall_seconds\": %.4f,\n", nIndent + 2, "", stage.m_flWallTime );
+		CmdLib_FPrintf( fp, "%*s\"cpu_seconds\": %.4f,\n", nIndent + 2, "", stage.m_flCPUTime );
+		CmdLib_FPrintf( fp, "%*s\"rays\": %lld,\n", nIndent + 2, "", stage.m_nRays );
+		CmdLib_FPrintf( fp, "%*s\"rays_per_second\": %.0f,\n", nIndent + 2, "",
+			( stage.m_flWallTime > 0.0 ) ? stage.m_nRays / stage.m_flWallTime : 0.0 );
+		if ( stage.m_nAllocatedBytes >= 0 )
+		{
+			CmdLib_FPrintf( fp, "%*s\"allocated_bytes\": %lld,\n", nIndent + 2, "", stage.m_nAllocatedBytes );
+		}
+		else
+		{
+			CmdLib_FPrintf( fp, "%*s\"allocated_bytes\": null,\n", nIndent + 2, "" );
+		}
+		CmdLib_FPrintf( fp, "%*s\"memory_growth_bytes\": %lld,\n", nIndent + 2, "", stage.m_nMemoryGrowth );
+		CmdLib_FPrintf( fp, "%*s\"peak_memory_bytes\": %lld,\n", nIndent + 2, "", stage.m_nPeakMemory );
+
+		bool bFirstValue = true;
+		for ( int i = 0; i < s_ProfileValues.Count(); i++ )
+		{
+			const ProfileValue_t &value = s_ProfileValues[i];
+			if ( value.m_iStage != iStage )
+				continue;
+
+			CmdLib_FPrintf( fp, bFirstValue ? "%*s\"values\": {\n" : ",\n", nIndent + 2, "" );
+			CmdLib_FPrintf( fp, "%*s", nIndent + 4, "" );
+			WriteJSONString( fp, value.m_pName );
+			CmdLib_FPrintf( fp, ": %.6g", value.m_flValue );
+			bFirstValue = false;
+		}
+		if ( !bFirstValue )
+		{
+			CmdLib_FPrintf( fp, "\n%*s},\n", nIndent + 2, "" );
+		}
+
+		CmdLib_FPrintf( fp, "%*s\"stages\": [", nIndent + 2, "" );
+		WriteProfileStages( fp, iStage, nIndent + 4 );
+		CmdLib_FPrintf( fp, "]\n%*s}", nIndent, "" );
+	}
+	if ( !bFirst )
+	{
+		CmdLib_FPrintf( fp, "\n%*s", nIndent - 2, "" );
+	}
+}
+
+bool VRadProfile_WriteReport( const char *pFilename, const char *pMapName )
+{
+	while ( s_OpenProfileStages.Count() )
+	{
+		VRadProfile_EndStage();
+	}
+
+	FileHandle_t fp = g_pFileSystem->Open( pFilename, "w" );
+	if ( !fp )
+	{
+		Warning( "Couldn't open %s to write the profile\n", pFilename );
+		return false;
+	}
+
+	CmdLib_FPrintf( fp, "{\n  \"map\": " );
+	WriteJSONString( fp, pMapName );
+	CmdLib_FPrintf( fp, ",\n  \"threads\": %d,\n", numthreads );
+	CmdLib_FPrintf( fp, "  \"ray_packet_size\": %d,\n", RayTrace_GetPacketSize() );
+	CmdLib_FPrintf( fp, "  \"stages\": [" );
+	WriteProfileStages( fp, -1, 4 );
+	CmdLib_FPrintf( fp, "]\n}\n" );
+
+	g_pFileSystem->Close( fp );
+	return true;
+}
@@ -0,0 +1,91 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Per stage timings and counters for local vrad runs.
+//
+// Stages nest, and a stage's numbers include the stages inside it. Stages with
+// the same name under the same parent are merged and counted as more calls.
+// Each stage records wall and cpu time, rays traced, memory growth, the peak
+// memory so far and, when the heap can count them, allocations, plus any
+// values the stage reports about its own work. -profile writes them to a JSON
+// file when vrad finishes.
+//
+//=============================================================================//
+
+#ifndef VRADPROFILE_H
+#define VRADPROFILE_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+#include "threads.h"
+
+
+struct VRadProfileCounters_t
+{
+	int64	m_nRays;
+	char	m_Pad[56];					// keep each thread's counters on their own cache line
+};
+
+extern VRadProfileCounters_t g_VRadProfileCounters[MAX_TOOL_THREADS+1];
+
+
+// Starts a stage inside the current one. Only call these from the main thread.
+void VRadProfile_BeginStage( const char *pName );
+void VRadProfile_EndStage();
+
+// Counts rays traced by the calling thread. Cheap enough for the trace functions.
+inline void VRadProfile_CountRays( int nRays )
+{
+	int iThread = GetCurrentThreadIndex();
+	if ( iThread >= 0 )
+	{
+		g_VRadProfileCounters[iThread].m_nRays += nRays;
+	}
+	else
+	{
+		// a thread that RunThreadsOn didn't start
+		ThreadInterlockedExchangeAdd64( &g_VRadProfileCounters[THREADINDEX_MAIN].m_nRays, nRays );
+	}
+}
+
+// Rays traced so far by all threads.
+inline int64 VRadProfile_GetTotalRays()
+{
+	int64 nRays = 0;
+	for ( int i = 0; i <= MAX_TOOL_THREADS; ++i )
+	{
+		nRays += g_VRadProfileCounters[i].m_nRays;
+	}
+	return nRays;
+}
+
+// Rays traced so far by the calling thread, to count the rays spent on one job.
+inline int64 VRadProfile_GetThreadRays()
+{
+	int iThread = GetCurrentThreadIndex();
+	return g_VRadProfileCounters[( iThread >= 0 ) ? iThread : THREADINDEX_MAIN].m_nRays;
+}
+
+// Attaches a named number to the current stage, written in its "values". Setting
+// the same name again replaces it.
+void VRadProfile_SetValue( const char *pName, double flValue );
+
+// Ends any stages still open and writes the report. Returns false if the file
+// couldn't be written.
+bool VRadProfile_WriteReport( const char *pFilename, const char *pMapName );
+
+
+//-----------------------------------------------------------------------------
+// Times the rest of the enclosing scope as a stage.
+//-----------------------------------------------------------------------------
+class CVRadProfileStage
+{
+public:
+	CVRadProfileStage( const char *pName )	{ VRadProfile_BeginStage( pName ); }
+	~CVRadProfileStage()					{ VRadProfile_EndStage(); }
+};
+
+#define VRAD_PROFILE_STAGE( name )	CVRadProfileStage _profileStage( name )
+
+
+#endif // VRADPROFILE_H
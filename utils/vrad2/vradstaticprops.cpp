@@ -30,6 +30,7 @@
 #include "materialsystem/hardwaretexels.h"
 #include "byteswap.h"
 #include "mpivrad.h"
+#include "lightcull.h"
 #include "vtf/vtf.h"
 #include "tier1/utldict.h"
 #include "tier1/utlsymbol.h"
@@ -1183,63 +1184,157 @@ bool PositionInSolid( Vector &position )
 }
 
 //-----------------------------------------------------------------------------
-// Trace from a vertex to each direct light source, accumulating its contribution.
+// A vertex or texel to light
 //-----------------------------------------------------------------------------
-void ComputeDirectLightingAtPoint( Vector &position, Vector &normal, Vector &outColor, int iThread,
-								   int static_prop_id_to_skip=-1, int nLFlags = 0)
+struct propSample_t
 {
-	SSE_sampleLightOutput_t	sampleOutput;
+	Vector	m_Position;
+	Vector	m_Normal;
+	int		m_nCluster;
+	int		m_nIndex;			// where the caller wants its color
+};
+
+static void AddPropSample( CUtlVector<propSample_t> &samples, const Vector &position, const Vector &normal, int nIndex )
+{
+	propSample_t &sample = samples[samples.AddToTail()];
+	sample.m_Position = position;
+	sample.m_Normal = normal;
+	sample.m_nCluster = ClusterFromPoint( position );
+	sample.m_nIndex = nIndex;
+}
+
+static int __cdecl ComparePropSamples( const propSample_t *pA, const propSample_t *pB )
+{
+	if ( pA->m_nCluster != pB->m_nCluster )
+		return pA->m_nCluster - pB->m_nCluster;
+	return pA->m_nIndex - pB->m_nIndex;
+}
+
+//-----------------------------------------------------------------------------
+// Trace from up to 4 points to each direct light source, accumulating its contribution.
+//-----------------------------------------------------------------------------
+static void ComputeDirectLightingAt4Points( const propSample_t *pSamples, int nSamples, Vector *pOutColors, int iThread,
+										   const CUtlVector<directlight_t*> &lights, int static_prop_id_to_skip, int nLFlags )
+{
+	Assert( nSamples >= 1 && nSamples <= 4 );
+
+	// Unused lanes repeat the last sample
+	Vector positions[4], normals[4];
+	for ( int i = 0; i < 4; ++i )
+	{
+		const propSample_t &sample = pSamples[ MIN( i, nSamples - 1 ) ];
+		positions[i] = sample.m_Position;
+		normals[i] = sample.m_Normal;
+		pOutColors[i].Init();
+	}
 
-	outColor.Init();
+	FourVectors position4;
+	FourVectors normal4;
+	position4.LoadAndSwizzle( positions[0], positions[1], positions[2], positions[3] );
+	normal4.LoadAndSwizzle( normals[0], normals[1], normals[2], normals[3] );
 
-	// Iterate over all direct lights and accumulate their contribution
-	int cluster = ClusterFromPoint( position );
-	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	SSE_sampleLightOutput_t	sampleOutput;
+
+	// Iterate over the direct lights and accumulate their contribution
+	for ( int iLight = 0; iLight < lights.Count(); ++iLight )
 	{
-		if ( dl->light.style )
-		{
-			// skip lights with style
-			continue;
-		}
+		directlight_t *dl = lights[iLight];
 
 		// is this lights cluster visible?
-		if ( !PVSCheck( dl->pvs, cluster ) )
+		int nVisibleMask = 0;
+		for ( int i = 0; i < nSamples; ++i )
+		{
+			if ( PVSCheck( dl->pvs, pSamples[i].m_nCluster ) )
+			{
+				nVisibleMask |= 1 << i;
+			}
+		}
+		if ( !nVisibleMask )
 			continue;
 
-		// push the vertex towards the light to avoid surface acne
-		Vector adjusted_pos = position;
+		// push the vertexes towards the light to avoid surface acne
+		FourVectors adjusted_pos4 = position4;
+		FourVectors fudge;
 		float flEpsilon = 0.0;
 
 		if  (dl->light.type != emit_skyambient)
 		{
 			// push towards the light
-			Vector fudge;
 			if ( dl->light.type == emit_skylight )
-				fudge = -( dl->light.normal);
+			{
+				fudge.DuplicateVector( -dl->light.normal );
+			}
 			else
 			{
-				fudge = dl->light.origin-position;
-				VectorNormalize( fudge );
+				fudge.DuplicateVector( dl->light.origin );
+				fudge -= position4;
+				fudge.VectorNormalize();
 			}
-			fudge *= 4.0;
-			adjusted_pos += fudge;
 		}
 		else
 		{
 			// push out along normal
-			adjusted_pos += 4.0 * normal;
+			fudge = normal4;
 //			flEpsilon = 1.0;
 		}
-
-		FourVectors adjusted_pos4;
-		FourVectors normal4;
-		adjusted_pos4.DuplicateVector( adjusted_pos );
-		normal4.DuplicateVector( normal );
+		fudge *= 4.0f;
+		adjusted_pos4 += fudge;
 
 		GatherSampleLightSSE( sampleOutput, dl, -1, adjusted_pos4, &normal4, 1, iThread, nLFlags | GATHERLFLAGS_FORCE_FAST,
 		                      static_prop_id_to_skip, flEpsilon );
 
-		VectorMA( outColor, sampleOutput.m_flFalloff.m128_f32[0] * sampleOutput.m_flDot[0].m128_f32[0], dl->light.intensity, outColor );
+		for ( int i = 0; i < nSamples; ++i )
+		{
+			if ( nVisibleMask & ( 1 << i ) )
+			{
+				VectorMA( pOutColors[i], SubFloat( sampleOutput.m_flFalloff, i ) * SubFloat( sampleOutput.m_flDot[0], i ), dl->light.intensity, pOutColors[i] );
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Computes the direct lighting of a set of vertexes or texels, into
+// pOutColors[sample.m_nIndex]. The samples get lit four at a time, grouped by
+// cluster, against the lights that can reach any of them.
+//-----------------------------------------------------------------------------
+static void ComputeDirectLightingForSamples( CUtlVector<propSample_t> &samples, Vector *pOutColors, int iThread,
+											 int static_prop_id_to_skip=-1, int nLFlags = 0 )
+{
+	if ( !samples.Count() )
+		return;
+
+	Vector mins, maxs;
+	ClearBounds( mins, maxs );
+	for ( int i = 0; i < samples.Count(); ++i )
+	{
+		AddPointToBounds( samples[i].m_Position, mins, maxs );
+	}
+
+	// The points get pushed 4 units towards the light before they're lit
+	CUtlVector<directlight_t*> lights;
+	Vector vecBloat( 5.0f, 5.0f, 5.0f );
+	LightCull_GetLightsInBox( mins - vecBloat, maxs + vecBloat, lights );
+
+	// skip lights with style
+	for ( int iLight = lights.Count(); --iLight >= 0; )
+	{
+		if ( lights[iLight]->light.style )
+		{
+			lights.Remove( iLight );
+		}
+	}
+
+	samples.Sort( ComparePropSamples );
+	for ( int i = 0; i < samples.Count(); i += 4 )
+	{
+		int nSamples = MIN( 4, samples.Count() - i );
+		Vector colors[4];
+		ComputeDirectLightingAt4Points( &samples[i], nSamples, colors, iThread, lights, static_prop_id_to_skip, nLFlags );
+		for ( int k = 0; k < nSamples; ++k )
+		{
+			pOutColors[samples[i + k].m_nIndex] = colors[k];
+		}
 	}
 }
 
@@ -1396,6 +1491,9 @@ void CVradStaticPropMgr::ComputeLighting( CStaticProp &prop, int iThread, int pr
 			colorVerts.EnsureCount( pStudioModel->numvertices );
 			memset( colorVerts.Base(), 0, colorVerts.Count() * sizeof(colorVertex_t) );
 
+			// the vertexes to light, batched once they've all been found
+			CUtlVector<propSample_t> samples;
+
 			int numVertexes = 0;
 			for ( int meshID = 0; meshID < pStudioModel->nummeshes; ++meshID )
 			{
@@ -1430,40 +1528,50 @@ void CVradStaticPropMgr::ComputeLighting( CStaticProp &prop, int iThread, int pr
 					}
 					else
 					{
-						Vector direct_pos=samplePosition;
-
-
-
-						Vector directColor(0,0,0);
-						ComputeDirectLightingAtPoint( direct_pos,
-														sampleNormal, directColor, iThread,
-														skip_prop, nFlags );
-						Vector indirectColor(0,0,0);
-
-						if (g_bShowStaticPropNormals)
-						{
-							directColor= sampleNormal;
-							directColor += Vector(1.0,1.0,1.0);
-							directColor *= 50.0;
-						}
-						else
-						{
-							if (numbounce >= 1)
-								ComputeIndirectLightingAtPoint(
-									samplePosition, sampleNormal,
-									indirectColor, iThread, true,
-									( prop.m_Flags & STATIC_PROP_IGNORE_NORMALS) != 0 );
-						}
-
+						AddPropSample( samples, samplePosition, sampleNormal, numVertexes );
 						colorVerts[numVertexes].m_bValid = true;
 						colorVerts[numVertexes].m_Position = samplePosition;
-						VectorAdd( directColor, indirectColor, colorVerts[numVertexes].m_Color );
 					}
 
 					numVertexes++;
 				}
 			}
 
+			CUtlVector<Vector> directColors;
+			directColors.SetCount( numVertexes );
+			if ( !g_bShowStaticPropNormals )
+			{
+				ComputeDirectLightingForSamples( samples, directColors.Base(), iThread, skip_prop, nFlags );
+			}
+
+			for ( int i = 0; i < samples.Count(); ++i )
+			{
+				const propSample_t &sample = samples[i];
+				Vector sampleNormal = sample.m_Normal;
+				Vector directColor = directColors[sample.m_nIndex];
+				Vector indirectColor(0,0,0);
+
+				if (g_bShowStaticPropNormals)
+				{
+					directColor= sampleNormal;
+					directColor += Vector(1.0,1.0,1.0);
+					directColor *= 50.0;
+				}
+				else
+				{
+					if (numbounce >= 1)
+					{
+						Vector samplePosition = sample.m_Position;
+						ComputeIndirectLightingAtPoint(
+							samplePosition, sampleNormal,
+							indirectColor, iThread, true,
+							( prop.m_Flags & STATIC_PROP_IGNORE_NORMALS) != 0 );
+					}
+				}
+
+				VectorAdd( directColor, indirectColor, colorVerts[sample.m_nIndex].m_Color );
+			}
+
 			// color in the bad vertexes
 			// when entire model has no lighting origin and no valid neighbors
 			// must punt, leave black coloring
@@ -1518,7 +1626,9 @@ void CVradStaticPropMgr::ComputeLighting( CStaticProp &prop, int iThread, int pr
 
 					// re-light from better position
 					Vector directColor;
-					ComputeDirectLightingAtPoint( bestPosition, badVerts[nBadVertex].m_Normal, directColor, iThread );
+					CUtlVector<propSample_t> badSample;
+					AddPropSample( badSample, bestPosition, badVerts[nBadVertex].m_Normal, 0 );
+					ComputeDirectLightingForSamples( badSample, &directColor, iThread );
 
 					Vector indirectColor;
 					ComputeIndirectLightingAtPoint( bestPosition, badVerts[nBadVertex].m_Normal,
@@ -1790,7 +1900,7 @@ void CVradStaticPropMgr::ThreadComputeStaticPropLighting( int iThread, void *pUs
 {
 	while (1)
 	{
-		int j = GetThreadWork ();
+		int j = GetThreadWork( iThread );
 		if (j == -1)
 			break;
 		CComputeStaticPropLightingResults results;
@@ -2435,6 +2545,7 @@ static void GenerateLightmapSamplesForMesh( const matrix3x4_t& _matPos, const ma
 	// on the other side.
 	// First attempt: Just pretend the triangle was larger and cast a ray from this new world pos
 	// as above.
+	CUtlVector<propSample_t> samples;
 	int linearPos = 0;
 	for ( int j = 0; j < _lightmapResY; ++j )
 	{
@@ -2460,21 +2571,28 @@ static void GenerateLightmapSamplesForMesh( const matrix3x4_t& _matPos, const ma
 
 			if (shouldProcess)
 			{
-				Vector directColor(0, 0, 0),
-					   indirectColor(0, 0, 0);
+				AddPropSample( samples, colorTexels[linearPos].m_WorldPosition, colorTexels[linearPos].m_WorldNormal, linearPos );
+			}
 
+			++linearPos;
+		}
+	}
 
-				ComputeDirectLightingAtPoint( colorTexels[linearPos].m_WorldPosition, colorTexels[linearPos].m_WorldNormal, directColor, _iThread, _skipProp, _flags);
+	// Light the texels in batches
+	CUtlVector<Vector> texelColors;
+	texelColors.SetCount( colorTexels.Count() );
+	ComputeDirectLightingForSamples( samples, texelColors.Base(), _iThread, _skipProp, _flags );
 
-				if (numbounce >= 1) {
-					ComputeIndirectLightingAtPoint( colorTexels[linearPos].m_WorldPosition, colorTexels[linearPos].m_WorldNormal, indirectColor, _iThread, true, (_flags & GATHERLFLAGS_IGNORE_NORMALS) != 0 );
-				}
-
-				VectorAdd(directColor, indirectColor, colorTexels[linearPos].m_Color);
-			}
+	for ( int i = 0; i < samples.Count(); ++i )
+	{
+		int nTexel = samples[i].m_nIndex;
+		Vector indirectColor(0, 0, 0);
 
-			++linearPos;
+		if (numbounce >= 1) {
+			ComputeIndirectLightingAtPoint( colorTexels[nTexel].m_WorldPosition, colorTexels[nTexel].m_WorldNormal, indirectColor, _iThread, true, (_flags & GATHERLFLAGS_IGNORE_NORMALS) != 0 );
 		}
+
+		VectorAdd(texelColors[nTexel], indirectColor, colorTexels[nTexel].m_Color);
 	}
 }
 